@@ -9,6 +9,8 @@ option(BPFTIME_BUILD_EXECUTABLE "Build the project as an executable, rather than
 #
 option(BPFTIME_LLVM_JIT "Use LLVM as jit backend." OFF)
 
+option(BPFTIME_ENABLE_MAP_STATS "Count lookups and updates of each map in the shared memory." OFF)
+
 #
 # Compiler options
 #
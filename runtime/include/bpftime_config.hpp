@@ -1,6 +1,8 @@
 #ifndef _CONFIG_MANAGER_HPP
 #define _CONFIG_MANAGER_HPP
 
+#include <climits>
+
 namespace bpftime
 {
 struct agent_config {
@@ -12,6 +14,22 @@ struct agent_config {
 	bool enable_kernel_helper_group = true;
 	bool enable_ffi_helper_group = false;
 	bool enable_shm_maps_helper_group = true;
+
+	// Directory caching the native code of programs across processes,
+	// when JIT is enabled. Objects there are named by ebpf_aot_cache_key,
+	// so a program compiled by one agent is loaded by the others instead
+	// of being compiled again. Empty to always compile
+	char jit_cache_dir[PATH_MAX] = "";
+	// Threads compiling programs when the agent starts. 0 to use one per
+	// CPU
+	int jit_threads = 0;
+	// Run programs in the interpreter first, and compile them in the
+	// background once they have run this many times, when JIT is enabled.
+	// 0 to compile programs when they are loaded
+	int jit_threshold = 0;
+	// Interpret programs with the threaded interpreter rather than the
+	// switch one. Programs compiled when loaded aren't affected
+	bool threaded_interpreter = false;
 };
 } // namespace bpftime
 
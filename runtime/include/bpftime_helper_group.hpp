@@ -5,6 +5,7 @@
 #include <cinttypes>
 #include <vector>
 #include "bpftime_prog.hpp"
+#include "bpftime_config.hpp"
 
 #ifdef ENABLE_BPFTIME_VERIFIER
 #include <bpftime-verifier.hpp>
@@ -45,6 +46,9 @@ class bpftime_helper_group {
 
 	// Add the helper group to the program
 	int add_helper_group_to_prog(bpftime_prog *prog) const;
+	// Add the helper groups enabled in the agent config to the program
+	static int add_enabled_helper_groups_to_prog(bpftime_prog *prog,
+						     const agent_config &config);
 	// Get all helper ids of this helper group
 	std::vector<int32_t> get_helper_ids() const;
 
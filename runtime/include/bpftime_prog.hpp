@@ -8,11 +8,26 @@
 
 #include <ebpf-vm.h>
 #include <cinttypes>
+#include <memory>
 #include <vector>
 #include <string>
+#include <sys/types.h>
 namespace bpftime
 {
 
+// Called by bpftime_prog_exec around each run of a program in the calling
+// thread. Calls deferred during the run are made by bpftime_prog_end_run,
+// which takes what bpftime_prog_begin_run returned, so runs nested by
+// signal handlers only make their own
+ssize_t bpftime_prog_begin_run();
+void bpftime_prog_end_run(ssize_t outer);
+// Call `fn(ctx, arg)` once the program running in the calling thread
+// returns, e.g. to release what helpers handed to it. Returns -1 if no
+// program is running, 1 if the same call is already deferred by the
+// running program, and 0 otherwise
+int bpftime_prog_defer_until_return(void (*fn)(void *, uint64_t), void *ctx,
+				    uint64_t arg);
+
 // executable program for bpf function
 class bpftime_prog {
     public:
@@ -23,9 +38,35 @@ class bpftime_prog {
 	bpftime_prog(const ebpf_inst *insn, size_t insn_cnt, const char *name);
 	~bpftime_prog();
 
+	// interpret the program with the threaded interpreter when it's loaded
+	// without JIT, or tiered. Off by default
+	void bpftime_prog_toggle_threaded_interpreter(bool enable);
 	// load the programs to userspace vm or compile the jit program
 	// if program_name is NULL, will load the first program in the object
 	int bpftime_prog_load(bool jit);
+	// compile the program into a relocatable native object, which could
+	// be loaded in other processes without LLVM
+	int bpftime_prog_compile_aot(std::vector<uint8_t> &obj);
+	// load the program with an object from bpftime_prog_compile_aot
+	// instead of compiling it. Fails if the object was compiled from
+	// other instructions, or references helpers not registered
+	int bpftime_prog_load_aot(const void *obj, size_t obj_len);
+	// jit the program, reusing the object another process compiled into
+	// cache_dir, which is keyed by ebpf_aot_cache_key. On a miss the
+	// object is compiled and added to the cache, if the backend supports
+	// AOT compilation. The cache is ignored unless the directory and its
+	// files belong to the effective user and aren't writable by others
+	int bpftime_prog_load_cached(const char *cache_dir);
+	// run the program in the interpreter, and compile it on a background
+	// thread once it has run jit_threshold times. Later runs switch to the
+	// compiled code when it's ready. The JIT cache is used if cache_dir
+	// isn't empty. The thread is shared by all tiered programs, and started
+	// by the first one loaded in the process
+	int bpftime_prog_load_tiered(uint64_t jit_threshold,
+				     const char *cache_dir);
+	// whether runs use compiled code. For tiered programs, this changes
+	// once the background compilation is done
+	bool bpftime_prog_is_jitted() const;
 	int bpftime_prog_unload();
 
 	// exec in user space
@@ -38,16 +79,26 @@ class bpftime_prog {
 	}
 
     private:
+	struct tier_state;
+	friend struct tier_compiler;
+	void tier_up();
+	int load_from_cache(int dir_fd, const std::string &file_name);
+	int compile_to_cache(int dir_fd, const std::string &file_name);
 	int bpftime_prog_set_insn(struct ebpf_inst *insn, size_t insn_cnt);
 	std::string name;
 	// vm at the first element
 	struct ebpf_vm *vm;
 
-	bool jitted;
+	bool jitted = false;
+	bool threaded_interpreter = false;
 
 	// used in jit
 	ebpf_jit_fn fn;
 	std::vector<struct ebpf_inst> insns;
+	// registered helpers, for the VM compiling a tiered program
+	std::vector<struct bpftime_helper_info> helpers;
+	// set if loaded with bpftime_prog_load_tiered
+	std::unique_ptr<tier_state> tier;
 
 	char *errmsg;
 
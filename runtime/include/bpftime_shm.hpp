@@ -32,6 +32,25 @@ struct bpf_map_attr {
 	uint32_t kernel_bpf_map_id = 0;
 };
 
+// Statistics of a map, summed up over all cpus. The operation counters are
+// only maintained when built with BPFTIME_ENABLE_MAP_STATS, which is off by
+// default since it adds an atomic add to every lookup and update, and are
+// zero otherwise.
+struct bpf_map_stats {
+	uint64_t lookups = 0;
+	uint64_t lookup_misses = 0;
+	uint64_t updates = 0;
+	uint64_t update_failures = 0;
+	// Bytes of the shared memory taken by the map
+	uint64_t bytes_used = 0;
+};
+
+// A record committed to a ringbuf map, which points into the ringbuf itself
+struct ringbuf_sample {
+	void *data;
+	uint32_t size;
+};
+
 enum class bpf_event_type {
 	PERF_TYPE_HARDWARE = 0,
 	PERF_TYPE_SOFTWARE = 1,
@@ -50,6 +69,12 @@ enum class bpf_event_type {
 };
 
 #define KERNEL_USER_MAP_OFFSET 1000
+// Map types that only exist in bpftime
+#define BPFTIME_USER_MAP_OFFSET 2000
+
+// Map flag of ringbuf maps, to keep the newest records by overwriting the
+// oldest ones when the ringbuf is full, instead of failing to reserve
+static const uint64_t BPFTIME_F_RB_OVERWRITE = 1U << 19;
 
 enum class bpf_map_type {
 	BPF_MAP_TYPE_UNSPEC,
@@ -103,6 +128,11 @@ enum class bpf_map_type {
 	BPF_MAP_TYPE_KERNEL_USER_PERF_EVENT_ARRAY =
 		KERNEL_USER_MAP_OFFSET + BPF_MAP_TYPE_PERF_EVENT_ARRAY,
 
+	// A hash map with an active buffer for programs and an inactive one
+	// for userspace, swapped at the end of every collecting interval
+	BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH =
+		BPFTIME_USER_MAP_OFFSET + BPF_MAP_TYPE_HASH,
+
 };
 
 enum class shm_open_type {
@@ -190,6 +220,15 @@ int bpftime_link_create(int fd, int prog_fd, int target_fd);
 int bpftime_progs_create(int fd, const ebpf_inst *insn, size_t insn_cnt,
 			 const char *prog_name, int prog_type);
 
+// get the instructions and the name of a prog from the global shared memory
+int bpftime_prog_get_info(int fd, const ebpf_inst **out_insns,
+			  size_t *out_insn_cnt, const char **out_name);
+
+// get the first prog fd greater than `fd`, so that all progs could be
+// iterated starting from -1. Returns -1 and sets errno to ENOENT if there is
+// none
+int bpftime_prog_get_next_fd(int fd);
+
 // create a bpf map in the global shared memory
 //
 // @param[fd]: fd is the fd allocated by the kernel. if fd is -1, then the
@@ -200,6 +239,16 @@ int bpftime_maps_create(int fd, const char *name, bpftime::bpf_map_attr attr);
 int bpftime_map_get_info(int fd, bpftime::bpf_map_attr *out_attr,
 			 const char **out_name, bpftime::bpf_map_type *type);
 
+// get the statistics of a map from the global shared memory
+int bpftime_map_get_stats(int fd, bpftime::bpf_map_stats *out_stats);
+
+// get the first map fd greater than `fd`, so that all maps could be iterated
+// starting from -1. Returns -1 and sets errno to ENOENT if there is none
+int bpftime_map_get_next_fd(int fd);
+
+// get the size and the free bytes of the global shared memory
+int bpftime_get_global_shm_usage(uint64_t *total_bytes, uint64_t *free_bytes);
+
 // get the map value size from the global shared memory by fd
 uint32_t bpftime_map_value_size_from_syscall(int fd);
 
@@ -222,6 +271,19 @@ long bpftime_map_update_elem(int fd, const void *key, const void *value,
 			     uint64_t flags);
 // use from bpf syscall to delete the elem
 long bpftime_map_delete_elem(int fd, const void *key);
+// use from userspace to lookup an elem of a per cpu map, with the values of
+// all cpus summed up into `value`
+long bpftime_map_lookup_elem_aggregated(int fd, const void *key, void *value);
+// use from bpf syscall to update several elems at once. The updates are
+// applied under one lock acquisition, and either all or none of them take
+// effect. The batch is only atomic against other syscall accesses: maps
+// accessed lock-free by programs (per cpu, double buffered and kernel-user
+// maps) may show a probe part of a batch, or a rolled back update. If an
+// update fails and the elements updated before it can't all be restored,
+// returns -1 with errno EIO, and the map is left with a part of the batch
+long bpftime_map_update_elem_batch(int fd, const void *keys,
+				   const void *values, uint32_t count,
+				   uint64_t flags);
 
 // create uprobe in the global shared memory
 //
@@ -249,6 +311,19 @@ int bpftime_add_ringbuf_fd_to_epoll(int ringbuf_fd, int epoll_fd,
 int bpftime_add_software_perf_event_fd_to_epoll(int swpe_fd, int epoll_fd,
 						epoll_data_t extra_data);
 
+// Create an eventfd in the calling process, which would be signaled when
+// records are put to the ringbuf map or the software perf event `fd`, so it
+// could be waited with epoll_wait(2) along with other fds. Returns the
+// eventfd.
+//
+// Producers in other processes of the same user get the eventfd from a
+// thread of the calling process, over a unix socket with SCM_RIGHTS.
+int bpftime_enable_eventfd_notification(int fd);
+// Signals are coalesced: only the first record after arming signals the
+// eventfd. Arm it before sleeping on the eventfd. Returns 1 if there are
+// records already, in which case the caller should consume them instead of
+// sleeping, 0 if not, or -1 on error
+int bpftime_arm_eventfd_notification(int fd);
 int bpftime_epoll_create();
 void *bpftime_get_ringbuf_consumer_page(int ringbuf_fd);
 void *bpftime_get_ringbuf_producer_page(int ringbuf_fd);
@@ -262,10 +337,64 @@ int bpftime_is_map_fd(int fd);
 
 void *bpftime_get_array_map_raw_data(int fd);
 
+// hand the buffer written by programs to userspace, and let programs write
+// to the other one. Only for double buffered maps
+int bpftime_map_swap_buffers(int fd);
+// remove all elements of the buffer owned by userspace. Only for double
+// buffered maps
+int bpftime_map_clear_inactive_buffer(int fd);
+
 void bpftime_close(int fd);
 
+// Also how userspace produces records to user ringbuf maps, which programs
+// consume with bpf_user_ringbuf_drain
 void *bpftime_ringbuf_reserve(int fd, uint64_t size);
-void bpftime_ringbuf_submit(int fd, void *data, int discard);
+// `flags` could be BPF_RB_NO_WAKEUP or BPF_RB_FORCE_WAKEUP, same as
+// bpf_ringbuf_submit
+void bpftime_ringbuf_submit(int fd, void *data, int discard, uint64_t flags);
+// Shrink a record got from bpftime_ringbuf_reserve to `size` bytes, before
+// submitting it, so that it only takes the bytes written
+int bpftime_ringbuf_shrink(int fd, void *data, uint32_t size);
+uint64_t bpftime_ringbuf_query(int fd, uint64_t flags);
+// Also wake up consumers when there are at least `bytes` bytes not consumed,
+// even if they haven't caught up with the submitted record. 0 to disable
+int bpftime_ringbuf_set_wakeup_watermark(int fd, uint32_t bytes);
+// Consume records of a user ringbuf map in order, by calling `callback` on
+// each of them until it returns nonzero, or `max_samples` records are
+// consumed. Returns the number of records consumed, or -1 with errno set to
+// EBUSY if it's being drained by someone else
+long bpftime_user_ringbuf_drain(int fd,
+				long (*callback)(void *data, uint32_t size,
+						 void *ctx),
+				void *ctx, uint32_t max_samples);
+// Get up to `max_samples` committed records of a ringbuf map, which could be
+// processed in place, without consuming them. Returns the number of records,
+// and the position to pass to bpftime_ringbuf_commit_batch in `batch_end`
+int bpftime_ringbuf_peek_batch(int fd, bpftime::ringbuf_sample *samples,
+			       int max_samples, uint64_t *batch_end);
+// Consume the records got by bpftime_ringbuf_peek_batch at once
+int bpftime_ringbuf_commit_batch(int fd, uint64_t batch_end);
+// Register a consumer of a ringbuf map, which reads every record on its own
+// through bpftime_ringbuf_peek_consumer_batch and
+// bpftime_ringbuf_commit_consumer_batch. Producers write each record once,
+// and the space is released after all consumers have consumed it. Returns
+// the id of the consumer
+int bpftime_ringbuf_add_consumer(int fd);
+int bpftime_ringbuf_remove_consumer(int fd, int consumer);
+// Let producers detach the slowest consumers when the ringbuf is full, as
+// long as some consumers are ahead of them, instead of failing to reserve.
+// Detached consumers get EPIPE, and should be removed
+int bpftime_ringbuf_set_detach_slow_consumers(int fd, int enable);
+int bpftime_ringbuf_peek_consumer_batch(int fd, int consumer,
+					bpftime::ringbuf_sample *samples,
+					int max_samples, uint64_t *batch_end);
+int bpftime_ringbuf_commit_consumer_batch(int fd, int consumer,
+					  uint64_t batch_end);
+// Copy the records kept in a ringbuf map to `buf`, in the ringbuf layout,
+// without consuming them. Ringbuf maps created with BPFTIME_F_RB_OVERWRITE
+// keep the newest records, and must be read with this. `size` must be at
+// least max_entries of the map. Returns the number of bytes copied
+long bpftime_ringbuf_snapshot(int fd, void *buf, uint64_t size);
 int bpftime_epoll_wait(int fd, struct epoll_event *out_evts, int max_evt,
 		       int timeout);
 
@@ -274,6 +403,11 @@ int bpftime_add_software_perf_event(int cpu, int32_t sample_type,
 int bpftime_is_software_perf_event(int fd);
 void *bpftime_get_software_perf_event_raw_buffer(int fd, size_t expected_size);
 int bpftime_perf_event_output(int fd, const void *buf, size_t sz);
+// Output to the software perf event at index `cpu` of the perf event array
+// `map_fd`. The perf event is resolved once per thread, and looked up again
+// only when the array slot changes or a handler is closed
+int bpftime_perf_event_array_output(int map_fd, int cpu, const void *buf,
+				    size_t sz);
 int bpftime_shared_perf_event_output(int map_fd, const void *buf, size_t sz);
 }
 
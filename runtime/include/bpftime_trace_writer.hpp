@@ -0,0 +1,138 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#ifndef _BPFTIME_TRACE_WRITER_HPP
+#define _BPFTIME_TRACE_WRITER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace bpftime
+{
+
+/*
+Format of the trace files
+
+A trace file starts with a trace_file_header, followed by batches. Each batch
+is a trace_batch_header followed by `stored_size` bytes, which are the records
+of the batch, deflated as a whole if TRACE_BATCH_COMPRESSED is set. Each
+record is a trace_record_header followed by `size` bytes of data, padded to 8
+bytes.
+
+Records of a ringbuf map are the samples as submitted, and records of a
+software perf event are the whole perf records, starting with
+perf_event_header, so that PERF_RECORD_LOST could be told from samples.
+*/
+static const char TRACE_FILE_MAGIC[8] = { 'B', 'P', 'F', 'T',
+					  'R', 'A', 'C', 'E' };
+static const uint32_t TRACE_FILE_VERSION = 1;
+static const uint32_t TRACE_BATCH_MAGIC = 0x48435442; // "BTCH"
+
+enum trace_batch_flags {
+	TRACE_BATCH_COMPRESSED = 1,
+};
+
+enum trace_record_kind {
+	TRACE_RECORD_RINGBUF = 1,
+	TRACE_RECORD_PERF_EVENT = 2,
+};
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct trace_batch_header {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t nr_records;
+	// Size of the records before compression
+	uint32_t raw_size;
+	// Size of the records in the file
+	uint64_t stored_size;
+	// CLOCK_REALTIME nanoseconds when the batch was started
+	uint64_t timestamp;
+};
+
+struct trace_record_header {
+	uint32_t size;
+	// fd of the ringbuf map or the software perf event. Larger fds can't
+	// be traced
+	uint16_t source;
+	uint16_t kind;
+};
+
+struct trace_writer_opts {
+	// Finish a batch once it holds this many bytes of records
+	uint32_t batch_bytes = 1 << 20;
+	// Deflate each batch. Without zlib, opening a file fails with ENOTSUP
+	// instead, and compressed batches can't be read
+	bool compress = false;
+};
+
+// Move records of ringbuf maps and software perf events into a trace file.
+//
+// The file is mapped into memory, so records are copied (or compressed)
+// straight from the buffers in the shared memory to the page cache, and
+// released to producers in batches instead of one by one.
+class trace_writer {
+    public:
+	trace_writer(const trace_writer_opts &opts = {});
+	~trace_writer();
+	trace_writer(const trace_writer &) = delete;
+	trace_writer &operator=(const trace_writer &) = delete;
+
+	// Create the trace file, truncating it if it exists
+	int open(const char *path);
+	// Write all records available in the ringbuf map or the software
+	// perf event `fd`, which must fit in trace_record_header::source.
+	// Returns the number of records written
+	long drain(int fd);
+	// Finish the current batch, so that it could be read
+	int flush();
+	// Flush, then trim the file to the written size and close it
+	int close();
+	uint64_t bytes_written() const
+	{
+		return write_pos;
+	}
+
+    private:
+	trace_writer_opts opts;
+	int fd = -1;
+	uint8_t *base = nullptr;
+	// Size of the file and the mapping, grown in chunks
+	uint64_t capacity = 0;
+	uint64_t write_pos = 0;
+	// Offset of the header of the current batch, -1 if there is none
+	int64_t batch_start = -1;
+	trace_batch_header batch;
+	// zlib state of the current batch, if compressed
+	struct deflate_stream;
+	std::unique_ptr<deflate_stream> deflater;
+
+	int ensure_capacity(uint64_t size);
+	int begin_batch();
+	int write_bytes(const void *data, size_t size);
+	int write_record(int source, trace_record_kind kind, const void *data1,
+			 size_t size1, const void *data2, size_t size2);
+	long drain_ringbuf(int fd);
+	long drain_perf_event(int fd);
+};
+
+// Call `callback` on each record of a trace file in order. Stops and returns
+// its value if it returns nonzero. Returns 0 when all records are read, or
+// -1 if the file is malformed
+int read_trace_file(
+	const char *path,
+	std::function<int(const trace_record_header &, const void *data)>
+		callback);
+
+} // namespace bpftime
+
+#endif
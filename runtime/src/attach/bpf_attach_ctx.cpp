@@ -6,7 +6,9 @@
 #include "attach/attach_manager/frida_attach_manager.hpp"
 #include "bpftime.hpp"
 #include "handler/epoll_handler.hpp"
+#include <algorithm>
 #include <asm/unistd_64.h>
+#include <atomic>
 #include <cerrno>
 #include <map>
 #include <memory>
@@ -20,27 +22,62 @@
 #include <bpftime_helper_group.hpp>
 #include <handler/handler_manager.hpp>
 #include <attach/attach_internal.hpp>
+#include <thread>
 #include <utility>
 #include <variant>
+#include <vector>
 #include <sys/resource.h>
 namespace bpftime
 {
 
 static int load_prog_and_helpers(bpftime_prog *prog, const agent_config &config)
 {
-	if (config.enable_kernel_helper_group) {
-		bpftime_helper_group::get_kernel_utils_helper_group()
-			.add_helper_group_to_prog(prog);
-	}
-	if (config.enable_ffi_helper_group) {
-		bpftime_helper_group::get_ffi_helper_group()
-			.add_helper_group_to_prog(prog);
+	bpftime_helper_group::add_enabled_helper_groups_to_prog(prog, config);
+	prog->bpftime_prog_toggle_threaded_interpreter(
+		config.threaded_interpreter);
+	if (config.jit_enabled && config.jit_threshold > 0)
+		return prog->bpftime_prog_load_tiered(config.jit_threshold,
+						      config.jit_cache_dir);
+	if (config.jit_enabled && config.jit_cache_dir[0] != '\0')
+		return prog->bpftime_prog_load_cached(config.jit_cache_dir);
+	return prog->bpftime_prog_load(config.jit_enabled);
+}
+
+// Load programs on a pool of threads, since compiling them one by one delays
+// the start of the traced process. Each program is compiled in its own LLVM
+// context. Returns the error of the first program that failed, in the order
+// of progs
+static int load_progs(const std::vector<bpftime_prog *> &progs,
+		      const agent_config &config)
+{
+	if (progs.empty())
+		return 0;
+	std::vector<int> results(progs.size());
+	std::atomic<size_t> next = 0;
+	auto worker = [&]() {
+		for (size_t i = next++; i < progs.size(); i = next++)
+			results[i] = load_prog_and_helpers(progs[i], config);
+	};
+	size_t nr_threads = 1;
+	if (config.jit_enabled) {
+		nr_threads = config.jit_threads > 0 ?
+				     config.jit_threads :
+				     std::thread::hardware_concurrency();
+		nr_threads = std::clamp<size_t>(nr_threads, 1, progs.size());
 	}
-	if (config.enable_shm_maps_helper_group) {
-		bpftime_helper_group::get_shm_maps_helper_group()
-			.add_helper_group_to_prog(prog);
+	spdlog::debug("Loading {} programs with {} threads", progs.size(),
+		      nr_threads);
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < nr_threads; i++)
+		threads.emplace_back(worker);
+	worker();
+	for (auto &thread : threads)
+		thread.join();
+	for (int res : results) {
+		if (res < 0)
+			return res;
 	}
-	return prog->bpftime_prog_load(config.jit_enabled);
+	return 0;
 }
 
 int bpf_attach_ctx::init_attach_ctx_from_handlers(const agent_config &config)
@@ -173,6 +210,7 @@ int bpf_attach_ctx::init_attach_ctx_from_handlers(
 	// Maintain perf_event fd -> [(prog fd,bpftime_prog*)]
 	std::map<int, std::vector<std::pair<int, bpftime_prog *> > >
 		handler_prog_fds;
+	std::vector<bpftime_prog *> progs_to_load;
 	// First, we create programs
 	for (std::size_t i = 0; i < manager->size(); i++) {
 		// skip uninitialized handlers
@@ -190,10 +228,8 @@ int bpf_attach_ctx::init_attach_ctx_from_handlers(
 			progs[i] = std::make_unique<bpftime_prog>(insns, cnt,
 								  name);
 			bpftime_prog *prog = progs[i].get();
-			int res = load_prog_and_helpers(prog, config);
-			if (res < 0) {
-				return res;
-			}
+			// Loaded after all programs are created
+			progs_to_load.push_back(prog);
 			for (auto v : prog_handler.attach_fds) {
 				if (std::holds_alternative<
 					    bpf_perf_event_handler>(
@@ -238,6 +274,9 @@ int bpf_attach_ctx::init_attach_ctx_from_handlers(
 			return -1;
 		}
 	}
+	if (int res = load_progs(progs_to_load, config); res < 0) {
+		return res;
+	}
 	// Second, we create bpf perf event handlers
 	for (std::size_t i = 0; i < manager->size(); i++) {
 		if (!manager->is_allocated(i)) {
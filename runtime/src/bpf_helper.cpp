@@ -4,6 +4,7 @@
  * All rights reserved.
  */
 #include "bpftime_helper_group.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <sched.h>
@@ -169,10 +170,6 @@ uint64_t bpf_ringbuf_output(uint64_t rb, uint64_t data, uint64_t size,
 			    uint64_t flags, uint64_t)
 {
 	int fd = (int)(rb >> 32);
-	if (flags != 0) {
-		spdlog::warn(
-			"Currently only supports ringbuf_output with flags=0");
-	}
 	auto buf = bpftime_ringbuf_reserve(fd, size);
 	if (!buf) {
 		spdlog::error(
@@ -180,7 +177,7 @@ uint64_t bpf_ringbuf_output(uint64_t rb, uint64_t data, uint64_t size,
 		return (uint64_t)-1;
 	}
 	memcpy(buf, (const void *)(uintptr_t)data, size);
-	bpftime_ringbuf_submit(fd, buf, false);
+	bpftime_ringbuf_submit(fd, buf, false, flags);
 	return 0;
 }
 
@@ -200,11 +197,7 @@ uint64_t bpf_ringbuf_submit(uint64_t data, uint64_t flags, uint64_t, uint64_t,
 {
 	int32_t *ptr = (int32_t *)(uintptr_t)data;
 	int fd = ptr[-1];
-	if (flags != 0) {
-		spdlog::warn(
-			"Currently only supports ringbuf_submit with flags=0");
-	}
-	bpftime_ringbuf_submit(fd, (void *)(uintptr_t)data, false);
+	bpftime_ringbuf_submit(fd, (void *)(uintptr_t)data, false, flags);
 	return 0;
 }
 uint64_t bpf_ringbuf_discard(uint64_t data, uint64_t flags, uint64_t, uint64_t,
@@ -212,53 +205,262 @@ uint64_t bpf_ringbuf_discard(uint64_t data, uint64_t flags, uint64_t, uint64_t,
 {
 	int32_t *ptr = (int32_t *)(uintptr_t)data;
 	int fd = ptr[-1];
+	bpftime_ringbuf_submit(fd, (void *)(uintptr_t)data, true, flags);
+	return 0;
+}
+
+uint64_t bpf_ringbuf_query(uint64_t rb, uint64_t flags, uint64_t, uint64_t,
+			   uint64_t)
+{
+	int fd = (int)(rb >> 32);
+	return bpftime_ringbuf_query(fd, flags);
+}
+
+// Same layout as the kernel's struct bpf_dynptr_kern
+struct bpf_dynptr_kern {
+	void *data;
+	// The lower 24 bits are the size, and the upper bits hold the type
+	// and whether it's read only
+	uint32_t size;
+	uint32_t offset;
+};
+
+enum {
+	DYNPTR_SIZE_MASK = 0xffffff,
+	DYNPTR_TYPE_SHIFT = 28,
+	DYNPTR_RDONLY_BIT = 1U << 31,
+	BPF_DYNPTR_TYPE_LOCAL = 1,
+	BPF_DYNPTR_TYPE_RINGBUF = 2,
+};
+
+static void bpf_dynptr_init(bpf_dynptr_kern *ptr, void *data, uint32_t type,
+			    uint32_t offset, uint32_t size)
+{
+	ptr->data = data;
+	ptr->offset = offset;
+	ptr->size = size | (type << DYNPTR_TYPE_SHIFT);
+}
+
+static uint32_t bpf_dynptr_get_size(const bpf_dynptr_kern *ptr)
+{
+	return ptr->size & DYNPTR_SIZE_MASK;
+}
+
+static bool bpf_dynptr_is_rdonly(const bpf_dynptr_kern *ptr)
+{
+	return ptr->size & DYNPTR_RDONLY_BIT;
+}
+
+static uint32_t bpf_dynptr_get_type(const bpf_dynptr_kern *ptr)
+{
+	return (ptr->size & ~DYNPTR_RDONLY_BIT) >> DYNPTR_TYPE_SHIFT;
+}
+
+static void bpf_dynptr_set_null(bpf_dynptr_kern *ptr)
+{
+	memset(ptr, 0, sizeof(*ptr));
+}
+
+static int bpf_dynptr_check_off_len(const bpf_dynptr_kern *ptr,
+				    uint64_t offset, uint64_t len)
+{
+	uint64_t size = bpf_dynptr_get_size(ptr);
+	if (len > size || offset > size - len)
+		return -E2BIG;
+	return 0;
+}
+
+// Records of ringbuf dynptrs reserved by this thread, and how many bytes of
+// them were written, so that records only take the written bytes when
+// submitted
+struct ringbuf_dynptr_usage {
+	void *data;
+	uint32_t written;
+};
+static const int MAX_RINGBUF_DYNPTRS = 8;
+static thread_local ringbuf_dynptr_usage
+	ringbuf_dynptr_usages[MAX_RINGBUF_DYNPTRS];
+
+static ringbuf_dynptr_usage *find_ringbuf_dynptr_usage(const void *data)
+{
+	for (auto &usage : ringbuf_dynptr_usages) {
+		if (usage.data == data)
+			return &usage;
+	}
+	return nullptr;
+}
+
+static void mark_dynptr_written(const bpf_dynptr_kern *ptr, uint64_t end)
+{
+	if (bpf_dynptr_get_type(ptr) != BPF_DYNPTR_TYPE_RINGBUF)
+		return;
+	if (auto usage = find_ringbuf_dynptr_usage(ptr->data); usage)
+		usage->written =
+			std::max<uint32_t>(usage->written, ptr->offset + end);
+}
+
+uint64_t bpf_ringbuf_reserve_dynptr(uint64_t map, uint64_t size,
+				    uint64_t flags, uint64_t dynptr, uint64_t)
+{
+	auto ptr = (bpf_dynptr_kern *)(uintptr_t)dynptr;
 	if (flags != 0) {
-		spdlog::warn(
-			"Currently only supports ringbuf_submit with flags=0");
+		bpf_dynptr_set_null(ptr);
+		return (uint64_t)-EINVAL;
+	}
+	if (size > DYNPTR_SIZE_MASK) {
+		bpf_dynptr_set_null(ptr);
+		return (uint64_t)-E2BIG;
+	}
+	int fd = bpftime::map_ptr_to_fd(map);
+	auto sample = bpftime_ringbuf_reserve(fd, size);
+	if (sample == nullptr) {
+		bpf_dynptr_set_null(ptr);
+		return (uint64_t)-EINVAL;
+	}
+	bpf_dynptr_init(ptr, sample, BPF_DYNPTR_TYPE_RINGBUF, 0, size);
+	// Without a free slot, the record is submitted with the reserved
+	// size
+	if (auto usage = find_ringbuf_dynptr_usage(nullptr); usage)
+		*usage = ringbuf_dynptr_usage{ .data = sample, .written = 0 };
+	return 0;
+}
+
+static void submit_ringbuf_dynptr(uint64_t dynptr, bool discard,
+				  uint64_t flags)
+{
+	auto ptr = (bpf_dynptr_kern *)(uintptr_t)dynptr;
+	if (ptr->data == nullptr)
+		return;
+	// The map fd is kept in the header, same as bpf_ringbuf_submit
+	int fd = ((int32_t *)ptr->data)[-1];
+	if (auto usage = find_ringbuf_dynptr_usage(ptr->data); usage) {
+		if (!discard)
+			bpftime_ringbuf_shrink(fd, ptr->data, usage->written);
+		usage->data = nullptr;
 	}
-	bpftime_ringbuf_submit(fd, (void *)(uintptr_t)data, true);
+	bpftime_ringbuf_submit(fd, ptr->data, discard, flags);
+	bpf_dynptr_set_null(ptr);
+}
+
+uint64_t bpf_ringbuf_submit_dynptr(uint64_t dynptr, uint64_t flags, uint64_t,
+				   uint64_t, uint64_t)
+{
+	submit_ringbuf_dynptr(dynptr, false, flags);
+	return 0;
+}
+
+uint64_t bpf_ringbuf_discard_dynptr(uint64_t dynptr, uint64_t flags, uint64_t,
+				    uint64_t, uint64_t)
+{
+	submit_ringbuf_dynptr(dynptr, true, flags);
 	return 0;
 }
 
+uint64_t bpf_dynptr_write(uint64_t dst, uint64_t offset, uint64_t src,
+			  uint64_t len, uint64_t flags)
+{
+	auto ptr = (const bpf_dynptr_kern *)(uintptr_t)dst;
+	if (ptr->data == nullptr || bpf_dynptr_is_rdonly(ptr) || flags != 0)
+		return (uint64_t)-EINVAL;
+	if (int err = bpf_dynptr_check_off_len(ptr, offset, len); err < 0)
+		return (uint64_t)err;
+	// Source and destination may overlap, if both are in the record
+	memmove((uint8_t *)ptr->data + ptr->offset + offset,
+		(const void *)(uintptr_t)src, len);
+	mark_dynptr_written(ptr, offset + len);
+	return 0;
+}
+
+uint64_t bpf_dynptr_read(uint64_t dst, uint64_t len, uint64_t src,
+			 uint64_t offset, uint64_t flags)
+{
+	auto ptr = (const bpf_dynptr_kern *)(uintptr_t)src;
+	if (ptr->data == nullptr || flags != 0)
+		return (uint64_t)-EINVAL;
+	if (int err = bpf_dynptr_check_off_len(ptr, offset, len); err < 0)
+		return (uint64_t)err;
+	memcpy((void *)(uintptr_t)dst,
+	       (const uint8_t *)ptr->data + ptr->offset + offset, len);
+	return 0;
+}
+
+uint64_t bpf_dynptr_data(uint64_t dynptr, uint64_t offset, uint64_t len,
+			 uint64_t, uint64_t)
+{
+	auto ptr = (const bpf_dynptr_kern *)(uintptr_t)dynptr;
+	if (ptr->data == nullptr || bpf_dynptr_is_rdonly(ptr))
+		return 0;
+	if (bpf_dynptr_check_off_len(ptr, offset, len) < 0)
+		return 0;
+	// The slice may be written through, so keep it in the record
+	mark_dynptr_written(ptr, offset + len);
+	return (uint64_t)(uintptr_t)((uint8_t *)ptr->data + ptr->offset +
+				     offset);
+}
+
+// Same as the kernel
+static const uint32_t BPF_MAX_USER_RINGBUF_SAMPLES = 128 * 1024;
+
+struct user_ringbuf_drain_ctx {
+	uint64_t callback_fn;
+	uint64_t ctx;
+};
+
+static long call_user_ringbuf_callback(void *data, uint32_t size, void *ctx)
+{
+	auto drain_ctx = (user_ringbuf_drain_ctx *)ctx;
+	bpf_dynptr_kern dynptr;
+	bpf_dynptr_init(&dynptr, data, BPF_DYNPTR_TYPE_LOCAL, 0, size);
+	// callback_fn is a subprogram of the program, loaded by a lddw
+	// with BPF_PSEUDO_FUNC
+	return (long)ebpf_call_callback(drain_ctx->callback_fn,
+					(uint64_t)(uintptr_t)&dynptr,
+					drain_ctx->ctx, 0, 0, 0);
+}
+
+uint64_t bpf_user_ringbuf_drain(uint64_t map, uint64_t callback_fn,
+				uint64_t ctx, uint64_t flags, uint64_t)
+{
+	// Only BPF_RB_NO_WAKEUP and BPF_RB_FORCE_WAKEUP. Userspace producers
+	// don't wait for space, so there is no one to wake up
+	if (flags & ~(uint64_t)3)
+		return (uint64_t)-EINVAL;
+	int fd = bpftime::map_ptr_to_fd(map);
+	user_ringbuf_drain_ctx drain_ctx{ .callback_fn = callback_fn,
+					  .ctx = ctx };
+	long ret = bpftime_user_ringbuf_drain(fd, call_user_ringbuf_callback,
+					      &drain_ctx,
+					      BPF_MAX_USER_RINGBUF_SAMPLES);
+	if (ret < 0)
+		return (uint64_t)(int64_t)-errno;
+	return ret;
+}
+
 uint64_t bpf_perf_event_output(uint64_t ctx, uint64_t map, uint64_t flags,
 			       uint64_t data, uint64_t size)
 {
+	// Software perf buffers accept concurrent producers, so there is no
+	// need to stay on this cpu while outputting. sched_getcpu reads the
+	// cpu from rseq or vDSO, without a syscall
 	int32_t current_cpu = sched_getcpu();
 	assert(current_cpu != -1);
-	cpu_set_t mask, orig;
-	CPU_ZERO(&mask);
-	CPU_SET(current_cpu, &mask);
-	sched_getaffinity(0, sizeof(orig), &orig);
-	// Bind to the current cpu
-	if (sched_setaffinity(0, sizeof(mask), &mask) < 0) {
-		spdlog::error("Failed to set cpu affinity: {}", errno);
-		errno = EINVAL;
-		return (uint64_t)(-1);
-	}
-	int fd = map >> 32;
+	int fd = bpftime::map_ptr_to_fd(map);
 	// Check map type. userspace perf event array, or shared perf event
 	// array?
 	bpftime::bpf_map_type map_ty;
-	if (int err = bpftime_map_get_info(fd, nullptr, nullptr, &map_ty);
-	    err < 0) {
+	if (int cached = bpftime::map_ptr_to_type(map); cached >= 0) {
+		map_ty = (bpftime::bpf_map_type)cached;
+	} else if (int err = bpftime_map_get_info(fd, nullptr, nullptr,
+						  &map_ty);
+		   err < 0) {
 		spdlog::error("Unable to query map type of fd {}", fd);
 		return -1;
 	}
 	int ret;
 	if (map_ty == bpftime::bpf_map_type::BPF_MAP_TYPE_PERF_EVENT_ARRAY) {
-		const int32_t *val_ptr =
-			(int32_t *)(uintptr_t)bpftime_helper_map_lookup_elem(
-				fd, &current_cpu);
-		if (val_ptr == nullptr) {
-			spdlog::error(
-				"Invalid map fd for perf event output: {}", fd);
-			errno = EINVAL;
-			return (uint64_t)(-1);
-		}
-		int32_t perf_handler_fd = *val_ptr;
-		ret = bpftime_perf_event_output(perf_handler_fd,
-						(const void *)(uintptr_t)data,
-						(size_t)size);
+		ret = bpftime_perf_event_array_output(
+			fd, current_cpu, (const void *)(uintptr_t)data,
+			(size_t)size);
 	} else if (map_ty ==
 		   bpftime::bpf_map_type::
 			   BPF_MAP_TYPE_KERNEL_USER_PERF_EVENT_ARRAY) {
@@ -269,8 +471,6 @@ uint64_t bpf_perf_event_output(uint64_t ctx, uint64_t map, uint64_t flags,
 			"Attempting to run perf_output on a non-perf array map");
 		ret = -1;
 	}
-
-	sched_setaffinity(0, sizeof(orig), &orig);
 	return (uint64_t)ret;
 }
 } // extern "C"
@@ -537,6 +737,20 @@ int bpftime_helper_group::add_helper_group_to_prog(bpftime_prog *prog) const
 	}
 	return 0;
 }
+int bpftime_helper_group::add_enabled_helper_groups_to_prog(
+	bpftime_prog *prog, const agent_config &config)
+{
+	if (config.enable_kernel_helper_group) {
+		get_kernel_utils_helper_group().add_helper_group_to_prog(prog);
+	}
+	if (config.enable_ffi_helper_group) {
+		get_ffi_helper_group().add_helper_group_to_prog(prog);
+	}
+	if (config.enable_shm_maps_helper_group) {
+		get_shm_maps_helper_group().add_helper_group_to_prog(prog);
+	}
+	return 0;
+}
 std::vector<int32_t> bpftime_helper_group::get_helper_ids() const
 {
 	std::vector<int32_t> result;
@@ -697,6 +911,54 @@ const bpftime_helper_group kernel_helper_group = {
 		    .name = "bpf_ringbuf_discard",
 		    .fn = (void *)bpf_ringbuf_discard,
 	    } },
+	  { BPF_FUNC_ringbuf_query,
+	    bpftime_helper_info{
+		    .index = BPF_FUNC_ringbuf_query,
+		    .name = "bpf_ringbuf_query",
+		    .fn = (void *)bpf_ringbuf_query,
+	    } },
+	  { BPF_FUNC_user_ringbuf_drain,
+	    bpftime_helper_info{
+		    .index = BPF_FUNC_user_ringbuf_drain,
+		    .name = "bpf_user_ringbuf_drain",
+		    .fn = (void *)bpf_user_ringbuf_drain,
+	    } },
+	  { BPF_FUNC_ringbuf_reserve_dynptr,
+	    bpftime_helper_info{
+		    .index = BPF_FUNC_ringbuf_reserve_dynptr,
+		    .name = "bpf_ringbuf_reserve_dynptr",
+		    .fn = (void *)bpf_ringbuf_reserve_dynptr,
+	    } },
+	  { BPF_FUNC_ringbuf_submit_dynptr,
+	    bpftime_helper_info{
+		    .index = BPF_FUNC_ringbuf_submit_dynptr,
+		    .name = "bpf_ringbuf_submit_dynptr",
+		    .fn = (void *)bpf_ringbuf_submit_dynptr,
+	    } },
+	  { BPF_FUNC_ringbuf_discard_dynptr,
+	    bpftime_helper_info{
+		    .index = BPF_FUNC_ringbuf_discard_dynptr,
+		    .name = "bpf_ringbuf_discard_dynptr",
+		    .fn = (void *)bpf_ringbuf_discard_dynptr,
+	    } },
+	  { BPF_FUNC_dynptr_write,
+	    bpftime_helper_info{
+		    .index = BPF_FUNC_dynptr_write,
+		    .name = "bpf_dynptr_write",
+		    .fn = (void *)bpf_dynptr_write,
+	    } },
+	  { BPF_FUNC_dynptr_read,
+	    bpftime_helper_info{
+		    .index = BPF_FUNC_dynptr_read,
+		    .name = "bpf_dynptr_read",
+		    .fn = (void *)bpf_dynptr_read,
+	    } },
+	  { BPF_FUNC_dynptr_data,
+	    bpftime_helper_info{
+		    .index = BPF_FUNC_dynptr_data,
+		    .name = "bpf_dynptr_data",
+		    .fn = (void *)bpf_dynptr_data,
+	    } },
 	  { BPF_FUNC_perf_event_output,
 	    bpftime_helper_info{ .index = BPF_FUNC_perf_event_output,
 				 .name = "bpf_perf_event_output",
@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#ifndef _EPOLL_READY_SET_HPP
+#define _EPOLL_READY_SET_HPP
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/smart_ptr/shared_ptr.hpp>
+#include <bpf_map/futex_notifier.hpp>
+#include <bpf_map/map_common_def.hpp>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <unistd.h>
+
+namespace bpftime
+{
+
+// Readiness bitmap of an epoll instance, one bit for each of its files.
+//
+// Producers set the bit of a file when publishing data into it, and the
+// waiter takes all the bits at once, only looking at files whose bit is set.
+// So a wakeup costs in proportion to the number of active files, instead of
+// the registered ones.
+struct epoll_ready_set {
+	// Files beyond this are always looked at by the waiter
+	static const uint32_t MAX_FILES = 4096;
+	uint64_t bits[MAX_FILES / 64] = {};
+	// Woken up when a bit gets set
+	futex_notifier notifier;
+
+	void mark_ready(uint32_t idx)
+	{
+		auto &word = bits[idx / 64];
+		uint64_t mask = 1ULL << (idx % 64);
+		// Already set since the last scan of the waiter, which will
+		// look at this file anyway
+		if (__atomic_load_n(&word, __ATOMIC_RELAXED) & mask)
+			return;
+		if (__atomic_fetch_or(&word, mask, __ATOMIC_SEQ_CST) & mask)
+			return;
+		notifier.notify();
+	}
+	// Take and clear a word of the bitmap
+	uint64_t take_word(uint32_t word_idx)
+	{
+		if (__atomic_load_n(&bits[word_idx], __ATOMIC_RELAXED) == 0)
+			return 0;
+		return __atomic_exchange_n(&bits[word_idx], 0,
+					   __ATOMIC_SEQ_CST);
+	}
+	// Set a bit without waking up anyone. Used by the waiter to look at a
+	// file again next time, since epoll is level triggered
+	void set_ready(uint32_t idx)
+	{
+		__atomic_fetch_or(&bits[idx / 64], 1ULL << (idx % 64),
+				  __ATOMIC_RELAXED);
+	}
+};
+
+using epoll_ready_set_shared_ptr = boost::interprocess::managed_shared_ptr<
+	epoll_ready_set,
+	boost::interprocess::managed_shared_memory::segment_manager>::type;
+
+// The epoll instances watching a ring buffer or a perf buffer, kept by the
+// producer side. A strong reference is held, so that the ready set stays
+// valid even if the epoll instance is closed first.
+//
+// Slots are claimed with CAS, so instances in different processes could be
+// added and removed concurrently. Producers count themselves on a slot while
+// notifying through it, and a freed slot is only reused once they are gone.
+// Slots of instances whose process has exited are reclaimed when there is no
+// free one.
+struct epoll_watchers {
+	static const uint32_t MAX_WATCHERS = 4;
+	enum : uint32_t {
+		SLOT_FREE = 0,
+		// Being filled by `add`
+		SLOT_CLAIMED,
+		SLOT_USED,
+	};
+	struct watcher {
+		uint32_t state = SLOT_FREE;
+		// Producers notifying through this slot
+		uint32_t users = 0;
+		// Process which added the epoll instance
+		int pid = 0;
+		epoll_ready_set_shared_ptr ready_set;
+		uint32_t index;
+	};
+	watcher watchers[MAX_WATCHERS];
+
+	// Called by producers after publishing new data
+	void notify()
+	{
+		// Pairs with taking the bits by the waiter: either the waiter
+		// sees the published data, or we see the cleared bit
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		for (auto &w : watchers) {
+			if (__atomic_load_n(&w.state, __ATOMIC_ACQUIRE) !=
+			    SLOT_USED)
+				continue;
+			__atomic_fetch_add(&w.users, 1, __ATOMIC_SEQ_CST);
+			// Either `add` waits for us, or we see the slot freed
+			if (__atomic_load_n(&w.state, __ATOMIC_SEQ_CST) ==
+			    SLOT_USED) {
+				if (w.index < epoll_ready_set::MAX_FILES)
+					w.ready_set->mark_ready(w.index);
+				else
+					w.ready_set->notifier.notify();
+			}
+			__atomic_fetch_sub(&w.users, 1, __ATOMIC_RELEASE);
+		}
+	}
+	// Returns -1 if there are too many watchers
+	int add(const epoll_ready_set_shared_ptr &ready_set, uint32_t index)
+	{
+		for (int pass = 0; pass < 2; pass++) {
+			for (auto &w : watchers) {
+				uint32_t expected = SLOT_FREE;
+				if (!__atomic_compare_exchange_n(
+					    &w.state, &expected, SLOT_CLAIMED,
+					    false, __ATOMIC_SEQ_CST,
+					    __ATOMIC_RELAXED))
+					continue;
+				// Producers may still be using the previous
+				// ready set of the slot
+				for (int spins = 0;
+				     __atomic_load_n(&w.users,
+						     __ATOMIC_ACQUIRE) != 0;)
+					spin_wait(spins);
+				w.ready_set = ready_set;
+				w.index = index;
+				w.pid = getpid();
+				__atomic_store_n(&w.state, SLOT_USED,
+						 __ATOMIC_RELEASE);
+				return 0;
+			}
+			if (pass == 0 && reclaim_dead() == 0)
+				break;
+		}
+		return -1;
+	}
+	// Stop notifying an epoll instance, when it's closed
+	void remove(const epoll_ready_set *ready_set)
+	{
+		for (auto &w : watchers) {
+			if (__atomic_load_n(&w.state, __ATOMIC_ACQUIRE) ==
+				    SLOT_USED &&
+			    w.ready_set.get().get() == ready_set)
+				release(w, SLOT_USED);
+		}
+	}
+
+    private:
+	bool release(watcher &w, uint32_t state)
+	{
+		// The ready set is dropped when the slot is reused
+		return __atomic_compare_exchange_n(&w.state, &state, SLOT_FREE,
+						   false, __ATOMIC_SEQ_CST,
+						   __ATOMIC_RELAXED);
+	}
+	// Free slots of epoll instances whose process has exited. Returns
+	// the number of slots freed
+	int reclaim_dead()
+	{
+		int cnt = 0;
+		for (auto &w : watchers) {
+			if (__atomic_load_n(&w.state, __ATOMIC_ACQUIRE) !=
+			    SLOT_USED)
+				continue;
+			if (kill(w.pid, 0) < 0 && errno == ESRCH &&
+			    release(w, SLOT_USED))
+				cnt++;
+		}
+		return cnt;
+	}
+};
+
+} // namespace bpftime
+#endif
@@ -0,0 +1,593 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#include "spdlog/spdlog.h"
+#include <bpf_map/eventfd_notifier.hpp>
+#include <bpf_map/map_common_def.hpp>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+namespace bpftime
+{
+
+// Producers in other processes get the eventfd with SCM_RIGHTS, from a
+// thread of the consumer process serving an abstract unix socket named after
+// its pid. Only eventfds created by `enable` are handed out, and only to
+// processes of the same user.
+
+union fd_control {
+	cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+};
+
+static std::mutex eventfd_server_mutex;
+// The process the server thread runs in; a forked child starts its own
+static int eventfd_server_pid;
+static std::unordered_set<int> served_eventfds;
+
+static socklen_t eventfd_server_addr(int pid, sockaddr_un &addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	// Abstract namespace, the name starts with a nul byte
+	int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+			   "bpftime_eventfd_%d", pid);
+	return offsetof(sockaddr_un, sun_path) + 1 + len;
+}
+
+static bool is_served_eventfd(int fd)
+{
+	{
+		std::lock_guard<std::mutex> guard(eventfd_server_mutex);
+		if (!served_eventfds.count(fd))
+			return false;
+	}
+	// The consumer may have closed it, and the number reused
+	char path[64], target[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	auto len = readlink(path, target, sizeof(target) - 1);
+	if (len < 0)
+		return false;
+	target[len] = 0;
+	return strcmp(target, "anon_inode:[eventfd]") == 0;
+}
+
+static void serve_eventfd_request(int conn)
+{
+	ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+	    cred.uid != geteuid())
+		return;
+	// Don't let a stuck client block the others
+	timeval timeout = { 1, 0 };
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	int32_t fd;
+	if (recv(conn, &fd, sizeof(fd), 0) != sizeof(fd))
+		return;
+	char byte = 0;
+	iovec iov = { &byte, 1 };
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	fd_control control;
+	if (is_served_eventfd(fd)) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	sendmsg(conn, &msg, MSG_NOSIGNAL);
+}
+
+// Start the server thread of this process, if not yet. The caller holds
+// eventfd_server_mutex
+static int start_eventfd_server()
+{
+	if (eventfd_server_pid == getpid())
+		return 0;
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	sockaddr_un addr;
+	auto addr_len = eventfd_server_addr(getpid(), addr);
+	if (bind(sock, (sockaddr *)&addr, addr_len) < 0 ||
+	    listen(sock, 16) < 0) {
+		int err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+	std::thread([sock]() {
+		while (true) {
+			int conn = accept4(sock, nullptr, nullptr,
+					   SOCK_CLOEXEC);
+			if (conn < 0) {
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				spdlog::error("Eventfd server stopped: {}",
+					      errno);
+				break;
+			}
+			serve_eventfd_request(conn);
+			close(conn);
+		}
+		close(sock);
+	}).detach();
+	eventfd_server_pid = getpid();
+	return 0;
+}
+
+eventfd_notifier::eventfd_notifier(
+	boost::interprocess::managed_shared_memory &memory)
+	: registry(memory.find_or_construct<eventfd_notifier_registry>(
+		  "eventfd_notifier_registry")())
+{
+	start_fetcher();
+}
+
+int eventfd_notifier::enable()
+{
+	uint64_t new_id = 0;
+	while (new_id == 0) {
+		if (getrandom(&new_id, sizeof(new_id), 0) !=
+		    sizeof(new_id)) {
+			spdlog::error("Unable to get a random notifier id: {}",
+				      errno);
+			return -1;
+		}
+	}
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		spdlog::error("Unable to create eventfd: {}", errno);
+		return -1;
+	}
+	{
+		std::lock_guard<std::mutex> guard(eventfd_server_mutex);
+		if (start_eventfd_server() < 0) {
+			spdlog::error("Unable to serve eventfds: {}", errno);
+			close(fd);
+			return -1;
+		}
+		served_eventfds.insert(fd);
+	}
+	uint32_t start = __atomic_load_n(&seq, __ATOMIC_RELAXED);
+	for (int spins = 0;
+	     (start & 1) ||
+	     !__atomic_compare_exchange_n(&seq, &start, start + 1, false,
+					  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);) {
+		spin_wait(spins);
+		start = __atomic_load_n(&seq, __ATOMIC_RELAXED);
+	}
+	// Keep the stores below from being seen before the odd sequence
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&owner_fd, fd, __ATOMIC_RELAXED);
+	__atomic_store_n(&owner_pid, getpid(), __ATOMIC_RELAXED);
+	__atomic_store_n(&id, new_id, __ATOMIC_RELAXED);
+	__atomic_store_n(&seq, start + 2, __ATOMIC_RELEASE);
+	return fd;
+}
+
+// How long the fetcher waits for a consumer to hand out its eventfd, and
+// waits before asking again after failing
+static const int EVENTFD_FETCH_TIMEOUT_MS = 100;
+static const int EVENTFD_FETCH_RETRY_MS = 1000;
+
+static uint64_t now_ms()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * (uint64_t)1000 + ts.tv_nsec / 1000000;
+}
+
+// Ask process `pid` for its eventfd `fd`. Returns the received fd, or -1
+static int receive_eventfd(int pid, int fd)
+{
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	sockaddr_un addr;
+	auto addr_len = eventfd_server_addr(pid, addr);
+	int32_t request = fd;
+	ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	char byte;
+	iovec iov = { &byte, 1 };
+	fd_control control;
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	int local_fd = -1;
+	// Don't let a stuck consumer hold up the fetches of the others
+	timeval timeout = { 0, EVENTFD_FETCH_TIMEOUT_MS * 1000 };
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+		       sizeof(timeout)) < 0 ||
+	    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+		       sizeof(timeout)) < 0 ||
+	    connect(sock, (sockaddr *)&addr, addr_len) < 0 ||
+	    getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
+		goto out;
+	// Anyone could bind the name; only trust the consumer itself
+	if (cred.pid != pid || cred.uid != geteuid()) {
+		errno = EPERM;
+		goto out;
+	}
+	if (send(sock, &request, sizeof(request), MSG_NOSIGNAL) !=
+		    sizeof(request) ||
+	    recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+		goto out;
+	if (auto cmsg = CMSG_FIRSTHDR(&msg);
+	    cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&local_fd, CMSG_DATA(cmsg), sizeof(int));
+	else
+		errno = ENOENT;
+out:
+	int err = errno;
+	close(sock);
+	errno = err;
+	return local_fd;
+}
+
+// Producers run inside programs and probes, so they never fetch eventfds of
+// consumers in other processes themselves, or take locks. A producer missing
+// the eventfd asks the fetcher thread of its process for it, and skips the
+// wake-up, which the fetcher makes once it has the eventfd. Producers find
+// the received eventfds in a fixed table without locks, and count
+// themselves in the slot while writing to it, so that it's only closed
+// once they are done.
+
+// An eventfd of a consumer received into this process
+struct local_eventfd {
+	// Id of the notifier it was received for, 0 if the slot is free
+	uint64_t id;
+	// -1 if it couldn't be received, in which case it isn't asked for
+	// again until `retry_after`
+	int32_t fd;
+	// Producers writing to the eventfd
+	uint32_t users;
+	uint64_t retry_after;
+	// Only used by the fetcher
+	const eventfd_notifier *notifier;
+};
+static const int LOCAL_EVENTFDS = 64;
+static local_eventfd local_eventfds[LOCAL_EVENTFDS];
+// Notifiers whose eventfds producers are missing
+static const int FETCH_REQUESTS = 16;
+static const eventfd_notifier *fetch_requests[FETCH_REQUESTS];
+// Taken by the fetcher and by destructors to change the slots, never by
+// producers
+static std::mutex fetcher_mutex;
+// The process the fetcher runs in, and the eventfd it sleeps on
+static int fetcher_pid;
+static int fetcher_wake_fd = -1;
+// The registry and its count of destroyed notifiers when eventfds of
+// destroyed notifiers were last dropped, and a registry producers saw
+// more destroyed in
+static const eventfd_notifier_registry *registry_seen;
+static uint64_t destroyed_seen;
+static const eventfd_notifier_registry *registry_changed;
+// Slot to take when the table is full
+static int next_evicted;
+
+static void wake_fetcher()
+{
+	int wake_fd = __atomic_load_n(&fetcher_wake_fd, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+	if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0 &&
+	    errno != EAGAIN)
+		spdlog::error("Unable to wake eventfd fetcher: {}", errno);
+}
+
+// Write to the eventfd received for notifier `id`. Returns 1 if written, 0
+// if it couldn't be received lately, and -1 if it's not in the table
+static int signal_local_eventfd(uint64_t id)
+{
+	for (auto &slot : local_eventfds) {
+		if (__atomic_load_n(&slot.id, __ATOMIC_ACQUIRE) != id)
+			continue;
+		__atomic_fetch_add(&slot.users, 1, __ATOMIC_SEQ_CST);
+		// Either the fetcher sees us and waits before closing it, or
+		// we see the slot freed
+		int ret = -1;
+		if (__atomic_load_n(&slot.id, __ATOMIC_SEQ_CST) == id) {
+			int fd = __atomic_load_n(&slot.fd, __ATOMIC_RELAXED);
+			uint64_t one = 1;
+			if (fd < 0) {
+				ret = now_ms() < __atomic_load_n(
+							 &slot.retry_after,
+							 __ATOMIC_RELAXED) ?
+					      0 :
+					      -1;
+			} else {
+				if (write(fd, &one, sizeof(one)) < 0 &&
+				    errno != EAGAIN)
+					spdlog::error(
+						"Unable to signal eventfd: {}",
+						errno);
+				ret = 1;
+			}
+		}
+		__atomic_fetch_sub(&slot.users, 1, __ATOMIC_RELEASE);
+		return ret;
+	}
+	return -1;
+}
+
+// Free a slot, once the producers writing to its eventfd are done. The
+// caller holds fetcher_mutex
+static void free_local_eventfd(local_eventfd &slot)
+{
+	__atomic_store_n(&slot.id, 0, __ATOMIC_SEQ_CST);
+	for (int spins = 0;
+	     __atomic_load_n(&slot.users, __ATOMIC_SEQ_CST) != 0;)
+		spin_wait(spins);
+	if (slot.fd >= 0)
+		close(slot.fd);
+	slot.fd = -1;
+	slot.notifier = nullptr;
+}
+
+// Close the eventfds received for notifiers destroyed by any process. The
+// caller holds fetcher_mutex
+static void drop_destroyed_eventfds(const eventfd_notifier_registry *registry)
+{
+	auto destroyed =
+		__atomic_load_n(&registry->destroyed, __ATOMIC_ACQUIRE);
+	if (registry_seen == registry && destroyed_seen == destroyed)
+		return;
+	for (auto &slot : local_eventfds) {
+		auto slot_id = __atomic_load_n(&slot.id, __ATOMIC_RELAXED);
+		if (slot_id == 0)
+			continue;
+		// Too many to tell which, fetch the live ones again
+		bool stale = registry_seen != registry ||
+			     destroyed - destroyed_seen >
+				     eventfd_notifier_registry::RECENT_IDS;
+		for (auto &id : registry->recent_ids) {
+			if (stale)
+				break;
+			stale = __atomic_load_n(&id, __ATOMIC_RELAXED) ==
+				slot_id;
+		}
+		if (stale)
+			free_local_eventfd(slot);
+	}
+	__atomic_store_n(&registry_seen, registry, __ATOMIC_RELAXED);
+	__atomic_store_n(&destroyed_seen, destroyed, __ATOMIC_RELEASE);
+}
+
+// Fetch the eventfd of a notifier producers are missing, and make the
+// wake-up they skipped
+static void fetch_eventfd(const eventfd_notifier *notifier)
+{
+	uint64_t id;
+	int pid, fd;
+	if (!notifier->read_owner(id, pid, fd) || id == 0 || pid == getpid())
+		return;
+	if (signal_local_eventfd(id) >= 0)
+		return;
+	int received = receive_eventfd(pid, fd);
+	if (received < 0)
+		spdlog::error("Unable to get eventfd {} of process {}: {}", fd,
+			      pid, errno);
+	std::lock_guard<std::mutex> guard(fetcher_mutex);
+	local_eventfd *free_slot = nullptr;
+	for (auto &slot : local_eventfds) {
+		auto slot_id = __atomic_load_n(&slot.id, __ATOMIC_RELAXED);
+		// Drop the eventfds the notifier had before being enabled
+		// again, or a failed fetch of this one
+		if (slot_id != 0 &&
+		    (slot_id == id || slot.notifier == notifier))
+			free_local_eventfd(slot);
+		if (free_slot == nullptr &&
+		    __atomic_load_n(&slot.id, __ATOMIC_RELAXED) == 0)
+			free_slot = &slot;
+	}
+	if (free_slot == nullptr) {
+		free_slot = &local_eventfds[next_evicted];
+		next_evicted = (next_evicted + 1) % LOCAL_EVENTFDS;
+		free_local_eventfd(*free_slot);
+	}
+	free_slot->fd = received;
+	free_slot->retry_after =
+		received < 0 ? now_ms() + EVENTFD_FETCH_RETRY_MS : 0;
+	free_slot->notifier = notifier;
+	__atomic_store_n(&free_slot->id, id, __ATOMIC_RELEASE);
+	uint64_t one = 1;
+	if (received >= 0 && write(received, &one, sizeof(one)) < 0 &&
+	    errno != EAGAIN)
+		spdlog::error("Unable to signal eventfd: {}", errno);
+}
+
+static void run_fetcher(int wake_fd)
+{
+	while (true) {
+		std::vector<const eventfd_notifier *> requests;
+		{
+			std::lock_guard<std::mutex> guard(fetcher_mutex);
+			if (auto registry = __atomic_exchange_n(
+				    &registry_changed, nullptr,
+				    __ATOMIC_ACQUIRE))
+				drop_destroyed_eventfds(registry);
+			for (auto &req : fetch_requests) {
+				if (auto notifier = __atomic_exchange_n(
+					    &req, nullptr, __ATOMIC_ACQUIRE))
+					requests.push_back(notifier);
+			}
+		}
+		// A notifier destroyed meanwhile has its id recorded in the
+		// registry, so its eventfd is dropped on a later wake-up
+		for (auto notifier : requests)
+			fetch_eventfd(notifier);
+		uint64_t cnt;
+		if (read(wake_fd, &cnt, sizeof(cnt)) < 0 && errno != EINTR) {
+			spdlog::error("Eventfd fetcher stopped: {}", errno);
+			break;
+		}
+	}
+}
+
+// Start the fetcher thread of this process, if not yet. The caller holds
+// fetcher_mutex
+static int start_fetcher_thread()
+{
+	if (fetcher_pid == getpid())
+		return 0;
+	int wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd < 0)
+		return -1;
+	__atomic_store_n(&fetcher_wake_fd, wake_fd, __ATOMIC_RELEASE);
+	std::thread(run_fetcher, wake_fd).detach();
+	fetcher_pid = getpid();
+	return 0;
+}
+
+static void fetcher_prepare_fork()
+{
+	fetcher_mutex.lock();
+}
+
+static void fetcher_parent_fork()
+{
+	fetcher_mutex.unlock();
+}
+
+// The fetcher of the parent doesn't run in the child, which starts its own
+static void fetcher_child_fork()
+{
+	if (fetcher_pid != 0) {
+		close(fetcher_wake_fd);
+		__atomic_store_n(&fetcher_wake_fd, -1, __ATOMIC_RELEASE);
+		if (start_fetcher_thread() < 0)
+			spdlog::error("Unable to start eventfd fetcher: {}",
+				      errno);
+	}
+	fetcher_mutex.unlock();
+}
+
+void eventfd_notifier::start_fetcher()
+{
+	static int registered = pthread_atfork(
+		fetcher_prepare_fork, fetcher_parent_fork, fetcher_child_fork);
+	(void)registered;
+	std::lock_guard<std::mutex> guard(fetcher_mutex);
+	if (start_fetcher_thread() < 0)
+		spdlog::error("Unable to start eventfd fetcher: {}", errno);
+}
+
+eventfd_notifier::~eventfd_notifier()
+{
+	auto cur_id = __atomic_load_n(&id, __ATOMIC_ACQUIRE);
+	if (cur_id == 0)
+		return;
+	if (registry) {
+		auto slot = __atomic_fetch_add(&registry->reserved, 1,
+					       __ATOMIC_RELAXED);
+		__atomic_store_n(
+			&registry->recent_ids
+				 [slot % eventfd_notifier_registry::RECENT_IDS],
+			cur_id, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&registry->destroyed, 1, __ATOMIC_RELEASE);
+	}
+	std::lock_guard<std::mutex> guard(fetcher_mutex);
+	for (auto &req : fetch_requests) {
+		const eventfd_notifier *expected = this;
+		__atomic_compare_exchange_n(&req, &expected, nullptr, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	for (auto &slot : local_eventfds) {
+		if (__atomic_load_n(&slot.id, __ATOMIC_RELAXED) != 0 &&
+		    slot.notifier == this)
+			free_local_eventfd(slot);
+	}
+}
+
+bool eventfd_notifier::read_owner(uint64_t &cur_id, int &pid, int &fd) const
+{
+	// Give up if `enable` is stuck in the middle, rather than hang the
+	// producer
+	for (int tries = 0; tries < 100; tries++) {
+		auto start = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+		if (start & 1) {
+			cpu_relax();
+			continue;
+		}
+		cur_id = __atomic_load_n(&id, __ATOMIC_RELAXED);
+		pid = __atomic_load_n(&owner_pid, __ATOMIC_RELAXED);
+		fd = __atomic_load_n(&owner_fd, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&seq, __ATOMIC_RELAXED) == start)
+			return true;
+	}
+	return false;
+}
+
+void eventfd_notifier::signal()
+{
+	uint64_t cur_id;
+	int pid, fd;
+	if (!read_owner(cur_id, pid, fd) || cur_id == 0)
+		return;
+	if (pid == getpid()) {
+		uint64_t one = 1;
+		if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			spdlog::error("Unable to signal eventfd: {}", errno);
+		return;
+	}
+	bool wake = false;
+	if (auto reg = registry.get()) {
+		auto destroyed =
+			__atomic_load_n(&reg->destroyed, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&registry_seen, __ATOMIC_RELAXED) != reg ||
+		    __atomic_load_n(&destroyed_seen, __ATOMIC_ACQUIRE) !=
+			    destroyed) {
+			__atomic_store_n(&registry_changed, reg,
+					 __ATOMIC_RELEASE);
+			wake = true;
+		}
+	}
+	if (signal_local_eventfd(cur_id) < 0) {
+		// The fetcher makes the wake-up once it has the eventfd
+		bool requested = false;
+		for (auto &req : fetch_requests) {
+			if (__atomic_load_n(&req, __ATOMIC_RELAXED) == this) {
+				requested = true;
+				break;
+			}
+		}
+		for (auto &req : fetch_requests) {
+			const eventfd_notifier *expected = nullptr;
+			if (requested)
+				break;
+			requested = __atomic_compare_exchange_n(
+				&req, &expected, this, false, __ATOMIC_RELEASE,
+				__ATOMIC_RELAXED);
+		}
+		wake = true;
+	}
+	if (wake)
+		wake_fetcher();
+}
+
+} // namespace bpftime
@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#ifndef _EVENTFD_NOTIFIER_HPP
+#define _EVENTFD_NOTIFIER_HPP
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <cstdint>
+
+namespace bpftime
+{
+
+// Ids of the notifiers destroyed lately in a shared memory, so that
+// producers in other processes close the eventfds they received for them
+struct eventfd_notifier_registry {
+	static const uint32_t RECENT_IDS = 64;
+	// Slots of `recent_ids` taken so far
+	uint64_t reserved = 0;
+	// Notifiers destroyed so far, bumped after the id is in its slot
+	uint64_t destroyed = 0;
+	uint64_t recent_ids[RECENT_IDS] = {};
+};
+
+// An optional, kernel visible notification for a ring buffer or a perf
+// buffer, so that consumers could wait for it with a real epoll_wait or
+// io_uring, along with other fds.
+//
+// The consumer process owns an eventfd, and producers in other processes
+// receive it from the consumer with SCM_RIGHTS, through a fetcher thread of
+// their process, since producers run inside programs and probes and can't
+// wait for the consumer or take locks. A producer that doesn't have the
+// eventfd yet leaves the wake-up to the fetcher. Writes are coalesced:
+// producers only signal the eventfd when the consumer has armed it, which
+// the consumer does right before going to sleep, and the first producer to
+// see it armed disarms it. So a burst of records costs at most one write.
+struct eventfd_notifier {
+	// Odd while `enable` changes the fields below, so that producers read
+	// the id, the pid and the fd of the same eventfd
+	uint32_t seq = 0;
+	// The consumer process and its eventfd
+	int32_t owner_pid = 0;
+	int32_t owner_fd = -1;
+	// Random and unique each time the eventfd changes, so that producers
+	// fetch it again. 0 if not enabled
+	uint64_t id = 0;
+	// Whether the consumer is sleeping on the eventfd
+	uint32_t armed = 0;
+	boost::interprocess::offset_ptr<eventfd_notifier_registry> registry;
+
+	eventfd_notifier(boost::interprocess::managed_shared_memory &memory);
+	// Producers in other processes close their copies of the eventfd on
+	// their next signal of any notifier
+	~eventfd_notifier();
+
+	// Called by producers after publishing new data
+	void notify()
+	{
+		// Pairs with the barrier in `arm`: either the consumer sees
+		// the published data, or we see it armed
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&armed, __ATOMIC_RELAXED) == 0)
+			return;
+		if (__atomic_exchange_n(&armed, 0, __ATOMIC_ACQ_REL) == 0)
+			return;
+		signal();
+	}
+	// Called by the consumer before sleeping on the eventfd. The consumer
+	// must check for data after arming, and only sleep if there is none
+	void arm()
+	{
+		__atomic_store_n(&armed, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	// Create an eventfd in the calling process, and make it the one to be
+	// signaled. Returns the eventfd, or -1 on error
+	int enable();
+	// Write to the eventfd of the consumer
+	void signal();
+	// Read the id, the pid and the fd consistently. Fails if `enable` is
+	// stuck in the middle
+	bool read_owner(uint64_t &cur_id, int &pid, int &fd) const;
+	// Start the thread fetching eventfds for producers of the calling
+	// process, if not yet. Called by processes creating or opening the
+	// shared memory with notifiers
+	static void start_fetcher();
+};
+
+} // namespace bpftime
+#endif
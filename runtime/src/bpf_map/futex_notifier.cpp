@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#include <bpf_map/futex_notifier.hpp>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace bpftime
+{
+
+// The futex word is shared between processes, so FUTEX_PRIVATE_FLAG must
+// not be used
+void futex_notifier::wake_all()
+{
+	syscall(SYS_futex, &seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+int futex_notifier_wait(futex_notifier *notifier, uint32_t seq,
+			int timeout_ms)
+{
+	timespec ts, *pts = nullptr;
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+		pts = &ts;
+	}
+	if (syscall(SYS_futex, &notifier->seq, FUTEX_WAIT, seq, pts, nullptr,
+		    0) < 0 &&
+	    errno == ETIMEDOUT)
+		return -1;
+	return 0;
+}
+
+} // namespace bpftime
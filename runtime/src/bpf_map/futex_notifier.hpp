@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#ifndef _FUTEX_NOTIFIER_HPP
+#define _FUTEX_NOTIFIER_HPP
+#include <cstdint>
+
+namespace bpftime
+{
+
+// A futex word living in the shared memory, which lets consumers of ring
+// buffers and perf buffers sleep until producers publish something, instead
+// of polling.
+//
+// Producers only make a syscall when there are consumers waiting. A consumer
+// registers itself with `add_waiter`, takes a snapshot of `current_seq`,
+// checks for data, and only then sleeps. Together with the barrier in
+// `notify`, either the consumer sees the published data, or the producer
+// sees the waiter and bumps the sequence, failing the futex wait.
+struct futex_notifier {
+	uint32_t seq = 0;
+	uint32_t waiters = 0;
+
+	// Called by producers after publishing new data
+	void notify()
+	{
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&waiters, __ATOMIC_RELAXED) == 0)
+			return;
+		__atomic_fetch_add(&seq, 1, __ATOMIC_RELEASE);
+		wake_all();
+	}
+	void add_waiter()
+	{
+		__atomic_fetch_add(&waiters, 1, __ATOMIC_SEQ_CST);
+	}
+	void remove_waiter()
+	{
+		__atomic_fetch_sub(&waiters, 1, __ATOMIC_RELAXED);
+	}
+	uint32_t current_seq() const
+	{
+		return __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+	}
+	void wake_all();
+};
+
+// Sleep until the notifier is bumped past `seq`, or `timeout_ms` elapses. A
+// negative timeout means waiting forever. Returns 0 when woken up (maybe
+// spuriously), or -1 on timeout.
+int futex_notifier_wait(futex_notifier *notifier, uint32_t seq,
+			int timeout_ms);
+
+} // namespace bpftime
+#endif
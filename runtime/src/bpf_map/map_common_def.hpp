@@ -12,6 +12,11 @@
 #include <boost/interprocess/containers/vector.hpp>
 #include <functional>
 #include <sched.h>
+#include <cerrno>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace bpftime
 {
@@ -20,19 +25,15 @@ using bytes_vec_allocator = boost::interprocess::allocator<
 	uint8_t, boost::interprocess::managed_shared_memory::segment_manager>;
 using bytes_vec = boost::interprocess::vector<uint8_t, bytes_vec_allocator>;
 
-template <class T>
-static inline T ensure_on_current_cpu(std::function<T(int cpu)> func)
+// Index of the cpu the calling thread runs on, for a per cpu map of `ncpu`
+// cpus. sched_getcpu reads it from rseq or the vDSO, without a syscall. The
+// thread may move to another cpu right after, so the slot of a cpu could be
+// written by two threads at once, as in the kernel with preemptible programs
+static inline int current_cpu_index(int ncpu)
 {
-	cpu_set_t orig, set;
-	CPU_ZERO(&orig);
-	CPU_ZERO(&set);
-	sched_getaffinity(0, sizeof(orig), &orig);
-	int currcpu = sched_getcpu();
-	CPU_SET(currcpu, &set);
-	sched_setaffinity(0, sizeof(set), &set);
-	T ret = func(currcpu);
-	sched_setaffinity(0, sizeof(orig), &orig);
-	return ret;
+	int cpu = sched_getcpu();
+	// Ids of online cpus may go past their count if some are offline
+	return cpu < 0 ? 0 : cpu % ncpu;
 }
 
 template <class T>
@@ -62,6 +63,105 @@ inline void ensure_on_certain_cpu(int cpu, std::function<void()> func)
 	sched_setaffinity(0, sizeof(orig), &orig);
 }
 
+// Tell the cpu that the caller is busy waiting
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield" ::: "memory");
+#else
+	asm volatile("" ::: "memory");
+#endif
+}
+
+// Busy wait for a little while, then give up the cpu, so that a waiter
+// doesn't burn its time slice on another thread that was preempted while
+// holding up the waiter. `spins` counts the rounds waited so far
+static inline void spin_wait(int &spins)
+{
+	if (spins++ < 64)
+		cpu_relax();
+	else
+		sched_yield();
+}
+
+// Sum up `ncpu` adjacent values of a per cpu map into `out`, treating each
+// value as an array of 64-bit counters, or 32-bit counters if `value_size` is
+// not a multiple of 8. Returns -1 and sets errno if `value_size` is not a
+// multiple of 4.
+static inline long sum_per_cpu_values(const uint8_t *values,
+				      uint32_t value_size, int ncpu, void *out)
+{
+#ifdef __SSE2__
+	const auto load = [](const void *p) {
+		return _mm_loadu_si128((const __m128i *)p);
+	};
+#endif
+	if (value_size % 8 == 0) {
+		const size_t lanes = value_size / 8;
+		const uint64_t *src = (const uint64_t *)values;
+		uint64_t *dst = (uint64_t *)out;
+		size_t i = 0;
+		if (lanes == 1) {
+			// A single counter: values of all cpus are contiguous
+			uint64_t sum = 0;
+			int c = 0;
+#ifdef __SSE2__
+			__m128i acc = _mm_setzero_si128();
+			for (; c + 2 <= ncpu; c += 2)
+				acc = _mm_add_epi64(acc, load(src + c));
+			uint64_t parts[2];
+			_mm_storeu_si128((__m128i *)parts, acc);
+			sum = parts[0] + parts[1];
+#endif
+			for (; c < ncpu; c++)
+				sum += src[c];
+			dst[0] = sum;
+			return 0;
+		}
+#ifdef __SSE2__
+		for (; i + 2 <= lanes; i += 2) {
+			__m128i acc = _mm_setzero_si128();
+			for (int c = 0; c < ncpu; c++)
+				acc = _mm_add_epi64(acc,
+						    load(src + c * lanes + i));
+			_mm_storeu_si128((__m128i *)(dst + i), acc);
+		}
+#endif
+		for (; i < lanes; i++) {
+			uint64_t sum = 0;
+			for (int c = 0; c < ncpu; c++)
+				sum += src[c * lanes + i];
+			dst[i] = sum;
+		}
+		return 0;
+	} else if (value_size % 4 == 0) {
+		const size_t lanes = value_size / 4;
+		const uint32_t *src = (const uint32_t *)values;
+		uint32_t *dst = (uint32_t *)out;
+		size_t i = 0;
+#ifdef __SSE2__
+		for (; i + 4 <= lanes; i += 4) {
+			__m128i acc = _mm_setzero_si128();
+			for (int c = 0; c < ncpu; c++)
+				acc = _mm_add_epi32(acc,
+						    load(src + c * lanes + i));
+			_mm_storeu_si128((__m128i *)(dst + i), acc);
+		}
+#endif
+		for (; i < lanes; i++) {
+			uint32_t sum = 0;
+			for (int c = 0; c < ncpu; c++)
+				sum += src[c * lanes + i];
+			dst[i] = sum;
+		}
+		return 0;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
 struct bytes_vec_hasher {
 	size_t operator()(bytes_vec const &vec) const
 	{
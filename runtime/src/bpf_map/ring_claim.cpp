@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#include <bpf_map/ring_claim.hpp>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace bpftime
+{
+
+// The claim this thread is between claiming and publishing, if any
+static thread_local const ring_claim *current_claim = nullptr;
+
+// getpid is a syscall, which producers can't afford for every claim
+static pid_t cached_pid = 0;
+
+static void reset_cached_pid()
+{
+	__atomic_store_n(&cached_pid, getpid(), __ATOMIC_RELAXED);
+}
+
+static pid_t current_pid()
+{
+	auto pid = __atomic_load_n(&cached_pid, __ATOMIC_RELAXED);
+	if (pid == 0) {
+		static int registered =
+			pthread_atfork(nullptr, nullptr, reset_cached_pid);
+		(void)registered;
+		pid = getpid();
+		__atomic_store_n(&cached_pid, pid, __ATOMIC_RELAXED);
+	}
+	return pid;
+}
+
+uint64_t ring_claim_now_ms()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * (uint64_t)1000 + ts.tv_nsec / 1000000;
+}
+
+bool ring_claim::cas(uint64_t old_pos, uint64_t old_owner, uint64_t new_pos,
+		     uint64_t new_owner)
+{
+#if defined(__x86_64__)
+	bool ok;
+	asm volatile("lock cmpxchg16b %1"
+		     : "=@ccz"(ok), "+m"(*(unsigned __int128 *)word()),
+		       "+a"(old_pos), "+d"(old_owner)
+		     : "b"(new_pos), "c"(new_owner)
+		     : "memory");
+	return ok;
+#else
+	unsigned __int128 expected =
+		((unsigned __int128)old_owner << 64) | old_pos;
+	unsigned __int128 desired =
+		((unsigned __int128)new_owner << 64) | new_pos;
+	return __atomic_compare_exchange_n((unsigned __int128 *)word(),
+					   &expected, desired, false,
+					   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+#endif
+}
+
+bool ring_claim::begin(ring_claim_ticket &ticket)
+{
+	// Only this thread could have set it to this claim, so it's set only
+	// if a signal handler interrupted this thread in the middle of a
+	// claim of the same ring. Claims of other rings could be nested
+	if (current_claim == this) {
+		errno = EBUSY;
+		return false;
+	}
+	ticket.outer = current_claim;
+	current_claim = this;
+	// Keep the compiler from moving the claim above this
+	asm volatile("" ::: "memory");
+	return true;
+}
+
+void ring_claim::end(const ring_claim_ticket &ticket)
+{
+	asm volatile("" ::: "memory");
+	current_claim = ticket.outer;
+}
+
+bool ring_claim::try_claim(ring_claim_ticket &ticket, uint64_t &pos,
+			   uint64_t size)
+{
+	// The owner half could be torn from the position half here, in which
+	// case the CAS fails
+	auto owner = __atomic_load_n(word() + 1, __ATOMIC_RELAXED);
+	if (!cas(pos, owner, pos + size,
+		 ((uint64_t)current_pid() << 32) | size)) {
+		pos = position();
+		return false;
+	}
+	ticket.start = pos;
+	ticket.end = pos + size;
+	ticket.prev_pid = (int32_t)(owner >> 32);
+	ticket.prev_start = pos - (uint32_t)owner;
+	return true;
+}
+
+bool ring_claim::try_shrink(uint64_t end, uint64_t new_end)
+{
+	auto owner = __atomic_load_n(word() + 1, __ATOMIC_RELAXED);
+	auto size = (uint32_t)owner;
+	if (end - new_end >= size)
+		return false;
+	return cas(end, owner, new_end,
+		   (owner & ~(uint64_t)UINT32_MAX) | (size - (end - new_end)));
+}
+
+bool ring_claim::prev_owner_dead(const ring_claim_ticket &ticket) const
+{
+	pid_t pid = ticket.prev_pid;
+	if (pid <= 0 || pid == current_pid())
+		return false;
+	if (kill(pid, 0) < 0)
+		return errno == ESRCH;
+	// A killed process stays around until reaped by its parent
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *fp = fopen(path, "r");
+	if (fp == nullptr)
+		return false;
+	char buf[512];
+	bool dead = false;
+	if (fgets(buf, sizeof(buf), fp) != nullptr) {
+		// The state follows the command name, which may contain ')'
+		auto p = strrchr(buf, ')');
+		dead = p != nullptr && (p[1] == ' ') &&
+		       (p[2] == 'Z' || p[2] == 'X');
+	}
+	fclose(fp);
+	return dead;
+}
+
+} // namespace bpftime
@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#ifndef _RING_CLAIM_HPP
+#define _RING_CLAIM_HPP
+#include <bpf_map/map_common_def.hpp>
+#include <cstdint>
+
+namespace bpftime
+{
+
+// How long a producer waits for the space before its own to be published,
+// before checking whether the process that claimed it has died
+static const int RING_CLAIM_TIMEOUT_MS = 10;
+
+class ring_claim;
+
+// Space claimed by a producer, and the space claimed right before it
+struct ring_claim_ticket {
+	uint64_t start = 0;
+	uint64_t end = 0;
+	uint64_t prev_start = 0;
+	int32_t prev_pid = 0;
+	// The claim this thread was in when it started this one, if a signal
+	// handler interrupted a producer of another ring
+	const ring_claim *outer = nullptr;
+};
+
+// Lets producers of a ring buffer claim space without a lock, and publish
+// the records written there in the order the space was claimed, since
+// consumers trust everything before the published position.
+//
+// A producer killed between claiming and publishing would hold up every
+// later producer forever. So the claim position is moved with a 16 byte
+// CAS, which also records the pid of the claiming process and the size of
+// its space. The producer claiming next knows who claimed the space right
+// before its own, and once everything before that space is published, but
+// not that space, for RING_CLAIM_TIMEOUT_MS, it checks whether that process
+// is still alive. If it died, the waiter covers the space with records
+// that consumers skip, and publishes it in place of the dead one. Only the
+// next producer does that, so no live producer's space is ever given up.
+//
+// A producer interrupted by a signal handler producing into the same ring
+// would hold up the handler the same way, so claims nested in the same
+// thread fail instead, like nested reservations in NMIs in the kernel.
+//
+// A producer preempted between claiming and publishing still holds up the
+// later ones until it runs again. A recycled pid is taken as alive.
+class ring_claim {
+	// {claim position, pid << 32 | size of the space before it}. The
+	// CAS needs it 16 byte aligned, while objects in the shm are only 8
+	// byte aligned
+	uint64_t storage[3] = {};
+
+	uint64_t *word()
+	{
+		return (uint64_t *)(((uintptr_t)storage + 15) & ~(uintptr_t)15);
+	}
+	const uint64_t *word() const
+	{
+		return (const uint64_t *)(((uintptr_t)storage + 15) &
+					  ~(uintptr_t)15);
+	}
+	bool cas(uint64_t old_pos, uint64_t old_owner, uint64_t new_pos,
+		 uint64_t new_owner);
+	bool prev_owner_dead(const ring_claim_ticket &ticket) const;
+
+    public:
+	// End of the claimed space
+	uint64_t position() const
+	{
+		return __atomic_load_n(word(), __ATOMIC_ACQUIRE);
+	}
+	// Start claiming space. Fails with errno EBUSY if this thread is
+	// already between claiming and publishing space of this ring
+	bool begin(ring_claim_ticket &ticket);
+	// Claim [pos, pos + size). On failure, `pos` is set to the current
+	// claim position, for the caller to check for space and retry
+	bool try_claim(ring_claim_ticket &ticket, uint64_t &pos, uint64_t size);
+	// Give back the space from `new_end` to `end`, the end of the space
+	// the calling thread claimed, if nothing is claimed after it
+	bool try_shrink(uint64_t end, uint64_t new_end);
+	// Wait until everything before the claimed space is published to
+	// `published`. If the process that claimed the space right before
+	// died before publishing it, `skip` is called to cover that space
+	// with records consumers skip, and the space is published
+	template <class T, class F>
+	void wait_turn(const ring_claim_ticket &ticket, T *published,
+		       F &&skip);
+	// Done with the claim, after publishing the space or failing to claim
+	// it
+	void end(const ring_claim_ticket &ticket);
+};
+
+// Current time in milliseconds, for timing waits in producers
+uint64_t ring_claim_now_ms();
+
+template <class T, class F>
+void ring_claim::wait_turn(const ring_claim_ticket &ticket, T *published,
+			   F &&skip)
+{
+	uint64_t since = 0;
+	for (int spins = 0;;) {
+		uint64_t pos = __atomic_load_n(published, __ATOMIC_ACQUIRE);
+		if (pos == ticket.start)
+			return;
+		spin_wait(spins);
+		// Only the space right before ours is our business, the
+		// producers waiting for earlier spaces take care of those.
+		// Don't look at the clock while spinning
+		if (pos != ticket.prev_start) {
+			since = 0;
+			continue;
+		}
+		if (spins < 128)
+			continue;
+		auto now = ring_claim_now_ms();
+		if (since == 0) {
+			since = now;
+		} else if (now - since >= (uint64_t)RING_CLAIM_TIMEOUT_MS) {
+			if (prev_owner_dead(ticket)) {
+				spdlog::warn(
+					"Skipping space [{}, {}) of ring buffer claimed by dead process {}",
+					ticket.prev_start, ticket.start,
+					ticket.prev_pid);
+				skip(ticket.prev_start, ticket.start);
+				__atomic_store_n(published, (T)ticket.start,
+						 __ATOMIC_RELEASE);
+				return;
+			}
+			since = now;
+		}
+	}
+}
+
+} // namespace bpftime
+#endif
@@ -3,24 +3,248 @@
  * Copyright (c) 2022, eunomia-bpf org
  * All rights reserved.
  */
+#include "spdlog/spdlog.h"
 #include <bpf_map/userspace/array_map.hpp>
+#include <atomic>
 #include <cerrno>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
 
 namespace bpftime
 {
 
+static std::string sparse_object_name(uint64_t id)
+{
+	return "/bpftime_array_" + std::to_string(id);
+}
+
+// Name of the counter of destroyed sparse arrays in the shared memory
+static const char *SPARSE_DESTROYED_NAME = "sparse_array_destroyed";
+
+struct sparse_mapping {
+	void *addr;
+	size_t size;
+};
+
+// Sparse objects are mapped at different addresses in each process, so
+// every process keeps its own mappings, looked up by the id of the object
+struct sparse_mappings {
+	std::mutex mutex;
+	std::unordered_map<uint64_t, sparse_mapping> addrs;
+	// Bumped whenever a mapping is removed, so that threads could tell
+	// whether the mapping they remembered is still there
+	std::atomic<uint64_t> generation = 1;
+	// The count of destroyed arrays when mappings of destroyed ones were
+	// last dropped
+	std::atomic<uint64_t> destroyed_seen = 0;
+};
+
+static sparse_mappings &get_sparse_mappings()
+{
+	static sparse_mappings mappings;
+	return mappings;
+}
+
+// Mappings used by this thread, so that accessing the same few arrays
+// repeatedly doesn't go through the lock. Indexed by the id, which is
+// random. An entry is only valid while the generation of the mappings is
+// still the one it holds
+struct sparse_cache_entry {
+	uint64_t id;
+	void *addr;
+	uint64_t generation;
+};
+static const size_t SPARSE_CACHE_SIZE = 8;
+static thread_local sparse_cache_entry sparse_cache[SPARSE_CACHE_SIZE];
+
+// Ids of sparse objects are random, so that they are neither reused by
+// another process that gets the same pid, nor guessable by other users
+static uint64_t new_sparse_object_id()
+{
+	uint64_t id = 0;
+	while (id == 0) {
+		if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+			return 0;
+	}
+	return id;
+}
+
+static void *map_sparse_object(uint64_t id, size_t size, bool create)
+{
+	auto name = sparse_object_name(id);
+	int fd = shm_open(name.c_str(),
+			  O_RDWR | (create ? (O_CREAT | O_EXCL) : 0), 0600);
+	if (fd < 0) {
+		if (create && errno == EEXIST)
+			spdlog::error(
+				"Sparse array object {} already exists, refusing to share it",
+				name);
+		else
+			spdlog::error("Unable to open sparse array object {}: {}",
+				      name, errno);
+		return nullptr;
+	}
+	// Extending a shm object doesn't commit any page
+	if (create && ftruncate(fd, size) < 0) {
+		spdlog::error("Unable to resize sparse array object {}: {}",
+			      name, errno);
+		close(fd);
+		shm_unlink(name.c_str());
+		return nullptr;
+	}
+	void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_NORESERVE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (addr == MAP_FAILED) {
+		spdlog::error("Unable to map sparse array object {}: {}", name,
+			      err);
+		if (create)
+			shm_unlink(name.c_str());
+		return nullptr;
+	}
+	return addr;
+}
+
+// Unmap the objects of arrays destroyed by any process. The objects are
+// unlinked when destroyed, so they can't be opened any more
+static void drop_destroyed_mappings(uint64_t destroyed)
+{
+	auto &mappings = get_sparse_mappings();
+	std::lock_guard<std::mutex> guard(mappings.mutex);
+	if (mappings.destroyed_seen.load(std::memory_order_relaxed) ==
+	    destroyed)
+		return;
+	bool removed = false;
+	for (auto itr = mappings.addrs.begin(); itr != mappings.addrs.end();) {
+		int fd = shm_open(sparse_object_name(itr->first).c_str(),
+				  O_RDONLY, 0);
+		if (fd >= 0 || errno != ENOENT) {
+			if (fd >= 0)
+				close(fd);
+			itr++;
+			continue;
+		}
+		spdlog::debug("Dropping mapping of destroyed sparse array {}",
+			      sparse_object_name(itr->first));
+		if (!removed) {
+			// Invalidate what other threads remembered before the
+			// memory goes away
+			mappings.generation.fetch_add(1);
+			removed = true;
+		}
+		munmap(itr->second.addr, itr->second.size);
+		itr = mappings.addrs.erase(itr);
+	}
+	mappings.destroyed_seen.store(destroyed, std::memory_order_release);
+}
+
+uint8_t *array_map_impl::data_base() const
+{
+	if (sparse_id == 0)
+		return (uint8_t *)data.data();
+	auto &mappings = get_sparse_mappings();
+	auto destroyed =
+		__atomic_load_n(sparse_destroyed.get(), __ATOMIC_ACQUIRE);
+	if (destroyed !=
+	    mappings.destroyed_seen.load(std::memory_order_acquire))
+		drop_destroyed_mappings(destroyed);
+	auto generation = mappings.generation.load(std::memory_order_acquire);
+	auto &cached = sparse_cache[sparse_id % SPARSE_CACHE_SIZE];
+	if (cached.id == sparse_id && cached.generation == generation)
+		return (uint8_t *)cached.addr;
+	std::lock_guard<std::mutex> guard(mappings.mutex);
+	void *addr;
+	if (auto itr = mappings.addrs.find(sparse_id);
+	    itr != mappings.addrs.end()) {
+		addr = itr->second.addr;
+	} else {
+		size_t size = (size_t)_value_size * _max_entries;
+		addr = map_sparse_object(sparse_id, size, false);
+		if (addr == nullptr)
+			return nullptr;
+		mappings.addrs[sparse_id] = { addr, size };
+	}
+	cached = { sparse_id, addr, mappings.generation.load() };
+	return (uint8_t *)addr;
+}
+
 void *array_map_impl::get_raw_data() const
 {
-	return (void *)data.data();
+	return (void *)data_base();
 }
 array_map_impl::array_map_impl(
 	boost::interprocess::managed_shared_memory &memory, uint32_t value_size,
 	uint32_t max_entries)
-	: data(value_size * max_entries, memory.get_segment_manager())
+	: data(memory.get_segment_manager())
 {
 	this->_value_size = value_size;
 	this->_max_entries = max_entries;
+	size_t size = (size_t)value_size * max_entries;
+	if (size >= SPARSE_ARRAY_MIN_BYTES) {
+		uint64_t id = new_sparse_object_id();
+		if (void *addr = id ? map_sparse_object(id, size, true) :
+				      nullptr;
+		    addr) {
+			sparse_destroyed = memory.find_or_construct<uint64_t>(
+				SPARSE_DESTROYED_NAME)(0);
+			auto &mappings = get_sparse_mappings();
+			std::lock_guard<std::mutex> guard(mappings.mutex);
+			mappings.addrs[id] = { addr, size };
+			sparse_id = id;
+			spdlog::debug(
+				"Array map with {} bytes backed by sparse object {}",
+				size, sparse_object_name(id));
+			return;
+		}
+		spdlog::warn(
+			"Falling back to allocate {} bytes of array map in the shared memory",
+			size);
+	}
+	data.resize(size);
+}
+
+array_map_impl::~array_map_impl()
+{
+	if (sparse_id == 0)
+		return;
+	auto &mappings = get_sparse_mappings();
+	{
+		std::lock_guard<std::mutex> guard(mappings.mutex);
+		if (auto itr = mappings.addrs.find(sparse_id);
+		    itr != mappings.addrs.end()) {
+			// Invalidate what other threads remembered before
+			// the memory goes away
+			mappings.generation.fetch_add(1);
+			munmap(itr->second.addr, itr->second.size);
+			mappings.addrs.erase(itr);
+		}
+	}
+	shm_unlink(sparse_object_name(sparse_id).c_str());
+	// Other processes drop their mappings on their next access to a
+	// sparse array
+	__atomic_fetch_add(sparse_destroyed.get(), 1, __ATOMIC_RELEASE);
 }
+
+size_t array_map_impl::memory_usage() const
+{
+	if (sparse_id == 0)
+		return 0;
+	int fd = shm_open(sparse_object_name(sparse_id).c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	size_t ret = fstat(fd, &st) == 0 ? (size_t)st.st_blocks * 512 : 0;
+	close(fd);
+	return ret;
+}
+
 void *array_map_impl::elem_lookup(const void *key)
 {
 	auto key_val = *(uint32_t *)key;
@@ -28,7 +252,12 @@ void *array_map_impl::elem_lookup(const void *key)
 		errno = ENOENT;
 		return nullptr;
 	}
-	return &data[key_val * _value_size];
+	auto base = data_base();
+	if (base == nullptr) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+	return base + (size_t)key_val * _value_size;
 }
 
 long array_map_impl::elem_update(const void *key, const void *value,
@@ -39,8 +268,13 @@ long array_map_impl::elem_update(const void *key, const void *value,
 		errno = ENOENT;
 		return -1;
 	}
+	auto base = data_base();
+	if (base == nullptr) {
+		errno = ENOMEM;
+		return -1;
+	}
 	std::copy((uint8_t *)value, (uint8_t *)value + _value_size,
-		  &data[key_val * _value_size]);
+		  base + (size_t)key_val * _value_size);
 	return 0;
 }
 
@@ -51,8 +285,13 @@ long array_map_impl::elem_delete(const void *key)
 		errno = ENOENT;
 		return -1;
 	}
-	std::fill(&data[key_val * _value_size],
-		  &data[key_val * _value_size] + _value_size, 0);
+	auto base = data_base();
+	if (base == nullptr) {
+		errno = ENOMEM;
+		return -1;
+	}
+	std::fill(base + (size_t)key_val * _value_size,
+		  base + (size_t)key_val * _value_size + _value_size, 0);
 	return 0;
 }
 
@@ -10,16 +10,36 @@
 namespace bpftime
 {
 
+// Arrays with at least this many bytes of values are backed by a sparse
+// shared memory object of their own, instead of the global segment
+const size_t SPARSE_ARRAY_MIN_BYTES = 1 << 20;
+
 // implementation of array map
+//
+// Large arrays are put in a separate shm object, mapped with MAP_NORESERVE.
+// Pages of it are only committed when they are touched, so a big sparse
+// table (e.g, indexed by pid) neither takes memory up front nor counts
+// against the size of the global segment. Untouched values read as zero.
+// Each process maps the object on first access, and drops the mapping once
+// the array is destroyed by any process, see `sparse_destroyed`.
 class array_map_impl {
 	bytes_vec data;
 	uint32_t _value_size;
 	uint32_t _max_entries;
+	// Id of the sparse backing object, 0 if values are stored in `data`
+	uint64_t sparse_id = 0;
+	// Count of sparse arrays destroyed in this shared memory, shared by
+	// all of them. Processes drop the mappings of destroyed arrays when
+	// they see it changed
+	boost::interprocess::offset_ptr<uint64_t> sparse_destroyed;
+
+	uint8_t *data_base() const;
 
     public:
 	const static bool should_lock = true;
 	array_map_impl(boost::interprocess::managed_shared_memory &memory,
 		       uint32_t value_size, uint32_t max_entries);
+	~array_map_impl();
 
 	void *elem_lookup(const void *key);
 
@@ -30,6 +50,16 @@ class array_map_impl {
 	int map_get_next_key(const void *key, void *next_key);
 
 	void *get_raw_data() const;
+
+	// Whether values are in a sparse backing object instead of the
+	// shared memory
+	bool is_sparse() const
+	{
+		return sparse_id != 0;
+	}
+
+	// Bytes committed by the sparse backing object, 0 if there is none
+	size_t memory_usage() const;
 };
 
 } // namespace bpftime
@@ -0,0 +1,228 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#include "spdlog/spdlog.h"
+#include <bpf_map/map_common_def.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#include <boost/interprocess/sync/sharable_lock.hpp>
+#include <bpf_map/userspace/double_buffered_hash_map.hpp>
+#include <bpftime_prog.hpp>
+#include <cstring>
+
+using boost::interprocess::interprocess_sharable_mutex;
+using boost::interprocess::scoped_lock;
+using boost::interprocess::sharable_lock;
+
+namespace bpftime
+{
+double_buffered_hash_map_impl::double_buffered_hash_map_impl(
+	managed_shared_memory &memory, uint32_t key_size, uint32_t value_size)
+	: buffers{ { memory, key_size, value_size },
+		   { memory, key_size, value_size } },
+	  _value_size(value_size)
+{
+}
+
+void double_buffered_hash_map_impl::release_pin(void *map, uint64_t idx)
+{
+	((double_buffered_hash_map_impl *)map)->exit_active_buffer(idx);
+}
+
+void double_buffered_hash_map_impl::pin_until_program_returns(uint32_t idx)
+{
+	// Outside of programs, the pointer is only valid until the next
+	// clear. A buffer already pinned by the program is pinned once
+	if (bpftime_prog_defer_until_return(release_pin, this, idx) != 0)
+		exit_active_buffer(idx);
+}
+
+uint32_t double_buffered_hash_map_impl::enter_active_buffer()
+{
+	while (true) {
+		auto idx = active_buffer();
+		prog_ops[idx].fetch_add(1, std::memory_order_seq_cst);
+		// Either the count is visible to the clear after the next swap,
+		// or we see the swap and move to the new active buffer
+		if (active_idx.load(std::memory_order_seq_cst) == idx)
+			return idx;
+		exit_active_buffer(idx);
+	}
+}
+
+void double_buffered_hash_map_impl::exit_active_buffer(uint32_t idx)
+{
+	prog_ops[idx].fetch_sub(1, std::memory_order_release);
+}
+
+bool double_buffered_hash_map_impl::try_enter_lockless(uint32_t idx)
+{
+	lockless_ops[idx].fetch_add(1, std::memory_order_seq_cst);
+	// Either the writer sees our count and waits for it, or we see the
+	// writer and take the lock
+	if (writers[idx].load(std::memory_order_seq_cst) == 0)
+		return true;
+	exit_lockless(idx);
+	return false;
+}
+
+void double_buffered_hash_map_impl::exit_lockless(uint32_t idx)
+{
+	lockless_ops[idx].fetch_sub(1, std::memory_order_release);
+}
+
+void double_buffered_hash_map_impl::begin_write(uint32_t idx)
+{
+	writers[idx].fetch_add(1, std::memory_order_seq_cst);
+	for (int spins = 0;
+	     lockless_ops[idx].load(std::memory_order_seq_cst) != 0;)
+		spin_wait(spins);
+}
+
+void double_buffered_hash_map_impl::end_write(uint32_t idx)
+{
+	writers[idx].fetch_sub(1, std::memory_order_release);
+}
+
+void *double_buffered_hash_map_impl::do_lookup(uint32_t idx, const void *key)
+{
+	if (try_enter_lockless(idx)) {
+		auto ret = buffers[idx].find_value(key);
+		exit_lockless(idx);
+		return ret;
+	}
+	sharable_lock<interprocess_sharable_mutex> guard(locks[idx]);
+	return buffers[idx].find_value(key);
+}
+
+long double_buffered_hash_map_impl::do_update(uint32_t idx, const void *key,
+					      const void *value,
+					      uint64_t flags)
+{
+	// Most updates of an aggregation hit keys already there, which are
+	// updated in place
+	if (try_enter_lockless(idx)) {
+		auto old_value = buffers[idx].find_value(key);
+		if (old_value != nullptr)
+			memcpy(old_value, value, _value_size);
+		exit_lockless(idx);
+		if (old_value != nullptr)
+			return 0;
+	}
+	scoped_lock<interprocess_sharable_mutex> guard(locks[idx]);
+	begin_write(idx);
+	auto ret = buffers[idx].elem_update(key, value, flags);
+	end_write(idx);
+	return ret;
+}
+
+long double_buffered_hash_map_impl::do_delete(uint32_t idx, const void *key)
+{
+	scoped_lock<interprocess_sharable_mutex> guard(locks[idx]);
+	begin_write(idx);
+	auto ret = buffers[idx].elem_delete(key);
+	end_write(idx);
+	return ret;
+}
+
+int double_buffered_hash_map_impl::do_get_next_key(uint32_t idx,
+						   const void *key,
+						   void *next_key)
+{
+	sharable_lock<interprocess_sharable_mutex> guard(locks[idx]);
+	return buffers[idx].map_get_next_key(key, next_key);
+}
+
+void *double_buffered_hash_map_impl::elem_lookup(const void *key)
+{
+	auto idx = enter_active_buffer();
+	auto ret = do_lookup(idx, key);
+	pin_until_program_returns(idx);
+	return ret;
+}
+
+long double_buffered_hash_map_impl::elem_update(const void *key,
+						const void *value,
+						uint64_t flags)
+{
+	auto idx = enter_active_buffer();
+	auto ret = do_update(idx, key, value, flags);
+	exit_active_buffer(idx);
+	return ret;
+}
+
+long double_buffered_hash_map_impl::elem_delete(const void *key)
+{
+	auto idx = enter_active_buffer();
+	auto ret = do_delete(idx, key);
+	exit_active_buffer(idx);
+	return ret;
+}
+
+int double_buffered_hash_map_impl::map_get_next_key(const void *key,
+						    void *next_key)
+{
+	auto idx = enter_active_buffer();
+	auto ret = do_get_next_key(idx, key, next_key);
+	exit_active_buffer(idx);
+	return ret;
+}
+
+void *double_buffered_hash_map_impl::elem_lookup_userspace(const void *key)
+{
+	return do_lookup(inactive_buffer(), key);
+}
+
+long double_buffered_hash_map_impl::elem_update_userspace(const void *key,
+							  const void *value,
+							  uint64_t flags)
+{
+	return do_update(inactive_buffer(), key, value, flags);
+}
+
+long double_buffered_hash_map_impl::elem_delete_userspace(const void *key)
+{
+	return do_delete(inactive_buffer(), key);
+}
+
+int double_buffered_hash_map_impl::map_get_next_key_userspace(const void *key,
+							      void *next_key)
+{
+	return do_get_next_key(inactive_buffer(), key, next_key);
+}
+
+void double_buffered_hash_map_impl::swap_buffers()
+{
+	auto prev = active_idx.fetch_xor(1, std::memory_order_seq_cst);
+	// Wait for operations of programs that picked the previous buffer
+	// before the swap. No new one could pick it until the next swap, so
+	// userspace sees all of its updates
+	for (int spins = 0;
+	     prog_ops[prev].load(std::memory_order_acquire) != 0;)
+		spin_wait(spins);
+	spdlog::debug("Swapped double buffered hash map, active buffer {}",
+		      prev ^ 1);
+}
+
+void double_buffered_hash_map_impl::clear_inactive_buffer()
+{
+	auto idx = inactive_buffer();
+	// Programs left this buffer when it was swapped out
+	scoped_lock<interprocess_sharable_mutex> guard(locks[idx]);
+	begin_write(idx);
+	buffers[idx].clear();
+	end_write(idx);
+}
+
+size_t double_buffered_hash_map_impl::memory_usage() const
+{
+	size_t ret = 0;
+	for (uint32_t i = 0; i < 2; i++) {
+		sharable_lock<interprocess_sharable_mutex> guard(locks[i]);
+		ret += buffers[i].memory_usage();
+	}
+	return ret;
+}
+
+} // namespace bpftime
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#ifndef _DOUBLE_BUFFERED_HASH_MAP_HPP
+#define _DOUBLE_BUFFERED_HASH_MAP_HPP
+#include <atomic>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
+#include <bpf_map/userspace/hash_map.hpp>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace bpftime
+{
+
+// A hash map with two buffers, used for interval aggregation.
+//
+// Programs always access the active buffer, and userspace always accesses
+// the inactive one. When a collecting interval ends, userspace calls
+// `swap_buffers` to hand the active buffer to the reader, reads it through
+// the usual lookup/get_next_key interface, then drops all of its elements
+// with `clear_inactive_buffer`, instead of deleting the keys one by one.
+//
+// Each buffer has its own lock, so the reader never contends with the
+// programs. Programs count themselves in `prog_ops` of the buffer for the
+// duration of each map operation, and `swap_buffers` waits for the count of
+// the swapped out buffer to drop to zero, so operations that picked it
+// right before the swap are done before userspace reads or clears it. A
+// lookup of a program keeps the buffer counted until the program returns,
+// see `bpftime_prog_defer_until_return`, so the value it points to isn't
+// cleared under the program.
+//
+// Lookups and updates of keys already in a buffer take no lock. They count
+// themselves in `lockless_ops`, unless an insertion or deletion is changing
+// the buffer, and those wait for the count to drop to zero after raising
+// `writers`, under the exclusive lock. Values are written in place, with
+// no more atomicity than values the programs write through pointers.
+class double_buffered_hash_map_impl {
+	hash_map_impl buffers[2];
+	mutable boost::interprocess::interprocess_sharable_mutex locks[2];
+	// Index of the buffer that programs write to
+	std::atomic<uint32_t> active_idx = 0;
+	// Map operations of programs in progress on each buffer
+	std::atomic<uint32_t> prog_ops[2] = { 0, 0 };
+	// Operations in progress on each buffer without holding its lock
+	std::atomic<uint32_t> lockless_ops[2] = { 0, 0 };
+	// Insertions, deletions or clears in progress on each buffer
+	std::atomic<uint32_t> writers[2] = { 0, 0 };
+	uint32_t _value_size;
+
+	uint32_t active_buffer() const
+	{
+		return active_idx.load(std::memory_order_acquire);
+	}
+	uint32_t inactive_buffer() const
+	{
+		return active_buffer() ^ 1;
+	}
+	// Pin the active buffer for an operation of a program, so it won't be
+	// cleared before `exit_active_buffer`
+	uint32_t enter_active_buffer();
+	void exit_active_buffer(uint32_t idx);
+	// Keep the buffer pinned until the running program returns, if any
+	void pin_until_program_returns(uint32_t idx);
+	static void release_pin(void *map, uint64_t idx);
+	// Start an operation on a buffer without its lock. Fails if an
+	// insertion or deletion is in progress
+	bool try_enter_lockless(uint32_t idx);
+	void exit_lockless(uint32_t idx);
+	// Wait for the operations without the lock, with the lock of the
+	// buffer held exclusively
+	void begin_write(uint32_t idx);
+	void end_write(uint32_t idx);
+
+	void *do_lookup(uint32_t idx, const void *key);
+	long do_update(uint32_t idx, const void *key, const void *value,
+		       uint64_t flags);
+	long do_delete(uint32_t idx, const void *key);
+	int do_get_next_key(uint32_t idx, const void *key, void *next_key);
+
+    public:
+	// Buffers are guarded by the locks above
+	const static bool should_lock = false;
+	double_buffered_hash_map_impl(
+		boost::interprocess::managed_shared_memory &memory,
+		uint32_t key_size, uint32_t value_size);
+
+	void *elem_lookup(const void *key);
+
+	long elem_update(const void *key, const void *value, uint64_t flags);
+
+	long elem_delete(const void *key);
+
+	int map_get_next_key(const void *key, void *next_key);
+
+	void *elem_lookup_userspace(const void *key);
+
+	long elem_update_userspace(const void *key, const void *value,
+				   uint64_t flags);
+
+	long elem_delete_userspace(const void *key);
+
+	int map_get_next_key_userspace(const void *key, void *next_key);
+
+	// Make the inactive buffer active, and hand the active one to
+	// userspace, once the programs still updating it are done
+	void swap_buffers();
+	// Remove all elements of the buffer owned by userspace
+	void clear_inactive_buffer();
+	// Estimated bytes taken by elements of both buffers
+	size_t memory_usage() const;
+};
+
+} // namespace bpftime
+#endif
@@ -6,11 +6,43 @@
 #include "spdlog/spdlog.h"
 #include <bpf_map/userspace/hash_map.hpp>
 #include <algorithm>
+#include <cstring>
 #include <functional>
 #include <unistd.h>
 
 namespace bpftime
 {
+// A key in local memory, looked up in place of a bytes_vec
+struct bytes_view {
+	const uint8_t *data;
+	size_t size;
+};
+
+// Hashes the same way as bytes_vec_hasher
+struct bytes_view_hasher {
+	size_t operator()(const bytes_view &key) const
+	{
+		using boost::hash_combine;
+		size_t seed = 0;
+		hash_combine(seed, key.size);
+		for (size_t i = 0; i < key.size; i++)
+			hash_combine(seed, key.data[i]);
+		return seed;
+	}
+};
+
+struct bytes_view_equal {
+	bool operator()(const bytes_view &a, const bytes_vec &b) const
+	{
+		return a.size == b.size() &&
+		       memcmp(a.data, b.data(), a.size) == 0;
+	}
+	bool operator()(const bytes_vec &a, const bytes_view &b) const
+	{
+		return (*this)(b, a);
+	}
+};
+
 hash_map_impl::hash_map_impl(managed_shared_memory &memory, uint32_t key_size,
 			     uint32_t value_size)
 	: map_impl(10, bytes_vec_hasher(), std::equal_to<bytes_vec>(),
@@ -94,4 +126,30 @@ int hash_map_impl::map_get_next_key(const void *key, void *next_key)
 	return 0;
 }
 
+void *hash_map_impl::find_value(const void *key)
+{
+	auto itr = map_impl.find(bytes_view{ (const uint8_t *)key, _key_size },
+				 bytes_view_hasher(), bytes_view_equal());
+	if (itr == map_impl.end()) {
+		errno = ENOENT;
+		return nullptr;
+	}
+	return &itr->second[0];
+}
+
+void hash_map_impl::clear()
+{
+	map_impl.clear();
+}
+
+size_t hash_map_impl::memory_usage() const
+{
+	// Each node holds the key and value vectors, a link and the cached
+	// hash, and the vectors own buffers of their own
+	const size_t node_size = sizeof(bi_map_value_ty) + 2 * sizeof(void *) +
+				 _key_size + _value_size;
+	return map_impl.size() * node_size +
+	       map_impl.bucket_count() * sizeof(void *);
+}
+
 } // namespace bpftime
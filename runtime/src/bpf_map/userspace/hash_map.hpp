@@ -47,6 +47,17 @@ class hash_map_impl {
 	long elem_delete(const void *key);
 
 	int map_get_next_key(const void *key, void *next_key);
+
+	// Find the value of `key` without copying the key into the shared
+	// memory, which takes the lock of the segment manager
+	void *find_value(const void *key);
+
+	// Remove all elements at once
+	void clear();
+
+	// Estimated bytes of the shared memory taken by the elements and the
+	// buckets
+	size_t memory_usage() const;
 };
 
 } // namespace bpftime
@@ -32,38 +32,33 @@ per_cpu_array_map_impl::per_cpu_array_map_impl(
 
 void *per_cpu_array_map_impl::elem_lookup(const void *key)
 {
-	return ensure_on_current_cpu<void *>([&](int cpu) -> void * {
-		if (key == nullptr) {
-			errno = ENOENT;
-			return nullptr;
-		}
-		uint32_t key_val = *(uint32_t *)key;
-		if (key_val >= max_ent) {
-			errno = E2BIG;
-			return nullptr;
-		}
-		return data_at(key_val, cpu);
-	});
+	if (key == nullptr) {
+		errno = ENOENT;
+		return nullptr;
+	}
+	uint32_t key_val = *(uint32_t *)key;
+	if (key_val >= max_ent) {
+		errno = E2BIG;
+		return nullptr;
+	}
+	return data_at(key_val, current_cpu_index(ncpu));
 }
 
 long per_cpu_array_map_impl::elem_update(const void *key, const void *value,
 					 uint64_t flags)
 {
-	return ensure_on_current_cpu<long>([&](int cpu) -> long {
-		// return impl[cpu].elem_update(key, value, flags);
-		if (key == nullptr) {
-			errno = ENOENT;
-			return -1;
-		}
-		uint32_t key_val = *(uint32_t *)key;
-		if (key_val >= max_ent) {
-			errno = E2BIG;
-			return -1;
-		}
-		std::copy((uint8_t *)value, (uint8_t *)value + value_size,
-			  data_at(key_val, cpu));
-		return 0;
-	});
+	if (key == nullptr) {
+		errno = ENOENT;
+		return -1;
+	}
+	uint32_t key_val = *(uint32_t *)key;
+	if (key_val >= max_ent) {
+		errno = E2BIG;
+		return -1;
+	}
+	std::copy((uint8_t *)value, (uint8_t *)value + value_size,
+		  data_at(key_val, current_cpu_index(ncpu)));
+	return 0;
 }
 
 long per_cpu_array_map_impl::elem_delete(const void *key)
@@ -71,9 +66,6 @@ long per_cpu_array_map_impl::elem_delete(const void *key)
 	errno = ENOTSUP;
 	spdlog::error("Deleting of per cpu array is not supported");
 	return -1;
-	// return ensure_on_current_cpu<long>([&](int cpu) {
-
-	// });
 }
 
 int per_cpu_array_map_impl::map_get_next_key(const void *key,
@@ -134,4 +126,20 @@ long per_cpu_array_map_impl::elem_delete_userspace(const void *key)
 	return -1;
 }
 
+long per_cpu_array_map_impl::elem_lookup_aggregated_userspace(const void *key,
+							      void *value)
+{
+	if (key == nullptr) {
+		errno = ENOENT;
+		return -1;
+	}
+	uint32_t key_val = *(uint32_t *)key;
+	if (key_val >= max_ent) {
+		errno = E2BIG;
+		return -1;
+	}
+	return sum_per_cpu_values(data_at(key_val, 0), value_size, ncpu,
+				  value);
+}
+
 } // namespace bpftime
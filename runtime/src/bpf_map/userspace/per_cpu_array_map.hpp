@@ -51,6 +51,9 @@ class per_cpu_array_map_impl {
 				   uint64_t flags);
 
 	long elem_delete_userspace(const void *key);
+
+	// Sum up the values of all cpus into `value`
+	long elem_lookup_aggregated_userspace(const void *key, void *value);
 };
 } // namespace bpftime
 
@@ -7,167 +7,296 @@
 #include "spdlog/fmt/bin_to_hex.h"
 #include "spdlog/spdlog.h"
 #include <algorithm>
+#include <boost/container_hash/hash.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
 #include <bpf_map/userspace/per_cpu_hash_map.hpp>
+#include <cstring>
+#include <linux/bpf.h>
 #include <unistd.h>
 
+enum {
+	BUCKET_EMPTY = 0,
+	BUCKET_TOMBSTONE = 0xffffffff,
+};
+
+using boost::interprocess::interprocess_mutex;
+using boost::interprocess::scoped_lock;
+
+static inline uint64_t round_up_pow2(uint64_t x)
+{
+	uint64_t ret = 1;
+	while (ret < x)
+		ret <<= 1;
+	return ret;
+}
+
+// Keep the load factor no more than 0.5, so probing stays short
+static inline uint64_t bucket_count(uint32_t max_entries)
+{
+	return round_up_pow2((uint64_t)max_entries * 2);
+}
+
 namespace bpftime
 {
+size_t per_cpu_hash_map_impl::memory_needed(uint32_t key_size,
+					    uint32_t value_size,
+					    uint32_t max_entries, int ncpu)
+{
+	return (size_t)bucket_count(max_entries) * sizeof(uint32_t) +
+	       (size_t)max_entries *
+		       (key_size + (size_t)value_size * ncpu +
+			2 * sizeof(uint32_t));
+}
+
 per_cpu_hash_map_impl::per_cpu_hash_map_impl(
 	boost::interprocess::managed_shared_memory &memory, uint32_t key_size,
-	uint32_t value_size)
-	: per_cpu_hash_map_impl(memory, key_size, value_size,
+	uint32_t value_size, uint32_t max_entries)
+	: per_cpu_hash_map_impl(memory, key_size, value_size, max_entries,
 				sysconf(_SC_NPROCESSORS_ONLN))
 {
 }
 
 per_cpu_hash_map_impl::per_cpu_hash_map_impl(
 	boost::interprocess::managed_shared_memory &memory, uint32_t key_size,
-	uint32_t value_size, int ncpu)
-	: impl(memory.get_segment_manager()), key_size(key_size),
-	  value_size(value_size), ncpu(ncpu),
-	  key_template(key_size, memory.get_segment_manager()),
-	  value_template(value_size * ncpu, memory.get_segment_manager()),
-	  single_value_template(value_size, memory.get_segment_manager())
+	uint32_t value_size, uint32_t max_entries, int ncpu)
+	: key_size(key_size), value_size(value_size), max_entries(max_entries),
+	  ncpu(ncpu),
+	  buckets(bucket_count(max_entries), BUCKET_EMPTY,
+		  memory.get_segment_manager()),
+	  keys((size_t)max_entries * key_size, memory.get_segment_manager()),
+	  values((size_t)max_entries * value_size * ncpu,
+		 memory.get_segment_manager()),
+	  slot_seqs(max_entries, 0, memory.get_segment_manager()),
+	  free_slots(max_entries, 0, memory.get_segment_manager())
 {
 	spdlog::debug(
-		"Initializing per cpu hash, key size {}, value size {}, ncpu {}",
-		key_size, value_size, ncpu);
+		"Initializing per cpu hash, key size {}, value size {}, max entries {}, ncpu {}",
+		key_size, value_size, max_entries, ncpu);
 }
 
-void *per_cpu_hash_map_impl::elem_lookup(const void *key)
+size_t per_cpu_hash_map_impl::hash_key(const void *key) const
 {
-	return ensure_on_current_cpu<void *>([&](int cpu) -> void * {
-		spdlog::debug("Run per cpu hash lookup at cpu {}", cpu);
-		if (key == nullptr) {
-			errno = ENOENT;
-			return nullptr;
-		}
-		bytes_vec key_vec = this->key_template;
-		key_vec.assign((uint8_t *)key, (uint8_t *)key + key_size);
-		if (auto itr = impl.find(key_vec); itr != impl.end()) {
-			spdlog::trace("Exit elem lookup of hash map");
-			return &itr->second[value_size * cpu];
-		} else {
-			spdlog::trace("Exit elem lookup of hash map");
-			errno = ENOENT;
-			return nullptr;
-		}
-	});
+	return boost::hash_range((const uint8_t *)key,
+				 (const uint8_t *)key + key_size);
 }
 
-long per_cpu_hash_map_impl::elem_update(const void *key, const void *value,
-					uint64_t flags)
+int64_t per_cpu_hash_map_impl::find_bucket(const void *key, uint32_t *slot)
 {
-	spdlog::debug("Per cpu update, key {}, value {}",(const char*)key,*(long*)value);
-	return ensure_on_current_cpu<long>([&](int cpu) -> long {
-		spdlog::debug("Run per cpu hash update at cpu {}", cpu);
-		bytes_vec key_vec = this->key_template;
-		bytes_vec value_vec = this->single_value_template;
-		key_vec.assign((uint8_t *)key, (uint8_t *)key + key_size);
-		value_vec.assign((uint8_t *)value,
-				 (uint8_t *)value + value_size);
-		if (auto itr = impl.find(key_vec); itr != impl.end()) {
-			std::copy(value_vec.begin(), value_vec.end(),
-				  itr->second.begin() + cpu * value_size);
-		} else {
-			bytes_vec full_value_vec = this->value_template;
-			std::copy(value_vec.begin(), value_vec.end(),
-				  full_value_vec.begin() + cpu * value_size);
-
-			impl.insert(bi_map_value_ty(key_vec, full_value_vec));
+	const auto mask = bucket_mask();
+retry:
+	auto pos = hash_key(key) & mask;
+	for (size_t i = 0; i <= mask; i++, pos = (pos + 1) & mask) {
+		auto bucket = __atomic_load_n(&buckets[pos], __ATOMIC_ACQUIRE);
+		if (bucket == BUCKET_EMPTY)
+			return -1;
+		if (bucket == BUCKET_TOMBSTONE)
+			continue;
+		auto curr = bucket - 1;
+		auto seq = __atomic_load_n(&slot_seqs[curr], __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			goto retry;
+		bool equal = memcmp(key_at(curr), key, key_size) == 0;
+		// The slot was deleted and reused while comparing, so the
+		// key we compared may be torn
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot_seqs[curr], __ATOMIC_RELAXED) != seq ||
+		    __atomic_load_n(&buckets[pos], __ATOMIC_RELAXED) != bucket)
+			goto retry;
+		if (equal) {
+			if (slot)
+				*slot = curr;
+			return pos;
 		}
-
-		return 0;
-	});
+	}
+	return -1;
 }
 
-long per_cpu_hash_map_impl::elem_delete(const void *key)
+int64_t per_cpu_hash_map_impl::find_slot(const void *key)
 {
-	return ensure_on_current_cpu<long>([&](int cpu) -> long {
-		spdlog::debug("Run per cpu hash delete at cpu {}", cpu);
-		bytes_vec key_vec = this->key_template;
-		key_vec.assign((uint8_t *)key, (uint8_t *)key + key_size);
-		if (auto itr = impl.find(key_vec); itr != impl.end()) {
-			std::fill(itr->second.begin(),
-				  itr->second.begin() + cpu * value_size, 0);
-		}
-		return 0;
-	});
+	uint32_t slot;
+	if (find_bucket(key, &slot) < 0)
+		return -1;
+	return slot;
 }
 
-int per_cpu_hash_map_impl::map_get_next_key(const void *key, void *next_key)
+int64_t per_cpu_hash_map_impl::find_or_insert_slot(const void *key,
+						   uint64_t flags)
 {
-	if (key == nullptr) {
-		// nullptr means the first key
-		auto itr = impl.begin();
-		if (itr == impl.end()) {
-			errno = ENOENT;
+	// Fast path: the key already exists
+	if (auto slot = find_slot(key); slot >= 0) {
+		if (flags == BPF_NOEXIST) {
+			errno = EEXIST;
+			return -1;
+		}
+		return slot;
+	}
+	if (flags == BPF_EXIST) {
+		errno = ENOENT;
+		return -1;
+	}
+	scoped_lock<interprocess_mutex> guard(insert_mutex);
+	// Someone else may have inserted it before we took the lock
+	if (auto slot = find_slot(key); slot >= 0) {
+		if (flags == BPF_NOEXIST) {
+			errno = EEXIST;
 			return -1;
 		}
-		std::copy(itr->first.begin(), itr->first.end(),
-			  (uint8_t *)next_key);
-		return 0;
+		return slot;
 	}
-	// No need to be allocated at shm. Allocate as a local variable to make
-	// it thread safe, since we use sharable lock
-	bytes_vec key_vec = this->key_template;
-	key_vec.assign((uint8_t *)key, (uint8_t *)key + key_size);
-
-	auto itr = impl.find(key_vec);
-	if (itr == impl.end()) {
-		// not found, should be refer to the first key
-		return map_get_next_key(nullptr, next_key);
+	uint32_t slot;
+	if (next_unused_slot < max_entries) {
+		slot = next_unused_slot++;
+	} else if (free_count > 0) {
+		slot = free_slots[free_head];
+		free_head = (free_head + 1) % max_entries;
+		free_count--;
+	} else {
+		errno = E2BIG;
+		return -1;
+	}
+	// Readers still comparing the key of the deleted element retry
+	// when they see the counter changed
+	auto seq = slot_seqs[slot];
+	__atomic_store_n(&slot_seqs[slot], seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(key_at(slot), key, key_size);
+	memset(values_at(slot), 0, (size_t)value_size * ncpu);
+	__atomic_store_n(&slot_seqs[slot], seq + 2, __ATOMIC_RELEASE);
+	// Prefer reusing a tombstone, so that deleted buckets don't pile up
+	const auto mask = bucket_mask();
+	auto pos = hash_key(key) & mask;
+	while (true) {
+		auto bucket = buckets[pos];
+		if (bucket == BUCKET_EMPTY || bucket == BUCKET_TOMBSTONE)
+			break;
+		pos = (pos + 1) & mask;
 	}
-	itr++;
-	if (itr == impl.end()) {
-		// If *key* is the last element, returns -1 and *errno*
-		// is set to **ENOENT**.
+	// Publish the key and the zeroed values together
+	__atomic_store_n(&buckets[pos], slot + 1, __ATOMIC_RELEASE);
+	return slot;
+}
+
+long per_cpu_hash_map_impl::remove_key(const void *key)
+{
+	scoped_lock<interprocess_mutex> guard(insert_mutex);
+	uint32_t slot;
+	auto pos = find_bucket(key, &slot);
+	if (pos < 0) {
 		errno = ENOENT;
 		return -1;
 	}
-	std::copy(itr->first.begin(), itr->first.end(), (uint8_t *)next_key);
+	__atomic_store_n(&buckets[pos], BUCKET_TOMBSTONE, __ATOMIC_RELEASE);
+	// No probe goes past an empty bucket, so if the next one is empty,
+	// the tombstones right before it could be emptied as well
+	const auto mask = bucket_mask();
+	if (buckets[(pos + 1) & mask] == BUCKET_EMPTY) {
+		for (auto curr = (uint32_t)pos;
+		     buckets[curr] == BUCKET_TOMBSTONE;
+		     curr = (curr - 1) & mask)
+			__atomic_store_n(&buckets[curr], BUCKET_EMPTY,
+					 __ATOMIC_RELEASE);
+	}
+	free_slots[(free_head + free_count) % max_entries] = slot;
+	free_count++;
+	return 0;
+}
+
+void *per_cpu_hash_map_impl::elem_lookup(const void *key)
+{
+	int cpu = current_cpu_index(ncpu);
+	spdlog::trace("Run per cpu hash lookup at cpu {}", cpu);
+	if (key == nullptr) {
+		errno = ENOENT;
+		return nullptr;
+	}
+	auto slot = find_slot(key);
+	if (slot < 0) {
+		errno = ENOENT;
+		return nullptr;
+	}
+	return values_at(slot) + (size_t)value_size * cpu;
+}
+
+long per_cpu_hash_map_impl::elem_update(const void *key, const void *value,
+					uint64_t flags)
+{
+	int cpu = current_cpu_index(ncpu);
+	spdlog::trace("Run per cpu hash update at cpu {}", cpu);
+	auto slot = find_or_insert_slot(key, flags);
+	if (slot < 0)
+		return -1;
+	memcpy(values_at(slot) + (size_t)value_size * cpu, value, value_size);
 	return 0;
 }
+
+long per_cpu_hash_map_impl::elem_delete(const void *key)
+{
+	return remove_key(key);
+}
+
+int per_cpu_hash_map_impl::map_get_next_key(const void *key, void *next_key)
+{
+	// If key is not found, start from the first key
+	size_t pos = 0;
+	if (key != nullptr) {
+		if (auto curr = find_bucket(key); curr >= 0)
+			pos = curr + 1;
+	}
+	for (; pos < buckets.size(); pos++) {
+		auto bucket = __atomic_load_n(&buckets[pos], __ATOMIC_ACQUIRE);
+		if (bucket != BUCKET_EMPTY && bucket != BUCKET_TOMBSTONE) {
+			memcpy(next_key, key_at(bucket - 1), key_size);
+			return 0;
+		}
+	}
+	// If *key* is the last element, returns -1 and *errno*
+	// is set to **ENOENT**.
+	errno = ENOENT;
+	return -1;
+}
+
 void *per_cpu_hash_map_impl::elem_lookup_userspace(const void *key)
 {
 	if (key == nullptr) {
 		errno = ENOENT;
 		return nullptr;
 	}
-	bytes_vec key_vec = this->key_template;
-	key_vec.assign((uint8_t *)key, (uint8_t *)key + key_size);
-	if (auto itr = impl.find(key_vec); itr != impl.end()) {
-		spdlog::trace("Exit elem lookup of hash map: {}",spdlog::to_hex(itr->second.begin(),itr->second.end()));
-		return &itr->second[0];
-	} else {
+	auto slot = find_slot(key);
+	if (slot < 0) {
 		spdlog::trace("Exit elem lookup of hash map");
 		errno = ENOENT;
 		return nullptr;
 	}
+	auto ptr = values_at(slot);
+	spdlog::trace("Exit elem lookup of hash map: {}",
+		      spdlog::to_hex(ptr, ptr + (size_t)value_size * ncpu));
+	return ptr;
 }
 
 long per_cpu_hash_map_impl::elem_update_userspace(const void *key,
 						  const void *value,
 						  uint64_t flags)
 {
-	bytes_vec key_vec = this->key_template;
-	bytes_vec value_vec = this->value_template;
-	key_vec.assign((uint8_t *)key, (uint8_t *)key + key_size);
-	value_vec.assign((uint8_t *)value,
-			 (uint8_t *)value + value_size * ncpu);
-
-	if (auto itr = impl.find(key_vec); itr != impl.end()) {
-		itr->second = value_vec;
-	} else {
-		impl.insert(bi_map_value_ty(key_vec, value_vec));
-	}
+	auto slot = find_or_insert_slot(key, flags);
+	if (slot < 0)
+		return -1;
+	memcpy(values_at(slot), value, (size_t)value_size * ncpu);
 	return 0;
 }
+
 long per_cpu_hash_map_impl::elem_delete_userspace(const void *key)
 {
-	bytes_vec key_vec = this->key_template;
-	key_vec.assign((uint8_t *)key, (uint8_t *)key + key_size);
-	impl.erase(key_vec);
-	return 0;
+	return remove_key(key);
+}
+
+long per_cpu_hash_map_impl::elem_lookup_aggregated_userspace(const void *key,
+							     void *value)
+{
+	auto slot = find_slot(key);
+	if (slot < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	return sum_per_cpu_values(values_at(slot), value_size, ncpu, value);
 }
 } // namespace bpftime
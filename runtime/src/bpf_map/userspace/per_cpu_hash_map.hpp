@@ -10,36 +10,99 @@
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/smart_ptr/unique_ptr.hpp>
 #include <boost/interprocess/containers/vector.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
 #include <bpf_map/map_common_def.hpp>
-#include <boost/unordered/unordered_map.hpp>
 #include <cstdint>
 
 namespace bpftime
 {
 
+/*
+Implementation of the per cpu hash map
+
+Keys and values live in preallocated slots, one slot for each of the
+`max_entries` elements. The values of a slot are laid out as `ncpu` adjacent
+values, so that userspace could read all of them at once.
+
+Slots are indexed by an open addressing hash table, whose buckets hold
+`slot index + 1`, 0 for an empty bucket, or a tombstone for a deleted one.
+Buckets are published with release stores, so looking up, or updating the
+value of an existing key never takes a lock. Only inserting and deleting keys
+are serialized by `insert_mutex`. Tombstones followed by an empty bucket are
+emptied again when deleting, so they don't pile up.
+
+A deleted slot may be reused for another key while a lock-free reader is
+still comparing its key, so each slot has a sequence counter, odd while the
+key is being rewritten, and readers retry if it changed under them. Freed
+slots are reused in FIFO order, after all the never used ones, to keep
+pointers to deleted values valid for as long as possible.
+*/
 class per_cpu_hash_map_impl {
-	using bi_map_value_ty = std::pair<const bytes_vec, bytes_vec>;
-	using bi_map_allocator = boost::interprocess::allocator<
-		bi_map_value_ty,
+	using u32_vec_allocator = boost::interprocess::allocator<
+		uint32_t,
 		boost::interprocess::managed_shared_memory::segment_manager>;
-	using shm_hash_map =
-		boost::unordered_map<bytes_vec, bytes_vec, bytes_vec_hasher,
-				     std::equal_to<bytes_vec>, bi_map_allocator>;
+	using u32_vec =
+		boost::interprocess::vector<uint32_t, u32_vec_allocator>;
 
-	shm_hash_map impl;
 	uint32_t key_size;
 	uint32_t value_size;
+	uint32_t max_entries;
 	int ncpu;
 
-	bytes_vec key_template, value_template, single_value_template;
+	// Hash table of slot indexes, size is a power of 2
+	u32_vec buckets;
+	// Key of each slot
+	bytes_vec keys;
+	// `ncpu` values of each slot
+	bytes_vec values;
+	// Sequence counter of the key of each slot
+	u32_vec slot_seqs;
+	// Ring of slots released by deleting, oldest first
+	u32_vec free_slots;
+	uint32_t free_head = 0;
+	uint32_t free_count = 0;
+	// Slots that were never used
+	uint32_t next_unused_slot = 0;
+	// Serialize inserting and deleting
+	boost::interprocess::interprocess_mutex insert_mutex;
+
+	uint32_t bucket_mask() const
+	{
+		return buckets.size() - 1;
+	}
+	uint8_t *key_at(uint32_t slot)
+	{
+		return keys.data() + (size_t)slot * key_size;
+	}
+	uint8_t *values_at(uint32_t slot)
+	{
+		return values.data() + (size_t)slot * value_size * ncpu;
+	}
+	size_t hash_key(const void *key) const;
+	// Find the bucket holding a key without locking, and the slot it
+	// refers to. Returns -1 if not found
+	int64_t find_bucket(const void *key, uint32_t *slot = nullptr);
+	// Find the slot of a key without locking. Returns -1 if not found
+	int64_t find_slot(const void *key);
+	// Find the slot of a key, or insert it with zeroed values
+	int64_t find_or_insert_slot(const void *key, uint64_t flags);
+	long remove_key(const void *key);
 
     public:
 	const static bool should_lock = false;
+	// Most entries a per cpu hash map could have
+	const static uint32_t MAX_ENTRIES = 1U << 30;
+
+	// Bytes of the shared memory taken by a map with these parameters
+	static size_t memory_needed(uint32_t key_size, uint32_t value_size,
+				    uint32_t max_entries, int ncpu);
 
 	per_cpu_hash_map_impl(boost::interprocess::managed_shared_memory &memory,
-			      uint32_t key_size, uint32_t value_size);
+			      uint32_t key_size, uint32_t value_size,
+			      uint32_t max_entries);
 	per_cpu_hash_map_impl(boost::interprocess::managed_shared_memory &memory,
-			      uint32_t key_size, uint32_t value_size, int ncpu);
+			      uint32_t key_size, uint32_t value_size,
+			      uint32_t max_entries, int ncpu);
 	void *elem_lookup(const void *key);
 
 	long elem_update(const void *key, const void *value, uint64_t flags);
@@ -54,6 +117,9 @@ class per_cpu_hash_map_impl {
 				   uint64_t flags);
 
 	long elem_delete_userspace(const void *key);
+
+	// Sum up the values of all cpus into `value`
+	long elem_lookup_aggregated_userspace(const void *key, void *value);
 };
 } // namespace bpftime
 
@@ -5,10 +5,15 @@
  */
 #include <boost/interprocess/interprocess_fwd.hpp>
 #include <boost/interprocess/smart_ptr/shared_ptr.hpp>
-#include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
-#include <boost/interprocess/sync/sharable_lock.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
 #include <bpf_map/userspace/ringbuf_map.hpp>
+#include <bpf_map/map_common_def.hpp>
+#include <algorithm>
+#include <climits>
+#include <csignal>
+#include <cstring>
 #include <spdlog/spdlog.h>
+#include <unistd.h>
 
 enum {
 	BPF_RINGBUF_BUSY_BIT = 2147483648,
@@ -16,6 +21,19 @@ enum {
 	BPF_RINGBUF_HDR_SZ = 8,
 };
 
+// Flags of bpf_ringbuf_submit and bpf_ringbuf_query
+enum {
+	BPF_RB_NO_WAKEUP = 1,
+	BPF_RB_FORCE_WAKEUP = 2,
+};
+enum {
+	BPF_RB_AVAIL_DATA = 0,
+	BPF_RB_RING_SIZE = 1,
+	BPF_RB_CONS_POS = 2,
+	BPF_RB_PROD_POS = 3,
+	BPF_RB_OVERWRITE_POS = 4,
+};
+
 #define READ_ONCE_UL(x) (*(volatile unsigned long *)&x)
 #define WRITE_ONCE_UL(x, v) (*(volatile unsigned long *)&x) = (v)
 #define READ_ONCE_I(x) (*(volatile int *)&x)
@@ -47,6 +65,9 @@ enum {
 #error Only supports x86_64
 #endif
 
+using boost::interprocess::interprocess_mutex;
+using boost::interprocess::scoped_lock;
+
 namespace bpftime
 {
 
@@ -84,11 +105,12 @@ int ringbuf_map_impl::map_get_next_key(const void *key, void *next_key)
 }
 
 ringbuf_map_impl::ringbuf_map_impl(
-	uint32_t max_ent, boost::interprocess::managed_shared_memory &memory)
+	uint32_t max_ent, boost::interprocess::managed_shared_memory &memory,
+	bool overwrite)
 	: ringbuf_impl(boost::interprocess::make_managed_shared_ptr(
 		  memory.construct<ringbuf>(
-			  boost::interprocess::anonymous_instance)(max_ent,
-								   memory),
+			  boost::interprocess::anonymous_instance)(
+			  max_ent, memory, overwrite),
 		  memory))
 {
 }
@@ -105,23 +127,82 @@ void *ringbuf_map_impl::get_producer_page() const
 	return ringbuf_impl->producer_pos.get();
 }
 
+bool ringbuf_map_impl::has_data() const
+{
+	return ringbuf_impl->has_data();
+}
+eventfd_notifier &ringbuf_map_impl::get_eventfd_notifier()
+{
+	return ringbuf_impl->get_eventfd_notifier();
+}
+
 void *ringbuf_map_impl::reserve(size_t size, int self_fd)
 {
 	return ringbuf_impl->reserve(size, self_fd);
 }
-void ringbuf_map_impl::submit(const void *sample, bool discard)
+void ringbuf_map_impl::submit(const void *sample, bool discard,
+			      uint64_t flags)
 {
-	return ringbuf_impl->submit(sample, discard);
+	return ringbuf_impl->submit(sample, discard, flags);
+}
+uint64_t ringbuf_map_impl::query(uint64_t flags) const
+{
+	return ringbuf_impl->query(flags);
+}
+void ringbuf_map_impl::set_wakeup_watermark(uint32_t bytes)
+{
+	ringbuf_impl->set_wakeup_watermark(bytes);
+}
+int ringbuf_map_impl::peek_batch(ringbuf_sample *samples, int max_samples,
+				 unsigned long *batch_end) const
+{
+	return ringbuf_impl->peek_batch(samples, max_samples, batch_end);
+}
+int ringbuf_map_impl::commit_batch(unsigned long batch_end)
+{
+	return ringbuf_impl->commit_batch(batch_end);
+}
+int ringbuf_map_impl::add_consumer()
+{
+	return ringbuf_impl->add_consumer();
+}
+int ringbuf_map_impl::remove_consumer(int id)
+{
+	return ringbuf_impl->remove_consumer(id);
+}
+void ringbuf_map_impl::set_detach_slow_consumers(bool enable)
+{
+	ringbuf_impl->set_detach_slow_consumers(enable);
+}
+int ringbuf_map_impl::peek_consumer_batch(int id, ringbuf_sample *samples,
+					  int max_samples,
+					  unsigned long *batch_end) const
+{
+	return ringbuf_impl->peek_consumer_batch(id, samples, max_samples,
+						 batch_end);
+}
+int ringbuf_map_impl::commit_consumer_batch(int id, unsigned long batch_end)
+{
+	return ringbuf_impl->commit_consumer_batch(id, batch_end);
+}
+void ringbuf_map_impl::shrink(void *sample, uint32_t size)
+{
+	ringbuf_impl->shrink(sample, size);
+}
+long ringbuf_map_impl::snapshot(void *buf, size_t size) const
+{
+	return ringbuf_impl->snapshot(buf, size);
+}
+long ringbuf_map_impl::drain(ringbuf::drain_callback callback, void *ctx,
+			     uint32_t max_samples)
+{
+	return ringbuf_impl->drain(callback, ctx, max_samples);
 }
 
 ringbuf::ringbuf(uint32_t max_ent,
-		 boost::interprocess::managed_shared_memory &memory)
-	: max_ent(max_ent),
-	  reserve_mutex(boost::interprocess::make_managed_unique_ptr(
-		  memory.construct<
-			  boost::interprocess::interprocess_sharable_mutex>(
-			  boost::interprocess::anonymous_instance)(),
-		  memory)),
+		 boost::interprocess::managed_shared_memory &memory,
+		 bool overwrite)
+	: max_ent(max_ent), overwrite(overwrite), efd_notifier(memory),
 	  raw_buffer(boost::interprocess::make_managed_unique_ptr(
 		  memory.construct<buf_vec>(
 			  boost::interprocess::anonymous_instance)(
@@ -138,9 +219,25 @@ ringbuf::ringbuf(uint32_t max_ent,
 	data = (uint8_t *)(uintptr_t)(&((*raw_buffer)[page_size * 2]));
 }
 
-bool ringbuf::has_data() const
+unsigned long ringbuf::read_start_pos() const
 {
 	auto cons_pos = smp_load_acquire_ul(consumer_pos.get());
+	if (!overwrite)
+		return cons_pos;
+	return std::max(cons_pos,
+			__atomic_load_n(&overwrite_pos, __ATOMIC_ACQUIRE));
+}
+
+unsigned long ringbuf::free_start_pos() const
+{
+	if (__atomic_load_n(&consumer_mask, __ATOMIC_ACQUIRE) != 0)
+		return __atomic_load_n(&reclaim_pos, __ATOMIC_ACQUIRE);
+	return smp_load_acquire_ul(consumer_pos.get());
+}
+
+bool ringbuf::has_data() const
+{
+	auto cons_pos = read_start_pos();
 	auto prod_pos = smp_load_acquire_ul(producer_pos.get());
 	if (cons_pos < prod_pos) {
 		auto len_ptr = (int32_t *)(uintptr_t)(data.get() +
@@ -152,14 +249,43 @@ bool ringbuf::has_data() const
 	}
 	return false;
 }
-using boost::interprocess::interprocess_sharable_mutex;
-using boost::interprocess::sharable_lock;
-
 struct ringbuf_hdr {
 	uint32_t len;
 	int32_t fd;
 };
 
+static inline unsigned long record_size(uint32_t len)
+{
+	return ((len & ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT)) +
+		BPF_RINGBUF_HDR_SZ + 7) /
+	       8 * 8;
+}
+
+bool ringbuf::overwrite_oldest(unsigned long end)
+{
+	auto pos = __atomic_load_n(&overwrite_pos, __ATOMIC_ACQUIRE);
+	while (end - pos > max_ent) {
+		// Headers of records being reserved may not be written yet,
+		// so only published records could be dropped
+		if (pos >= smp_load_acquire_ul(producer_pos.get()))
+			return false;
+		auto hdr = (ringbuf_hdr *)((uintptr_t)data.get() +
+					   (pos & mask()));
+		auto len = __atomic_load_n(&hdr->len, __ATOMIC_ACQUIRE);
+		// A producer is still writing the oldest record
+		if (len & BPF_RINGBUF_BUSY_BIT)
+			return false;
+		// If someone else has dropped it, the header may have been
+		// overwritten, and the CAS fails
+		auto next = pos + record_size(len);
+		if (__atomic_compare_exchange_n(&overwrite_pos, &pos, next,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			pos = next;
+	}
+	return true;
+}
+
 void *ringbuf::reserve(size_t size, int self_fd)
 {
 	if (size & (BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT)) {
@@ -169,31 +295,91 @@ void *ringbuf::reserve(size_t size, int self_fd)
 			size, self_fd);
 		return nullptr;
 	}
-	sharable_lock<interprocess_sharable_mutex> guard(*reserve_mutex);
-	auto cons_pos = smp_load_acquire_ul(consumer_pos.get());
-	auto prod_pos = smp_load_acquire_ul(producer_pos.get());
-	auto avail_size = max_ent - (prod_pos - cons_pos);
 	auto total_size = (size + BPF_RINGBUF_HDR_SZ + 7) / 8 * 8;
 	if (total_size > max_ent) {
 		errno = E2BIG;
 		return nullptr;
 	}
-	if (avail_size < total_size) {
-		errno = ENOSPC;
+	// Claim [prod_pos, prod_pos + total_size) without any lock
+	ring_claim_ticket ticket;
+	// Fails if a signal handler interrupted a producer of this ringbuf
+	// in this thread, since it would wait for that producer forever. Not
+	// logged, as that isn't safe in a signal handler
+	if (!claim.begin(ticket))
 		return nullptr;
-	}
+	uint64_t prod_pos = claim.position();
+	do {
+		if (overwrite) {
+			// Consumers are not waited for in overwrite mode
+			if (!overwrite_oldest(prod_pos + total_size)) {
+				claim.end(ticket);
+				errno = ENOSPC;
+				return nullptr;
+			}
+			continue;
+		}
+		auto cons_pos = free_start_pos();
+		auto avail_size = max_ent - (prod_pos - cons_pos);
+		if (avail_size < total_size &&
+		    !(__atomic_load_n(&detach_slow_consumers,
+				      __ATOMIC_RELAXED) &&
+		      detach_slowest_consumers(prod_pos + total_size))) {
+			claim.end(ticket);
+			errno = ENOSPC;
+			return nullptr;
+		}
+	} while (!claim.try_claim(ticket, prod_pos, total_size));
 	auto header =
 		(ringbuf_hdr *)((uintptr_t)data.get() + (prod_pos & mask()));
 	header->len = size | BPF_RINGBUF_BUSY_BIT;
 	header->fd = self_fd;
+	// The consumer trusts every header before producer_pos, so records
+	// must be published in the order they were claimed. Producers that
+	// claimed earlier space are usually only a few instructions away
+	// from publishing it, but may have been preempted in between, or
+	// killed, in which case their space is discarded
+	claim.wait_turn(ticket, producer_pos.get(),
+			[&](uint64_t start, uint64_t end) {
+				auto hdr = (ringbuf_hdr *)((uintptr_t)data.get() +
+							   (start & mask()));
+				hdr->fd = self_fd;
+				__atomic_store_n(&hdr->len,
+						 (uint32_t)(end - start -
+							    BPF_RINGBUF_HDR_SZ) |
+							 BPF_RINGBUF_DISCARD_BIT,
+						 __ATOMIC_RELEASE);
+			});
 	smp_store_release_ul(producer_pos.get(), prod_pos + total_size);
-	auto ptr = data.get() + ((prod_pos + BPF_RINGBUF_HDR_SZ) & mask());
+	claim.end(ticket);
+	// Records never wrap around, same as what consumers see with the
+	// kernel's double mapped data area, so even a header at the very end
+	// of the data area is followed by its sample
+	auto ptr = (uint8_t *)header + BPF_RINGBUF_HDR_SZ;
 	spdlog::trace("ringbuf: reserved {} bytes at {}, fd {}", size,
 		      (void *)ptr, self_fd);
 	return ptr;
 }
 
-void ringbuf::submit(const void *sample, bool discard)
+bool ringbuf::consumer_caught_up(unsigned long pos) const
+{
+	pos &= mask();
+	auto consumers = __atomic_load_n(&consumer_mask, __ATOMIC_ACQUIRE) &
+			 ~__atomic_load_n(&detached_mask, __ATOMIC_ACQUIRE);
+	if (consumers == 0)
+		return (smp_load_acquire_ul(consumer_pos.get()) & mask()) == pos;
+	// Fan-out consumers wait separately, and consumer_pos only tells
+	// about the slowest one
+	for (; consumers; consumers &= consumers - 1) {
+		auto id = __builtin_ctz(consumers);
+		if ((__atomic_load_n(&consumer_positions[id],
+				     __ATOMIC_ACQUIRE) &
+		     mask()) == pos)
+			return true;
+	}
+	return false;
+}
+
+void ringbuf::submit(const void *sample, bool discard, uint64_t flags)
 {
 	uintptr_t hdr_offset = mask() + 1 + ((uint8_t *)sample - data.get()) -
 			       BPF_RINGBUF_HDR_SZ;
@@ -204,6 +390,382 @@ void ringbuf::submit(const void *sample, bool discard)
 	if (discard)
 		new_len |= BPF_RINGBUF_DISCARD_BIT;
 	__atomic_exchange_n(&hdr->len, new_len, __ATOMIC_ACQ_REL);
+	if (flags & BPF_RB_NO_WAKEUP)
+		return;
+	if ((flags & BPF_RB_FORCE_WAKEUP) == 0) {
+		// Same as the kernel, only wake up the consumer if it has
+		// consumed everything before this record, since it would
+		// be sleeping then. Otherwise it hasn't caught up, and will
+		// see this record without being woken up, unless there is
+		// enough data for the watermark
+		auto cons_pos = free_start_pos();
+		auto watermark =
+			__atomic_load_n(&wakeup_watermark, __ATOMIC_RELAXED);
+		if (!consumer_caught_up(hdr_offset) &&
+		    (watermark == 0 ||
+		     smp_load_acquire_ul(producer_pos.get()) - cons_pos <
+			     watermark))
+			return;
+	}
+	watchers.notify();
+	efd_notifier.notify();
+}
+
+void ringbuf::shrink(void *sample, uint32_t size)
+{
+	auto hdr = (ringbuf_hdr *)((uint8_t *)sample - BPF_RINGBUF_HDR_SZ);
+	auto len = __atomic_load_n(&hdr->len, __ATOMIC_RELAXED);
+	auto old_size = len & ~BPF_RINGBUF_BUSY_BIT;
+	if (size >= old_size)
+		return;
+	auto old_total = record_size(old_size);
+	auto new_total = record_size(size);
+	__atomic_store_n(&hdr->len, size | BPF_RINGBUF_BUSY_BIT,
+			 __ATOMIC_RELAXED);
+	if (old_total == new_total)
+		return;
+	// Headers are read at the masked position, while the sample of a
+	// record at the end of the data area runs past it
+	unsigned long hdr_offset = (uint8_t *)hdr - data.get();
+	auto tail = (ringbuf_hdr *)((uintptr_t)data.get() +
+				    ((hdr_offset + new_total) & mask()));
+	// Consumers may have loaded producer_pos before it's moved back, and
+	// come to the tail after this record is submitted. Keep them from
+	// reading the sample as a header. The tail is still owned by this
+	// record, so no producer is writing it
+	tail->fd = hdr->fd;
+	__atomic_store_n(&tail->len, BPF_RINGBUF_BUSY_BIT, __ATOMIC_RELEASE);
+	// Give the tail back if no one has claimed space after this record.
+	// The record is not consumed, so the claim position is within max_ent
+	// bytes
+	// after it, and matching the offset means matching the position
+	unsigned long end_offset = (hdr_offset + old_total) & mask();
+	auto end = claim.position();
+	if ((end & mask()) == end_offset &&
+	    claim.try_shrink(end, end - (old_total - new_total))) {
+		// Producers claiming the tail wait for producer_pos to reach
+		// it before publishing
+		smp_store_release_ul(producer_pos.get(),
+				     end - (old_total - new_total));
+		spdlog::trace("ringbuf: shrunk record at {} to {} bytes",
+			      (void *)sample, size);
+		return;
+	}
+	// Otherwise leave the tail as a discarded record, which consumers
+	// skip
+	__atomic_store_n(&tail->len,
+			 (old_total - new_total - BPF_RINGBUF_HDR_SZ) |
+				 BPF_RINGBUF_DISCARD_BIT,
+			 __ATOMIC_RELEASE);
+}
+
+uint64_t ringbuf::query(uint64_t flags) const
+{
+	switch (flags) {
+	case BPF_RB_AVAIL_DATA:
+		return smp_load_acquire_ul(producer_pos.get()) -
+		       read_start_pos();
+	case BPF_RB_RING_SIZE:
+		return max_ent;
+	case BPF_RB_CONS_POS:
+		return smp_load_acquire_ul(consumer_pos.get());
+	case BPF_RB_PROD_POS:
+		return smp_load_acquire_ul(producer_pos.get());
+	case BPF_RB_OVERWRITE_POS:
+		return __atomic_load_n(&overwrite_pos, __ATOMIC_ACQUIRE);
+	default:
+		return 0;
+	}
+}
+
+void ringbuf::set_wakeup_watermark(uint32_t bytes)
+{
+	__atomic_store_n(&wakeup_watermark, bytes, __ATOMIC_RELAXED);
+}
+
+int ringbuf::peek_batch(ringbuf_sample *samples, int max_samples,
+			unsigned long *batch_end) const
+{
+	// Only the consumer updates consumer_pos
+	return collect_samples(read_start_pos(), samples, max_samples,
+			       batch_end);
+}
+
+int ringbuf::collect_samples(unsigned long cons_pos, ringbuf_sample *samples,
+			     int max_samples, unsigned long *batch_end) const
+{
+	auto prod_pos = smp_load_acquire_ul(producer_pos.get());
+	int cnt = 0;
+	while (cons_pos < prod_pos && cnt < max_samples) {
+		auto hdr = (ringbuf_hdr *)((uintptr_t)data.get() +
+					   (cons_pos & mask()));
+		auto len = __atomic_load_n(&hdr->len, __ATOMIC_ACQUIRE);
+		// Records must be consumed in order, so stop at the first
+		// one that is still being written
+		if (len & BPF_RINGBUF_BUSY_BIT)
+			break;
+		auto size = len & ~BPF_RINGBUF_DISCARD_BIT;
+		if ((len & BPF_RINGBUF_DISCARD_BIT) == 0) {
+			// Records never wrap around, the buffer has another
+			// `max_ent` bytes after the data area
+			samples[cnt].data = (uint8_t *)hdr + BPF_RINGBUF_HDR_SZ;
+			samples[cnt].size = size;
+			cnt++;
+		}
+		cons_pos += (size + BPF_RINGBUF_HDR_SZ + 7) / 8 * 8;
+	}
+	*batch_end = cons_pos;
+	return cnt;
+}
+
+int ringbuf::commit_batch(unsigned long batch_end)
+{
+	if (__atomic_load_n(&consumer_mask, __ATOMIC_ACQUIRE) != 0) {
+		spdlog::error(
+			"Ringbuf with fan-out consumers could only be consumed by them");
+		errno = EBUSY;
+		return -1;
+	}
+	auto cons_pos = read_start_pos();
+	auto prod_pos = smp_load_acquire_ul(producer_pos.get());
+	if (batch_end < cons_pos || batch_end > prod_pos) {
+		spdlog::error(
+			"Invalid batch end {}, consumer pos {}, producer pos {}",
+			batch_end, cons_pos, prod_pos);
+		errno = EINVAL;
+		return -1;
+	}
+	smp_store_release_ul(consumer_pos.get(), batch_end);
+	return 0;
+}
+
+int ringbuf::add_consumer()
+{
+	if (overwrite) {
+		spdlog::error(
+			"Ringbuf in overwrite mode doesn't support fan-out consumers");
+		errno = EINVAL;
+		return -1;
+	}
+	scoped_lock<interprocess_mutex> guard(consumers_mutex);
+	auto free_mask = ~consumer_mask & ((1U << MAX_RINGBUF_CONSUMERS) - 1);
+	if (free_mask == 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	int id = __builtin_ctz(free_mask);
+	// Start from what is not released yet, which is kept for the
+	// other consumers anyway
+	if (consumer_mask == 0)
+		__atomic_store_n(&reclaim_pos,
+				 smp_load_acquire_ul(consumer_pos.get()),
+				 __ATOMIC_RELEASE);
+	consumer_positions[id] = reclaim_pos;
+	__atomic_fetch_or(&consumer_mask, 1U << id, __ATOMIC_RELEASE);
+	spdlog::debug("Added ringbuf consumer {} at {}", id,
+		      consumer_positions[id]);
+	return id;
+}
+
+int ringbuf::remove_consumer(int id)
+{
+	scoped_lock<interprocess_mutex> guard(consumers_mutex);
+	if (id < 0 || id >= MAX_RINGBUF_CONSUMERS ||
+	    (consumer_mask & (1U << id)) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_fetch_and(&consumer_mask, ~(1U << id), __ATOMIC_RELEASE);
+	__atomic_fetch_and(&detached_mask, ~(1U << id), __ATOMIC_RELEASE);
+	// It may have been the slowest one
+	update_reclaim_pos();
+	return 0;
+}
+
+void ringbuf::set_detach_slow_consumers(bool enable)
+{
+	__atomic_store_n(&detach_slow_consumers, enable, __ATOMIC_RELAXED);
+}
+
+void ringbuf::update_reclaim_pos()
+{
+	auto attached = consumer_mask & ~detached_mask;
+	unsigned long min_pos = ULONG_MAX;
+	for (int i = 0; i < MAX_RINGBUF_CONSUMERS; i++) {
+		if (attached & (1U << i))
+			min_pos = std::min(min_pos, consumer_positions[i]);
+	}
+	if (attached != 0 && min_pos > reclaim_pos)
+		__atomic_store_n(&reclaim_pos, min_pos, __ATOMIC_RELEASE);
+	// Undo direct stores to the mapped consumer_pos, which would
+	// otherwise look like released space once the consumers are removed
+	auto cons_pos = smp_load_acquire_ul(consumer_pos.get());
+	if (cons_pos != reclaim_pos) {
+		if (cons_pos > reclaim_pos)
+			spdlog::warn(
+				"Ignoring consumer position {} of ringbuf with fan-out consumers, which are at {}",
+				cons_pos, reclaim_pos);
+		smp_store_release_ul(consumer_pos.get(), reclaim_pos);
+	}
+}
+
+bool ringbuf::detach_slowest_consumers(unsigned long end)
+{
+	// Producers never wait for consumers. If they are being updated,
+	// just fail like there is no space
+	if (!consumers_mutex.try_lock())
+		return false;
+	scoped_lock<interprocess_mutex> guard(consumers_mutex,
+					      boost::interprocess::accept_ownership);
+	while (end - reclaim_pos > max_ent) {
+		auto attached = consumer_mask & ~detached_mask;
+		unsigned long min_pos = ULONG_MAX, max_pos = 0;
+		for (int i = 0; i < MAX_RINGBUF_CONSUMERS; i++) {
+			if (attached & (1U << i)) {
+				min_pos = std::min(min_pos,
+						   consumer_positions[i]);
+				max_pos = std::max(max_pos,
+						   consumer_positions[i]);
+			}
+		}
+		// Only leave consumers behind for the sake of faster ones.
+		// If all of them are equally behind, the ringbuf is full
+		if (attached == 0 || min_pos == max_pos)
+			return false;
+		for (int i = 0; i < MAX_RINGBUF_CONSUMERS; i++) {
+			if ((attached & (1U << i)) &&
+			    consumer_positions[i] == min_pos) {
+				spdlog::warn(
+					"Detaching ringbuf consumer {}, which is {} bytes behind",
+					i, max_pos - min_pos);
+				__atomic_fetch_or(&detached_mask, 1U << i,
+						  __ATOMIC_RELEASE);
+			}
+		}
+		update_reclaim_pos();
+	}
+	return true;
+}
+
+int ringbuf::check_consumer(int id) const
+{
+	if (id < 0 || id >= MAX_RINGBUF_CONSUMERS ||
+	    (__atomic_load_n(&consumer_mask, __ATOMIC_ACQUIRE) & (1U << id)) ==
+		    0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (__atomic_load_n(&detached_mask, __ATOMIC_ACQUIRE) & (1U << id)) {
+		errno = EPIPE;
+		return -1;
+	}
+	return 0;
+}
+
+int ringbuf::peek_consumer_batch(int id, ringbuf_sample *samples,
+				 int max_samples,
+				 unsigned long *batch_end) const
+{
+	if (check_consumer(id) < 0)
+		return -1;
+	// Only the consumer itself updates its position
+	return collect_samples(
+		__atomic_load_n(&consumer_positions[id], __ATOMIC_RELAXED),
+		samples, max_samples, batch_end);
+}
+
+int ringbuf::commit_consumer_batch(int id, unsigned long batch_end)
+{
+	scoped_lock<interprocess_mutex> guard(consumers_mutex);
+	if (check_consumer(id) < 0)
+		return -1;
+	auto cons_pos = consumer_positions[id];
+	auto prod_pos = smp_load_acquire_ul(producer_pos.get());
+	if (batch_end < cons_pos || batch_end > prod_pos) {
+		spdlog::error(
+			"Invalid batch end {} of consumer {}, consumer pos {}, producer pos {}",
+			batch_end, id, cons_pos, prod_pos);
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_store_n(&consumer_positions[id], batch_end, __ATOMIC_RELAXED);
+	update_reclaim_pos();
+	return 0;
+}
+
+long ringbuf::snapshot(void *buf, size_t size) const
+{
+	if (size < max_ent) {
+		errno = EINVAL;
+		return -1;
+	}
+	auto start = read_start_pos();
+	auto prod_pos = smp_load_acquire_ul(producer_pos.get());
+	auto out = (uint8_t *)buf;
+	// Records are copied as they are, so the offset of a record in `buf`
+	// is always its position minus `start`
+	auto pos = start;
+	while (pos < prod_pos) {
+		auto hdr = (ringbuf_hdr *)((uintptr_t)data.get() +
+					   (pos & mask()));
+		auto len = __atomic_load_n(&hdr->len, __ATOMIC_ACQUIRE);
+		if (len & BPF_RINGBUF_BUSY_BIT)
+			break;
+		auto rec_sz = record_size(len);
+		// Garbage read from a record being overwritten
+		if (pos + rec_sz > prod_pos)
+			break;
+		memcpy(out + (pos - start), hdr, rec_sz);
+		pos += rec_sz;
+	}
+	// Like a seqlock, records dropped by producers while being copied may
+	// be torn, so drop them from the snapshot too. overwrite_pos is
+	// always at the start of a record
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	auto new_start = std::max(
+		start, __atomic_load_n(&overwrite_pos, __ATOMIC_ACQUIRE));
+	if (new_start >= pos)
+		return 0;
+	if (new_start > start)
+		memmove(out, out + (new_start - start), pos - new_start);
+	return pos - new_start;
+}
+
+long ringbuf::drain(drain_callback callback, void *ctx, uint32_t max_samples)
+{
+	int32_t self = getpid(), owner = 0;
+	while (!__atomic_compare_exchange_n(&drainer_pid, &owner, self, false,
+					    __ATOMIC_ACQUIRE,
+					    __ATOMIC_RELAXED)) {
+		// Records it hadn't published as consumed are drained again
+		if (owner == self || kill(owner, 0) == 0 || errno != ESRCH) {
+			errno = EBUSY;
+			return -1;
+		}
+		spdlog::warn("Taking over ringbuf draining from dead process {}",
+			     owner);
+	}
+	auto cons_pos = smp_load_acquire_ul(consumer_pos.get());
+	auto prod_pos = smp_load_acquire_ul(producer_pos.get());
+	long cnt = 0;
+	while (cons_pos < prod_pos && (uint32_t)cnt < max_samples) {
+		auto hdr = (ringbuf_hdr *)((uintptr_t)data.get() +
+					   (cons_pos & mask()));
+		auto len = __atomic_load_n(&hdr->len, __ATOMIC_ACQUIRE);
+		if (len & BPF_RINGBUF_BUSY_BIT)
+			break;
+		cons_pos += record_size(len);
+		// Discarded records are consumed silently
+		if (len & BPF_RINGBUF_DISCARD_BIT)
+			continue;
+		cnt++;
+		if (callback((uint8_t *)hdr + BPF_RINGBUF_HDR_SZ, len, ctx))
+			break;
+	}
+	// Release the space to producers once for all records
+	smp_store_release_ul(consumer_pos.get(), cons_pos);
+	__atomic_store_n(&drainer_pid, 0, __ATOMIC_RELEASE);
+	return cnt;
 }
 
 } // namespace bpftime
@@ -14,10 +14,18 @@
 #include <boost/interprocess/smart_ptr/unique_ptr.hpp>
 #include <boost/interprocess/smart_ptr/shared_ptr.hpp>
 #include <boost/interprocess/smart_ptr/weak_ptr.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <bpf_map/epoll_ready_set.hpp>
+#include <bpftime_shm.hpp>
+#include <bpf_map/eventfd_notifier.hpp>
+#include <bpf_map/ring_claim.hpp>
 #include <cstddef>
 
 namespace bpftime
 {
+// Most consumers a ringbuf could fan records out to
+static const int MAX_RINGBUF_CONSUMERS = 8;
+
 using sharable_mutex_ptr = boost::interprocess::managed_unique_ptr<
 	boost::interprocess::interprocess_sharable_mutex,
 	boost::interprocess::managed_shared_memory>::type;
@@ -37,17 +45,131 @@ class ringbuf {
 	boost::interprocess::offset_ptr<unsigned long> consumer_pos;
 	boost::interprocess::offset_ptr<unsigned long> producer_pos;
 	boost::interprocess::offset_ptr<uint8_t> data;
-	// Guard for reserving memory
-	mutable sharable_mutex_ptr reserve_mutex;
+	// End of the area claimed by producers. Producers claim space with
+	// it, then publish the claimed records to the consumer by advancing
+	// producer_pos in order, after the headers are written
+	ring_claim claim;
+	// Whether producers overwrite the oldest records when full
+	bool overwrite;
+	// Start of the oldest record kept in overwrite mode. Producers drop
+	// the oldest records by CAS on it, before claiming their space
+	unsigned long overwrite_pos = 0;
+	// Positions of the consumers registered for fan-out. While there
+	// are any, producers reclaim space up to `reclaim_pos`, the slowest
+	// of them, instead of consumer_pos. consumer_pos is mapped by
+	// libbpf consumers, so this keeps their stores from releasing
+	// records the fan-out consumers haven't read. It mirrors
+	// `reclaim_pos` meanwhile
+	unsigned long consumer_positions[MAX_RINGBUF_CONSUMERS] = {};
+	unsigned long reclaim_pos = 0;
+	// Bit i is set if consumer i is registered
+	uint32_t consumer_mask = 0;
+	// Bit i is set if consumer i was left behind for being too slow
+	uint32_t detached_mask = 0;
+	// Whether producers detach the slowest consumers when the ringbuf is
+	// full, instead of failing, as long as some consumers are ahead
+	bool detach_slow_consumers = false;
+	// Serialize registering and committing of fan-out consumers
+	boost::interprocess::interprocess_mutex consumers_mutex;
+	// The process draining a user ringbuf, since records must be consumed
+	// by one consumer at a time. 0 if none. Taken over if that process
+	// died while draining
+	int32_t drainer_pid = 0;
+	// Epoll instances to notify on submitting
+	epoll_watchers watchers;
+	// Eventfd to notify on submitting, if enabled
+	eventfd_notifier efd_notifier;
+	// Without wakeup flags, consumers are woken up when it has caught up
+	// with the submitted record, or when there are at least this many
+	// bytes not consumed. 0 disables the latter
+	uint32_t wakeup_watermark = 0;
 	// raw buffer
 	buf_vec_unique_ptr raw_buffer;
 
+	// Position of the first record that is readable
+	unsigned long read_start_pos() const;
+	// Position of the first record whose space is not released to
+	// producers
+	unsigned long free_start_pos() const;
+	// Whether a consumer was waiting for the record at `pos`
+	bool consumer_caught_up(unsigned long pos) const;
+	// Drop the oldest records, so that the space before `end` fits in
+	// the buffer
+	bool overwrite_oldest(unsigned long end);
+	// Collect records from `start`, see peek_batch
+	int collect_samples(unsigned long start, ringbuf_sample *samples,
+			    int max_samples, unsigned long *batch_end) const;
+	// Move reclaim_pos to the slowest attached consumer. Requires
+	// consumers_mutex
+	void update_reclaim_pos();
+	// Detach the slowest consumers until the space before `end` fits in
+	// the buffer. Returns whether it fits
+	bool detach_slowest_consumers(unsigned long end);
+	// Check that consumer `id` is registered and attached
+	int check_consumer(int id) const;
+
     public:
 	bool has_data() const;
+	epoll_watchers &get_watchers()
+	{
+		return watchers;
+	}
+	eventfd_notifier &get_eventfd_notifier()
+	{
+		return efd_notifier;
+	}
 	void *reserve(size_t size, int self_fd);
-	void submit(const void *sample, bool discard);
+	void submit(const void *sample, bool discard, uint64_t flags = 0);
+	// Shrink a reserved record to `size` bytes before submitting it. The
+	// space after it is released right away if nothing was reserved
+	// after it, or consumed with it otherwise
+	void shrink(void *sample, uint32_t size);
+	// Implements bpf_ringbuf_query
+	uint64_t query(uint64_t flags) const;
+	void set_wakeup_watermark(uint32_t bytes);
+	// Collect up to `max_samples` committed records from the consumer
+	// position, without consuming them, so that they could be processed
+	// in place. Discarded records are skipped. Stores the position to
+	// pass to `commit_batch` in `batch_end`, and returns the number of
+	// samples collected
+	int peek_batch(ringbuf_sample *samples, int max_samples,
+		       unsigned long *batch_end) const;
+	// Release the records before `batch_end` to producers, with a single
+	// update of the consumer position
+	int commit_batch(unsigned long batch_end);
+	// Register a consumer which reads all records on its own, from the
+	// oldest one not consumed. Records are released to producers after
+	// every consumer has consumed them. Returns the id of the consumer,
+	// or -1 with errno ENOSPC if there are MAX_RINGBUF_CONSUMERS already.
+	// While there are registered consumers, consumer_pos could only be
+	// updated by them
+	int add_consumer();
+	int remove_consumer(int id);
+	void set_detach_slow_consumers(bool enable);
+	// Same as peek_batch and commit_batch, from the position of consumer
+	// `id`. Fail with errno EPIPE if the consumer was detached, in which
+	// case records it has peeked may have been overwritten
+	int peek_consumer_batch(int id, ringbuf_sample *samples,
+				int max_samples,
+				unsigned long *batch_end) const;
+	int commit_consumer_batch(int id, unsigned long batch_end);
+	// Copy all committed records that are not consumed or overwritten to
+	// `buf`, in the same layout as in the ringbuf, without consuming
+	// them. This is the only safe way to read a ringbuf in overwrite
+	// mode, since records may be overwritten while being read in place.
+	// `size` must be at least the size of the ringbuf. Returns the
+	// number of bytes copied
+	long snapshot(void *buf, size_t size) const;
+	using drain_callback = long (*)(void *data, uint32_t size, void *ctx);
+	// Consume committed records in order with `callback`, until it
+	// returns nonzero, or `max_samples` records are consumed. Used by
+	// user ringbufs, where userspace produces and programs consume.
+	// Returns the number of records consumed, or -1 with errno EBUSY if
+	// another consumer is draining
+	long drain(drain_callback callback, void *ctx, uint32_t max_samples);
 	ringbuf(uint32_t max_ent,
-		boost::interprocess::managed_shared_memory &memory);
+		boost::interprocess::managed_shared_memory &memory,
+		bool overwrite = false);
 	friend class ringbuf_map_impl;
 };
 
@@ -65,7 +187,8 @@ class ringbuf_map_impl {
     public:
 	const static bool should_lock = false;
 	ringbuf_map_impl(uint32_t max_ent,
-			 boost::interprocess::managed_shared_memory &memory);
+			 boost::interprocess::managed_shared_memory &memory,
+			 bool overwrite = false);
 
 	void *elem_lookup(const void *key);
 
@@ -77,9 +200,26 @@ class ringbuf_map_impl {
 	ringbuf_weak_ptr create_impl_weak_ptr();
 	void *get_consumer_page() const;
 	void *get_producer_page() const;
+	bool has_data() const;
+	eventfd_notifier &get_eventfd_notifier();
 	void *reserve(size_t size, int self_fd);
-	void submit(const void *sample, bool discard);
-
+	void submit(const void *sample, bool discard, uint64_t flags = 0);
+	void shrink(void *sample, uint32_t size);
+	uint64_t query(uint64_t flags) const;
+	void set_wakeup_watermark(uint32_t bytes);
+	int peek_batch(ringbuf_sample *samples, int max_samples,
+		       unsigned long *batch_end) const;
+	int commit_batch(unsigned long batch_end);
+	int add_consumer();
+	int remove_consumer(int id);
+	void set_detach_slow_consumers(bool enable);
+	int peek_consumer_batch(int id, ringbuf_sample *samples,
+				int max_samples,
+				unsigned long *batch_end) const;
+	int commit_consumer_batch(int id, unsigned long batch_end);
+	long snapshot(void *buf, size_t size) const;
+	long drain(ringbuf::drain_callback callback, void *ctx,
+		   uint32_t max_samples);
 };
 
 } // namespace bpftime
@@ -41,6 +41,27 @@ extern "C" uint64_t __ebpf_call_ffi_dispatcher(uint64_t id, uint64_t arg_list);
 // not used directly
 extern "C" int64_t __ebpf_call_find_ffi_id(const char *func_name);
 
+// Map pointers given to programs are `fd << 32 | 0xffff0000 | map type`. The
+// map type is resolved once when loading the program, so that helpers could
+// dispatch on it without looking up the map handler
+#define MAP_PTR_TYPE_TAG 0xffff0000u
+#define MAP_PTR_TYPE_MASK 0x0000ffffu
+
+static inline int map_ptr_to_fd(uint64_t map_ptr)
+{
+	return (int)(map_ptr >> 32);
+}
+
+// Returns -1 if the map type is not cached in the map pointer
+static inline int map_ptr_to_type(uint64_t map_ptr)
+{
+	auto low = (uint32_t)map_ptr;
+	if ((low & ~MAP_PTR_TYPE_MASK) != MAP_PTR_TYPE_TAG ||
+	    (low & MAP_PTR_TYPE_MASK) == MAP_PTR_TYPE_MASK)
+		return -1;
+	return (int)(low & MAP_PTR_TYPE_MASK);
+}
+
 extern "C" uint64_t map_ptr_by_fd(uint32_t fd);
 
 extern "C" uint64_t map_val(uint64_t map_ptr);
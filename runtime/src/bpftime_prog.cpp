@@ -11,11 +11,220 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <climits>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <spdlog/spdlog.h>
 
 using namespace std;
+
+// Waiting for another process compiling the same program into the JIT cache
+// gives up after this many tries, and compiles it without the cache
+static const int JIT_CACHE_LOCK_TRIES = 100;
+static const useconds_t JIT_CACHE_LOCK_INTERVAL_US = 10000;
+
 namespace bpftime
 {
+struct deferred_call {
+	void (*fn)(void *, uint64_t);
+	void *ctx;
+	uint64_t arg;
+};
+
+// Calls deferred by the programs running in this thread
+static thread_local std::vector<deferred_call> deferred_calls;
+// Where the calls of the innermost running program start in
+// `deferred_calls`, or -1 if no program is running
+static thread_local ssize_t run_deferred_start = -1;
+
+ssize_t bpftime_prog_begin_run()
+{
+	auto outer = run_deferred_start;
+	run_deferred_start = deferred_calls.size();
+	return outer;
+}
+
+void bpftime_prog_end_run(ssize_t outer)
+{
+	while ((ssize_t)deferred_calls.size() > run_deferred_start) {
+		auto call = deferred_calls.back();
+		deferred_calls.pop_back();
+		call.fn(call.ctx, call.arg);
+	}
+	run_deferred_start = outer;
+}
+
+int bpftime_prog_defer_until_return(void (*fn)(void *, uint64_t), void *ctx,
+				    uint64_t arg)
+{
+	if (run_deferred_start < 0)
+		return -1;
+	for (size_t i = run_deferred_start; i < deferred_calls.size(); i++) {
+		auto &call = deferred_calls[i];
+		if (call.fn == fn && call.ctx == ctx && call.arg == arg)
+			return 1;
+	}
+	deferred_calls.push_back({ fn, ctx, arg });
+	return 0;
+}
+
+enum tier_up_state {
+	TIER_INTERPRETED,
+	// Ran jit_threshold times, waiting for the compile thread
+	TIER_REQUESTED,
+	TIER_COMPILING,
+	TIER_JITTED,
+	// Failed to compile, so it keeps being interpreted
+	TIER_FAILED,
+};
+
+struct bpftime_prog::tier_state {
+	uint64_t jit_threshold;
+	std::string cache_dir;
+	std::atomic<uint64_t> runs = 0;
+	std::atomic<int> state = TIER_INTERPRETED;
+	// set once the program is compiled
+	std::atomic<ebpf_jit_fn> fn = nullptr;
+	// owns the compiled code
+	std::unique_ptr<bpftime_prog> jit_prog;
+};
+
+// Compiles hot tiered programs, on a single thread per process started when
+// the first of them is loaded. Running a program only flags it and wakes the
+// thread up.
+//
+// All waits are on the futex word `seq`, bumped on each event, rather than
+// on condition variables, whose waiters would be left behind in forked
+// children
+struct tier_compiler {
+	std::mutex mutex;
+	// Loaded tiered programs
+	std::vector<bpftime_prog *> progs;
+	bpftime_prog *compiling = nullptr;
+	// Set while forking, so that no compilation starts
+	bool forking = false;
+	// The process the thread runs in
+	int thread_pid = 0;
+	uint32_t seq = 0;
+
+	void wake()
+	{
+		__atomic_fetch_add(&seq, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &seq, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr,
+			nullptr, 0);
+	}
+	// Wait for an event after `cur_seq`, with the mutex released
+	void wait(std::unique_lock<std::mutex> &guard, uint32_t cur_seq)
+	{
+		guard.unlock();
+		syscall(SYS_futex, &seq, FUTEX_WAIT_PRIVATE, cur_seq, nullptr,
+			nullptr, 0);
+		guard.lock();
+	}
+	// The caller holds the mutex
+	void start_thread()
+	{
+		if (thread_pid == getpid())
+			return;
+		std::thread([this]() { run(); }).detach();
+		thread_pid = getpid();
+	}
+	void run()
+	{
+		std::unique_lock<std::mutex> guard(mutex);
+		while (true) {
+			auto cur_seq = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+			bpftime_prog *prog = nullptr;
+			for (auto p : progs) {
+				int expected = TIER_REQUESTED;
+				if (!forking &&
+				    p->tier->state.compare_exchange_strong(
+					    expected, TIER_COMPILING)) {
+					prog = p;
+					break;
+				}
+			}
+			if (prog == nullptr) {
+				wait(guard, cur_seq);
+				continue;
+			}
+			compiling = prog;
+			guard.unlock();
+			prog->tier_up();
+			guard.lock();
+			compiling = nullptr;
+			wake();
+		}
+	}
+	// Wait for the program being compiled, if it is `prog` or `prog` is
+	// nullptr. The caller holds the mutex
+	void wait_compiling(std::unique_lock<std::mutex> &guard,
+			    const bpftime_prog *prog)
+	{
+		while (true) {
+			auto cur_seq = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+			if (compiling == nullptr ||
+			    (prog != nullptr && compiling != prog))
+				break;
+			wait(guard, cur_seq);
+		}
+	}
+};
+
+static tier_compiler &get_tier_compiler();
+
+// A compilation running while forking would never finish in the child, and
+// could leave LLVM locked there, so forks wait for it. The child starts its
+// own thread
+static void tier_compiler_prepare_fork()
+{
+	auto &compiler = get_tier_compiler();
+	std::unique_lock<std::mutex> guard(compiler.mutex);
+	compiler.forking = true;
+	compiler.wait_compiling(guard, nullptr);
+	guard.release();
+}
+
+static void tier_compiler_parent_fork()
+{
+	auto &compiler = get_tier_compiler();
+	compiler.forking = false;
+	compiler.mutex.unlock();
+	compiler.wake();
+}
+
+static void tier_compiler_child_fork()
+{
+	auto &compiler = get_tier_compiler();
+	compiler.forking = false;
+	if (!compiler.progs.empty())
+		compiler.start_thread();
+	compiler.mutex.unlock();
+}
+
+static tier_compiler &get_tier_compiler()
+{
+	// Never destroyed, since the thread runs until the process exits
+	static tier_compiler *compiler = []() {
+		auto compiler = new tier_compiler;
+		pthread_atfork(tier_compiler_prepare_fork,
+			       tier_compiler_parent_fork,
+			       tier_compiler_child_fork);
+		return compiler;
+	}();
+	return *compiler;
+}
 
 bpftime_prog::bpftime_prog(const struct ebpf_inst *insn, size_t insn_cnt,
 			   const char *name)
@@ -31,6 +240,14 @@ bpftime_prog::bpftime_prog(const struct ebpf_inst *insn, size_t insn_cnt,
 
 bpftime_prog::~bpftime_prog()
 {
+	if (tier) {
+		auto &compiler = get_tier_compiler();
+		std::unique_lock<std::mutex> guard(compiler.mutex);
+		compiler.wait_compiling(guard, this);
+		compiler.progs.erase(std::remove(compiler.progs.begin(),
+						 compiler.progs.end(), this),
+				     compiler.progs.end());
+	}
 	ebpf_unload_code(vm);
 	ebpf_destroy(vm);
 }
@@ -40,6 +257,8 @@ int bpftime_prog::bpftime_prog_load(bool jit)
 	int res = -1;
 
 	spdlog::debug("Load insn cnt {}", insns.size());
+	// Decoding for the threaded interpreter is wasted on compiled programs
+	ebpf_toggle_threaded_interpreter(vm, !jit && threaded_interpreter);
 	res = ebpf_load(vm, insns.data(),
 			insns.size() * sizeof(struct ebpf_inst), &errmsg);
 	if (res < 0) {
@@ -62,6 +281,273 @@ int bpftime_prog::bpftime_prog_load(bool jit)
 	return 0;
 }
 
+int bpftime_prog::bpftime_prog_compile_aot(std::vector<uint8_t> &obj)
+{
+	void *buf;
+	size_t buf_len;
+	ebpf_toggle_threaded_interpreter(vm, false);
+	int res = ebpf_load(vm, insns.data(),
+			    insns.size() * sizeof(struct ebpf_inst), &errmsg);
+	if (res < 0) {
+		spdlog::error("Failed to load insn: {}", errmsg);
+		return res;
+	}
+	res = ebpf_compile_aot(vm, &buf, &buf_len, &errmsg);
+	ebpf_unload_code(vm);
+	if (res < 0) {
+		spdlog::error("Failed to AOT compile {}: {}", name, errmsg);
+		return res;
+	}
+	obj.assign((uint8_t *)buf, (uint8_t *)buf + buf_len);
+	free(buf);
+	return 0;
+}
+
+int bpftime_prog::bpftime_prog_load_aot(const void *obj, size_t obj_len)
+{
+	ebpf_toggle_threaded_interpreter(vm, false);
+	int res = ebpf_load(vm, insns.data(),
+			    insns.size() * sizeof(struct ebpf_inst), &errmsg);
+	if (res < 0) {
+		spdlog::error("Failed to load insn: {}", errmsg);
+		return res;
+	}
+	ebpf_jit_fn aot_fn = ebpf_load_aot_object(vm, obj, obj_len, &errmsg);
+	if (aot_fn == NULL) {
+		spdlog::error("Failed to load AOT object of {}: {}", name,
+			      errmsg);
+		ebpf_unload_code(vm);
+		return -1;
+	}
+	jitted = true;
+	fn = aot_fn;
+	return 0;
+}
+
+// Objects in the JIT cache are loaded as code, so only trust a cache, and
+// files in it, that belong to this user and can't be written by others
+static bool is_private(int fd, const std::string &path)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		spdlog::warn("Unable to stat JIT cache {}: {}", path,
+			     strerror(errno));
+		return false;
+	}
+	if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		spdlog::warn(
+			"Ignoring JIT cache {}, which is not private to user {}",
+			path, geteuid());
+		return false;
+	}
+	return true;
+}
+
+int bpftime_prog::load_from_cache(int dir_fd, const std::string &file_name)
+{
+	int fd = openat(dir_fd, file_name.c_str(),
+			O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    !is_private(fd, file_name)) {
+		close(fd);
+		return -1;
+	}
+	std::vector<uint8_t> obj(st.st_size);
+	size_t pos = 0;
+	while (pos < obj.size()) {
+		auto len = read(fd, obj.data() + pos, obj.size() - pos);
+		if (len <= 0)
+			break;
+		pos += len;
+	}
+	close(fd);
+	if (pos < obj.size())
+		return -1;
+	return bpftime_prog_load_aot(obj.data(), obj.size());
+}
+
+int bpftime_prog::compile_to_cache(int dir_fd, const std::string &file_name)
+{
+	std::vector<uint8_t> obj;
+	if (bpftime_prog_compile_aot(obj) < 0)
+		return -1;
+	// Readers never see a partially written object
+	auto tmp_name = file_name + ".tmp." + std::to_string(getpid());
+	int fd = openat(dir_fd, tmp_name.c_str(),
+			O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+			0600);
+	if (fd < 0) {
+		spdlog::warn("Failed to create JIT cache file {}: {}", tmp_name,
+			     strerror(errno));
+		return bpftime_prog_load_aot(obj.data(), obj.size());
+	}
+	size_t pos = 0;
+	while (pos < obj.size()) {
+		auto len = write(fd, obj.data() + pos, obj.size() - pos);
+		if (len <= 0)
+			break;
+		pos += len;
+	}
+	close(fd);
+	if (pos < obj.size()) {
+		spdlog::warn("Failed to write JIT cache file {}", tmp_name);
+		unlinkat(dir_fd, tmp_name.c_str(), 0);
+	} else if (renameat(dir_fd, tmp_name.c_str(), dir_fd,
+			    file_name.c_str()) < 0) {
+		spdlog::warn("Failed to rename {} to {}: {}", tmp_name,
+			     file_name, strerror(errno));
+		unlinkat(dir_fd, tmp_name.c_str(), 0);
+	}
+	return bpftime_prog_load_aot(obj.data(), obj.size());
+}
+
+// Open the JIT cache directory, creating it if needed. Returns -1 if it can't
+// be trusted
+static int open_cache_dir(const char *cache_dir)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(
+		std::filesystem::path(cache_dir).parent_path(), ec);
+	if (mkdir(cache_dir, 0700) < 0 && errno != EEXIST) {
+		spdlog::warn("Unable to create JIT cache {}: {}", cache_dir,
+			     strerror(errno));
+		return -1;
+	}
+	int dir_fd =
+		open(cache_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dir_fd < 0) {
+		spdlog::warn("Unable to open JIT cache {}: {}", cache_dir,
+			     strerror(errno));
+		return -1;
+	}
+	if (!is_private(dir_fd, cache_dir)) {
+		close(dir_fd);
+		return -1;
+	}
+	return dir_fd;
+}
+
+int bpftime_prog::bpftime_prog_load_cached(const char *cache_dir)
+{
+	ebpf_toggle_threaded_interpreter(vm, false);
+	int res = ebpf_load(vm, insns.data(),
+			    insns.size() * sizeof(struct ebpf_inst), &errmsg);
+	if (res < 0) {
+		spdlog::error("Failed to load insn: {}", errmsg);
+		return res;
+	}
+	uint64_t key = ebpf_aot_cache_key(vm);
+	ebpf_unload_code(vm);
+
+	int dir_fd = open_cache_dir(cache_dir);
+	if (dir_fd < 0)
+		return bpftime_prog_load(true);
+	char base[32];
+	snprintf(base, sizeof(base), "%016" PRIx64, key);
+	auto file_name = std::string(base) + ".o";
+	auto lock_name = std::string(base) + ".lock";
+	// Processes missing the same program wait for the first one to compile
+	// it, instead of all compiling it. They don't wait forever though, in
+	// case it's stuck
+	int lock_fd = openat(dir_fd, lock_name.c_str(),
+			     O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	bool locked = false;
+	if (lock_fd < 0) {
+		spdlog::warn("Unable to lock JIT cache entry {}: {}", lock_name,
+			     strerror(errno));
+	} else if (is_private(lock_fd, lock_name)) {
+		for (int i = 0; i < JIT_CACHE_LOCK_TRIES; i++) {
+			if (flock(lock_fd, LOCK_EX | LOCK_NB) == 0) {
+				locked = true;
+				break;
+			}
+			if (errno != EWOULDBLOCK)
+				break;
+			usleep(JIT_CACHE_LOCK_INTERVAL_US);
+		}
+	}
+	if (load_from_cache(dir_fd, file_name) == 0) {
+		spdlog::info("Loaded program {} from JIT cache {}/{}", name,
+			     cache_dir, file_name);
+		res = 0;
+	} else if (locked) {
+		res = compile_to_cache(dir_fd, file_name);
+		if (res == 0)
+			spdlog::info("Added program {} to JIT cache {}/{}",
+				     name, cache_dir, file_name);
+	} else {
+		res = -1;
+	}
+	if (lock_fd >= 0)
+		close(lock_fd);
+	close(dir_fd);
+	if (res == 0)
+		return 0;
+	spdlog::debug("JIT cache unavailable for {}, compiling", name);
+	return bpftime_prog_load(true);
+}
+
+int bpftime_prog::bpftime_prog_load_tiered(uint64_t jit_threshold,
+					   const char *cache_dir)
+{
+	ebpf_toggle_threaded_interpreter(vm, threaded_interpreter);
+	int res = ebpf_load(vm, insns.data(),
+			    insns.size() * sizeof(struct ebpf_inst), &errmsg);
+	if (res < 0) {
+		spdlog::error("Failed to load insn: {}", errmsg);
+		return res;
+	}
+	jitted = false;
+	tier = std::make_unique<tier_state>();
+	tier->jit_threshold = jit_threshold;
+	tier->cache_dir = cache_dir;
+	auto &compiler = get_tier_compiler();
+	std::lock_guard<std::mutex> guard(compiler.mutex);
+	compiler.progs.push_back(this);
+	compiler.start_thread();
+	return 0;
+}
+
+// Compile the program in another VM, since this one keeps interpreting it
+// meanwhile. Runs on the thread of tier_compiler
+void bpftime_prog::tier_up()
+{
+	auto prog = std::make_unique<bpftime_prog>(insns.data(), insns.size(),
+						   name.c_str());
+	for (const auto &helper : helpers)
+		prog->bpftime_prog_register_raw_helper(helper);
+	int res = tier->cache_dir.empty() ?
+			  prog->bpftime_prog_load(true) :
+			  prog->bpftime_prog_load_cached(tier->cache_dir.c_str());
+	if (res < 0) {
+		spdlog::warn("Failed to compile program {}, keep interpreting it",
+			     name);
+		tier->state.store(TIER_FAILED, std::memory_order_release);
+		return;
+	}
+	spdlog::info("Program {} ran {} times, switching to JIT", name,
+		     tier->jit_threshold);
+	tier->jit_prog = std::move(prog);
+	tier->fn.store(tier->jit_prog->fn, std::memory_order_release);
+	tier->state.store(TIER_JITTED, std::memory_order_release);
+}
+
+void bpftime_prog::bpftime_prog_toggle_threaded_interpreter(bool enable)
+{
+	threaded_interpreter = enable;
+}
+
+bool bpftime_prog::bpftime_prog_is_jitted() const
+{
+	if (tier)
+		return tier->state.load(std::memory_order_acquire) ==
+		       TIER_JITTED;
+	return jitted;
+}
+
 int bpftime_prog::bpftime_prog_unload()
 {
 	if (jitted) {
@@ -79,6 +565,7 @@ int bpftime_prog::bpftime_prog_exec(void *memory, size_t memory_size,
 	int res = 0;
 	// set share memory read and write able
 	bpftime_protect_disable();
+	auto outer_run = bpftime_prog_begin_run();
 	spdlog::debug(
 		"Calling bpftime_prog::bpftime_prog_exec, memory={:x}, memory_size={}, return_val={:x}, prog_name={}",
 		(uintptr_t)memory, memory_size, (uintptr_t)return_val,
@@ -87,6 +574,24 @@ int bpftime_prog::bpftime_prog_exec(void *memory, size_t memory_size,
 		spdlog::debug("Directly call jitted function at {:x}",
 			      (uintptr_t)fn);
 		val = fn(memory, memory_size);
+	} else if (tier) {
+		if (auto tier_fn = tier->fn.load(std::memory_order_acquire)) {
+			val = tier_fn(memory, memory_size);
+		} else {
+			res = ebpf_interpret(vm, memory, memory_size, &val);
+			if (res < 0) {
+				spdlog::error("ebpf_interpret returned error: {}",
+					      res);
+			}
+			// Only one caller hands it to the compile thread
+			if (tier->runs.fetch_add(1, std::memory_order_relaxed) +
+				    1 ==
+			    tier->jit_threshold) {
+				tier->state.store(TIER_REQUESTED,
+						  std::memory_order_release);
+				get_tier_compiler().wake();
+			}
+		}
 	} else {
 		spdlog::debug("Running using ebpf_exec");
 		res = ebpf_exec(vm, memory, memory_size, &val);
@@ -94,6 +599,7 @@ int bpftime_prog::bpftime_prog_exec(void *memory, size_t memory_size,
 			spdlog::error("ebpf_exec returned error: {}", res);
 		}
 	}
+	bpftime_prog_end_run(outer_run);
 	*return_val = val;
 	// set share memory read only
 	bpftime_protect_enable();
@@ -103,6 +609,7 @@ int bpftime_prog::bpftime_prog_exec(void *memory, size_t memory_size,
 int bpftime_prog::bpftime_prog_register_raw_helper(
 	struct bpftime_helper_info info)
 {
+	helpers.push_back(info);
 	return ebpf_register(vm, info.index, info.name.c_str(), info.fn);
 }
 
@@ -3,6 +3,7 @@
  * Copyright (c) 2022, eunomia-bpf org
  * All rights reserved.
  */
+#include "bpftime_internal.h"
 #include "handler/epoll_handler.hpp"
 #include "handler/map_handler.hpp"
 #include "handler/perf_event_handler.hpp"
@@ -11,8 +12,6 @@
 #include <errno.h>
 #include <bpftime_shm_internal.hpp>
 #include <sys/epoll.h>
-#include <thread>
-#include <chrono>
 #include <variant>
 
 using namespace bpftime;
@@ -85,6 +84,20 @@ long bpftime_map_delete_elem(int fd, const void *key)
 	return shm_holder.global_shared_memory.bpf_delete_elem(fd, key, true);
 }
 
+long bpftime_map_lookup_elem_aggregated(int fd, const void *key, void *value)
+{
+	return shm_holder.global_shared_memory.bpf_map_lookup_elem_aggregated(
+		fd, key, value);
+}
+
+long bpftime_map_update_elem_batch(int fd, const void *keys,
+				   const void *values, uint32_t count,
+				   uint64_t flags)
+{
+	return shm_holder.global_shared_memory.bpf_map_update_elem_batch(
+		fd, keys, values, count, flags, true);
+}
+
 int bpftime_map_get_next_key(int fd, const void *key, void *next_key)
 {
 	return shm_holder.global_shared_memory.bpf_map_get_next_key(
@@ -126,6 +139,16 @@ int bpftime_add_ringbuf_fd_to_epoll(int ringbuf_fd, int epoll_fd,
 		ringbuf_fd, epoll_fd, extra_data);
 }
 
+int bpftime_enable_eventfd_notification(int fd)
+{
+	return shm_holder.global_shared_memory.enable_eventfd_notification(fd);
+}
+
+int bpftime_arm_eventfd_notification(int fd)
+{
+	return shm_holder.global_shared_memory.arm_eventfd_notification(fd);
+}
+
 int bpftime_epoll_create()
 {
 	return shm_holder.global_shared_memory.epoll_create();
@@ -157,6 +180,50 @@ int bpftime_map_get_info(int fd, bpftime::bpf_map_attr *out_attr,
 	return 0;
 }
 
+int bpftime_map_get_stats(int fd, bpftime::bpf_map_stats *out_stats)
+{
+	return shm_holder.global_shared_memory.bpf_map_get_stats(fd,
+								  out_stats);
+}
+
+int bpftime_map_get_next_fd(int fd)
+{
+	return shm_holder.global_shared_memory.bpf_map_get_next_fd(fd);
+}
+
+int bpftime_prog_get_info(int fd, const ebpf_inst **out_insns,
+			  size_t *out_insn_cnt, const char **out_name)
+{
+	if (!shm_holder.global_shared_memory.is_prog_fd(fd)) {
+		errno = ENOENT;
+		return -1;
+	}
+	auto &handler = std::get<bpftime::bpf_prog_handler>(
+		shm_holder.global_shared_memory.get_handler(fd));
+	if (out_insns) {
+		*out_insns = handler.insns.data();
+	}
+	if (out_insn_cnt) {
+		*out_insn_cnt = handler.insns.size();
+	}
+	if (out_name) {
+		*out_name = handler.name.c_str();
+	}
+	return 0;
+}
+
+int bpftime_prog_get_next_fd(int fd)
+{
+	return shm_holder.global_shared_memory.bpf_prog_get_next_fd(fd);
+}
+
+int bpftime_get_global_shm_usage(uint64_t *total_bytes, uint64_t *free_bytes)
+{
+	shm_holder.global_shared_memory.get_memory_usage(total_bytes,
+							 free_bytes);
+	return 0;
+}
+
 int bpftime_is_ringbuf_map(int fd)
 {
 	return shm_holder.global_shared_memory.is_ringbuf_map_fd(fd);
@@ -202,6 +269,36 @@ void *bpftime_get_array_map_raw_data(int fd)
 	}
 }
 
+int bpftime_map_swap_buffers(int fd)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_double_buffered_hash_map_impl(fd);
+	    ret.has_value()) {
+		ret.value()->swap_buffers();
+		return 0;
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be a double buffered map fd",
+			      fd);
+		return -1;
+	}
+}
+
+int bpftime_map_clear_inactive_buffer(int fd)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_double_buffered_hash_map_impl(fd);
+	    ret.has_value()) {
+		ret.value()->clear_inactive_buffer();
+		return 0;
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be a double buffered map fd",
+			      fd);
+		return -1;
+	}
+}
+
 void *bpftime_get_ringbuf_consumer_page(int ringbuf_fd)
 {
 	auto &shm = shm_holder.global_shared_memory;
@@ -243,18 +340,181 @@ void *bpftime_ringbuf_reserve(int fd, uint64_t size)
 	}
 }
 
-void bpftime_ringbuf_submit(int fd, void *data, int discard)
+void bpftime_ringbuf_submit(int fd, void *data, int discard, uint64_t flags)
 {
 	auto &shm = shm_holder.global_shared_memory;
 	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
 		auto impl = ret.value();
-		impl->submit(data, discard);
+		impl->submit(data, discard, flags);
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+	}
+}
+
+int bpftime_ringbuf_shrink(int fd, void *data, uint32_t size)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		ret.value()->shrink(data, size);
+		return 0;
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+uint64_t bpftime_ringbuf_query(int fd, uint64_t flags)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		return ret.value()->query(flags);
 	} else {
 		errno = EINVAL;
 		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return 0;
 	}
 }
 
+int bpftime_ringbuf_set_wakeup_watermark(int fd, uint32_t bytes)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		ret.value()->set_wakeup_watermark(bytes);
+		return 0;
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+int bpftime_ringbuf_peek_batch(int fd, bpftime::ringbuf_sample *samples,
+			       int max_samples, uint64_t *batch_end)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		unsigned long end;
+		int cnt = ret.value()->peek_batch(samples, max_samples, &end);
+		*batch_end = end;
+		return cnt;
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+int bpftime_ringbuf_commit_batch(int fd, uint64_t batch_end)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		return ret.value()->commit_batch(batch_end);
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+int bpftime_ringbuf_add_consumer(int fd)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		return ret.value()->add_consumer();
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+int bpftime_ringbuf_remove_consumer(int fd, int consumer)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		return ret.value()->remove_consumer(consumer);
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+int bpftime_ringbuf_set_detach_slow_consumers(int fd, int enable)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		ret.value()->set_detach_slow_consumers(enable != 0);
+		return 0;
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+int bpftime_ringbuf_peek_consumer_batch(int fd, int consumer,
+					bpftime::ringbuf_sample *samples,
+					int max_samples, uint64_t *batch_end)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		unsigned long end;
+		int cnt = ret.value()->peek_consumer_batch(
+			consumer, samples, max_samples, &end);
+		*batch_end = end;
+		return cnt;
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+int bpftime_ringbuf_commit_consumer_batch(int fd, int consumer,
+					  uint64_t batch_end)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		return ret.value()->commit_consumer_batch(consumer, batch_end);
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+long bpftime_ringbuf_snapshot(int fd, void *buf, uint64_t size)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	if (auto ret = shm.try_get_ringbuf_map_impl(fd); ret.has_value()) {
+		return ret.value()->snapshot(buf, size);
+	} else {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be ringbuf map fd ", fd);
+		return -1;
+	}
+}
+
+long bpftime_user_ringbuf_drain(int fd,
+				long (*callback)(void *data, uint32_t size,
+						 void *ctx),
+				void *ctx, uint32_t max_samples)
+{
+	bpftime::bpf_map_type type;
+	if (bpftime_map_get_info(fd, nullptr, nullptr, &type) < 0 ||
+	    type != bpftime::bpf_map_type::BPF_MAP_TYPE_USER_RINGBUF) {
+		errno = EINVAL;
+		spdlog::error("Expected fd {} to be user ringbuf map fd", fd);
+		return -1;
+	}
+	auto &shm = shm_holder.global_shared_memory;
+	return shm.try_get_ringbuf_map_impl(fd).value()->drain(
+		callback, ctx, max_samples);
+}
+
 int bpftime_is_epoll_handler(int fd)
 {
 	return shm_holder.global_shared_memory.is_epoll_fd(fd);
@@ -269,57 +529,9 @@ int bpftime_epoll_wait(int fd, struct epoll_event *out_evts, int max_evt,
 		spdlog::error("Expected {} to be an epoll fd", fd);
 		return -1;
 	}
-	using namespace std::chrono;
 	auto &epoll_inst =
 		std::get<epoll_handler>(shm.get_manager()->get_handler(fd));
-	auto start_time = high_resolution_clock::now();
-	int next_id = 0;
-	while (next_id < max_evt) {
-		auto now_time = high_resolution_clock::now();
-		auto elasped =
-			duration_cast<milliseconds>(now_time - start_time);
-		if (elasped.count() > timeout) {
-			break;
-		}
-		for (const auto &p : epoll_inst.files) {
-			if (std::holds_alternative<software_perf_event_weak_ptr>(
-				    p.file)) {
-				if (auto ptr =
-					    std::get<software_perf_event_weak_ptr>(
-						    p.file)
-						    .lock();
-				    ptr) {
-					if (ptr->has_data() &&
-					    next_id < max_evt) {
-						out_evts[next_id++] =
-							epoll_event{
-								.events =
-									EPOLLIN,
-								.data = p.data
-							};
-					}
-				}
-			} else if (std::holds_alternative<ringbuf_weak_ptr>(
-					   p.file)) {
-				if (auto ptr =
-					    std::get<ringbuf_weak_ptr>(p.file)
-						    .lock();
-				    ptr) {
-					if (ptr->has_data() &&
-					    next_id < max_evt) {
-						out_evts[next_id++] =
-							epoll_event{
-								.events =
-									EPOLLIN,
-								.data = p.data
-							};
-					}
-				}
-			}
-		}
-		std::this_thread::sleep_for(milliseconds(1));
-	}
-	return next_id;
+	return epoll_inst.wait(out_evts, max_evt, timeout);
 }
 
 int bpftime_add_software_perf_event(int cpu, int32_t sample_type,
@@ -370,6 +582,67 @@ int bpftime_perf_event_output(int fd, const void *buf, size_t sz)
 	}
 }
 
+// Software perf events resolved from perf event arrays by this thread. An
+// entry is valid as long as no handler was closed since it was resolved, and
+// the array slot still holds the same perf event fd
+struct perf_event_array_cache_entry {
+	int map_fd = -1;
+	int cpu = -1;
+	uint64_t generation;
+	const int32_t *slot;
+	int32_t perf_fd;
+	software_perf_event_data *perf;
+};
+static const int PERF_EVENT_ARRAY_CACHE_SIZE = 8;
+static thread_local perf_event_array_cache_entry
+	perf_event_array_cache[PERF_EVENT_ARRAY_CACHE_SIZE];
+
+int bpftime_perf_event_array_output(int map_fd, int cpu, const void *buf,
+				    size_t sz)
+{
+	auto &shm = shm_holder.global_shared_memory;
+	auto generation = shm.get_manager()->get_generation();
+	auto &entry = perf_event_array_cache[(unsigned)(map_fd + cpu) %
+					     PERF_EVENT_ARRAY_CACHE_SIZE];
+	if (entry.map_fd == map_fd && entry.cpu == cpu &&
+	    entry.generation == generation &&
+	    __atomic_load_n(entry.slot, __ATOMIC_RELAXED) == entry.perf_fd)
+		return entry.perf->output_data(buf, sz);
+	auto slot = (const int32_t *)bpftime_helper_map_lookup_elem(map_fd,
+								    &cpu);
+	if (slot == nullptr) {
+		spdlog::error("Invalid map fd for perf event output: {}",
+			      map_fd);
+		errno = EINVAL;
+		return -1;
+	}
+	int32_t perf_fd = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	if (!shm.is_perf_event_handler_fd(perf_fd)) {
+		spdlog::error("Expected fd {} to be a perf event handler",
+			      perf_fd);
+		errno = EINVAL;
+		return -1;
+	}
+	auto &handler =
+		std::get<bpf_perf_event_handler>(shm.get_handler(perf_fd));
+	if (!handler.sw_perf.has_value()) {
+		spdlog::error(
+			"Expected perf event handler {} to be a software perf event handler",
+			perf_fd);
+		errno = ENOTSUP;
+		return -1;
+	}
+	entry = perf_event_array_cache_entry{
+		.map_fd = map_fd,
+		.cpu = cpu,
+		.generation = generation,
+		.slot = slot,
+		.perf_fd = perf_fd,
+		.perf = handler.sw_perf.value().get().get(),
+	};
+	return entry.perf->output_data(buf, sz);
+}
+
 int bpftime_shared_perf_event_output(int map_fd, const void *buf, size_t sz)
 {
 	spdlog::debug("Output data into shared perf event array fd {}", map_fd);
@@ -411,8 +684,12 @@ extern "C" uint64_t map_ptr_by_fd(uint32_t fd)
 		// Here we just ignore the wrong maps
 		return INVALID_MAP_PTR;
 	}
-	// Use a convenient way to represent a pointer
-	return ((uint64_t)fd << 32) | 0xffffffff;
+	auto &handler = std::get<bpftime::bpf_map_handler>(
+		shm_holder.global_shared_memory.get_handler(fd));
+	// Use a convenient way to represent a pointer, which also carries the
+	// map type
+	return ((uint64_t)fd << 32) | MAP_PTR_TYPE_TAG |
+	       ((uint32_t)handler.type & MAP_PTR_TYPE_MASK);
 }
 
 extern "C" uint64_t map_val(uint64_t map_ptr)
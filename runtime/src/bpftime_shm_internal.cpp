@@ -9,6 +9,7 @@
 #include "spdlog/spdlog.h"
 #include <bpftime_shm_internal.hpp>
 #include <cstdio>
+#include <functional>
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <variant>
@@ -133,6 +134,80 @@ int bpftime_shm::bpf_map_get_next_key(int fd, const void *key, void *next_key,
 	return handler.bpf_map_get_next_key(key, next_key, from_userspace);
 }
 
+long bpftime_shm::bpf_map_lookup_elem_aggregated(int fd, const void *key,
+						 void *value) const
+{
+	if (!is_map_fd(fd)) {
+		errno = ENOENT;
+		return -1;
+	}
+	auto &handler =
+		std::get<bpftime::bpf_map_handler>(manager->get_handler(fd));
+	return handler.map_lookup_elem_aggregated(key, value);
+}
+
+int bpftime_shm::bpf_map_get_stats(int fd, bpf_map_stats *out) const
+{
+	if (!is_map_fd(fd)) {
+		errno = ENOENT;
+		return -1;
+	}
+	auto &handler =
+		std::get<bpftime::bpf_map_handler>(manager->get_handler(fd));
+	handler.map_get_stats(*out);
+	return 0;
+}
+
+int bpftime_shm::bpf_map_get_next_fd(int fd) const
+{
+	if (manager != nullptr) {
+		for (std::size_t i = fd < 0 ? 0 : fd + 1; i < manager->size();
+		     i++) {
+			if (is_map_fd(i))
+				return i;
+		}
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+int bpftime_shm::bpf_prog_get_next_fd(int fd) const
+{
+	if (manager != nullptr) {
+		for (std::size_t i = fd < 0 ? 0 : fd + 1; i < manager->size();
+		     i++) {
+			if (is_prog_fd(i))
+				return i;
+		}
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+void bpftime_shm::get_memory_usage(uint64_t *total_bytes,
+				   uint64_t *free_bytes) const
+{
+	if (total_bytes)
+		*total_bytes = segment.get_size();
+	if (free_bytes)
+		*free_bytes = segment.get_free_memory();
+}
+
+long bpftime_shm::bpf_map_update_elem_batch(int fd, const void *keys,
+					    const void *values, uint32_t count,
+					    uint64_t flags,
+					    bool from_userspace) const
+{
+	if (!is_map_fd(fd)) {
+		errno = ENOENT;
+		return -1;
+	}
+	auto &handler =
+		std::get<bpftime::bpf_map_handler>(manager->get_handler(fd));
+	return handler.map_update_elem_batch(keys, values, count, flags,
+					     from_userspace);
+}
+
 int bpftime_shm::add_uprobe(int fd, int pid, const char *name, uint64_t offset,
 			    bool retprobe, size_t ref_ctr_off)
 {
@@ -247,8 +322,7 @@ int bpftime_shm::add_software_perf_event_to_epoll(int swpe_fd, int epoll_fd,
 	}
 	if (auto ptr = perf_handler.try_get_software_perf_data_weak_ptr();
 	    ptr.has_value()) {
-		epoll_inst.files.emplace_back(ptr.value(), extra_data);
-		return 0;
+		return epoll_inst.add_file(ptr.value(), extra_data);
 	} else {
 		spdlog::error(
 			"Expected perf handler {} to have software perf event data",
@@ -278,8 +352,9 @@ int bpftime_shm::add_ringbuf_to_epoll(int ringbuf_fd, int epoll_fd,
 
 	auto ringbuf_map_impl = map_inst.try_get_ringbuf_map_impl();
 	if (ringbuf_map_impl.has_value(); auto val = ringbuf_map_impl.value()) {
-		epoll_inst.files.emplace_back(val->create_impl_weak_ptr(),
-					      extra_data);
+		if (epoll_inst.add_file(val->create_impl_weak_ptr(),
+					extra_data) < 0)
+			return -1;
 		spdlog::debug("Ringbuf {} added to epoll {}", ringbuf_fd,
 			      epoll_fd);
 		return 0;
@@ -333,7 +408,8 @@ bool bpftime_shm::is_ringbuf_map_fd(int fd) const
 	if (!is_map_fd(fd))
 		return false;
 	auto &map_impl = std::get<bpf_map_handler>(manager->get_handler(fd));
-	return map_impl.type == bpf_map_type::BPF_MAP_TYPE_RINGBUF;
+	return map_impl.type == bpf_map_type::BPF_MAP_TYPE_RINGBUF ||
+	       map_impl.type == bpf_map_type::BPF_MAP_TYPE_USER_RINGBUF;
 }
 bool bpftime_shm::is_shared_perf_event_array_map_fd(int fd) const
 {
@@ -371,6 +447,16 @@ bpftime_shm::try_get_array_map_impl(int fd) const
 	auto &map_handler = std::get<bpf_map_handler>(manager->get_handler(fd));
 	return map_handler.try_get_array_map_impl();
 }
+std::optional<double_buffered_hash_map_impl *>
+bpftime_shm::try_get_double_buffered_hash_map_impl(int fd) const
+{
+	if (!is_map_fd(fd)) {
+		spdlog::error("Expected fd {} to be a map fd", fd);
+		return {};
+	}
+	auto &map_handler = std::get<bpf_map_handler>(manager->get_handler(fd));
+	return map_handler.try_get_double_buffered_hash_map_impl();
+}
 bool bpftime_shm::is_prog_fd(int fd) const
 {
 	if (manager == nullptr || fd < 0 ||
@@ -546,6 +632,9 @@ bpftime_shm::bpftime_shm(const char *shm_name, shm_open_type type)
 			"NOT creating global shm. This is only for testing purpose.");
 		return;
 	}
+	// Programs of this process may signal eventfds of consumers in other
+	// processes
+	eventfd_notifier::start_fetcher();
 
 #if BPFTIME_ENABLE_MPK
 	// init mpk key
@@ -605,10 +694,61 @@ const handler_manager *bpftime_shm::get_manager() const
 
 bool bpftime_shm::is_perf_event_handler_fd(int fd) const
 {
+	// Empty slots of perf event arrays are -1
+	if (manager == nullptr || fd < 0 ||
+	    (std::size_t)fd >= manager->size())
+		return false;
 	auto &handler = get_handler(fd);
 	return std::holds_alternative<bpf_perf_event_handler>(handler);
 }
 
+// Find the eventfd notifier of a ringbuf map or a software perf event, and a
+// function telling whether there is data to consume
+static eventfd_notifier *
+find_eventfd_notifier(const bpftime_shm &shm, int fd,
+		      std::function<bool()> &has_data)
+{
+	if (shm.is_ringbuf_map_fd(fd)) {
+		auto impl = shm.try_get_ringbuf_map_impl(fd).value();
+		has_data = [=]() { return impl->has_data(); };
+		return &impl->get_eventfd_notifier();
+	}
+	if (shm.is_software_perf_event_handler_fd(fd)) {
+		auto &handler =
+			std::get<bpf_perf_event_handler>(shm.get_handler(fd));
+		if (handler.sw_perf.has_value()) {
+			auto data = &*handler.sw_perf.value();
+			has_data = [=]() { return data->has_data(); };
+			return &data->efd_notifier;
+		}
+	}
+	spdlog::error(
+		"Expected fd {} to be a ringbuf map or a software perf event",
+		fd);
+	errno = EINVAL;
+	return nullptr;
+}
+
+int bpftime_shm::enable_eventfd_notification(int fd) const
+{
+	std::function<bool()> has_data;
+	auto notifier = find_eventfd_notifier(*this, fd, has_data);
+	if (!notifier)
+		return -1;
+	return notifier->enable();
+}
+
+int bpftime_shm::arm_eventfd_notification(int fd) const
+{
+	std::function<bool()> has_data;
+	auto notifier = find_eventfd_notifier(*this, fd, has_data);
+	if (!notifier)
+		return -1;
+	notifier->arm();
+	// Records published before arming won't signal the eventfd
+	return has_data() ? 1 : 0;
+}
+
 bool bpftime_shm::is_software_perf_event_handler_fd(int fd) const
 {
 	if (!is_perf_event_handler_fd(fd))
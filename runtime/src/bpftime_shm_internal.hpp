@@ -79,6 +79,8 @@ class bpftime_shm {
 	try_get_ringbuf_map_impl(int fd) const;
 
 	std::optional<array_map_impl *> try_get_array_map_impl(int fd) const;
+	std::optional<double_buffered_hash_map_impl *>
+	try_get_double_buffered_hash_map_impl(int fd) const;
 	bool is_prog_fd(int fd) const;
 
 	bool is_perf_fd(int fd) const;
@@ -107,6 +109,25 @@ class bpftime_shm {
 	int bpf_map_get_next_key(int fd, const void *key, void *next_key,
 				 bool from_userspace) const;
 
+	long bpf_map_lookup_elem_aggregated(int fd, const void *key,
+					    void *value) const;
+
+	int bpf_map_get_stats(int fd, bpf_map_stats *out) const;
+
+	// find the next map fd after `fd`, or -1 if there is none
+	int bpf_map_get_next_fd(int fd) const;
+	// find the next prog fd after `fd`, or -1 if there is none
+	int bpf_prog_get_next_fd(int fd) const;
+
+	// get the total size and the free bytes of the segment
+	void get_memory_usage(uint64_t *total_bytes,
+			      uint64_t *free_bytes) const;
+
+	long bpf_map_update_elem_batch(int fd, const void *keys,
+				       const void *values, uint32_t count,
+				       uint64_t flags,
+				       bool from_userspace) const;
+
 	// create an uprobe fd
 	int add_uprobe(int fd, int pid, const char *name, uint64_t offset,
 		       bool retprobe, size_t ref_ctr_off);
@@ -131,6 +152,13 @@ class bpftime_shm {
 	int add_software_perf_event_to_epoll(int swpe_fd, int epoll_fd,
 					     epoll_data_t extra_data);
 
+	// Let the ringbuf map or the software perf event `fd` signal an eventfd
+	// owned by the calling process. Returns the eventfd
+	int enable_eventfd_notification(int fd) const;
+	// Ask producers of `fd` to signal its eventfd on the next record.
+	// Returns 1 if there is data already, so the caller shouldn't sleep
+	int arm_eventfd_notification(int fd) const;
+
 	int epoll_create();
 	// remove a fake fd from the manager.
 	// The fake fd should be closed by the caller.
@@ -3,15 +3,21 @@
  * Copyright (c) 2022, eunomia-bpf org
  * All rights reserved.
  */
+#include "spdlog/spdlog.h"
+#include <algorithm>
+#include <chrono>
 #include <handler/epoll_handler.hpp>
 #include <sys/epoll.h>
 namespace bpftime
 {
 epoll_handler::epoll_handler(boost::interprocess::managed_shared_memory &memory)
-	: files(memory.get_segment_manager())
+	: files(memory.get_segment_manager()),
+	  ready_set(boost::interprocess::make_managed_shared_ptr(
+		  memory.construct<epoll_ready_set>(
+			  boost::interprocess::anonymous_instance)(),
+		  memory))
 
 {
-	epoll_event ev;
 }
 
 epoll_file::epoll_file(const file_ptr_variant &&ptr)
@@ -23,4 +29,124 @@ epoll_file::epoll_file(const file_ptr_variant &&ptr, epoll_data_t data)
 {
 }
 
+int epoll_handler::add_file(file_ptr_variant &&ptr,
+			    epoll_data_t data) const
+{
+	uint32_t idx = files.size();
+	int err = std::visit(
+		[&](auto &weak_ptr) -> int {
+			auto file = weak_ptr.lock();
+			if (!file)
+				return -1;
+			if constexpr (std::is_same_v<
+					      std::decay_t<decltype(weak_ptr)>,
+					      ringbuf_weak_ptr>) {
+				return file->get_watchers().add(ready_set,
+								idx);
+			} else {
+				return file->watchers.add(ready_set, idx);
+			}
+		},
+		ptr);
+	if (err < 0) {
+		spdlog::error(
+			"Unable to add file to epoll, it's either closed or watched by too many epoll instances");
+		errno = ENOSPC;
+		return -1;
+	}
+	files.emplace_back(std::move(ptr), data);
+	// Look at it on the next wait, since it may already have data
+	if (idx < epoll_ready_set::MAX_FILES)
+		ready_set->set_ready(idx);
+	return 0;
+}
+
+void epoll_handler::remove_files() const
+{
+	for (auto &file : files) {
+		std::visit(
+			[&](auto &weak_ptr) {
+				auto ptr = weak_ptr.lock();
+				if (!ptr)
+					return;
+				if constexpr (std::is_same_v<
+						      std::decay_t<
+							      decltype(weak_ptr)>,
+						      ringbuf_weak_ptr>) {
+					ptr->get_watchers().remove(
+						ready_set.get().get());
+				} else {
+					ptr->watchers.remove(
+						ready_set.get().get());
+				}
+			},
+			file.file);
+	}
+	files.clear();
+}
+
+// Check whether the file has data. Returns false if it was closed
+static bool file_has_data(const epoll_file &file)
+{
+	return std::visit(
+		[](auto &weak_ptr) -> bool {
+			auto ptr = weak_ptr.lock();
+			return ptr && ptr->has_data();
+		},
+		file.file);
+}
+
+int epoll_handler::wait(epoll_event *out_evts, int max_evt, int timeout) const
+{
+	using namespace std::chrono;
+	auto deadline = steady_clock::now() + milliseconds(timeout);
+	auto &set = *ready_set;
+	while (true) {
+		// Register as a waiter before taking the bits, so that no
+		// wakeup could be missed between the scan and the sleep
+		set.notifier.add_waiter();
+		uint32_t seq = set.notifier.current_seq();
+		int next_id = 0;
+		const auto check_file = [&](uint32_t idx) {
+			if (next_id >= max_evt || !file_has_data(files[idx]))
+				return false;
+			out_evts[next_id++] = epoll_event{
+				.events = EPOLLIN, .data = files[idx].data
+			};
+			return true;
+		};
+		uint32_t file_cnt = files.size();
+		uint32_t tracked_cnt =
+			std::min(file_cnt, epoll_ready_set::MAX_FILES);
+		for (uint32_t word = 0; word * 64 < tracked_cnt; word++) {
+			for (uint64_t bits = set.take_word(word); bits;
+			     bits &= bits - 1) {
+				uint32_t idx = word * 64 + __builtin_ctzll(bits);
+				if (idx >= file_cnt)
+					continue;
+				// Epoll is level triggered, so look at it
+				// again next time, until it's drained. Files
+				// not checked for lack of room are kept too
+				if (next_id >= max_evt || check_file(idx))
+					set.set_ready(idx);
+			}
+		}
+		for (uint32_t idx = tracked_cnt; idx < file_cnt; idx++)
+			check_file(idx);
+		// A negative timeout means waiting forever
+		int remaining = -1;
+		if (timeout >= 0) {
+			remaining = std::max<int64_t>(
+				0, duration_cast<milliseconds>(
+					   deadline - steady_clock::now())
+					   .count());
+		}
+		if (next_id == 0 && remaining != 0)
+			futex_notifier_wait(&set.notifier, seq, remaining);
+		set.notifier.remove_waiter();
+		if (next_id > 0 || remaining == 0)
+			return next_id;
+	}
+}
+
 } // namespace bpftime
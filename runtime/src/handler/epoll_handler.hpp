@@ -8,6 +8,7 @@
 #include "handler/perf_event_handler.hpp"
 #include <boost/interprocess/allocators/allocator.hpp>
 #include <boost/interprocess/containers/vector.hpp>
+#include <bpf_map/epoll_ready_set.hpp>
 #include <bpf_map/userspace/ringbuf_map.hpp>
 #include <sys/epoll.h>
 #include <variant>
@@ -27,7 +28,17 @@ using file_vector = boost::interprocess::vector<epoll_file, file_allocator>;
 struct epoll_handler {
     public:
 	mutable file_vector files;
+	// Which files have got data since the last wait
+	epoll_ready_set_shared_ptr ready_set;
 	epoll_handler(boost::interprocess::managed_shared_memory &memory);
+	// Add a ring buffer or a perf buffer, and register this instance to
+	// be notified by its producers
+	int add_file(file_ptr_variant &&ptr, epoll_data_t data) const;
+	// Unregister this instance from the producers of all files, before
+	// it's closed
+	void remove_files() const;
+	// Wait for files with data, with the semantics of epoll_wait
+	int wait(epoll_event *out_evts, int max_evt, int timeout) const;
 };
 } // namespace bpftime
 #endif
@@ -48,7 +48,12 @@ int handler_manager::set_handler(int fd, handler_variant &&handler,
 	}
 	handlers[fd] = std::move(handler);
 	if (std::holds_alternative<bpf_map_handler>(handlers[fd])) {
-		std::get<bpf_map_handler>(handlers[fd]).map_init(memory);
+		if (int err = std::get<bpf_map_handler>(handlers[fd])
+				      .map_init(memory);
+		    err < 0) {
+			handlers[fd] = unused_handler();
+			return err;
+		}
 	}
 	return fd;
 }
@@ -66,8 +71,11 @@ void handler_manager::clear_fd_at(int fd, managed_shared_memory &memory)
 	if (fd < 0 || (std::size_t)fd >= handlers.size()) {
 		return;
 	}
+	__atomic_fetch_add(&generation, 1, __ATOMIC_ACQ_REL);
 	if (std::holds_alternative<bpf_map_handler>(handlers[fd])) {
 		std::get<bpf_map_handler>(handlers[fd]).map_free(memory);
+	} else if (std::holds_alternative<epoll_handler>(handlers[fd])) {
+		std::get<epoll_handler>(handlers[fd]).remove_files();
 	} else if (std::holds_alternative<bpf_perf_event_handler>(
 			   handlers[fd])) {
 		// Clean attached programs..
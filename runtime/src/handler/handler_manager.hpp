@@ -115,6 +115,13 @@ class handler_manager {
 
 	void clear_all(managed_shared_memory &memory);
 
+	// Bumped each time a handler is closed, so that pointers into handlers
+	// cached by other processes could be checked for staleness
+	uint64_t get_generation() const
+	{
+		return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+	}
+
 	handler_manager(const handler_manager &) = delete;
 	handler_manager(handler_manager &&) noexcept = default;
 	handler_manager &operator=(const handler_manager &) = delete;
@@ -122,6 +129,7 @@ class handler_manager {
 
     private:
 	handler_variant_vector handlers;
+	uint64_t generation = 0;
 };
 
 } // namespace bpftime
@@ -10,12 +10,17 @@
 #include <handler/map_handler.hpp>
 #include <bpf_map/userspace/array_map.hpp>
 #include <bpf_map/userspace/hash_map.hpp>
+#include <bpf_map/userspace/double_buffered_hash_map.hpp>
 #include <bpf_map/userspace/ringbuf_map.hpp>
 #include <bpf_map/shared/array_map_kernel_user.hpp>
 #include <bpf_map/shared/hash_map_kernel_user.hpp>
 #include <bpf_map/shared/percpu_array_map_kernel_user.hpp>
 #include <bpf_map/shared/perf_event_array_kernel_user.hpp>
 #include <unistd.h>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <vector>
 
 using boost::interprocess::interprocess_sharable_mutex;
 using boost::interprocess::scoped_lock;
@@ -39,10 +44,19 @@ uint32_t bpf_map_handler::get_value_size() const
 std::optional<ringbuf_map_impl *>
 bpf_map_handler::try_get_ringbuf_map_impl() const
 {
-	if (type != bpf_map_type::BPF_MAP_TYPE_RINGBUF)
+	if (type != bpf_map_type::BPF_MAP_TYPE_RINGBUF &&
+	    type != bpf_map_type::BPF_MAP_TYPE_USER_RINGBUF)
 		return {};
 	return static_cast<ringbuf_map_impl *>(map_impl_ptr.get());
 }
+std::optional<double_buffered_hash_map_impl *>
+bpf_map_handler::try_get_double_buffered_hash_map_impl() const
+{
+	if (type != bpf_map_type::BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH)
+		return {};
+	return static_cast<double_buffered_hash_map_impl *>(
+		map_impl_ptr.get());
+}
 std::optional<array_map_impl *> bpf_map_handler::try_get_array_map_impl() const
 {
 	if (type != bpf_map_type::BPF_MAP_TYPE_ARRAY)
@@ -54,22 +68,28 @@ const void *bpf_map_handler::map_lookup_elem(const void *key,
 					     bool from_userspace) const
 {
 	const auto do_lookup = [&](auto *impl) -> const void * {
+		const void *ret;
 		if (impl->should_lock) {
 			sharable_lock<interprocess_sharable_mutex> guard(
 				*map_mutex);
-			return impl->elem_lookup(key);
+			ret = impl->elem_lookup(key);
 		} else {
-			return impl->elem_lookup(key);
+			ret = impl->elem_lookup(key);
 		}
+		count_lookup(ret != nullptr);
+		return ret;
 	};
 	const auto do_lookup_userspace = [&](auto *impl) -> const void * {
+		const void *ret;
 		if (impl->should_lock) {
 			sharable_lock<interprocess_sharable_mutex> guard(
 				*map_mutex);
-			return impl->elem_lookup_userspace(key);
+			ret = impl->elem_lookup_userspace(key);
 		} else {
-			return impl->elem_lookup_userspace(key);
+			ret = impl->elem_lookup_userspace(key);
 		}
+		count_lookup(ret != nullptr);
+		return ret;
 	};
 
 	switch (type) {
@@ -81,7 +101,8 @@ const void *bpf_map_handler::map_lookup_elem(const void *key,
 		auto impl = static_cast<array_map_impl *>(map_impl_ptr.get());
 		return do_lookup(impl);
 	}
-	case bpf_map_type::BPF_MAP_TYPE_RINGBUF: {
+	case bpf_map_type::BPF_MAP_TYPE_RINGBUF:
+	case bpf_map_type::BPF_MAP_TYPE_USER_RINGBUF: {
 		auto impl = static_cast<ringbuf_map_impl *>(map_impl_ptr.get());
 		return do_lookup(impl);
 	}
@@ -122,6 +143,12 @@ const void *bpf_map_handler::map_lookup_elem(const void *key,
 			map_impl_ptr.get());
 		return do_lookup(impl);
 	}
+	case bpf_map_type::BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH: {
+		auto impl = static_cast<double_buffered_hash_map_impl *>(
+			map_impl_ptr.get());
+		return from_userspace ? do_lookup_userspace(impl) :
+					do_lookup(impl);
+	}
 	default:
 		assert(false && "Unsupported map type");
 	}
@@ -132,23 +159,29 @@ long bpf_map_handler::map_update_elem(const void *key, const void *value,
 				      uint64_t flags, bool from_userspace) const
 {
 	const auto do_update = [&](auto *impl) -> long {
+		long ret;
 		if (impl->should_lock) {
 			scoped_lock<interprocess_sharable_mutex> guard(
 				*map_mutex);
-			return impl->elem_update(key, value, flags);
+			ret = impl->elem_update(key, value, flags);
 		} else {
-			return impl->elem_update(key, value, flags);
+			ret = impl->elem_update(key, value, flags);
 		}
+		count_update(ret == 0);
+		return ret;
 	};
 
 	const auto do_update_userspace = [&](auto *impl) -> long {
+		long ret;
 		if (impl->should_lock) {
 			scoped_lock<interprocess_sharable_mutex> guard(
 				*map_mutex);
-			return impl->elem_update_userspace(key, value, flags);
+			ret = impl->elem_update_userspace(key, value, flags);
 		} else {
-			return impl->elem_update_userspace(key, value, flags);
+			ret = impl->elem_update_userspace(key, value, flags);
 		}
+		count_update(ret == 0);
+		return ret;
 	};
 	switch (type) {
 	case bpf_map_type::BPF_MAP_TYPE_HASH: {
@@ -159,7 +192,8 @@ long bpf_map_handler::map_update_elem(const void *key, const void *value,
 		auto impl = static_cast<array_map_impl *>(map_impl_ptr.get());
 		return do_update(impl);
 	}
-	case bpf_map_type::BPF_MAP_TYPE_RINGBUF: {
+	case bpf_map_type::BPF_MAP_TYPE_RINGBUF:
+	case bpf_map_type::BPF_MAP_TYPE_USER_RINGBUF: {
 		auto impl = static_cast<ringbuf_map_impl *>(map_impl_ptr.get());
 		return do_update(impl);
 	}
@@ -200,6 +234,12 @@ long bpf_map_handler::map_update_elem(const void *key, const void *value,
 			map_impl_ptr.get());
 		return do_update(impl);
 	}
+	case bpf_map_type::BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH: {
+		auto impl = static_cast<double_buffered_hash_map_impl *>(
+			map_impl_ptr.get());
+		return from_userspace ? do_update_userspace(impl) :
+					do_update(impl);
+	}
 	default:
 		assert(false && "Unsupported map type");
 	}
@@ -218,6 +258,15 @@ int bpf_map_handler::bpf_map_get_next_key(const void *key, void *next_key,
 			return impl->map_get_next_key(key, next_key);
 		}
 	};
+	const auto do_get_next_key_userspace = [&](auto *impl) -> int {
+		if (impl->should_lock) {
+			sharable_lock<interprocess_sharable_mutex> guard(
+				*map_mutex);
+			return impl->map_get_next_key_userspace(key, next_key);
+		} else {
+			return impl->map_get_next_key_userspace(key, next_key);
+		}
+	};
 	switch (type) {
 	case bpf_map_type::BPF_MAP_TYPE_HASH: {
 		auto impl = static_cast<hash_map_impl *>(map_impl_ptr.get());
@@ -227,7 +276,8 @@ int bpf_map_handler::bpf_map_get_next_key(const void *key, void *next_key,
 		auto impl = static_cast<array_map_impl *>(map_impl_ptr.get());
 		return do_get_next_key(impl);
 	}
-	case bpf_map_type::BPF_MAP_TYPE_RINGBUF: {
+	case bpf_map_type::BPF_MAP_TYPE_RINGBUF:
+	case bpf_map_type::BPF_MAP_TYPE_USER_RINGBUF: {
 		auto impl = static_cast<ringbuf_map_impl *>(map_impl_ptr.get());
 		return do_get_next_key(impl);
 	}
@@ -266,6 +316,12 @@ int bpf_map_handler::bpf_map_get_next_key(const void *key, void *next_key,
 			map_impl_ptr.get());
 		return do_get_next_key(impl);
 	}
+	case bpf_map_type::BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH: {
+		auto impl = static_cast<double_buffered_hash_map_impl *>(
+			map_impl_ptr.get());
+		return from_userspace ? do_get_next_key_userspace(impl) :
+					do_get_next_key(impl);
+	}
 	default:
 		assert(false && "Unsupported map type");
 	}
@@ -303,7 +359,8 @@ long bpf_map_handler::map_delete_elem(const void *key,
 		auto impl = static_cast<array_map_impl *>(map_impl_ptr.get());
 		return do_delete(impl);
 	}
-	case bpf_map_type::BPF_MAP_TYPE_RINGBUF: {
+	case bpf_map_type::BPF_MAP_TYPE_RINGBUF:
+	case bpf_map_type::BPF_MAP_TYPE_USER_RINGBUF: {
 		auto impl = static_cast<ringbuf_map_impl *>(map_impl_ptr.get());
 		return do_delete(impl);
 	}
@@ -344,28 +401,281 @@ long bpf_map_handler::map_delete_elem(const void *key,
 			map_impl_ptr.get());
 		return do_delete(impl);
 	}
+	case bpf_map_type::BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH: {
+		auto impl = static_cast<double_buffered_hash_map_impl *>(
+			map_impl_ptr.get());
+		return from_userspace ? do_delete_userspace(impl) :
+					do_delete(impl);
+	}
 	default:
 		assert(false && "Unsupported map type");
 	}
 	return 0;
 }
 
-int bpf_map_handler::map_init(managed_shared_memory &memory)
+long bpf_map_handler::map_update_elem_batch(const void *keys,
+					    const void *values, uint32_t count,
+					    uint64_t flags,
+					    bool from_userspace) const
+{
+	const uint32_t curr_value_size =
+		from_userspace ? get_value_size() : value_size;
+	const auto key_at = [&](uint32_t i) -> const void * {
+		return (const uint8_t *)keys + (size_t)i * key_size;
+	};
+	const auto value_at = [&](uint32_t i) -> const void * {
+		return (const uint8_t *)values + (size_t)i * curr_value_size;
+	};
+	// Per-cpu maps have different semantics for userspace accesses, so
+	// pick the matching variant if the implementation provides one
+	const auto lookup_one = [&](auto *impl, const void *key) -> void * {
+		if constexpr (requires { impl->elem_lookup_userspace(key); }) {
+			if (from_userspace)
+				return impl->elem_lookup_userspace(key);
+		}
+		return impl->elem_lookup(key);
+	};
+	const auto update_one = [&](auto *impl, const void *key,
+				    const void *value, uint64_t elem_flags) -> long {
+		if constexpr (requires {
+				      impl->elem_update_userspace(key, value,
+								  elem_flags);
+			      }) {
+			if (from_userspace)
+				return impl->elem_update_userspace(
+					key, value, elem_flags);
+		}
+		return impl->elem_update(key, value, elem_flags);
+	};
+	const auto delete_one = [&](auto *impl, const void *key) -> long {
+		if constexpr (requires { impl->elem_delete_userspace(key); }) {
+			if (from_userspace)
+				return impl->elem_delete_userspace(key);
+		}
+		return impl->elem_delete(key);
+	};
+	const auto do_update_batch = [&](auto *impl) -> long {
+		// Always take the exclusive lock, so that no other update could
+		// be interleaved with this batch. Implementations that don't
+		// need the lock are still read and written by programs
+		// concurrently, which may see the batch half applied
+		scoped_lock<interprocess_sharable_mutex> guard(*map_mutex);
+		// Previous values of the updated keys, used for rolling back.
+		// An empty optional means that the key didn't exist
+		std::vector<std::optional<std::vector<uint8_t> > > old_values;
+		old_values.reserve(count);
+		for (uint32_t i = 0; i < count; i++) {
+			auto old = (const uint8_t *)lookup_one(impl, key_at(i));
+			if (old) {
+				old_values.emplace_back(std::vector<uint8_t>(
+					old, old + curr_value_size));
+			} else {
+				old_values.emplace_back();
+			}
+			if (update_one(impl, key_at(i), value_at(i), flags) ==
+			    0)
+				continue;
+			int err = errno;
+			spdlog::debug(
+				"Batch update of map {} failed at element {}, rolling back",
+				name.c_str(), i);
+			// Roll back in reverse order, so that duplicated keys
+			// end up with their original values
+			uint32_t failed_restores = 0;
+			for (uint32_t j = i; j-- > 0;) {
+				long ret;
+				if (old_values[j].has_value()) {
+					ret = update_one(impl, key_at(j),
+							 old_values[j]->data(),
+							 0);
+				} else {
+					ret = delete_one(impl, key_at(j));
+				}
+				failed_restores += ret != 0;
+			}
+			count_update(false, i + 1);
+			if (failed_restores != 0) {
+				// The map is left with a part of the batch,
+				// which the caller must not take as untouched
+				spdlog::error(
+					"Unable to roll back {} of {} elements of map {} after a failed batch update",
+					failed_restores, i, name.c_str());
+				err = EIO;
+			}
+			errno = err;
+			return -1;
+		}
+		count_update(true, count);
+		return 0;
+	};
+	switch (type) {
+	case bpf_map_type::BPF_MAP_TYPE_HASH: {
+		auto impl = static_cast<hash_map_impl *>(map_impl_ptr.get());
+		return do_update_batch(impl);
+	}
+	case bpf_map_type::BPF_MAP_TYPE_ARRAY: {
+		auto impl = static_cast<array_map_impl *>(map_impl_ptr.get());
+		return do_update_batch(impl);
+	}
+	case bpf_map_type::BPF_MAP_TYPE_PERF_EVENT_ARRAY: {
+		auto impl = static_cast<perf_event_array_map_impl *>(
+			map_impl_ptr.get());
+		return do_update_batch(impl);
+	}
+	case bpf_map_type::BPF_MAP_TYPE_PERCPU_ARRAY: {
+		auto impl = static_cast<per_cpu_array_map_impl *>(
+			map_impl_ptr.get());
+		return do_update_batch(impl);
+	}
+	case bpf_map_type::BPF_MAP_TYPE_PERCPU_HASH: {
+		auto impl = static_cast<per_cpu_hash_map_impl *>(
+			map_impl_ptr.get());
+		return do_update_batch(impl);
+	}
+	case bpf_map_type::BPF_MAP_TYPE_KERNEL_USER_ARRAY: {
+		auto impl = static_cast<array_map_kernel_user_impl *>(
+			map_impl_ptr.get());
+		return do_update_batch(impl);
+	}
+	case bpf_map_type::BPF_MAP_TYPE_KERNEL_USER_HASH: {
+		auto impl = static_cast<hash_map_kernel_user_impl *>(
+			map_impl_ptr.get());
+		return do_update_batch(impl);
+	}
+	case bpf_map_type::BPF_MAP_TYPE_KERNEL_USER_PERCPU_ARRAY: {
+		auto impl = static_cast<percpu_array_map_kernel_user_impl *>(
+			map_impl_ptr.get());
+		return do_update_batch(impl);
+	}
+	case bpf_map_type::BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH: {
+		auto impl = static_cast<double_buffered_hash_map_impl *>(
+			map_impl_ptr.get());
+		return do_update_batch(impl);
+	}
+	default:
+		spdlog::error("Batch update is not supported by map type {}",
+			      (int)type);
+		errno = ENOTSUP;
+		return -1;
+	}
+	return 0;
+}
+
+long bpf_map_handler::map_lookup_elem_aggregated(const void *key,
+						 void *value) const
+{
+	switch (type) {
+	case bpf_map_type::BPF_MAP_TYPE_PERCPU_ARRAY: {
+		auto impl = static_cast<per_cpu_array_map_impl *>(
+			map_impl_ptr.get());
+		return impl->elem_lookup_aggregated_userspace(key, value);
+	}
+	case bpf_map_type::BPF_MAP_TYPE_PERCPU_HASH: {
+		auto impl = static_cast<per_cpu_hash_map_impl *>(
+			map_impl_ptr.get());
+		return impl->elem_lookup_aggregated_userspace(key, value);
+	}
+	default:
+		spdlog::error(
+			"Aggregated lookup is only supported by per cpu maps, not {}",
+			(int)type);
+		errno = ENOTSUP;
+		return -1;
+	}
+	return 0;
+}
+
+void bpf_map_handler::count_lookup(bool hit) const
+{
+#if BPFTIME_ENABLE_MAP_STATS
+	if (!stats_slots)
+		return;
+	auto &slot = stats_slots[(unsigned)sched_getcpu() % stats_slot_count];
+	// Threads may migrate between cpus, so the counters still need
+	// atomic adds, though they are almost never contended
+	__atomic_fetch_add(&slot.lookups, 1, __ATOMIC_RELAXED);
+	if (!hit)
+		__atomic_fetch_add(&slot.lookup_misses, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+void bpf_map_handler::count_update(bool success, uint32_t count) const
+{
+#if BPFTIME_ENABLE_MAP_STATS
+	if (!stats_slots)
+		return;
+	auto &slot = stats_slots[(unsigned)sched_getcpu() % stats_slot_count];
+	__atomic_fetch_add(&slot.updates, count, __ATOMIC_RELAXED);
+	if (!success)
+		__atomic_fetch_add(&slot.update_failures, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+void bpf_map_handler::map_get_stats(bpf_map_stats &out) const
+{
+	out = bpf_map_stats();
+	for (uint32_t i = 0; i < stats_slot_count; i++) {
+		const auto &slot = stats_slots[i];
+		out.lookups += __atomic_load_n(&slot.lookups, __ATOMIC_RELAXED);
+		out.lookup_misses +=
+			__atomic_load_n(&slot.lookup_misses, __ATOMIC_RELAXED);
+		out.updates += __atomic_load_n(&slot.updates, __ATOMIC_RELAXED);
+		out.update_failures += __atomic_load_n(&slot.update_failures,
+						       __ATOMIC_RELAXED);
+	}
+	out.bytes_used = init_bytes;
+	// Hash maps allocate elements on demand, and large arrays commit pages
+	// of their backing objects on demand
+	switch (type) {
+	case bpf_map_type::BPF_MAP_TYPE_ARRAY: {
+		auto impl = static_cast<array_map_impl *>(map_impl_ptr.get());
+		out.bytes_used += impl->memory_usage();
+		break;
+	}
+	case bpf_map_type::BPF_MAP_TYPE_HASH: {
+		auto impl = static_cast<hash_map_impl *>(map_impl_ptr.get());
+		sharable_lock<interprocess_sharable_mutex> guard(*map_mutex);
+		out.bytes_used += impl->memory_usage();
+		break;
+	}
+	case bpf_map_type::BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH: {
+		auto impl = static_cast<double_buffered_hash_map_impl *>(
+			map_impl_ptr.get());
+		out.bytes_used += impl->memory_usage();
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+int bpf_map_handler::create_map_impl(managed_shared_memory &memory)
 {
 	auto container_name = get_container_name();
 	switch (type) {
 	case bpf_map_type::BPF_MAP_TYPE_HASH: {
 		map_impl_ptr = memory.construct<hash_map_impl>(
 			container_name.c_str())(memory, key_size, value_size);
+		// Elements and buckets are counted by memory_usage
+		init_bytes = sizeof(hash_map_impl);
 		return 0;
 	}
 	case bpf_map_type::BPF_MAP_TYPE_ARRAY: {
-		map_impl_ptr = memory.construct<array_map_impl>(
+		auto impl = memory.construct<array_map_impl>(
 			container_name.c_str())(memory, value_size,
 						max_entries);
+		map_impl_ptr = impl;
+		// Pages of sparse backing objects are counted by memory_usage
+		init_bytes = sizeof(array_map_impl) +
+			     (impl->is_sparse() ?
+				      0 :
+				      (uint64_t)value_size * max_entries);
 		return 0;
 	}
-	case bpf_map_type::BPF_MAP_TYPE_RINGBUF: {
+	case bpf_map_type::BPF_MAP_TYPE_RINGBUF:
+	// Same layout as ringbuf, but produced by userspace and consumed by
+	// programs
+	case bpf_map_type::BPF_MAP_TYPE_USER_RINGBUF: {
 		auto max_ent = max_entries;
 		int pop_cnt = 0;
 		while (max_ent) {
@@ -379,34 +689,66 @@ int bpf_map_handler::map_init(managed_shared_memory &memory)
 			return -1;
 		}
 		map_impl_ptr = memory.construct<ringbuf_map_impl>(
-			container_name.c_str())(max_entries, memory);
+			container_name.c_str())(
+			max_entries, memory,
+			(flags & BPFTIME_F_RB_OVERWRITE) != 0);
+		init_bytes = sizeof(ringbuf_map_impl) + sizeof(ringbuf) +
+			     getpagesize() * 2 + (uint64_t)max_entries * 2;
 		return 0;
 	}
 	case bpf_map_type::BPF_MAP_TYPE_PERF_EVENT_ARRAY: {
 		map_impl_ptr = memory.construct<perf_event_array_map_impl>(
 			container_name.c_str())(memory, key_size, value_size,
 						max_entries);
+		init_bytes = sizeof(perf_event_array_map_impl) +
+			     sizeof(int32_t) * (uint64_t)max_entries;
 		return 0;
 	}
 	case bpf_map_type::BPF_MAP_TYPE_PERCPU_ARRAY: {
 		map_impl_ptr = memory.construct<per_cpu_array_map_impl>(
 			container_name.c_str())(memory, value_size,
 						max_entries);
+		init_bytes = sizeof(per_cpu_array_map_impl) +
+			     (uint64_t)value_size * max_entries *
+				     sysconf(_SC_NPROCESSORS_ONLN);
 		return 0;
 	}
 	case bpf_map_type::BPF_MAP_TYPE_PERCPU_HASH: {
+		// All slots are allocated up front, so make sure they fit
+		if (max_entries > per_cpu_hash_map_impl::MAX_ENTRIES) {
+			spdlog::error(
+				"Failed to create per cpu hash map, max_entries {} exceeds {}",
+				max_entries,
+				per_cpu_hash_map_impl::MAX_ENTRIES);
+			errno = E2BIG;
+			return -E2BIG;
+		}
+		auto size = per_cpu_hash_map_impl::memory_needed(
+			key_size, value_size, max_entries,
+			sysconf(_SC_NPROCESSORS_ONLN));
+		if (size > memory.get_free_memory()) {
+			spdlog::error(
+				"Failed to create per cpu hash map, {} bytes needed but only {} bytes free in the shared memory",
+				size, memory.get_free_memory());
+			errno = ENOMEM;
+			return -ENOMEM;
+		}
 		map_impl_ptr = memory.construct<per_cpu_hash_map_impl>(
-			container_name.c_str())(memory, key_size, value_size);
+			container_name.c_str())(memory, key_size, value_size,
+						max_entries);
+		init_bytes = size;
 		return 0;
 	}
 	case bpf_map_type::BPF_MAP_TYPE_KERNEL_USER_ARRAY: {
 		map_impl_ptr = memory.construct<array_map_kernel_user_impl>(
 			container_name.c_str())(memory, attr.kernel_bpf_map_id);
+		init_bytes = sizeof(array_map_kernel_user_impl);
 		return 0;
 	}
 	case bpf_map_type::BPF_MAP_TYPE_KERNEL_USER_HASH: {
 		map_impl_ptr = memory.construct<hash_map_kernel_user_impl>(
 			container_name.c_str())(memory, attr.kernel_bpf_map_id);
+		init_bytes = sizeof(hash_map_kernel_user_impl);
 		return 0;
 	}
 	case bpf_map_type::BPF_MAP_TYPE_KERNEL_USER_PERCPU_ARRAY: {
@@ -414,6 +756,7 @@ int bpf_map_handler::map_init(managed_shared_memory &memory)
 			memory.construct<percpu_array_map_kernel_user_impl>(
 				container_name.c_str())(memory,
 							attr.kernel_bpf_map_id);
+		init_bytes = sizeof(percpu_array_map_kernel_user_impl);
 		return 0;
 	}
 	case bpf_map_type::BPF_MAP_TYPE_KERNEL_USER_PERF_EVENT_ARRAY: {
@@ -422,9 +765,17 @@ int bpf_map_handler::map_init(managed_shared_memory &memory)
 				container_name.c_str())(
 				memory, 4, 4, sysconf(_SC_NPROCESSORS_ONLN),
 				attr.kernel_bpf_map_id);
+		init_bytes = sizeof(perf_event_array_kernel_user_impl);
 		return 0;
 	}
 
+	case bpf_map_type::BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH: {
+		map_impl_ptr = memory.construct<double_buffered_hash_map_impl>(
+			container_name.c_str())(memory, key_size, value_size);
+		// Elements and buckets are counted by memory_usage
+		init_bytes = sizeof(double_buffered_hash_map_impl);
+		return 0;
+	}
 	default:
 		spdlog::error("Unsupported map type: {}", (int)type);
 		// assert(false && "Unsupported map type");
@@ -433,8 +784,38 @@ int bpf_map_handler::map_init(managed_shared_memory &memory)
 	return 0;
 }
 
+int bpf_map_handler::map_init(managed_shared_memory &memory)
+{
+	// Sizes of what each map allocates are recorded by create_map_impl,
+	// since the free memory also changes with allocations of others
+	if (int err = create_map_impl(memory); err < 0)
+		return err;
+#if BPFTIME_ENABLE_MAP_STATS
+	stats_slot_count = sysconf(_SC_NPROCESSORS_CONF);
+	auto size = sizeof(bpf_map_stats_slot) * stats_slot_count;
+	auto ptr = memory.allocate_aligned(size, alignof(bpf_map_stats_slot),
+					   std::nothrow);
+	if (ptr == nullptr) {
+		// Stats are not essential, so just go without them
+		spdlog::warn("Unable to allocate stats for map {}",
+			     name.c_str());
+		stats_slot_count = 0;
+	} else {
+		memset(ptr, 0, size);
+		stats_slots = static_cast<bpf_map_stats_slot *>(ptr);
+		init_bytes += size;
+	}
+#endif
+	return 0;
+}
+
 void bpf_map_handler::map_free(managed_shared_memory &memory)
 {
+	if (stats_slots) {
+		memory.deallocate(stats_slots.get());
+		stats_slots = nullptr;
+		stats_slot_count = 0;
+	}
 	auto container_name = get_container_name();
 	switch (type) {
 	case bpf_map_type::BPF_MAP_TYPE_HASH:
@@ -444,6 +825,7 @@ void bpf_map_handler::map_free(managed_shared_memory &memory)
 		memory.destroy<array_map_impl>(container_name.c_str());
 		break;
 	case bpf_map_type::BPF_MAP_TYPE_RINGBUF:
+	case bpf_map_type::BPF_MAP_TYPE_USER_RINGBUF:
 		memory.destroy<ringbuf_map_impl>(container_name.c_str());
 		break;
 	case bpf_map_type::BPF_MAP_TYPE_PERF_EVENT_ARRAY:
@@ -472,6 +854,10 @@ void bpf_map_handler::map_free(managed_shared_memory &memory)
 		memory.destroy<perf_event_array_kernel_user_impl>(
 			container_name.c_str());
 		break;
+	case bpf_map_type::BPF_MAP_TYPE_DOUBLE_BUFFERED_HASH:
+		memory.destroy<double_buffered_hash_map_impl>(
+			container_name.c_str());
+		break;
 	default:
 		assert(false && "Unsupported map type");
 	}
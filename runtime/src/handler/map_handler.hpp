@@ -6,6 +6,7 @@
 #ifndef _MAP_HANDLER
 #define _MAP_HANDLER
 #include "bpf_map/userspace/array_map.hpp"
+#include "bpf_map/userspace/double_buffered_hash_map.hpp"
 #include "bpf_map/userspace/ringbuf_map.hpp"
 #include "bpftime_shm.hpp"
 #include "spdlog/spdlog.h"
@@ -30,6 +31,15 @@ using boost_shm_string =
 using sharable_mutex_ptr = boost::interprocess::managed_unique_ptr<
 	boost::interprocess::interprocess_sharable_mutex,
 	boost::interprocess::managed_shared_memory>::type;
+// Operation counters of a map on a single cpu. Each cpu owns a cache line,
+// so counting from different cpus doesn't bounce cache lines around
+struct alignas(64) bpf_map_stats_slot {
+	uint64_t lookups;
+	uint64_t lookup_misses;
+	uint64_t updates;
+	uint64_t update_failures;
+};
+
 // bpf map handler
 // all map data will be put on shared memory, so it can be accessed by
 // different processes
@@ -161,23 +171,52 @@ class bpf_map_handler {
 	// *
 	int bpf_map_get_next_key(const void *key, void *next_key,
 				 bool from_userspace = false) const;
+	// Apply `count` updates under a single acquisition of the map lock.
+	// `keys` and `values` are packed arrays, with strides of the key size
+	// and the (userspace visible) value size. The updates are applied
+	// all-or-nothing: if any of them fails, the ones already applied are
+	// rolled back, and -1 is returned with errno of the failed update.
+	// Maps with should_lock == false are accessed by programs without
+	// the map lock, so the batch is only atomic against other users of
+	// the lock, not against programs running concurrently.
+	long map_update_elem_batch(const void *keys, const void *values,
+				   uint32_t count, uint64_t flags,
+				   bool from_userspace = true) const;
+	// Look up an element of a per cpu map from userspace, and sum up the
+	// values of all cpus into `value`. Values are treated as arrays of
+	// 64-bit counters, or 32-bit ones if the value size is not a multiple
+	// of 8.
+	long map_lookup_elem_aggregated(const void *key, void *value) const;
+	// Sum up the counters of all cpus, and estimate the memory usage
+	void map_get_stats(bpf_map_stats &out) const;
 	void map_free(boost::interprocess::managed_shared_memory &memory);
 	int map_init(boost::interprocess::managed_shared_memory &memory);
 	uint32_t get_value_size() const;
 	std::optional<ringbuf_map_impl *> try_get_ringbuf_map_impl() const;
 	std::optional<array_map_impl *> try_get_array_map_impl() const;
+	std::optional<double_buffered_hash_map_impl *>
+	try_get_double_buffered_hash_map_impl() const;
 	std::optional<perf_event_array_kernel_user_impl *>
 	try_get_shared_perf_event_array_map_impl() const;
 
     private:
 	std::string get_container_name();
+	int create_map_impl(boost::interprocess::managed_shared_memory &memory);
+	void count_lookup(bool hit) const;
+	void count_update(bool success, uint32_t count = 1) const;
 	mutable sharable_mutex_ptr map_mutex;
 	// The underlying data structure of the map
 	general_map_impl_ptr map_impl_ptr;
 	uint32_t max_entries = 0;
-	[[maybe_unused]] uint64_t flags = 0;
+	uint64_t flags = 0;
 	uint32_t key_size = 0;
 	uint32_t value_size = 0;
+	// Per cpu operation counters, null if map stats are disabled
+	boost::interprocess::offset_ptr<bpf_map_stats_slot> stats_slots =
+		nullptr;
+	uint32_t stats_slot_count = 0;
+	// Bytes of the shared memory allocated when creating the map
+	uint64_t init_bytes = 0;
 };
 
 } // namespace bpftime
@@ -7,11 +7,14 @@
 #include "spdlog/spdlog.h"
 #include <boost/interprocess/detail/segment_manager_helper.hpp>
 #include <boost/interprocess/smart_ptr/shared_ptr.hpp>
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <handler/perf_event_handler.hpp>
+#include <bpf_map/map_common_def.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
+#include <sched.h>
 #include <unistd.h>
 #include <spdlog/fmt/bin_to_hex.h>
 
@@ -105,6 +108,40 @@ software_perf_event_data::get_header_ref_const() const
 	return *(perf_event_mmap_page *)(uintptr_t)(mmap_buffer.data());
 }
 
+// Copy to the data area at `pos`, wrapping around at its end
+static void copy_to_ring(uint8_t *base, uint64_t data_size, uint64_t pos,
+			 const void *src, size_t size)
+{
+	auto offset = pos & (data_size - 1);
+	auto len_first = std::min<uint64_t>(size, data_size - offset);
+	memcpy(base + offset, src, len_first);
+	memcpy(base, (const uint8_t *)src + len_first, size - len_first);
+}
+
+// Cover [start, end) with PERF_RECORD_LOST records, for the space of a
+// producer which died before publishing its sample
+static void skip_space(uint8_t *base, uint64_t data_size, uint64_t start,
+		       uint64_t end)
+{
+	uint64_t lost = 1;
+	while (start < end) {
+		// Sizes of records are 16 bits, and the rest must still fit a
+		// header
+		uint64_t len = std::min<uint64_t>(end - start, 0xfff8);
+		if (end - start - len != 0 &&
+		    end - start - len < sizeof(perf_event_header))
+			len -= sizeof(perf_event_header);
+		perf_sample_lost rec{};
+		rec.header.type = PERF_RECORD_LOST;
+		rec.header.size = len;
+		rec.lost = lost;
+		copy_to_ring(base, data_size, start, &rec,
+			     std::min<uint64_t>(len, sizeof(rec)));
+		lost = 0;
+		start += len;
+	}
+}
+
 int software_perf_event_data::output_data(const void *buf, size_t size)
 {
 	spdlog::debug("Handling perf event output data with size {}", size);
@@ -114,45 +151,74 @@ int software_perf_event_data::output_data(const void *buf, size_t size)
 	head.header.size = sizeof(head) + size;
 	head.header.misc = 0;
 	head.size = size;
-	int64_t data_head = smp_load_acquire_u64(&header.data_head);
-	int64_t data_tail = header.data_tail;
+	const uint64_t record_size = head.header.size;
+	const uint64_t data_size = mmap_size();
 	uint8_t *base_addr = (uint8_t *)mmap_buffer.data() + pagesize;
-	int64_t available_size = mmap_size() - (data_head - data_tail);
-	spdlog::debug("Data tail={}", data_tail);
-	if (available_size == 0) {
-		spdlog::debug("Upgraded available size to {}", mmap_size());
-		available_size = mmap_size();
-	}
-	// If available_size is less or equal than head.header.size, just drop
-	// the data. In this way, we'll never make data_head equals to
-	// data_tail, at situation other than an empty buffer
-	if (available_size <= head.header.size) {
-		spdlog::debug(
-			"Dropping data with size {}, available_size {}, required size {}",
-			size, available_size, head.header.size);
+	// Fails if a signal handler interrupted a producer of this buffer in
+	// this thread, since it would wait for that producer forever
+	ring_claim_ticket ticket;
+	if (!claim.begin(ticket)) {
+		__atomic_fetch_add(&lost_samples, 1, __ATOMIC_RELAXED);
 		return 0;
 	}
-	auto &copy_size = head.header.size;
-	if (copy_buffer.size() != copy_size)
-		copy_buffer.resize(copy_size);
-
-	memcpy(copy_buffer.data(), &head, sizeof(head));
-	memcpy((uint8_t *)(copy_buffer.data()) + sizeof(head), buf, size);
-	uint8_t *copy_start_1 = base_addr + (data_head & (mmap_size() - 1));
-	if (copy_size + copy_start_1 <= base_addr + mmap_size()) {
-		memcpy(copy_start_1, copy_buffer.data(), copy_size);
-	} else {
-		size_t len_first = base_addr + mmap_size() - copy_start_1;
-		size_t len_second = copy_size - len_first;
-		memcpy(copy_start_1, copy_buffer.data(), len_first);
-		memcpy(base_addr, copy_buffer.data() + len_first, len_second);
+	// Report samples dropped before, in front of this one, same as the
+	// kernel does once there is space again
+	uint64_t lost = 0;
+	if (__atomic_load_n(&lost_samples, __ATOMIC_RELAXED) != 0)
+		lost = __atomic_exchange_n(&lost_samples, 0, __ATOMIC_ACQ_REL);
+	const uint64_t lost_size = lost ? sizeof(perf_sample_lost) : 0;
+	const uint64_t total_size = lost_size + record_size;
+	// Claim [data_head, data_head + total_size) without any lock
+	uint64_t data_head = claim.position();
+	do {
+		uint64_t data_tail = smp_load_acquire_u64(&header.data_tail);
+		int64_t available_size = data_size - (data_head - data_tail);
+		// If available_size is less or equal than the record size,
+		// just drop the data. In this way, we'll never make data_head
+		// equals to data_tail, at situation other than an empty buffer
+		if (available_size <= (int64_t)total_size) {
+			spdlog::debug(
+				"Dropping data with size {}, available_size {}, required size {}",
+				size, available_size, total_size);
+			__atomic_fetch_add(&lost_samples, lost + 1,
+					   __ATOMIC_RELAXED);
+			claim.end(ticket);
+			return 0;
+		}
+	} while (!claim.try_claim(ticket, data_head, total_size));
+	if (lost) {
+		perf_sample_lost lost_rec;
+		lost_rec.header.type = PERF_RECORD_LOST;
+		lost_rec.header.misc = 0;
+		lost_rec.header.size = sizeof(lost_rec);
+		lost_rec.id = 0;
+		lost_rec.lost = lost;
+		lost_rec.sample_id = 0;
+		copy_to_ring(base_addr, data_size, data_head, &lost_rec,
+			     sizeof(lost_rec));
 	}
-	uint64_t new_head = (data_head + copy_size);
+	// Write the header and the sample straight into the ring
+	copy_to_ring(base_addr, data_size, data_head + lost_size, &head,
+		     sizeof(head));
+	copy_to_ring(base_addr, data_size, data_head + lost_size + sizeof(head),
+		     buf, size);
+	// Consumers read everything before data_head, so records are
+	// published in the order they were claimed. Producers of a ring
+	// mostly run on the same cpu, so don't spin long on one that was
+	// preempted in the middle. The space of one that was killed in the
+	// middle is reported as lost
+	claim.wait_turn(ticket, &header.data_head,
+			[&](uint64_t start, uint64_t end) {
+				skip_space(base_addr, data_size, start, end);
+			});
+	uint64_t new_head = data_head + total_size;
 	smp_store_release_u64(&header.data_head, new_head);
+	claim.end(ticket);
+	watchers.notify();
+	efd_notifier.notify();
 	spdlog::debug(
-		"Data of size {}, total size {} outputed at head {}; new_head={} addr={:x}; available_size={}",
-		size, copy_size, data_head, new_head,
-		(uintptr_t)(base_addr + data_head), available_size);
+		"Data of size {}, total size {} outputed at head {}; new_head={}",
+		size, total_size, data_head, new_head);
 
 	return 0;
 }
@@ -168,7 +234,7 @@ software_perf_event_data::software_perf_event_data(
 	: cpu(cpu), config(config), sample_type(sample_type),
 	  pagesize(getpagesize()),
 	  mmap_buffer(pagesize, memory.get_segment_manager()),
-	  copy_buffer(pagesize, memory.get_segment_manager())
+	  efd_notifier(memory)
 {
 	perf_event_mmap_page &perf_header = get_header_ref();
 	perf_header.data_offset = pagesize;
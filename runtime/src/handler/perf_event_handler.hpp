@@ -16,6 +16,9 @@
 #include <boost/interprocess/smart_ptr/weak_ptr.hpp>
 #include "linux/perf_event.h"
 #include "bpftime_shm.hpp"
+#include <bpf_map/epoll_ready_set.hpp>
+#include <bpf_map/eventfd_notifier.hpp>
+#include <bpf_map/ring_claim.hpp>
 
 namespace bpftime
 {
@@ -54,12 +57,18 @@ the next input should read
 +-------+-------+-------+-------+--------+
 0                                        buf_len
 When the emitter (the side that produce data) wants to output something:
-- check if data_head meets data_tail under the modular of buffer length
-- If not reached, put an instance of perf_sample_raw at data_head, fill it with
-corresponding data, then fill the data to output. Note that the data may be cut
-into two pieces, one of which will be laid at the tail, and another will be laid
-at the head, if the remaining buffer space at the tail is not enough
-- Add data_head with the corresponding size. modular with buf_len
+- Claim space for the record with a ring_claim, if it doesn't meet data_tail
+under the modular of buffer length
+- Put an instance of perf_sample_raw at the claimed position, then the data to
+output, directly into the buffer. Note that the data may be cut into two
+pieces, one of which will be laid at the tail, and another will be laid at the
+head, if the remaining buffer space at the tail is not enough
+- If samples were dropped since the last output for lack of space, put a
+perf_sample_lost record carrying their count before the sample
+- Wait for data_head to reach the claimed position, then add data_head with the
+corresponding size with a release store. modular with buf_len. If the producer
+that claimed the space right before died before publishing it, the space is
+covered with PERF_RECORD_LOST records and published in its place
 */
 
 struct software_perf_event_data {
@@ -75,7 +84,16 @@ struct software_perf_event_data {
 	int32_t sample_type;
 	int pagesize;
 	bytes_vec mmap_buffer;
-	bytes_vec copy_buffer;
+	// End of the area claimed by producers. Producers claim space with
+	// it, write their records in place, then advance data_head in the
+	// order the space was claimed
+	ring_claim claim;
+	// Samples dropped since the last PERF_RECORD_LOST record
+	uint64_t lost_samples = 0;
+	// Epoll instances to notify on outputting
+	epoll_watchers watchers;
+	// Eventfd to notify on outputting, if enabled
+	eventfd_notifier efd_notifier;
 	software_perf_event_data(
 		int cpu, int64_t config, int32_t sample_type,
 		boost::interprocess::managed_shared_memory &memory);
@@ -0,0 +1,476 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#include "spdlog/spdlog.h"
+#include <algorithm>
+#include <bpftime_shm.hpp>
+#include <bpftime_trace_writer.hpp>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#if BPFTIME_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// The file is grown by at least this much at a time, so that it's seldom
+// remapped
+static const uint64_t TRACE_FILE_CHUNK = 64 << 20;
+// Free space to provide to each deflate call
+static const uint64_t DEFLATE_OUT_CHUNK = 64 << 10;
+// Records got from a ringbuf at once, before releasing them
+static const int RINGBUF_PEEK_BATCH = 256;
+
+static uint64_t realtime_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+namespace bpftime
+{
+struct trace_writer::deflate_stream {
+#if BPFTIME_HAVE_ZLIB
+	z_stream stream;
+#endif
+};
+
+trace_writer::trace_writer(const trace_writer_opts &opts)
+	: opts(opts), deflater(std::make_unique<deflate_stream>())
+{
+	memset(&batch, 0, sizeof(batch));
+#if BPFTIME_HAVE_ZLIB
+	memset(&deflater->stream, 0, sizeof(deflater->stream));
+#endif
+}
+
+trace_writer::~trace_writer()
+{
+	close();
+}
+
+int trace_writer::open(const char *path)
+{
+	if (fd >= 0) {
+		errno = EBUSY;
+		spdlog::error("Trace writer already has a file open");
+		return -1;
+	}
+#if !BPFTIME_HAVE_ZLIB
+	if (opts.compress) {
+		errno = ENOTSUP;
+		spdlog::error(
+			"Unable to compress trace batches, bpftime is built without zlib");
+		return -1;
+	}
+#endif
+	fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		spdlog::error("Unable to create trace file {}: {}", path, errno);
+		return -1;
+	}
+	if (ensure_capacity(sizeof(trace_file_header)) < 0) {
+		int err = errno;
+		::close(fd);
+		fd = -1;
+		errno = err;
+		return -1;
+	}
+	trace_file_header header;
+	memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_FILE_VERSION;
+	header.reserved = 0;
+	memcpy(base, &header, sizeof(header));
+	write_pos = sizeof(header);
+	return 0;
+}
+
+int trace_writer::ensure_capacity(uint64_t size)
+{
+	if (size <= capacity)
+		return 0;
+	uint64_t new_capacity =
+		std::max((size + TRACE_FILE_CHUNK - 1) / TRACE_FILE_CHUNK *
+				 TRACE_FILE_CHUNK,
+			 capacity * 2);
+	if (ftruncate(fd, new_capacity) < 0) {
+		spdlog::error("Unable to grow trace file to {} bytes: {}",
+			      new_capacity, errno);
+		return -1;
+	}
+	void *ptr;
+	if (base == nullptr)
+		ptr = mmap(nullptr, new_capacity, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+	else
+		ptr = mremap(base, capacity, new_capacity, MREMAP_MAYMOVE);
+	if (ptr == MAP_FAILED) {
+		spdlog::error("Unable to map trace file of {} bytes: {}",
+			      new_capacity, errno);
+		return -1;
+	}
+	base = (uint8_t *)ptr;
+	capacity = new_capacity;
+	return 0;
+}
+
+int trace_writer::begin_batch()
+{
+	if (ensure_capacity(write_pos + sizeof(trace_batch_header)) < 0)
+		return -1;
+#if BPFTIME_HAVE_ZLIB
+	if (opts.compress) {
+		memset(&deflater->stream, 0, sizeof(deflater->stream));
+		// Favor speed, since this runs while producers wait for space
+		if (int err = deflateInit(&deflater->stream, Z_BEST_SPEED);
+		    err != Z_OK) {
+			errno = ENOMEM;
+			spdlog::error("Unable to initialize deflate: {}", err);
+			return -1;
+		}
+	}
+#endif
+	batch_start = write_pos;
+	write_pos += sizeof(trace_batch_header);
+	batch.magic = TRACE_BATCH_MAGIC;
+#if BPFTIME_HAVE_ZLIB
+	batch.flags = opts.compress ? TRACE_BATCH_COMPRESSED : 0;
+#else
+	batch.flags = 0;
+#endif
+	batch.nr_records = 0;
+	batch.raw_size = 0;
+	batch.stored_size = 0;
+	batch.timestamp = realtime_ns();
+	return 0;
+}
+
+int trace_writer::write_bytes(const void *data, size_t size)
+{
+	batch.raw_size += size;
+#if BPFTIME_HAVE_ZLIB
+	if (opts.compress) {
+		auto &zstream = deflater->stream;
+		zstream.next_in = (Bytef *)data;
+		zstream.avail_in = size;
+		while (zstream.avail_in > 0) {
+			if (ensure_capacity(write_pos + DEFLATE_OUT_CHUNK) < 0)
+				return -1;
+			zstream.next_out = base + write_pos;
+			zstream.avail_out = std::min<uint64_t>(
+				capacity - write_pos, UINT_MAX);
+			auto avail_out = zstream.avail_out;
+			if (int err = deflate(&zstream, Z_NO_FLUSH);
+			    err != Z_OK) {
+				errno = EIO;
+				spdlog::error("Unable to deflate trace batch: {}",
+					      err);
+				return -1;
+			}
+			write_pos += avail_out - zstream.avail_out;
+		}
+		return 0;
+	}
+#endif
+	if (ensure_capacity(write_pos + size) < 0)
+		return -1;
+	memcpy(base + write_pos, data, size);
+	write_pos += size;
+	return 0;
+}
+
+int trace_writer::write_record(int source, trace_record_kind kind,
+			       const void *data1, size_t size1,
+			       const void *data2, size_t size2)
+{
+	static const uint8_t padding[8] = {};
+	if (batch_start < 0 && begin_batch() < 0)
+		return -1;
+	trace_record_header header{ .size = (uint32_t)(size1 + size2),
+				    .source = (uint16_t)source,
+				    .kind = (uint16_t)kind };
+	if (write_bytes(&header, sizeof(header)) < 0 ||
+	    write_bytes(data1, size1) < 0 ||
+	    (size2 > 0 && write_bytes(data2, size2) < 0) ||
+	    write_bytes(padding, (8 - header.size % 8) % 8) < 0)
+		return -1;
+	batch.nr_records++;
+	if (batch.raw_size >= opts.batch_bytes)
+		return flush();
+	return 0;
+}
+
+int trace_writer::flush()
+{
+	if (batch_start < 0)
+		return 0;
+#if BPFTIME_HAVE_ZLIB
+	if (opts.compress) {
+		auto &zstream = deflater->stream;
+		int err;
+		zstream.next_in = nullptr;
+		zstream.avail_in = 0;
+		do {
+			if (ensure_capacity(write_pos + DEFLATE_OUT_CHUNK) < 0)
+				return -1;
+			zstream.next_out = base + write_pos;
+			zstream.avail_out = std::min<uint64_t>(
+				capacity - write_pos, UINT_MAX);
+			auto avail_out = zstream.avail_out;
+			err = deflate(&zstream, Z_FINISH);
+			write_pos += avail_out - zstream.avail_out;
+		} while (err == Z_OK);
+		deflateEnd(&zstream);
+		if (err != Z_STREAM_END) {
+			errno = EIO;
+			spdlog::error("Unable to finish trace batch: {}", err);
+			return -1;
+		}
+	}
+#endif
+	batch.stored_size =
+		write_pos - batch_start - sizeof(trace_batch_header);
+	// Readers treat a zeroed header as the end of file, so the batch
+	// becomes visible only after it's complete
+	memcpy(base + batch_start, &batch, sizeof(batch));
+	batch_start = -1;
+	return 0;
+}
+
+int trace_writer::close()
+{
+	if (fd < 0)
+		return 0;
+	int ret = flush();
+	if (base != nullptr)
+		munmap(base, capacity);
+	if (ftruncate(fd, write_pos) < 0) {
+		spdlog::error("Unable to trim trace file to {} bytes: {}",
+			      write_pos, errno);
+		ret = -1;
+	}
+	::close(fd);
+	fd = -1;
+	base = nullptr;
+	capacity = 0;
+	return ret;
+}
+
+long trace_writer::drain_ringbuf(int map_fd)
+{
+	ringbuf_sample samples[RINGBUF_PEEK_BATCH];
+	long total = 0;
+	while (true) {
+		uint64_t batch_end;
+		int cnt = bpftime_ringbuf_peek_batch(map_fd, samples,
+						     RINGBUF_PEEK_BATCH,
+						     &batch_end);
+		if (cnt < 0)
+			return -1;
+		for (int i = 0; i < cnt; i++) {
+			if (write_record(map_fd, TRACE_RECORD_RINGBUF,
+					 samples[i].data, samples[i].size,
+					 nullptr, 0) < 0)
+				return -1;
+		}
+		// Also releases discarded records, if all of them were
+		if (bpftime_ringbuf_commit_batch(map_fd, batch_end) < 0)
+			return -1;
+		total += cnt;
+		if (cnt < RINGBUF_PEEK_BATCH)
+			break;
+	}
+	return total;
+}
+
+long trace_writer::drain_perf_event(int perf_fd)
+{
+	auto page = (perf_event_mmap_page *)
+		bpftime_get_software_perf_event_raw_buffer(perf_fd, 0);
+	if (page == nullptr) {
+		errno = EINVAL;
+		return -1;
+	}
+	const uint64_t data_size = page->data_size;
+	// Not mapped by anyone yet, so there is nothing in it
+	if (data_size == 0)
+		return 0;
+	auto data = (const uint8_t *)page + page->data_offset;
+	auto head = __atomic_load_n(&page->data_head, __ATOMIC_ACQUIRE);
+	auto tail = page->data_tail;
+	long total = 0;
+	bool failed = false;
+	while (tail < head) {
+		auto offset = tail & (data_size - 1);
+		// Records, including their headers, may wrap around
+		perf_event_header header;
+		auto first = std::min<uint64_t>(sizeof(header),
+						data_size - offset);
+		memcpy(&header, data + offset, first);
+		memcpy((uint8_t *)&header + first, data, sizeof(header) - first);
+		if (header.size < sizeof(header) ||
+		    header.size > head - tail) {
+			errno = EINVAL;
+			spdlog::error("Invalid perf record of size {} at {}",
+				      header.size, tail);
+			failed = true;
+			break;
+		}
+		first = std::min<uint64_t>(header.size, data_size - offset);
+		if (write_record(perf_fd, TRACE_RECORD_PERF_EVENT, data + offset,
+				 first, data, header.size - first) < 0) {
+			failed = true;
+			break;
+		}
+		tail += header.size;
+		total++;
+	}
+	__atomic_store_n(&page->data_tail, tail, __ATOMIC_RELEASE);
+	return failed ? -1 : total;
+}
+
+long trace_writer::drain(int source_fd)
+{
+	if (fd < 0) {
+		errno = EBADF;
+		spdlog::error("Trace writer has no file open");
+		return -1;
+	}
+	if (source_fd < 0 || source_fd > UINT16_MAX) {
+		errno = EINVAL;
+		spdlog::error("Unable to trace fd {}, which doesn't fit in records",
+			      source_fd);
+		return -1;
+	}
+	if (bpftime_is_ringbuf_map(source_fd))
+		return drain_ringbuf(source_fd);
+	if (bpftime_is_software_perf_event(source_fd))
+		return drain_perf_event(source_fd);
+	errno = EINVAL;
+	spdlog::error(
+		"Expected fd {} to be a ringbuf map or a software perf event",
+		source_fd);
+	return -1;
+}
+
+int read_trace_file(
+	const char *path,
+	std::function<int(const trace_record_header &, const void *data)>
+		callback)
+{
+	int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		spdlog::error("Unable to open trace file {}: {}", path, errno);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 ||
+	    (size_t)st.st_size < sizeof(trace_file_header)) {
+		::close(fd);
+		errno = EINVAL;
+		spdlog::error("Invalid trace file {}", path);
+		return -1;
+	}
+	const uint64_t size = st.st_size;
+	auto base = (const uint8_t *)mmap(nullptr, size, PROT_READ,
+					  MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED) {
+		spdlog::error("Unable to map trace file {}: {}", path, errno);
+		return -1;
+	}
+	int ret = 0;
+	auto file_header = (const trace_file_header *)base;
+	if (memcmp(file_header->magic, TRACE_FILE_MAGIC,
+		   sizeof(TRACE_FILE_MAGIC)) != 0 ||
+	    file_header->version != TRACE_FILE_VERSION) {
+		spdlog::error("Invalid trace file {}", path);
+		errno = EINVAL;
+		ret = -1;
+	}
+	std::vector<uint8_t> raw;
+	uint64_t pos = sizeof(trace_file_header);
+	while (ret == 0 && pos + sizeof(trace_batch_header) <= size) {
+		trace_batch_header batch;
+		memcpy(&batch, base + pos, sizeof(batch));
+		// The rest of a file still being written
+		if (batch.magic == 0)
+			break;
+		pos += sizeof(batch);
+		if (batch.magic != TRACE_BATCH_MAGIC ||
+		    batch.stored_size > size - pos) {
+			spdlog::error("Invalid trace batch at {} of {}", pos,
+				      path);
+			errno = EINVAL;
+			ret = -1;
+			break;
+		}
+		const uint8_t *records = base + pos;
+		if (batch.flags & TRACE_BATCH_COMPRESSED) {
+#if BPFTIME_HAVE_ZLIB
+			raw.resize(batch.raw_size);
+			uLongf raw_size = batch.raw_size;
+			if (uncompress(raw.data(), &raw_size, records,
+				       batch.stored_size) != Z_OK ||
+			    raw_size != batch.raw_size) {
+				spdlog::error(
+					"Unable to inflate trace batch at {} of {}",
+					pos, path);
+				errno = EINVAL;
+				ret = -1;
+				break;
+			}
+			records = raw.data();
+#else
+			spdlog::error(
+				"Unable to inflate trace batch at {} of {}, bpftime is built without zlib",
+				pos, path);
+			errno = ENOTSUP;
+			ret = -1;
+			break;
+#endif
+		} else if (batch.raw_size != batch.stored_size) {
+			spdlog::error("Invalid trace batch at {} of {}", pos,
+				      path);
+			errno = EINVAL;
+			ret = -1;
+			break;
+		}
+		pos += batch.stored_size;
+		uint64_t off = 0;
+		bool truncated = false;
+		for (uint32_t i = 0; i < batch.nr_records && ret == 0; i++) {
+			trace_record_header header;
+			if (batch.raw_size < off + sizeof(header)) {
+				truncated = true;
+				break;
+			}
+			memcpy(&header, records + off, sizeof(header));
+			off += sizeof(header);
+			if (batch.raw_size - off < header.size) {
+				truncated = true;
+				break;
+			}
+			ret = callback(header, records + off);
+			off += (header.size + 7) / 8 * 8;
+		}
+		if (truncated) {
+			spdlog::error("Truncated trace batch in {}", path);
+			errno = EINVAL;
+			ret = -1;
+		}
+	}
+	munmap((void *)base, size);
+	return ret;
+}
+
+} // namespace bpftime
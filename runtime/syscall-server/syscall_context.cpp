@@ -93,6 +93,19 @@ long syscall_context::handle_sysbpf(int cmd, union bpf_attr *attr, size_t size)
 		return bpftime_map_delete_elem(
 			attr->map_fd, (const void *)(uintptr_t)attr->key);
 	}
+	case BPF_MAP_UPDATE_BATCH: {
+		spdlog::debug("Batch updating map {}, count {}",
+			      attr->batch.map_fd, attr->batch.count);
+		long ret = bpftime_map_update_elem_batch(
+			attr->batch.map_fd,
+			(const void *)(uintptr_t)attr->batch.keys,
+			(const void *)(uintptr_t)attr->batch.values,
+			attr->batch.count, attr->batch.elem_flags);
+		// Updates are applied all-or-nothing
+		if (ret < 0)
+			attr->batch.count = 0;
+		return ret;
+	}
 	case BPF_MAP_GET_NEXT_KEY: {
 		spdlog::debug("Getting next key");
 		return (long)(uintptr_t)bpftime_map_get_next_key(
@@ -284,7 +297,11 @@ void *syscall_context::handle_mmap64(void *addr, size_t length, int prot,
 	if (fd != -1 && bpftime_is_ringbuf_map(fd)) {
 		spdlog::debug("Entering mmap64 handling for ringbuf fd: {}",
 			      fd);
-		if (prot == (PROT_WRITE | PROT_READ)) {
+		// The consumer page is at offset 0, followed by the producer
+		// page. Dispatch on the offset rather than the protection,
+		// since user ringbufs map the consumer page read only and the
+		// producer page writable
+		if (offset == 0) {
 			if (auto ptr = bpftime_get_ringbuf_consumer_page(fd);
 			    ptr != nullptr) {
 				spdlog::debug(
@@ -293,7 +310,7 @@ void *syscall_context::handle_mmap64(void *addr, size_t length, int prot,
 				mocked_mmap_values.insert((uintptr_t)ptr);
 				return ptr;
 			}
-		} else if (prot == (PROT_READ)) {
+		} else {
 			if (auto ptr = bpftime_get_ringbuf_producer_page(fd);
 			    ptr != nullptr) {
 				spdlog::debug(
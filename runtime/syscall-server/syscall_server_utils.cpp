@@ -7,6 +7,7 @@
 #include <spdlog/cfg/env.h>
 #include <spdlog/spdlog.h>
 #include <bpftime_shm.hpp>
+#include <cstring>
 #ifdef ENABLE_BPFTIME_VERIFIER
 #include <bpftime-verifier.hpp>
 #include <iomanip>
@@ -70,6 +71,24 @@ const bpftime::agent_config& set_agent_config_from_env()
 	}
 	const char *use_jit = getenv("BPFTIME_USE_JIT");
 	agent_config.jit_enabled = use_jit != nullptr;
+	if (const char *cache_dir = getenv("BPFTIME_JIT_CACHE_DIR");
+	    cache_dir != nullptr) {
+		strncpy(agent_config.jit_cache_dir, cache_dir,
+			sizeof(agent_config.jit_cache_dir) - 1);
+	}
+	if (const char *jit_threads = getenv("BPFTIME_JIT_THREADS");
+	    jit_threads != nullptr) {
+		agent_config.jit_threads = atoi(jit_threads);
+	}
+	if (const char *jit_threshold = getenv("BPFTIME_JIT_THRESHOLD");
+	    jit_threshold != nullptr) {
+		agent_config.jit_threshold = atoi(jit_threshold);
+	}
+	// BPFTIME_THREADED_INTERPRETER=1 interprets with the threaded interpreter
+	if (const char *threaded = getenv("BPFTIME_THREADED_INTERPRETER");
+	    threaded != nullptr) {
+		agent_config.threaded_interpreter = atoi(threaded) != 0;
+	}
 	bpftime_set_agent_config(agent_config);
 	return bpftime_get_agent_config();
 }
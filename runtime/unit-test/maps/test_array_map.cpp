@@ -0,0 +1,128 @@
+#include "catch2/catch_message.hpp"
+#include "../common_def.hpp"
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/interprocess_fwd.hpp>
+#include <bpf_map/userspace/array_map.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace boost::interprocess;
+using namespace bpftime;
+
+static const char *SHM_NAME = "BPFTIME_ARRAY_MAP_SHM";
+
+TEST_CASE("Test sparse backing of large array maps")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	{
+		// The count of destroyed sparse arrays stays in the segment
+		array_map_impl first(mem, 8, 1 << 20);
+	}
+	auto free_before = mem.get_free_memory();
+	{
+		// 64 MiB of values, larger than the whole segment
+		const uint32_t max_entries = 8 << 20;
+		array_map_impl map(mem, 8, max_entries);
+		REQUIRE(free_before - mem.get_free_memory() < 4096);
+
+		// Untouched elements read as zero
+		uint32_t key = max_entries - 1;
+		auto p = (uint64_t *)map.elem_lookup(&key);
+		REQUIRE(p != nullptr);
+		REQUIRE(*p == 0);
+
+		for (uint32_t i = 0; i < max_entries; i += max_entries / 16) {
+			uint64_t value = i + 1;
+			REQUIRE(map.elem_update(&i, &value, 0) == 0);
+		}
+		for (uint32_t i = 0; i < max_entries; i += max_entries / 16) {
+			p = (uint64_t *)map.elem_lookup(&i);
+			REQUIRE(p != nullptr);
+			REQUIRE(*p == i + 1);
+		}
+		// Only the touched pages are committed
+		REQUIRE(map.memory_usage() > 0);
+		REQUIRE(map.memory_usage() < (1 << 20));
+
+		key = max_entries;
+		REQUIRE(map.elem_lookup(&key) == nullptr);
+	}
+	REQUIRE(mem.get_free_memory() == free_before);
+}
+
+TEST_CASE("Test small array maps stay in the shared memory")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	auto free_before = mem.get_free_memory();
+	array_map_impl map(mem, 8, 1024);
+	REQUIRE(free_before - mem.get_free_memory() >= 8 * 1024);
+	REQUIRE(map.memory_usage() == 0);
+	uint32_t key = 1023;
+	uint64_t value = 0xabcd;
+	REQUIRE(map.elem_update(&key, &value, 0) == 0);
+	REQUIRE(*(uint64_t *)map.get_raw_data() == 0);
+	REQUIRE(((uint64_t *)map.get_raw_data())[1023] == 0xabcd);
+}
+
+// Sparse objects mapped by this process
+static int count_sparse_mappings()
+{
+	FILE *fp = fopen("/proc/self/maps", "r");
+	if (fp == nullptr)
+		return -1;
+	char line[512];
+	int cnt = 0;
+	while (fgets(line, sizeof(line), fp) != nullptr)
+		if (strstr(line, "/bpftime_array_") != nullptr)
+			cnt++;
+	fclose(fp);
+	return cnt;
+}
+
+TEST_CASE("Test dropping mappings of sparse arrays destroyed by others")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_entries = 1 << 20;
+	auto destroyed = mem.construct<array_map_impl>(anonymous_instance)(
+		mem, 8, max_entries);
+	auto kept = mem.construct<array_map_impl>(anonymous_instance)(
+		mem, 8, max_entries);
+	int ready[2], go[2];
+	REQUIRE(pipe(ready) == 0);
+	REQUIRE(pipe(go) == 0);
+	int pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		uint32_t key = 1;
+		uint64_t value = 1;
+		// Both arrays are mapped in the child
+		bool ok = destroyed->elem_update(&key, &value, 0) == 0 &&
+			  kept->elem_update(&key, &value, 0) == 0 &&
+			  count_sparse_mappings() == 2;
+		char c = 0;
+		ok = ok && write(ready[1], &c, 1) == 1 &&
+		     read(go[0], &c, 1) == 1;
+		// And the destroyed one is dropped on the next access
+		ok = ok && kept->elem_lookup(&key) != nullptr &&
+		     count_sparse_mappings() == 1;
+		_exit(ok ? 0 : 1);
+	}
+	char c;
+	REQUIRE(read(ready[0], &c, 1) == 1);
+	mem.destroy_ptr(destroyed);
+	REQUIRE(write(go[1], &c, 1) == 1);
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+	mem.destroy_ptr(kept);
+	for (int fd : { ready[0], ready[1], go[0], go[1] })
+		close(fd);
+}
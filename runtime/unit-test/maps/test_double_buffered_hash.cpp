@@ -0,0 +1,194 @@
+#include "catch2/catch_message.hpp"
+#include "../common_def.hpp"
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/interprocess_fwd.hpp>
+#include <bpf_map/userspace/double_buffered_hash_map.hpp>
+#include <bpftime_prog.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+using namespace boost::interprocess;
+using namespace bpftime;
+
+static const char *SHM_NAME = "BPFTIME_DOUBLE_BUFFERED_HASH_SHM";
+
+TEST_CASE("Test swapping buffers of double buffered hash map")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	double_buffered_hash_map_impl map(mem, 4, 8);
+
+	// Programs count into the active buffer
+	for (uint32_t i = 0; i < 10; i++) {
+		uint64_t val = i * 100;
+		REQUIRE(map.elem_update(&i, &val, 0) == 0);
+	}
+	// Which is invisible to userspace until swapped
+	uint32_t key = 0;
+	REQUIRE(map.elem_lookup_userspace(&key) == nullptr);
+	uint32_t next_key;
+	REQUIRE(map.map_get_next_key_userspace(nullptr, &next_key) < 0);
+
+	map.swap_buffers();
+	// Programs start with an empty buffer
+	REQUIRE(map.elem_lookup(&key) == nullptr);
+	uint64_t val = 1;
+	REQUIRE(map.elem_update(&key, &val, 0) == 0);
+
+	// Userspace reads the collected interval
+	int cnt = 0;
+	const void *prev = nullptr;
+	while (map.map_get_next_key_userspace(prev, &next_key) == 0) {
+		auto p = (uint64_t *)map.elem_lookup_userspace(&next_key);
+		REQUIRE(p != nullptr);
+		REQUIRE(*p == next_key * 100);
+		cnt++;
+		key = next_key;
+		prev = &key;
+	}
+	REQUIRE(cnt == 10);
+
+	map.clear_inactive_buffer();
+	REQUIRE(map.map_get_next_key_userspace(nullptr, &next_key) < 0);
+	// Data of the current interval is untouched
+	key = 0;
+	auto p = (uint64_t *)map.elem_lookup(&key);
+	REQUIRE(p != nullptr);
+	REQUIRE(*p == 1);
+
+	map.swap_buffers();
+	p = (uint64_t *)map.elem_lookup_userspace(&key);
+	REQUIRE(p != nullptr);
+	REQUIRE(*p == 1);
+	REQUIRE(map.elem_lookup(&key) == nullptr);
+}
+
+TEST_CASE("Test swapping buffers while programs are updating")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	double_buffered_hash_map_impl map(mem, 4, 8);
+	const uint32_t updaters = 4, updates = 5000;
+	std::vector<std::thread> threads;
+	std::atomic<uint32_t> done = 0;
+	for (uint32_t t = 0; t < updaters; t++) {
+		threads.emplace_back([&, t]() {
+			for (uint32_t i = 0; i < updates; i++) {
+				uint32_t key = t * updates + i;
+				uint64_t val = key;
+				map.elem_update(&key, &val, 0);
+			}
+			done++;
+		});
+	}
+	// Every update is seen by userspace in exactly one interval, and
+	// nothing is written to a buffer after it was cleared
+	uint64_t seen = 0;
+	while (true) {
+		bool last = done == updaters;
+		map.swap_buffers();
+		uint32_t key, next_key;
+		const void *prev = nullptr;
+		while (map.map_get_next_key_userspace(prev, &next_key) == 0) {
+			auto p = (uint64_t *)map.elem_lookup_userspace(&next_key);
+			REQUIRE(p != nullptr);
+			REQUIRE(*p == next_key);
+			seen++;
+			key = next_key;
+			prev = &key;
+		}
+		map.clear_inactive_buffer();
+		REQUIRE(map.map_get_next_key_userspace(nullptr, &next_key) <
+			0);
+		if (last)
+			break;
+	}
+	for (auto &thread : threads)
+		thread.join();
+	REQUIRE(seen == updaters * updates);
+}
+
+TEST_CASE("Test lookups of programs pinning the buffer until they return")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	double_buffered_hash_map_impl map(mem, 4, 8);
+	uint32_t key = 1;
+	uint64_t val = 1;
+	REQUIRE(map.elem_update(&key, &val, 0) == 0);
+	std::atomic<bool> looked_up = false, swapped = false;
+	bool swapped_early = true;
+	std::thread prog([&]() {
+		auto outer_run = bpftime_prog_begin_run();
+		auto p = (uint64_t *)map.elem_lookup(&key);
+		looked_up = true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		// The buffer can't be swapped out and cleared meanwhile
+		swapped_early = swapped;
+		*p += 1;
+		bpftime_prog_end_run(outer_run);
+	});
+	while (!looked_up)
+		std::this_thread::yield();
+	map.swap_buffers();
+	swapped = true;
+	prog.join();
+	REQUIRE_FALSE(swapped_early);
+	auto p = (uint64_t *)map.elem_lookup_userspace(&key);
+	REQUIRE(p != nullptr);
+	REQUIRE(*p == 2);
+	map.clear_inactive_buffer();
+	// Outside of programs, lookups don't hold up swaps
+	REQUIRE(map.elem_update(&key, &val, 0) == 0);
+	REQUIRE(map.elem_lookup(&key) != nullptr);
+	map.swap_buffers();
+}
+
+TEST_CASE("Test updating existing keys while others are inserted")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	double_buffered_hash_map_impl map(mem, 4, 8);
+	const uint32_t hot_keys = 16, updates = 20000;
+	for (uint32_t i = 0; i < hot_keys; i++) {
+		uint64_t val = i;
+		REQUIRE(map.elem_update(&i, &val, 0) == 0);
+	}
+	std::atomic<bool> stop = false;
+	// Inserting and deleting keys rehashes and frees nodes under the
+	// updates in place
+	std::thread writer([&]() {
+		for (uint32_t i = hot_keys; !stop; i++) {
+			uint64_t val = i;
+			map.elem_update(&i, &val, 0);
+			if (i % 4 == 0 && i - 2 >= hot_keys) {
+				uint32_t old = i - 2;
+				map.elem_delete(&old);
+			}
+		}
+	});
+	std::vector<std::thread> updaters;
+	std::atomic<bool> ok = true;
+	for (uint32_t t = 0; t < 4; t++) {
+		updaters.emplace_back([&]() {
+			for (uint32_t i = 0; i < updates; i++) {
+				uint32_t key = i % hot_keys;
+				uint64_t val = key;
+				if (map.elem_update(&key, &val, 0) != 0)
+					ok = false;
+				auto p = (uint64_t *)map.elem_lookup(&key);
+				if (p == nullptr || *p != key)
+					ok = false;
+			}
+		});
+	}
+	for (auto &thread : updaters)
+		thread.join();
+	stop = true;
+	writer.join();
+	REQUIRE(ok);
+}
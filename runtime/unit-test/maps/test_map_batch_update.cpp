@@ -0,0 +1,91 @@
+#include "catch2/catch_message.hpp"
+#include "../common_def.hpp"
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/interprocess_fwd.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <handler/map_handler.hpp>
+#include <vector>
+
+using namespace boost::interprocess;
+using namespace bpftime;
+
+static const char *SHM_NAME = "BPFTIME_MAP_BATCH_UPDATE_SHM";
+
+TEST_CASE("Test batch update of maps")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+
+	SECTION("Test applying all updates of a hash map")
+	{
+		bpf_map_handler map("hash", mem,
+				    bpf_map_attr{ .type = (int)bpf_map_type::
+							  BPF_MAP_TYPE_HASH,
+						  .key_size = 4,
+						  .value_size = 8,
+						  .max_ents = 100 });
+		REQUIRE(map.map_init(mem) == 0);
+		std::vector<uint32_t> keys = { 1, 2, 3, 4 };
+		std::vector<uint64_t> values = { 10, 20, 30, 40 };
+		REQUIRE(map.map_update_elem_batch(keys.data(), values.data(),
+						  keys.size(), 0) == 0);
+		for (size_t i = 0; i < keys.size(); i++) {
+			auto p = (const uint64_t *)map.map_lookup_elem(
+				&keys[i], true);
+			REQUIRE(p != nullptr);
+			REQUIRE(*p == values[i]);
+		}
+		map.map_free(mem);
+	}
+
+	SECTION("Test rolling back a failed batch of an array map")
+	{
+		bpf_map_handler map("array", mem,
+				    bpf_map_attr{ .type = (int)bpf_map_type::
+							  BPF_MAP_TYPE_ARRAY,
+						  .key_size = 4,
+						  .value_size = 8,
+						  .max_ents = 4 });
+		REQUIRE(map.map_init(mem) == 0);
+		uint32_t key = 1;
+		uint64_t value = 0xabcd;
+		REQUIRE(map.map_update_elem(&key, &value, 0, true) == 0);
+		// The last key is out of range, so the whole batch should fail
+		std::vector<uint32_t> keys = { 0, 1, 1, 4 };
+		std::vector<uint64_t> values = { 1, 2, 3, 4 };
+		REQUIRE(map.map_update_elem_batch(keys.data(), values.data(),
+						  keys.size(), 0) < 0);
+		REQUIRE(errno == ENOENT);
+		for (uint32_t i = 0; i < 4; i++) {
+			auto p = (const uint64_t *)map.map_lookup_elem(&i,
+								       true);
+			REQUIRE(p != nullptr);
+			REQUIRE(*p == (i == 1 ? 0xabcd : 0));
+		}
+		map.map_free(mem);
+	}
+
+	SECTION("Test rolling back a failed batch of a perf event array")
+	{
+		bpf_map_handler map("perf_event_array", mem,
+				    bpf_map_attr{ .type = (int)bpf_map_type::
+							  BPF_MAP_TYPE_PERF_EVENT_ARRAY,
+						  .key_size = 4,
+						  .value_size = 4,
+						  .max_ents = 2 });
+		REQUIRE(map.map_init(mem) == 0);
+		std::vector<int32_t> keys = { 0, 1, 2 };
+		std::vector<int32_t> values = { 5, 6, 7 };
+		REQUIRE(map.map_update_elem_batch(keys.data(), values.data(),
+						  keys.size(), 0) < 0);
+		for (int32_t i = 0; i < 2; i++) {
+			auto p = (const int32_t *)map.map_lookup_elem(&i,
+								      true);
+			REQUIRE(p != nullptr);
+			REQUIRE(*p == -1);
+		}
+		map.map_free(mem);
+	}
+}
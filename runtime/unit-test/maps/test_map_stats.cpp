@@ -0,0 +1,66 @@
+#include "catch2/catch_message.hpp"
+#include "../common_def.hpp"
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/interprocess_fwd.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <handler/map_handler.hpp>
+
+using namespace boost::interprocess;
+using namespace bpftime;
+
+static const char *SHM_NAME = "BPFTIME_MAP_STATS_SHM";
+
+TEST_CASE("Test statistics of maps")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+
+	SECTION("Test memory usage of an array map")
+	{
+		bpf_map_handler map("array", mem,
+				    bpf_map_attr{ .type = (int)bpf_map_type::
+							  BPF_MAP_TYPE_ARRAY,
+						  .key_size = 4,
+						  .value_size = 8,
+						  .max_ents = 1000 });
+		REQUIRE(map.map_init(mem) == 0);
+		bpf_map_stats stats;
+		map.map_get_stats(stats);
+		REQUIRE(stats.bytes_used >= 8 * 1000);
+		map.map_free(mem);
+	}
+
+	SECTION("Test counting operations of a hash map")
+	{
+		bpf_map_handler map("hash", mem,
+				    bpf_map_attr{ .type = (int)bpf_map_type::
+							  BPF_MAP_TYPE_HASH,
+						  .key_size = 4,
+						  .value_size = 8,
+						  .max_ents = 100 });
+		REQUIRE(map.map_init(mem) == 0);
+		bpf_map_stats before;
+		map.map_get_stats(before);
+		for (uint32_t i = 0; i < 10; i++) {
+			uint64_t value = i;
+			REQUIRE(map.map_update_elem(&i, &value, 0) == 0);
+		}
+		for (uint32_t i = 0; i < 20; i++) {
+			auto p = map.map_lookup_elem(&i);
+			REQUIRE((p != nullptr) == (i < 10));
+		}
+		bpf_map_stats stats;
+		map.map_get_stats(stats);
+		REQUIRE(stats.bytes_used > before.bytes_used);
+#if BPFTIME_ENABLE_MAP_STATS
+		REQUIRE(stats.lookups == 20);
+		REQUIRE(stats.lookup_misses == 10);
+		REQUIRE(stats.updates == 10);
+		REQUIRE(stats.update_failures == 0);
+#else
+		REQUIRE(stats.lookups == 0);
+#endif
+		map.map_free(mem);
+	}
+}
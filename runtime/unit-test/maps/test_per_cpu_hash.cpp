@@ -5,6 +5,7 @@
 #include <bpf_map/userspace/per_cpu_hash_map.hpp>
 #include <catch2/catch_test_macros.hpp>
 #include <cstdint>
+#include <linux/bpf.h>
 #include <sched.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -12,7 +13,10 @@
 #include <bpf_map/map_common_def.hpp>
 #include "catch2/internal/catch_run_context.hpp"
 #include <algorithm>
+#include <atomic>
+#include <handler/map_handler.hpp>
 #include <random>
+#include <thread>
 
 using namespace boost::interprocess;
 using namespace bpftime;
@@ -38,7 +42,7 @@ TEST_CASE("Test basic operations of hash map")
 
 	SECTION("Test writing from helpers, and read from userspace")
 	{
-		per_cpu_hash_map_impl map(mem, 4, 8);
+		per_cpu_hash_map_impl map(mem, 4, 8, 100);
 		for (uint32_t j = 0; j < ncpu; j++) {
 			ensure_on_certain_cpu<void>(j, [&]() {
 				for (uint32_t i = 0; i < 100; i++) {
@@ -64,7 +68,7 @@ TEST_CASE("Test basic operations of hash map")
 
 	SECTION("Test writing from userspace, and reading & updating from helpers")
 	{
-		per_cpu_hash_map_impl map(mem, 4, 8);
+		per_cpu_hash_map_impl map(mem, 4, 8, 100);
 		std::vector<uint64_t> buf(ncpu);
 		for (uint32_t j = 0; j < ncpu; j++) {
 			buf[j] = j;
@@ -96,4 +100,121 @@ TEST_CASE("Test basic operations of hash map")
 			});
 		}
 	}
+	SECTION("Test aggregated lookup, capacity and deleting")
+	{
+		per_cpu_hash_map_impl map(mem, 4, 8, 100);
+		std::vector<uint64_t> buf(ncpu);
+		for (uint32_t i = 0; i < 100; i++) {
+			for (uint32_t j = 0; j < ncpu; j++)
+				buf[j] = keys[i] + j;
+			REQUIRE(map.elem_update_userspace(&keys[i], buf.data(),
+							  0) == 0);
+		}
+		// The map is full
+		uint32_t extra = keys[0] ^ 1;
+		while (std::find(keys.begin(), keys.end(), extra) != keys.end())
+			extra++;
+		REQUIRE(map.elem_update_userspace(&extra, buf.data(), 0) < 0);
+		REQUIRE(errno == E2BIG);
+		REQUIRE(map.elem_update_userspace(&keys[0], buf.data(),
+						  BPF_NOEXIST) < 0);
+		REQUIRE(errno == EEXIST);
+		for (uint32_t i = 0; i < 100; i++) {
+			uint64_t sum = 0;
+			REQUIRE(map.elem_lookup_aggregated_userspace(&keys[i],
+								     &sum) == 0);
+			REQUIRE(sum == (uint64_t)keys[i] * ncpu +
+					       (uint64_t)ncpu * (ncpu - 1) / 2);
+		}
+		// Deleting releases the slot
+		REQUIRE(map.elem_delete_userspace(&keys[0]) == 0);
+		REQUIRE(map.elem_lookup_userspace(&keys[0]) == nullptr);
+		REQUIRE(map.elem_update_userspace(&extra, buf.data(), 0) == 0);
+		uint32_t next_key;
+		const void *prev = nullptr;
+		int cnt = 0;
+		uint32_t key;
+		while (map.map_get_next_key(prev, &next_key) == 0) {
+			REQUIRE(next_key != keys[0]);
+			cnt++;
+			key = next_key;
+			prev = &key;
+		}
+		REQUIRE(cnt == 100);
+	}
+	SECTION("Test deleting and reinserting many keys")
+	{
+		per_cpu_hash_map_impl map(mem, 4, 8, 8);
+		std::vector<uint64_t> buf(ncpu);
+		// Far more keys than buckets go through the map, which only
+		// keeps working if deleted buckets are reclaimed
+		for (uint32_t i = 0; i < 100000; i++) {
+			buf[0] = i;
+			REQUIRE(map.elem_update_userspace(&i, buf.data(), 0) ==
+				0);
+			if (i >= 4) {
+				uint32_t old = i - 4;
+				REQUIRE(map.elem_delete_userspace(&old) == 0);
+				REQUIRE(map.elem_lookup_userspace(&old) ==
+					nullptr);
+			}
+		}
+		for (uint32_t i = 100000 - 4; i < 100000; i++) {
+			auto p = (uint64_t *)map.elem_lookup_userspace(&i);
+			REQUIRE(p != nullptr);
+			REQUIRE(p[0] == i);
+		}
+	}
+	SECTION("Test looking up while keys are reinserted")
+	{
+		per_cpu_hash_map_impl map(mem, 4, 8, 256);
+		std::atomic<bool> stop = false;
+		std::thread updater([&]() {
+			std::vector<uint64_t> vals(ncpu);
+			for (uint32_t i = 0; !stop; i++) {
+				uint32_t key = i % 128;
+				std::fill(vals.begin(), vals.end(), key);
+				map.elem_update_userspace(&key, vals.data(), 0);
+				uint32_t old = (i + 64) % 128;
+				map.elem_delete_userspace(&old);
+			}
+		});
+		for (uint32_t i = 0; i < 1000000; i++) {
+			uint32_t key = i % 128;
+			auto p = (uint64_t *)map.elem_lookup_userspace(&key);
+			// Either not yet written, or the value of this key
+			if (p != nullptr) {
+				auto val = __atomic_load_n(&p[0], __ATOMIC_RELAXED);
+				REQUIRE((val == 0 || val == key));
+			}
+		}
+		stop = true;
+		updater.join();
+	}
+}
+
+TEST_CASE("Test creating per cpu hash maps too large to fit")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const auto make_attr = [](uint32_t max_entries) {
+		return bpf_map_attr{ .type = (int)bpftime::bpf_map_type::
+					     BPF_MAP_TYPE_PERCPU_HASH,
+				     .key_size = 4,
+				     .value_size = 8,
+				     .max_ents = max_entries };
+	};
+	{
+		bpf_map_handler map("huge", mem, make_attr(1U << 31));
+		REQUIRE(map.map_init(mem) == -E2BIG);
+	}
+	{
+		bpf_map_handler map("large", mem, make_attr(1U << 24));
+		REQUIRE(map.map_init(mem) == -ENOMEM);
+	}
+	{
+		bpf_map_handler map("small", mem, make_attr(1000));
+		REQUIRE(map.map_init(mem) == 0);
+		map.map_free(mem);
+	}
 }
@@ -0,0 +1,255 @@
+#include "catch2/catch_message.hpp"
+#include "../common_def.hpp"
+#include <atomic>
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/interprocess_fwd.hpp>
+#include <bpftime_shm.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <handler/perf_event_handler.hpp>
+#include <linux/perf_event.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace boost::interprocess;
+using namespace bpftime;
+
+static const char *SHM_NAME = "BPFTIME_PERF_EVENT_OUTPUT_SHM";
+
+struct record {
+	uint32_t producer;
+	uint32_t seq;
+	uint8_t padding[20];
+};
+
+// Consume samples in the same way as libbpf's perf_buffer__poll
+template <class F>
+static int consume(software_perf_event_data &perf, F &&callback,
+		   uint64_t *lost = nullptr)
+{
+	auto &header = perf.get_header_ref();
+	auto data_size = perf.mmap_size();
+	auto base = (uint8_t *)perf.mmap_buffer.data() + perf.pagesize;
+	auto head = __atomic_load_n(&header.data_head, __ATOMIC_ACQUIRE);
+	auto tail = header.data_tail;
+	int cnt = 0;
+	std::vector<uint8_t> copied;
+	while (tail != head) {
+		auto offset = tail & (data_size - 1);
+		auto ehdr = (perf_event_header *)(base + offset);
+		perf_event_header hdr_copy;
+		// The header itself may wrap around too
+		if (offset + sizeof(hdr_copy) > data_size) {
+			auto len_first = data_size - offset;
+			memcpy(&hdr_copy, ehdr, len_first);
+			memcpy((uint8_t *)&hdr_copy + len_first, base,
+			       sizeof(hdr_copy) - len_first);
+			ehdr = &hdr_copy;
+		}
+		auto size = ehdr->size;
+		if (offset + size > data_size) {
+			auto len_first = data_size - offset;
+			copied.resize(size);
+			memcpy(copied.data(), base + offset, len_first);
+			memcpy(copied.data() + len_first, base,
+			       size - len_first);
+			ehdr = (perf_event_header *)copied.data();
+		}
+		if (ehdr->type == PERF_RECORD_LOST) {
+			// Space of dead producers is skipped with larger ones
+			REQUIRE(size >= sizeof(perf_sample_lost));
+			REQUIRE(lost != nullptr);
+			*lost += ((perf_sample_lost *)ehdr)->lost;
+		} else {
+			REQUIRE(ehdr->type == PERF_RECORD_SAMPLE);
+			auto sample = (perf_sample_raw *)ehdr;
+			callback(sample->data, sample->size);
+			cnt++;
+		}
+		tail += size;
+	}
+	__atomic_store_n(&header.data_tail, tail, __ATOMIC_RELEASE);
+	return cnt;
+}
+
+TEST_CASE("Test outputting to software perf event buffer")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	software_perf_event_data perf(0, 0, 0, mem);
+	const size_t data_size = 8 * getpagesize();
+	REQUIRE(perf.ensure_mmap_buffer(data_size + getpagesize()) != nullptr);
+
+	SECTION("Samples wrap around the end of the buffer")
+	{
+		uint32_t received = 0;
+		for (uint32_t i = 0; i < 10000; i++) {
+			record rec{ .producer = 0, .seq = i };
+			REQUIRE(perf.output_data(&rec, sizeof(rec)) == 0);
+			REQUIRE(consume(perf, [&](const void *data,
+						  uint32_t size) {
+					REQUIRE(size == sizeof(record));
+					REQUIRE(((record *)data)->seq == i);
+					received++;
+				}) == 1);
+		}
+		REQUIRE(received == 10000);
+	}
+	SECTION("Samples are dropped when the buffer is full")
+	{
+		record rec{};
+		const uint32_t per_buf =
+			data_size / (sizeof(perf_sample_raw) + sizeof(rec));
+		for (uint32_t i = 0; i < per_buf + 10; i++)
+			REQUIRE(perf.output_data(&rec, sizeof(rec)) == 0);
+		uint64_t lost = 0;
+		REQUIRE(consume(perf, [](auto, auto) {}, &lost) ==
+			(int)per_buf);
+		REQUIRE(lost == 0);
+		// Dropped samples are reported once there is space
+		REQUIRE(perf.output_data(&rec, sizeof(rec)) == 0);
+		REQUIRE(consume(perf, [](auto, auto) {}, &lost) == 1);
+		REQUIRE(lost == 10);
+		REQUIRE(perf.output_data(&rec, sizeof(rec)) == 0);
+		REQUIRE(consume(perf, [](auto, auto) {}, &lost) == 1);
+		REQUIRE(lost == 10);
+	}
+	SECTION("Concurrent producers")
+	{
+		const uint32_t producer_count = 4;
+		const uint32_t record_count = 20000;
+		std::atomic<uint32_t> running = producer_count;
+		std::vector<std::thread> producers;
+		std::vector<uint32_t> next_seq(producer_count, 0);
+		for (uint32_t i = 0; i < producer_count; i++) {
+			producers.emplace_back([&, i]() {
+				for (uint32_t j = 0; j < record_count; j++) {
+					record rec{ .producer = i, .seq = j };
+					perf.output_data(&rec, sizeof(rec));
+				}
+				running--;
+			});
+		}
+		bool ok = true;
+		uint64_t received = 0;
+		const auto on_sample = [&](const void *data, uint32_t size) {
+			auto rec = (const record *)data;
+			if (size != sizeof(record) ||
+			    rec->producer >= producer_count ||
+			    rec->seq < next_seq[rec->producer]) {
+				ok = false;
+				return;
+			}
+			next_seq[rec->producer] = rec->seq + 1;
+			received++;
+		};
+		uint64_t lost = 0;
+		while (running > 0)
+			consume(perf, on_sample, &lost);
+		for (auto &thd : producers)
+			thd.join();
+		consume(perf, on_sample, &lost);
+		// Flush the count of samples dropped at last
+		record rec{ .producer = 0, .seq = record_count };
+		REQUIRE(perf.output_data(&rec, sizeof(rec)) == 0);
+		consume(perf, on_sample, &lost);
+		REQUIRE(ok);
+		REQUIRE(received + lost == producer_count * record_count + 1);
+	}
+}
+
+TEST_CASE("Test skipping perf buffer space claimed by a dead producer")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	// Shared with the child, unlike one on the stack
+	auto perf = mem.construct<software_perf_event_data>(anonymous_instance)(
+		0, 0, 0, mem);
+	REQUIRE(perf->ensure_mmap_buffer(2 * getpagesize()) != nullptr);
+	record rec{ .producer = 0, .seq = 0 };
+	REQUIRE(perf->output_data(&rec, sizeof(rec)) == 0);
+	int pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		// Killed right after claiming space
+		ring_claim_ticket ticket;
+		perf->claim.begin(ticket);
+		uint64_t pos = perf->claim.position();
+		while (!perf->claim.try_claim(ticket, pos, 40))
+			;
+		_exit(0);
+	}
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	rec.seq = 1;
+	REQUIRE(perf->output_data(&rec, sizeof(rec)) == 0);
+	uint64_t lost = 0;
+	uint32_t next_seq = 0;
+	REQUIRE(consume(
+			*perf,
+			[&](const void *data, uint32_t size) {
+				REQUIRE(size == sizeof(record));
+				REQUIRE(((record *)data)->seq == next_seq++);
+			},
+			&lost) == 2);
+	REQUIRE(lost == 1);
+	mem.destroy_ptr(perf);
+}
+
+TEST_CASE("Test outputting to perf event arrays")
+{
+	setenv("BPFTIME_GLOBAL_SHM_NAME", "BPFTIME_PERF_EVENT_ARRAY_SHM", 1);
+	bpftime_initialize_global_shm(shm_open_type::SHM_REMOVE_AND_CREATE);
+	const auto page_size = getpagesize();
+	auto create_perf = [&]() {
+		int fd = bpftime_add_software_perf_event(
+			0, PERF_SAMPLE_RAW, PERF_COUNT_SW_BPF_OUTPUT);
+		REQUIRE(fd >= 0);
+		auto buf = bpftime_get_software_perf_event_raw_buffer(
+			fd, page_size * 2);
+		REQUIRE(buf != nullptr);
+		return std::make_pair(fd, (perf_event_mmap_page *)buf);
+	};
+	int map_fd = bpftime_maps_create(
+		-1, "perf",
+		bpf_map_attr{ .type = (int)bpftime::bpf_map_type::
+				      BPF_MAP_TYPE_PERF_EVENT_ARRAY,
+			      .key_size = 4,
+			      .value_size = 4,
+			      .max_ents = 4 });
+	REQUIRE(map_fd >= 0);
+	auto [fd_a, page_a] = create_perf();
+	auto [fd_b, page_b] = create_perf();
+	int32_t cpu = 1;
+	record rec{};
+	REQUIRE(bpftime_map_update_elem(map_fd, &cpu, &fd_a, 0) == 0);
+	REQUIRE(bpftime_perf_event_array_output(map_fd, cpu, &rec,
+						sizeof(rec)) == 0);
+	REQUIRE(bpftime_perf_event_array_output(map_fd, cpu, &rec,
+						sizeof(rec)) == 0);
+	const auto sample_size = page_a->data_head / 2;
+	REQUIRE(sample_size > 0);
+	// Outputs follow updates of the slot
+	REQUIRE(bpftime_map_update_elem(map_fd, &cpu, &fd_b, 0) == 0);
+	REQUIRE(bpftime_perf_event_array_output(map_fd, cpu, &rec,
+						sizeof(rec)) == 0);
+	REQUIRE(page_a->data_head == sample_size * 2);
+	REQUIRE(page_b->data_head == sample_size);
+	// And perf events closed and created again with the same fd
+	bpftime_close(fd_b);
+	close(fd_b);
+	auto [fd_c, page_c] = create_perf();
+	REQUIRE(fd_c == fd_b);
+	REQUIRE(bpftime_perf_event_array_output(map_fd, cpu, &rec,
+						sizeof(rec)) == 0);
+	REQUIRE(page_c->data_head == sample_size);
+	// Empty slots are rejected
+	cpu = 2;
+	REQUIRE(bpftime_perf_event_array_output(map_fd, cpu, &rec,
+						sizeof(rec)) < 0);
+	bpftime_remove_global_shm();
+}
@@ -0,0 +1,1183 @@
+#include "catch2/catch_message.hpp"
+#include "../common_def.hpp"
+#include <atomic>
+#include <chrono>
+#include <boost/interprocess/creation_tags.hpp>
+#include <boost/interprocess/interprocess_fwd.hpp>
+#include <bpf_map/ring_claim.hpp>
+#include <bpf_map/userspace/ringbuf_map.hpp>
+#include <bpftime_helper_group.hpp>
+#include <bpftime_prog.hpp>
+#include <bpftime_shm.hpp>
+#include <handler/epoll_handler.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <linux/bpf.h>
+#include <memory>
+#include <optional>
+#include <poll.h>
+#include <thread>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace boost::interprocess;
+using namespace bpftime;
+
+static const char *SHM_NAME = "BPFTIME_RINGBUF_SHM";
+
+static const uint32_t BUSY_BIT = 1U << 31;
+static const uint32_t DISCARD_BIT = 1U << 30;
+
+struct record {
+	uint32_t producer;
+	uint32_t seq;
+	// Make records of different sizes
+	uint64_t padding[3];
+};
+
+// Consume records in the same way as libbpf's ring_buffer__poll
+template <class F>
+static int consume(ringbuf_map_impl &map, uint32_t max_ent, F &&callback)
+{
+	auto cons_pos = (unsigned long *)map.get_consumer_page();
+	auto prod_pos = (unsigned long *)map.get_producer_page();
+	auto data = (uint8_t *)cons_pos + 2 * getpagesize();
+	int cnt = 0;
+	auto cons = __atomic_load_n(cons_pos, __ATOMIC_ACQUIRE);
+	while (cons < __atomic_load_n(prod_pos, __ATOMIC_ACQUIRE)) {
+		auto len_ptr = (uint32_t *)(data + (cons & (max_ent - 1)));
+		auto len = __atomic_load_n(len_ptr, __ATOMIC_ACQUIRE);
+		if (len & BUSY_BIT)
+			break;
+		if ((len & DISCARD_BIT) == 0) {
+			callback((uint8_t *)len_ptr + 8, len);
+			cnt++;
+		}
+		cons += ((len & ~DISCARD_BIT) + 8 + 7) / 8 * 8;
+		__atomic_store_n(cons_pos, cons, __ATOMIC_RELEASE);
+	}
+	return cnt;
+}
+
+TEST_CASE("Test concurrent producers of ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 1 << 16;
+	ringbuf_map_impl map(max_ent, mem);
+
+	const uint32_t producer_count = 4;
+	const uint32_t record_count = 20000;
+	std::vector<uint32_t> next_seq(producer_count, 0);
+	std::atomic<uint32_t> running = producer_count;
+	std::vector<std::thread> producers;
+	for (uint32_t i = 0; i < producer_count; i++) {
+		producers.emplace_back([&, i]() {
+			for (uint32_t j = 0; j < record_count; j++) {
+				auto size = sizeof(record) - (j % 3) * 8;
+				record *rec;
+				while ((rec = (record *)map.reserve(size, 0)) ==
+				       nullptr)
+					std::this_thread::yield();
+				rec->producer = i;
+				rec->seq = j;
+				// Discard some of them
+				map.submit(rec, j % 10 == 9);
+			}
+			running--;
+		});
+	}
+	uint32_t received = 0;
+	bool ok = true;
+	const auto on_record = [&](const uint8_t *ptr, uint32_t len) {
+		auto rec = (const record *)ptr;
+		if (len < 8 || rec->producer >= producer_count ||
+		    rec->seq < next_seq[rec->producer] || rec->seq % 10 == 9) {
+			ok = false;
+			return;
+		}
+		next_seq[rec->producer] = rec->seq + 1;
+		received++;
+	};
+	while (running > 0)
+		consume(map, max_ent, on_record);
+	for (auto &thd : producers)
+		thd.join();
+	consume(map, max_ent, on_record);
+	REQUIRE(ok);
+	REQUIRE(received == producer_count * (record_count / 10 * 9));
+}
+
+TEST_CASE("Test reserving from a full ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	REQUIRE(map.reserve(max_ent, 0) == nullptr);
+	REQUIRE(errno == E2BIG);
+	std::vector<void *> records;
+	void *ptr;
+	while ((ptr = map.reserve(120, 0)) != nullptr)
+		records.push_back(ptr);
+	REQUIRE(errno == ENOSPC);
+	REQUIRE(records.size() == max_ent / 128);
+	// Records are not visible until submitted
+	REQUIRE(consume(map, max_ent, [](auto, auto) {}) == 0);
+	for (auto rec : records)
+		map.submit(rec, false);
+	REQUIRE(consume(map, max_ent, [](auto, auto) {}) ==
+		(int)records.size());
+	REQUIRE(map.reserve(120, 0) != nullptr);
+}
+
+struct claimed_ring {
+	ring_claim claim;
+	uint64_t published = 0;
+};
+
+TEST_CASE("Test skipping ring space claimed by a dead producer")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	auto ring = mem.construct<claimed_ring>(anonymous_instance)();
+	ring_claim_ticket ticket;
+
+	pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		// Die between claiming and publishing
+		uint64_t pos = ring->claim.position();
+		if (!ring->claim.begin(ticket) ||
+		    !ring->claim.try_claim(ticket, pos, 16))
+			_exit(1);
+		_exit(0);
+	}
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+
+	uint64_t pos = ring->claim.position();
+	REQUIRE(pos == 16);
+	REQUIRE(ring->claim.begin(ticket));
+	REQUIRE(ring->claim.try_claim(ticket, pos, 24));
+	REQUIRE(ticket.prev_pid == pid);
+	REQUIRE(ticket.prev_start == 0);
+	std::vector<std::pair<uint64_t, uint64_t> > skipped;
+	ring->claim.wait_turn(ticket, &ring->published,
+			      [&](uint64_t start, uint64_t end) {
+				      skipped.emplace_back(start, end);
+			      });
+	REQUIRE(skipped == std::vector<std::pair<uint64_t, uint64_t> >{
+				   { 0, 16 } });
+	REQUIRE(ring->published == 16);
+	__atomic_store_n(&ring->published, ticket.end, __ATOMIC_RELEASE);
+	ring->claim.end(ticket);
+	mem.destroy_ptr(ring);
+}
+
+TEST_CASE("Test waiting for ring space claimed by a live producer")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	auto ring = mem.construct<claimed_ring>(anonymous_instance)();
+	ring_claim_ticket ticket;
+	int pipefd[2];
+	REQUIRE(pipe(pipefd) == 0);
+
+	pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		// Publish well after the timeout
+		uint64_t pos = ring->claim.position();
+		if (!ring->claim.begin(ticket) ||
+		    !ring->claim.try_claim(ticket, pos, 16))
+			_exit(1);
+		char c = 0;
+		if (write(pipefd[1], &c, 1) != 1)
+			_exit(1);
+		usleep(RING_CLAIM_TIMEOUT_MS * 10 * 1000);
+		__atomic_store_n(&ring->published, ticket.end,
+				 __ATOMIC_RELEASE);
+		ring->claim.end(ticket);
+		_exit(0);
+	}
+	char c;
+	REQUIRE(read(pipefd[0], &c, 1) == 1);
+	uint64_t pos = ring->claim.position();
+	REQUIRE(ring->claim.begin(ticket));
+	REQUIRE(ring->claim.try_claim(ticket, pos, 24));
+	REQUIRE(ticket.prev_pid == pid);
+	bool skipped = false;
+	ring->claim.wait_turn(ticket, &ring->published,
+			      [&](uint64_t, uint64_t) { skipped = true; });
+	REQUIRE(!skipped);
+	REQUIRE(ring->published == 16);
+	ring->claim.end(ticket);
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	mem.destroy_ptr(ring);
+}
+
+TEST_CASE("Test nested claims of ring space")
+{
+	ring_claim claim, other;
+	ring_claim_ticket outer, inner, nested;
+	REQUIRE(claim.begin(outer));
+	// As if a signal handler interrupted the claim
+	REQUIRE(!claim.begin(inner));
+	REQUIRE(errno == EBUSY);
+	REQUIRE(other.begin(nested));
+	other.end(nested);
+	REQUIRE(!claim.begin(inner));
+	claim.end(outer);
+	REQUIRE(claim.begin(inner));
+	claim.end(inner);
+}
+
+TEST_CASE("Test waiting for ringbuf in epoll")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	epoll_handler epoll(mem);
+	REQUIRE(epoll.add_file(map.create_impl_weak_ptr(),
+			       epoll_data_t{ .u64 = 0x1234 }) == 0);
+	epoll_event evts[4];
+
+	// Times out if nothing is published
+	REQUIRE(epoll.wait(evts, 4, 10) == 0);
+
+	std::thread producer([&]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		map.submit(map.reserve(8, 0), false);
+	});
+	REQUIRE(epoll.wait(evts, 4, 10000) == 1);
+	REQUIRE(evts[0].data.u64 == 0x1234);
+	producer.join();
+	// Level triggered, until the data is consumed
+	REQUIRE(epoll.wait(evts, 4, 0) == 1);
+	REQUIRE(consume(map, max_ent, [](auto, auto) {}) == 1);
+	REQUIRE(epoll.wait(evts, 4, 0) == 0);
+}
+
+TEST_CASE("Test closing epoll instances watching a ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	ringbuf_map_impl map(4096, mem);
+	std::vector<std::unique_ptr<epoll_handler> > epolls;
+	for (uint32_t i = 0; i < epoll_watchers::MAX_WATCHERS; i++) {
+		epolls.push_back(std::make_unique<epoll_handler>(mem));
+		REQUIRE(epolls.back()->add_file(map.create_impl_weak_ptr(),
+						epoll_data_t{ .u64 = i }) == 0);
+	}
+	epoll_handler extra(mem);
+	REQUIRE(extra.add_file(map.create_impl_weak_ptr(),
+			       epoll_data_t{ .u64 = 0 }) < 0);
+	// Closing an instance frees its slot
+	epolls[0]->remove_files();
+	REQUIRE(extra.add_file(map.create_impl_weak_ptr(),
+			       epoll_data_t{ .u64 = 0 }) == 0);
+	map.submit(map.reserve(8, 0), false);
+	epoll_event evts[4];
+	REQUIRE(extra.wait(evts, 4, 0) == 1);
+
+	// Slots of instances added by exited processes are reclaimed
+	pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		epolls[1]->remove_files();
+		epoll_handler child(mem);
+		_exit(child.add_file(map.create_impl_weak_ptr(),
+				     epoll_data_t{ .u64 = 0 }) == 0 ?
+			      0 :
+			      1);
+	}
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+	epoll_handler other(mem);
+	REQUIRE(other.add_file(map.create_impl_weak_ptr(),
+			       epoll_data_t{ .u64 = 0 }) == 0);
+	REQUIRE(other.wait(evts, 4, 0) == 1);
+}
+
+TEST_CASE("Test eventfd notification of ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	auto &notifier = map.get_eventfd_notifier();
+	int efd = notifier.enable();
+	REQUIRE(efd >= 0);
+	eventfd_t cnt;
+
+	// Not signaled unless the consumer armed it
+	map.submit(map.reserve(8, 0), false);
+	REQUIRE(eventfd_read(efd, &cnt) < 0);
+	REQUIRE(errno == EAGAIN);
+	REQUIRE(consume(map, max_ent, [](auto, auto) {}) == 1);
+
+	// A burst of records after arming signals only once
+	notifier.arm();
+	REQUIRE(!map.has_data());
+	for (int i = 0; i < 10; i++)
+		map.submit(map.reserve(8, 0), false);
+	REQUIRE(eventfd_read(efd, &cnt) == 0);
+	REQUIRE(cnt == 1);
+	REQUIRE(consume(map, max_ent, [](auto, auto) {}) == 10);
+	close(efd);
+}
+
+// Producers in other processes leave the first wake-up to their fetcher
+// thread, which makes it once it has received the eventfd
+static bool wait_readable(int fd)
+{
+	pollfd pfd = { fd, POLLIN, 0 };
+	return poll(&pfd, 1, 5000) == 1;
+}
+
+TEST_CASE("Test eventfd notification of ringbuf across processes")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	auto &notifier = map.get_eventfd_notifier();
+	int efd = notifier.enable();
+	REQUIRE(efd >= 0);
+	notifier.arm();
+	int go[2];
+	REQUIRE(pipe(go) == 0);
+	// The child gets the eventfd from us, which it could not with ptrace
+	// under Yama, as we are not its descendant
+	pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		auto buf = map.reserve(8, 0);
+		if (buf == nullptr)
+			_exit(1);
+		map.submit(buf, false);
+		char c;
+		_exit(read(go[0], &c, 1) == 1 ? 0 : 1);
+	}
+	REQUIRE(wait_readable(efd));
+	char c = 0;
+	REQUIRE(write(go[1], &c, 1) == 1);
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+	eventfd_t cnt;
+	REQUIRE(eventfd_read(efd, &cnt) == 0);
+	REQUIRE(cnt == 1);
+	REQUIRE(consume(map, max_ent, [](auto, auto) {}) == 1);
+	for (int fd : { go[0], go[1], efd })
+		close(fd);
+}
+
+// Eventfds open in this process
+static int count_eventfds()
+{
+	int cnt = 0;
+	for (int fd = 0; fd < 1024; fd++) {
+		char path[64], target[32];
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+		auto len = readlink(path, target, sizeof(target) - 1);
+		if (len < 0)
+			continue;
+		target[len] = 0;
+		if (strcmp(target, "anon_inode:[eventfd]") == 0)
+			cnt++;
+	}
+	return cnt;
+}
+
+TEST_CASE("Test closing eventfds received for destroyed ringbufs")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	std::optional<ringbuf_map_impl> destroyed;
+	destroyed.emplace(max_ent, mem);
+	ringbuf_map_impl kept(max_ent, mem);
+	int efd_destroyed = destroyed->get_eventfd_notifier().enable();
+	int efd_kept = kept.get_eventfd_notifier().enable();
+	REQUIRE(efd_destroyed >= 0);
+	REQUIRE(efd_kept >= 0);
+	destroyed->get_eventfd_notifier().arm();
+	kept.get_eventfd_notifier().arm();
+	int ready[2], go[2];
+	REQUIRE(pipe(ready) == 0);
+	REQUIRE(pipe(go) == 0);
+	pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		// Inherited from the parent, along with the eventfd our
+		// fetcher sleeps on
+		int base = count_eventfds();
+		destroyed->submit(destroyed->reserve(8, 0), false);
+		char c = 0;
+		bool ok = write(ready[1], &c, 1) == 1 &&
+			  read(go[0], &c, 1) == 1 &&
+			  count_eventfds() == base + 1;
+		// Closed on signaling any other notifier
+		kept.submit(kept.reserve(8, 0), false);
+		ok = ok && write(ready[1], &c, 1) == 1 &&
+		     read(go[0], &c, 1) == 1 && count_eventfds() == base + 1;
+		_exit(ok ? 0 : 1);
+	}
+	char c;
+	REQUIRE(read(ready[0], &c, 1) == 1);
+	// Received by the child by now
+	REQUIRE(wait_readable(efd_destroyed));
+	destroyed.reset();
+	REQUIRE(write(go[1], &c, 1) == 1);
+	REQUIRE(read(ready[0], &c, 1) == 1);
+	REQUIRE(wait_readable(efd_kept));
+	REQUIRE(write(go[1], &c, 1) == 1);
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+	eventfd_t cnt;
+	REQUIRE(eventfd_read(efd_kept, &cnt) == 0);
+	for (int fd : { ready[0], ready[1], go[0], go[1], efd_destroyed,
+			efd_kept })
+		close(fd);
+}
+
+TEST_CASE("Test signaling eventfds of stuck consumers")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	int ready[2];
+	REQUIRE(pipe(ready) == 0);
+	// A consumer that never answers for its eventfd
+	pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+				   "bpftime_eventfd_%d", getpid());
+		char c = 0;
+		if (bind(sock, (sockaddr *)&addr,
+			 offsetof(sockaddr_un, sun_path) + 1 + len) < 0 ||
+		    listen(sock, 16) < 0 || write(ready[1], &c, 1) != 1)
+			_exit(1);
+		pause();
+		_exit(0);
+	}
+	char c;
+	REQUIRE(read(ready[0], &c, 1) == 1);
+	auto &notifier = map.get_eventfd_notifier();
+	notifier.owner_pid = pid;
+	notifier.owner_fd = 3;
+	notifier.id = 1;
+	const auto submit = [&]() {
+		notifier.arm();
+		auto start = std::chrono::steady_clock::now();
+		map.submit(map.reserve(8, 0), false);
+		return std::chrono::steady_clock::now() - start;
+	};
+	// Producers leave waiting for it to the fetcher
+	REQUIRE(submit() < std::chrono::milliseconds(50));
+	REQUIRE(submit() < std::chrono::milliseconds(50));
+	kill(pid, SIGKILL);
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	close(ready[0]);
+	close(ready[1]);
+}
+
+TEST_CASE("Test consuming ringbuf in batches")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	auto cons_pos = (unsigned long *)map.get_consumer_page();
+	ringbuf_sample samples[16];
+	unsigned long batch_end;
+
+	for (uint32_t i = 0; i < 10; i++) {
+		auto rec = (record *)map.reserve(sizeof(record), 0);
+		REQUIRE(rec != nullptr);
+		rec->seq = i;
+		// Discarded records are skipped
+		map.submit(rec, i % 3 == 0);
+	}
+	// A record being written ends the batch
+	auto busy = (record *)map.reserve(sizeof(record), 0);
+	REQUIRE(busy != nullptr);
+
+	REQUIRE(map.peek_batch(samples, 4, &batch_end) == 4);
+	// Peeking doesn't consume anything
+	REQUIRE(*cons_pos == 0);
+	REQUIRE(map.peek_batch(samples, 16, &batch_end) == 6);
+	uint32_t expected[] = { 1, 2, 4, 5, 7, 8 };
+	for (int i = 0; i < 6; i++) {
+		REQUIRE(samples[i].size == sizeof(record));
+		REQUIRE(((record *)samples[i].data)->seq == expected[i]);
+	}
+	REQUIRE(map.commit_batch(batch_end) == 0);
+	REQUIRE(*cons_pos == batch_end);
+	REQUIRE(map.peek_batch(samples, 16, &batch_end) == 0);
+	REQUIRE(batch_end == *cons_pos);
+
+	map.submit(busy, false);
+	REQUIRE(map.peek_batch(samples, 16, &batch_end) == 1);
+	REQUIRE(samples[0].data == busy);
+	REQUIRE(map.commit_batch(batch_end + 8) < 0);
+	REQUIRE(map.commit_batch(batch_end) == 0);
+	REQUIRE(!map.has_data());
+}
+
+TEST_CASE("Test wakeup flags of ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	auto &notifier = map.get_eventfd_notifier();
+	int efd = notifier.enable();
+	REQUIRE(efd >= 0);
+	eventfd_t cnt;
+	notifier.arm();
+
+	map.submit(map.reserve(8, 0), false, BPF_RB_NO_WAKEUP);
+	REQUIRE(eventfd_read(efd, &cnt) < 0);
+	// The consumer hasn't caught up with this record, so it isn't
+	// sleeping
+	map.submit(map.reserve(8, 0), false);
+	REQUIRE(eventfd_read(efd, &cnt) < 0);
+	REQUIRE(map.query(BPF_RB_AVAIL_DATA) == 32);
+	map.submit(map.reserve(8, 0), false, BPF_RB_FORCE_WAKEUP);
+	REQUIRE(eventfd_read(efd, &cnt) == 0);
+
+	// Wake up once there is enough data
+	notifier.arm();
+	map.set_wakeup_watermark(80);
+	map.submit(map.reserve(8, 0), false);
+	REQUIRE(eventfd_read(efd, &cnt) < 0);
+	map.submit(map.reserve(8, 0), false);
+	REQUIRE(eventfd_read(efd, &cnt) == 0);
+	REQUIRE(map.query(BPF_RB_AVAIL_DATA) == 80);
+	REQUIRE(map.query(BPF_RB_PROD_POS) == 80);
+
+	REQUIRE(consume(map, max_ent, [](auto, auto) {}) == 5);
+	REQUIRE(map.query(BPF_RB_CONS_POS) == 80);
+	REQUIRE(map.query(BPF_RB_AVAIL_DATA) == 0);
+	REQUIRE(map.query(BPF_RB_RING_SIZE) == max_ent);
+	// The consumer has caught up, so it may be sleeping
+	notifier.arm();
+	map.submit(map.reserve(8, 0), false);
+	REQUIRE(eventfd_read(efd, &cnt) == 0);
+	close(efd);
+}
+
+// Parse records copied by `snapshot`
+static std::vector<uint32_t> parse_snapshot(const uint8_t *buf, long size)
+{
+	std::vector<uint32_t> seqs;
+	long pos = 0;
+	while (pos < size) {
+		auto len = *(uint32_t *)(buf + pos);
+		REQUIRE((len & BUSY_BIT) == 0);
+		if ((len & DISCARD_BIT) == 0)
+			seqs.push_back(((record *)(buf + pos + 8))->seq);
+		pos += ((len & ~DISCARD_BIT) + 8 + 7) / 8 * 8;
+	}
+	REQUIRE(pos == size);
+	return seqs;
+}
+
+TEST_CASE("Test overwrite mode of ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	// Each record takes 40 bytes
+	const uint32_t rec_per_buf = max_ent / 40;
+	ringbuf_map_impl map(max_ent, mem, true);
+	std::vector<uint8_t> buf(max_ent);
+
+	SECTION("Keep the newest records")
+	{
+		for (uint32_t i = 0; i < rec_per_buf * 3 + 5; i++) {
+			auto rec = (record *)map.reserve(sizeof(record), 0);
+			REQUIRE(rec != nullptr);
+			rec->seq = i;
+			map.submit(rec, false);
+		}
+		auto size = map.snapshot(buf.data(), buf.size());
+		auto seqs = parse_snapshot(buf.data(), size);
+		REQUIRE(seqs.size() == rec_per_buf);
+		for (uint32_t i = 0; i < seqs.size(); i++)
+			REQUIRE(seqs[i] == rec_per_buf * 2 + 5 + i);
+		REQUIRE(map.snapshot(buf.data(), max_ent - 1) < 0);
+	}
+	SECTION("Snapshot while producing")
+	{
+		std::atomic<bool> stop = false;
+		std::vector<std::thread> producers;
+		for (uint32_t i = 0; i < 2; i++) {
+			producers.emplace_back([&, i]() {
+				uint32_t seq = 0;
+				while (!stop.load()) {
+					auto rec = (record *)map.reserve(
+						sizeof(record), 0);
+					// The oldest record is still being
+					// written by the other producer
+					if (rec == nullptr)
+						continue;
+					rec->producer = i;
+					rec->seq = seq++;
+					map.submit(rec, false);
+				}
+			});
+		}
+		for (int i = 0; i < 1000; i++) {
+			auto size = map.snapshot(buf.data(), buf.size());
+			REQUIRE(size >= 0);
+			long pos = 0;
+			uint32_t last_seq[2] = { 0, 0 };
+			bool seen[2] = { false, false };
+			// Records of each producer are kept in order
+			while (pos < size) {
+				auto rec = (record *)(buf.data() + pos + 8);
+				REQUIRE(rec->producer < 2);
+				if (seen[rec->producer])
+					REQUIRE(rec->seq ==
+						last_seq[rec->producer] + 1);
+				seen[rec->producer] = true;
+				last_seq[rec->producer] = rec->seq;
+				pos += 40;
+			}
+			REQUIRE(pos == size);
+		}
+		stop.store(true);
+		for (auto &thd : producers)
+			thd.join();
+	}
+}
+
+struct drain_state {
+	ringbuf_map_impl *map;
+	std::vector<uint32_t> seqs;
+	uint32_t stop_at;
+	long nested_ret;
+};
+
+static long drain_record(void *data, uint32_t size, void *ctx)
+{
+	auto state = (drain_state *)ctx;
+	if (size != sizeof(record))
+		return 1;
+	auto seq = ((record *)data)->seq;
+	state->seqs.push_back(seq);
+	// Draining from the callback must not consume anything
+	state->nested_ret = state->map->drain(drain_record, ctx, 1);
+	return seq == state->stop_at;
+}
+
+TEST_CASE("Test draining user ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	auto cons_pos = (unsigned long *)map.get_consumer_page();
+
+	for (uint32_t i = 0; i < 10; i++) {
+		auto rec = (record *)map.reserve(sizeof(record), 0);
+		REQUIRE(rec != nullptr);
+		rec->seq = i;
+		map.submit(rec, i == 2);
+	}
+	drain_state state{ .map = &map, .seqs = {}, .stop_at = 4,
+			   .nested_ret = 0 };
+	// Stops after the callback returns nonzero, the record is consumed
+	REQUIRE(map.drain(drain_record, &state, 100) == 4);
+	REQUIRE(state.seqs == std::vector<uint32_t>{ 0, 1, 3, 4 });
+	REQUIRE(state.nested_ret == -1);
+	REQUIRE(errno == EBUSY);
+	auto consumed = *cons_pos;
+	REQUIRE(consumed > 0);
+
+	state.seqs.clear();
+	REQUIRE(map.drain(drain_record, &state, 2) == 2);
+	REQUIRE(state.seqs == std::vector<uint32_t>{ 5, 6 });
+	REQUIRE(*cons_pos > consumed);
+
+	// A record being written stops draining
+	auto busy = (record *)map.reserve(sizeof(record), 0);
+	REQUIRE(busy != nullptr);
+	busy->seq = 10;
+	state.seqs.clear();
+	REQUIRE(map.drain(drain_record, &state, 100) == 3);
+	REQUIRE(state.seqs == std::vector<uint32_t>{ 7, 8, 9 });
+	REQUIRE(map.drain(drain_record, &state, 100) == 0);
+	map.submit(busy, false);
+	REQUIRE(map.drain(drain_record, &state, 100) == 1);
+	REQUIRE(state.seqs.back() == 10);
+	REQUIRE(!map.has_data());
+}
+
+TEST_CASE("Test draining user ringbuf after the drainer died")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	ringbuf_map_impl map(4096, mem);
+	for (uint32_t i = 0; i < 3; i++) {
+		auto rec = (record *)map.reserve(sizeof(record), 0);
+		REQUIRE(rec != nullptr);
+		rec->seq = i;
+		map.submit(rec, false);
+	}
+	pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		// Die in the middle of draining
+		map.drain([](void *, uint32_t, void *) -> long { _exit(0); },
+			  nullptr, 100);
+		_exit(1);
+	}
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+	drain_state state{ .map = &map, .seqs = {}, .stop_at = 100,
+			   .nested_ret = 0 };
+	REQUIRE(map.drain(drain_record, &state, 100) == 3);
+	REQUIRE(state.seqs == std::vector<uint32_t>{ 0, 1, 2 });
+	REQUIRE(state.nested_ret == -1);
+}
+
+TEST_CASE("Test programs draining user ringbuf")
+{
+	setenv("BPFTIME_GLOBAL_SHM_NAME", "BPFTIME_USER_RINGBUF_SHM", 1);
+	bpftime_initialize_global_shm(shm_open_type::SHM_REMOVE_AND_CREATE);
+	int map_fd = bpftime_maps_create(
+		-1, "user_ringbuf",
+		bpf_map_attr{ .type = (int)bpftime::bpf_map_type::
+				      BPF_MAP_TYPE_USER_RINGBUF,
+			      .max_ents = 4096 });
+	REQUIRE(map_fd >= 0);
+	std::vector<ebpf_inst> insns = {
+		// mov r6, r1
+		{ .code = 0xbf, .dst_reg = 6, .src_reg = 1 },
+		// lddw r1, map_fd
+		{ .code = 0x18, .dst_reg = 1, .src_reg = 1, .imm = map_fd },
+		{},
+		// lddw r2, callback, which is a subprogram at pc 10
+		{ .code = 0x18, .dst_reg = 2, .src_reg = 4, .imm = 6 },
+		{},
+		// mov r3, r6
+		{ .code = 0xbf, .dst_reg = 3, .src_reg = 6 },
+		// mov r4, 0
+		{ .code = 0xb7, .dst_reg = 4 },
+		// call bpf_user_ringbuf_drain
+		{ .code = 0x85, .imm = 209 },
+		// exit
+		{ .code = 0x95 },
+		// Unreachable, so that the callback isn't the next instruction
+		{ .code = 0x95 },
+		// callback: mov r6, r2
+		{ .code = 0xbf, .dst_reg = 6, .src_reg = 2 },
+		// mov r2, 0
+		{ .code = 0xb7, .dst_reg = 2 },
+		// mov r3, sizeof(record)
+		{ .code = 0xb7, .dst_reg = 3, .imm = sizeof(record) },
+		// call bpf_dynptr_data
+		{ .code = 0x85, .imm = 203 },
+		// jne r0, 0, +2
+		{ .code = 0x55, .off = 2 },
+		// mov r0, 1
+		{ .code = 0xb7, .imm = 1 },
+		// exit
+		{ .code = 0x95 },
+		// ldxw r1, [r0 + offsetof(record, seq)]
+		{ .code = 0x61,
+		  .dst_reg = 1,
+		  .off = offsetof(record, seq) },
+		// ldxdw r2, [r6]
+		{ .code = 0x79, .dst_reg = 2, .src_reg = 6 },
+		// add r2, 1
+		{ .code = 0x07, .dst_reg = 2, .imm = 1 },
+		// stxdw [r6], r2
+		{ .code = 0x7b, .dst_reg = 6, .src_reg = 2 },
+		// lsh r2, 3
+		{ .code = 0x67, .dst_reg = 2, .imm = 3 },
+		// add r2, r6
+		{ .code = 0x0f, .dst_reg = 2, .src_reg = 6 },
+		// stxdw [r2], r1
+		{ .code = 0x7b, .dst_reg = 2, .src_reg = 1 },
+		// Stop after the record with seq 4. mov r0, 0
+		{ .code = 0xb7 },
+		// jne r1, 4, +1
+		{ .code = 0x55, .dst_reg = 1, .off = 1, .imm = 4 },
+		// mov r0, 1
+		{ .code = 0xb7, .imm = 1 },
+		// exit
+		{ .code = 0x95 },
+	};
+	for (bool threaded : { false, true }) {
+		// Userspace produces records the way programs do
+		for (uint32_t i = 0; i < 7; i++) {
+			auto rec = (record *)bpftime_ringbuf_reserve(
+				map_fd, sizeof(record));
+			REQUIRE(rec != nullptr);
+			rec->seq = i;
+			bpftime_ringbuf_submit(map_fd, rec, i == 2, 0);
+		}
+		bpftime_prog prog(insns.data(), insns.size(), "drain");
+		REQUIRE(bpftime_helper_group::get_kernel_utils_helper_group()
+				.add_helper_group_to_prog(&prog) == 0);
+		prog.bpftime_prog_toggle_threaded_interpreter(threaded);
+		REQUIRE(prog.bpftime_prog_load(false) == 0);
+		// The count of records seen, followed by their seqs
+		uint64_t seen[16] = {};
+		uint64_t ret;
+		REQUIRE(prog.bpftime_prog_exec(seen, sizeof(seen), &ret) == 0);
+		// The discarded record is skipped, and the one stopping the
+		// callback is consumed
+		REQUIRE(ret == 4);
+		REQUIRE(seen[0] == 4);
+		REQUIRE(std::vector<uint64_t>(seen + 1, seen + 5) ==
+			std::vector<uint64_t>{ 0, 1, 3, 4 });
+		memset(seen, 0, sizeof(seen));
+		REQUIRE(prog.bpftime_prog_exec(seen, sizeof(seen), &ret) == 0);
+		REQUIRE(ret == 2);
+		REQUIRE(std::vector<uint64_t>(seen + 1, seen + 3) ==
+			std::vector<uint64_t>{ 5, 6 });
+		REQUIRE(prog.bpftime_prog_exec(seen, sizeof(seen), &ret) == 0);
+		REQUIRE(ret == 0);
+	}
+	bpftime_remove_global_shm();
+}
+
+TEST_CASE("Test fan-out consumers of ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	auto cons_pos = (unsigned long *)map.get_consumer_page();
+	ringbuf_sample samples[256];
+	unsigned long end_a, end_b;
+
+	int a = map.add_consumer();
+	int b = map.add_consumer();
+	REQUIRE(a >= 0);
+	REQUIRE(b >= 0);
+	REQUIRE(a != b);
+	for (uint32_t i = 0; i < 10; i++) {
+		auto rec = (record *)map.reserve(sizeof(record), 0);
+		REQUIRE(rec != nullptr);
+		rec->seq = i;
+		map.submit(rec, false);
+	}
+	// Each consumer reads all records
+	REQUIRE(map.peek_consumer_batch(a, samples, 256, &end_a) == 10);
+	REQUIRE(map.commit_consumer_batch(a, end_a) == 0);
+	REQUIRE(map.peek_consumer_batch(a, samples, 256, &end_a) == 0);
+	// The space is kept for the slower one
+	REQUIRE(*cons_pos == 0);
+	REQUIRE(map.commit_batch(end_a) < 0);
+	REQUIRE(errno == EBUSY);
+	REQUIRE(map.peek_consumer_batch(b, samples, 256, &end_b) == 10);
+	for (uint32_t i = 0; i < 10; i++)
+		REQUIRE(((record *)samples[i].data)->seq == i);
+	REQUIRE(map.commit_consumer_batch(b, end_b) == 0);
+	REQUIRE(*cons_pos == end_b);
+
+	// Fill the ringbuf, while only `a` keeps up
+	int produced = 0;
+	while (true) {
+		auto rec = (record *)map.reserve(sizeof(record), 0);
+		if (rec == nullptr)
+			break;
+		map.submit(rec, false);
+		produced++;
+	}
+	REQUIRE(errno == ENOSPC);
+	REQUIRE(map.peek_consumer_batch(a, samples, 256, &end_a) == produced);
+	REQUIRE(map.commit_consumer_batch(a, end_a) == 0);
+	REQUIRE(map.reserve(sizeof(record), 0) == nullptr);
+
+	// Leave `b` behind for `a`
+	map.set_detach_slow_consumers(true);
+	auto rec = (record *)map.reserve(sizeof(record), 0);
+	REQUIRE(rec != nullptr);
+	map.submit(rec, false);
+	REQUIRE(map.peek_consumer_batch(b, samples, 256, &end_b) < 0);
+	REQUIRE(errno == EPIPE);
+	REQUIRE(map.commit_consumer_batch(b, end_b) < 0);
+	REQUIRE(errno == EPIPE);
+	REQUIRE(map.remove_consumer(b) == 0);
+	REQUIRE(map.remove_consumer(b) < 0);
+
+	// With a single consumer, it's just full
+	while ((rec = (record *)map.reserve(sizeof(record), 0)) != nullptr)
+		map.submit(rec, false);
+	REQUIRE(errno == ENOSPC);
+	REQUIRE(map.peek_consumer_batch(a, samples, 256, &end_a) > 0);
+	REQUIRE(map.commit_consumer_batch(a, end_a) == 0);
+	REQUIRE(*cons_pos == end_a);
+	REQUIRE(map.remove_consumer(a) == 0);
+	REQUIRE(map.commit_batch(end_a) == 0);
+}
+
+TEST_CASE("Test waking up fan-out consumers of ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	auto cons_pos = (unsigned long *)map.get_consumer_page();
+	auto &notifier = map.get_eventfd_notifier();
+	int efd = notifier.enable();
+	REQUIRE(efd >= 0);
+	eventfd_t cnt;
+	ringbuf_sample samples[256];
+	unsigned long end_a, end_b;
+	int a = map.add_consumer();
+	int b = map.add_consumer();
+	REQUIRE(a >= 0);
+	REQUIRE(b >= 0);
+
+	notifier.arm();
+	map.submit(map.reserve(8, 0), false);
+	REQUIRE(eventfd_read(efd, &cnt) == 0);
+	// `a` has caught up and may be sleeping, even though `b` hasn't
+	REQUIRE(map.peek_consumer_batch(a, samples, 256, &end_a) == 1);
+	REQUIRE(map.commit_consumer_batch(a, end_a) == 0);
+	notifier.arm();
+	map.submit(map.reserve(8, 0), false);
+	REQUIRE(eventfd_read(efd, &cnt) == 0);
+	// Neither of them has caught up
+	notifier.arm();
+	map.submit(map.reserve(8, 0), false);
+	REQUIRE(eventfd_read(efd, &cnt) < 0);
+
+	// Storing to the mapped consumer position doesn't release records
+	// `b` hasn't read
+	*cons_pos = map.query(BPF_RB_PROD_POS);
+	int produced = 3;
+	while (map.reserve(8, 0) != nullptr)
+		produced++;
+	REQUIRE(errno == ENOSPC);
+	REQUIRE(produced == max_ent / 16);
+	REQUIRE(map.peek_consumer_batch(a, samples, 256, &end_a) > 0);
+	REQUIRE(map.commit_consumer_batch(a, end_a) == 0);
+	REQUIRE(*cons_pos == 0);
+	REQUIRE(map.peek_consumer_batch(b, samples, 256, &end_b) > 0);
+	REQUIRE(map.commit_consumer_batch(b, end_b) == 0);
+	REQUIRE(*cons_pos == end_b);
+	close(efd);
+}
+
+TEST_CASE("Test concurrent fan-out consumers of ringbuf")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	const uint32_t total = 20000;
+	const int nr_consumers = 3;
+	ringbuf_map_impl map(max_ent, mem);
+
+	int ids[nr_consumers];
+	for (int i = 0; i < nr_consumers; i++)
+		ids[i] = map.add_consumer();
+	std::vector<std::thread> consumers;
+	uint32_t received[nr_consumers] = {};
+	bool in_order[nr_consumers] = { true, true, true };
+	for (int i = 0; i < nr_consumers; i++) {
+		consumers.emplace_back([&, i]() {
+			ringbuf_sample samples[64];
+			unsigned long end;
+			while (received[i] < total) {
+				int cnt = map.peek_consumer_batch(
+					ids[i], samples, 64, &end);
+				if (cnt < 0)
+					break;
+				for (int j = 0; j < cnt; j++) {
+					auto seq =
+						((record *)samples[j].data)->seq;
+					if (seq != received[i])
+						in_order[i] = false;
+					received[i]++;
+				}
+				if (map.commit_consumer_batch(ids[i], end) < 0)
+					break;
+				if (cnt == 0)
+					std::this_thread::yield();
+			}
+		});
+	}
+	for (uint32_t i = 0; i < total;) {
+		auto rec = (record *)map.reserve(sizeof(record), 0);
+		if (rec == nullptr) {
+			std::this_thread::yield();
+			continue;
+		}
+		rec->seq = i++;
+		map.submit(rec, false);
+	}
+	for (auto &t : consumers)
+		t.join();
+	for (int i = 0; i < nr_consumers; i++) {
+		REQUIRE(received[i] == total);
+		REQUIRE(in_order[i]);
+	}
+	REQUIRE(map.query(BPF_RB_AVAIL_DATA) == 0);
+}
+
+TEST_CASE("Test shrinking ringbuf records")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	auto prod_pos = (unsigned long *)map.get_producer_page();
+	std::vector<uint32_t> sizes;
+	const auto on_record = [&](const uint8_t *, uint32_t len) {
+		sizes.push_back(len);
+	};
+
+	// The last record gives the space back
+	auto rec = (uint8_t *)map.reserve(200, 0);
+	REQUIRE(rec != nullptr);
+	map.shrink(rec, 10);
+	REQUIRE(*prod_pos == 24);
+	map.submit(rec, false);
+	REQUIRE(consume(map, max_ent, on_record) == 1);
+	REQUIRE(sizes == std::vector<uint32_t>{ 10 });
+
+	// Otherwise the rest is skipped by consumers
+	sizes.clear();
+	auto first = (uint8_t *)map.reserve(200, 0);
+	auto second = (uint8_t *)map.reserve(16, 0);
+	REQUIRE(first != nullptr);
+	REQUIRE(second != nullptr);
+	map.shrink(first, 10);
+	REQUIRE(*prod_pos == 24 + 208 + 24);
+	map.submit(first, false);
+	// Stopped by the record being written
+	REQUIRE(consume(map, max_ent, on_record) == 1);
+	map.submit(second, false);
+	REQUIRE(consume(map, max_ent, on_record) == 1);
+	REQUIRE(sizes == std::vector<uint32_t>{ 10, 16 });
+	REQUIRE(!map.has_data());
+}
+
+TEST_CASE("Test shrinking ringbuf records at the end of the data area")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 4096;
+	ringbuf_map_impl map(max_ent, mem);
+	auto cons_pos = (unsigned long *)map.get_consumer_page();
+	auto prod_pos = (unsigned long *)map.get_producer_page();
+	std::vector<uint32_t> sizes;
+	const auto on_record = [&](const uint8_t *, uint32_t len) {
+		sizes.push_back(len);
+	};
+
+	// Move to the last 16 bytes of the data area
+	auto filler = (uint8_t *)map.reserve(max_ent - 16 - 8, 0);
+	REQUIRE(filler != nullptr);
+	memset(filler, 0, max_ent - 16 - 8);
+	map.submit(filler, false);
+	REQUIRE(consume(map, max_ent, on_record) == 1);
+	sizes.clear();
+
+	// The shrunk record ends past the end of the data area, so its tail
+	// is at the start of it
+	auto first = (uint8_t *)map.reserve(200, 0);
+	auto second = (uint8_t *)map.reserve(16, 0);
+	REQUIRE(first != nullptr);
+	REQUIRE(second != nullptr);
+	map.shrink(first, 10);
+	REQUIRE(*prod_pos == max_ent - 16 + 208 + 24);
+	map.submit(first, false);
+	REQUIRE(consume(map, max_ent, on_record) == 1);
+	REQUIRE(*cons_pos == max_ent - 16 + 208);
+	map.submit(second, false);
+	REQUIRE(consume(map, max_ent, on_record) == 1);
+	REQUIRE(sizes == std::vector<uint32_t>{ 10, 16 });
+	REQUIRE(*cons_pos == *prod_pos);
+	REQUIRE(!map.has_data());
+}
+
+TEST_CASE("Test concurrent producers shrinking ringbuf records")
+{
+	shm_remove remover(SHM_NAME);
+	managed_shared_memory mem(create_only, SHM_NAME, 20 << 20);
+	const uint32_t max_ent = 1 << 14;
+	ringbuf_map_impl map(max_ent, mem);
+
+	const uint32_t producer_count = 4;
+	const uint32_t record_count = 20000;
+	std::vector<uint32_t> next_seq(producer_count, 0);
+	std::atomic<uint32_t> running = producer_count;
+	std::vector<std::thread> producers;
+	for (uint32_t i = 0; i < producer_count; i++) {
+		producers.emplace_back([&, i]() {
+			for (uint32_t j = 0; j < record_count; j++) {
+				record *rec;
+				while ((rec = (record *)map.reserve(256, 0)) ==
+				       nullptr)
+					std::this_thread::yield();
+				rec->producer = i;
+				rec->seq = j;
+				// Sizes that don't fill the last 8 bytes too
+				map.shrink(rec, 8 + j % 25);
+				map.submit(rec, false);
+			}
+			running--;
+		});
+	}
+	uint32_t received = 0;
+	bool ok = true;
+	const auto on_record = [&](const uint8_t *ptr, uint32_t len) {
+		auto rec = (const record *)ptr;
+		if (rec->producer >= producer_count ||
+		    rec->seq != next_seq[rec->producer] ||
+		    len != 8 + rec->seq % 25) {
+			ok = false;
+			return;
+		}
+		next_seq[rec->producer] = rec->seq + 1;
+		received++;
+	};
+	while (running > 0)
+		consume(map, max_ent, on_record);
+	for (auto &thd : producers)
+		thd.join();
+	consume(map, max_ent, on_record);
+	REQUIRE(ok);
+	REQUIRE(received == producer_count * record_count);
+}
@@ -0,0 +1,180 @@
+#include <bpftime_helper_group.hpp>
+#include <bpftime_prog.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace bpftime;
+
+static uint64_t add_helper(uint64_t a, uint64_t b, uint64_t, uint64_t,
+			   uint64_t)
+{
+	return a + b * 100;
+}
+
+// r0 = helper_1(*(u32 *)ctx, imm), then exit
+static std::vector<ebpf_inst> make_insns(int32_t imm)
+{
+	return {
+		// ldxw r1, [r1]
+		{ .code = 0x61, .dst_reg = 1, .src_reg = 1 },
+		// mov r2, imm
+		{ .code = 0xb7, .dst_reg = 2, .imm = imm },
+		// call 1
+		{ .code = 0x85, .imm = 1 },
+		// exit
+		{ .code = 0x95 },
+	};
+}
+
+static void register_helper(bpftime_prog &prog)
+{
+	REQUIRE(prog.bpftime_prog_register_raw_helper(bpftime_helper_info{
+			.index = 1, .name = "add", .fn = (void *)add_helper }) ==
+		0);
+}
+
+TEST_CASE("Test loading programs from AOT objects")
+{
+	auto insns = make_insns(3);
+	uint32_t ctx = 5;
+	uint64_t ret = 0;
+	{
+		bpftime_prog prog(insns.data(), insns.size(), "garbage");
+		register_helper(prog);
+		const char garbage[] = "not an object";
+		REQUIRE(prog.bpftime_prog_load_aot(garbage, sizeof(garbage)) <
+			0);
+		// The program still works without the object
+		REQUIRE(prog.bpftime_prog_load(false) == 0);
+		REQUIRE(prog.bpftime_prog_exec(&ctx, sizeof(ctx), &ret) == 0);
+		REQUIRE(ret == 305);
+	}
+	std::vector<uint8_t> obj;
+	bpftime_prog compiler(insns.data(), insns.size(), "compiler");
+	register_helper(compiler);
+#ifndef BPFTIME_LLVM_JIT
+	// Only the LLVM JIT compiles AOT objects
+	REQUIRE(compiler.bpftime_prog_compile_aot(obj) < 0);
+#else
+	REQUIRE(compiler.bpftime_prog_compile_aot(obj) == 0);
+	REQUIRE(!obj.empty());
+	SECTION("Load the object")
+	{
+		bpftime_prog prog(insns.data(), insns.size(), "loader");
+		register_helper(prog);
+		REQUIRE(prog.bpftime_prog_load_aot(obj.data(), obj.size()) ==
+			0);
+		REQUIRE(prog.bpftime_prog_exec(&ctx, sizeof(ctx), &ret) == 0);
+		REQUIRE(ret == 305);
+	}
+	SECTION("Reject objects of other instructions")
+	{
+		auto other_insns = make_insns(4);
+		bpftime_prog prog(other_insns.data(), other_insns.size(),
+				  "other");
+		register_helper(prog);
+		REQUIRE(prog.bpftime_prog_load_aot(obj.data(), obj.size()) < 0);
+	}
+	SECTION("Reject objects calling unregistered helpers")
+	{
+		bpftime_prog prog(insns.data(), insns.size(), "no_helper");
+		REQUIRE(prog.bpftime_prog_load_aot(obj.data(), obj.size()) < 0);
+	}
+#endif
+}
+
+static int count_cached_objects(const std::filesystem::path &dir)
+{
+	int cnt = 0;
+	for (const auto &entry : std::filesystem::directory_iterator(dir))
+		cnt += entry.path().extension() == ".o";
+	return cnt;
+}
+
+TEST_CASE("Test the JIT cache")
+{
+	auto dir = std::filesystem::temp_directory_path() /
+		   ("bpftime_jit_cache_test." + std::to_string(getpid()));
+	std::filesystem::remove_all(dir);
+	auto insns = make_insns(3);
+	uint32_t ctx = 5;
+	uint64_t ret = 0;
+	{
+		bpftime_prog prog(insns.data(), insns.size(), "first");
+		register_helper(prog);
+		REQUIRE(prog.bpftime_prog_load_cached(dir.c_str()) == 0);
+		REQUIRE(prog.bpftime_prog_exec(&ctx, sizeof(ctx), &ret) == 0);
+		REQUIRE(ret == 305);
+	}
+	// Created private to the user
+	REQUIRE((std::filesystem::status(dir).permissions() &
+		 (std::filesystem::perms::group_all |
+		  std::filesystem::perms::others_all)) ==
+		std::filesystem::perms::none);
+	// Only the LLVM JIT adds programs to the cache
+#ifdef BPFTIME_LLVM_JIT
+	const int cached = 1;
+#else
+	const int cached = 0;
+#endif
+	REQUIRE(count_cached_objects(dir) == cached);
+	{
+		bpftime_prog prog(insns.data(), insns.size(), "second");
+		register_helper(prog);
+		REQUIRE(prog.bpftime_prog_load_cached(dir.c_str()) == 0);
+		REQUIRE(prog.bpftime_prog_exec(&ctx, sizeof(ctx), &ret) == 0);
+		REQUIRE(ret == 305);
+		REQUIRE(count_cached_objects(dir) == cached);
+	}
+#ifdef BPFTIME_LLVM_JIT
+	{
+		// Other instructions or helpers are cached separately
+		auto other_insns = make_insns(4);
+		bpftime_prog other(other_insns.data(), other_insns.size(),
+				   "other");
+		register_helper(other);
+		REQUIRE(other.bpftime_prog_load_cached(dir.c_str()) == 0);
+		REQUIRE(other.bpftime_prog_exec(&ctx, sizeof(ctx), &ret) == 0);
+		REQUIRE(ret == 405);
+		REQUIRE(count_cached_objects(dir) == 2);
+		bpftime_prog more_helpers(insns.data(), insns.size(),
+					  "more_helpers");
+		register_helper(more_helpers);
+		REQUIRE(more_helpers.bpftime_prog_register_raw_helper(
+				bpftime_helper_info{ .index = 2,
+						     .name = "add2",
+						     .fn = (void *)add_helper }) ==
+			0);
+		REQUIRE(more_helpers.bpftime_prog_load_cached(dir.c_str()) ==
+			0);
+		REQUIRE(count_cached_objects(dir) == 3);
+	}
+#endif
+	std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Test ignoring JIT caches writable by others")
+{
+	auto dir = std::filesystem::temp_directory_path() /
+		   ("bpftime_jit_cache_test_shared." +
+		    std::to_string(getpid()));
+	std::filesystem::remove_all(dir);
+	REQUIRE(mkdir(dir.c_str(), 0700) == 0);
+	REQUIRE(chmod(dir.c_str(), 0777) == 0);
+	auto insns = make_insns(3);
+	uint32_t ctx = 5;
+	uint64_t ret = 0;
+	bpftime_prog prog(insns.data(), insns.size(), "shared");
+	register_helper(prog);
+	// The program is compiled without the cache
+	REQUIRE(prog.bpftime_prog_load_cached(dir.c_str()) == 0);
+	REQUIRE(prog.bpftime_prog_exec(&ctx, sizeof(ctx), &ret) == 0);
+	REQUIRE(ret == 305);
+	REQUIRE(std::filesystem::is_empty(dir));
+	std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,124 @@
+#include <bpftime_helper_group.hpp>
+#include <bpftime_prog.hpp>
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstdint>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace bpftime;
+
+static uint64_t mul_helper(uint64_t a, uint64_t b, uint64_t, uint64_t,
+			   uint64_t)
+{
+	return a * b;
+}
+
+// r0 = helper_1(*(u32 *)ctx, 7) + 1, then exit
+static const std::vector<ebpf_inst> insns = {
+	// ldxw r1, [r1]
+	{ .code = 0x61, .dst_reg = 1, .src_reg = 1 },
+	// mov r2, 7
+	{ .code = 0xb7, .dst_reg = 2, .imm = 7 },
+	// call 1
+	{ .code = 0x85, .imm = 1 },
+	// add r0, 1
+	{ .code = 0x07, .dst_reg = 0, .imm = 1 },
+	// exit
+	{ .code = 0x95 },
+};
+
+TEST_CASE("Test tiered execution of programs")
+{
+	bpftime_prog prog(insns.data(), insns.size(), "tiered");
+	REQUIRE(prog.bpftime_prog_register_raw_helper(bpftime_helper_info{
+			.index = 1, .name = "mul", .fn = (void *)mul_helper }) ==
+		0);
+	const uint64_t threshold = 10;
+	REQUIRE(prog.bpftime_prog_load_tiered(threshold, "") == 0);
+	auto run = [&](uint32_t ctx) {
+		uint64_t ret = 0;
+		REQUIRE(prog.bpftime_prog_exec(&ctx, sizeof(ctx), &ret) == 0);
+		REQUIRE(ret == ctx * 7 + 1);
+	};
+	// Interpreted up to the threshold, then compiled in the background.
+	// Results don't change while switching
+	for (uint32_t i = 0; i < threshold; i++) {
+		REQUIRE(!prog.bpftime_prog_is_jitted());
+		run(i);
+	}
+	for (uint32_t i = 0; !prog.bpftime_prog_is_jitted() && i < 10000; i++) {
+		run(i);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	REQUIRE(prog.bpftime_prog_is_jitted());
+	std::atomic<int> mismatches = 0;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; i++)
+		threads.emplace_back([&]() {
+			for (uint32_t ctx = 0; ctx < 10000; ctx++) {
+				uint64_t ret = 0;
+				if (prog.bpftime_prog_exec(&ctx, sizeof(ctx),
+							   &ret) < 0 ||
+				    ret != ctx * 7 + 1)
+					mismatches++;
+			}
+		});
+	for (auto &thread : threads)
+		thread.join();
+	REQUIRE(mismatches == 0);
+}
+
+TEST_CASE("Test tiered programs in forked processes")
+{
+	bpftime_prog prog(insns.data(), insns.size(), "tiered_fork");
+	REQUIRE(prog.bpftime_prog_register_raw_helper(bpftime_helper_info{
+			.index = 1, .name = "mul", .fn = (void *)mul_helper }) ==
+		0);
+	const uint64_t threshold = 10;
+	REQUIRE(prog.bpftime_prog_load_tiered(threshold, "") == 0);
+	// The child has no compile thread of the parent, and starts its own
+	pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		uint64_t ret = 0;
+		for (uint32_t i = 0; !prog.bpftime_prog_is_jitted() && i < 10000;
+		     i++) {
+			if (prog.bpftime_prog_exec(&i, sizeof(i), &ret) < 0 ||
+			    ret != i * 7 + 1)
+				_exit(1);
+			std::this_thread::sleep_for(
+				std::chrono::milliseconds(1));
+		}
+		_exit(prog.bpftime_prog_is_jitted() ? 0 : 2);
+	}
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+	// Not run in the parent
+	REQUIRE(!prog.bpftime_prog_is_jitted());
+}
+
+TEST_CASE("Test interpreting programs with either interpreter")
+{
+	for (bool threaded : { false, true }) {
+		bpftime_prog prog(insns.data(), insns.size(), "interpreted");
+		REQUIRE(prog.bpftime_prog_register_raw_helper(
+				bpftime_helper_info{ .index = 1,
+						     .name = "mul",
+						     .fn = (void *)mul_helper }) ==
+			0);
+		prog.bpftime_prog_toggle_threaded_interpreter(threaded);
+		REQUIRE(prog.bpftime_prog_load(false) == 0);
+		for (uint32_t ctx = 0; ctx < 100; ctx++) {
+			uint64_t ret = 0;
+			REQUIRE(prog.bpftime_prog_exec(&ctx, sizeof(ctx), &ret) ==
+				0);
+			REQUIRE(ret == ctx * 7 + 1);
+		}
+	}
+}
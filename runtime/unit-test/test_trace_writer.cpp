@@ -0,0 +1,152 @@
+#include "catch2/catch_message.hpp"
+#include <bpftime_shm.hpp>
+#include <bpftime_trace_writer.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <linux/bpf.h>
+#include <linux/perf_event.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace bpftime;
+
+static const char *SHM_NAME = "BPFTIME_TRACE_WRITER_SHM";
+static const char *TRACE_FILE = "/tmp/bpftime_test_trace_writer.trace";
+
+struct read_record {
+	trace_record_header header;
+	std::vector<uint8_t> data;
+};
+
+static std::vector<read_record> read_all(const char *path)
+{
+	std::vector<read_record> ret;
+	REQUIRE(read_trace_file(path,
+				[&](const trace_record_header &header,
+				    const void *data) -> int {
+					ret.push_back(read_record{
+						header,
+						std::vector<uint8_t>(
+							(uint8_t *)data,
+							(uint8_t *)data +
+								header.size) });
+					return 0;
+				}) == 0);
+	return ret;
+}
+
+TEST_CASE("Test writing records to a trace file")
+{
+	setenv("BPFTIME_GLOBAL_SHM_NAME", SHM_NAME, 1);
+	bpftime_initialize_global_shm(shm_open_type::SHM_REMOVE_AND_CREATE);
+
+	int rb_fd = bpftime_maps_create(
+		-1, "rb",
+		bpf_map_attr{ .type = (int)bpftime::bpf_map_type::BPF_MAP_TYPE_RINGBUF,
+			      .max_ents = 1 << 16 });
+	REQUIRE(rb_fd >= 0);
+	int perf_fd = bpftime_add_software_perf_event(0, PERF_SAMPLE_RAW,
+						      PERF_COUNT_SW_BPF_OUTPUT);
+	REQUIRE(perf_fd >= 0);
+	const auto page_size = getpagesize();
+	REQUIRE(bpftime_get_software_perf_event_raw_buffer(
+			perf_fd, page_size * 9) != nullptr);
+
+	auto produce = [&](uint32_t from, uint32_t to) {
+		for (uint32_t i = from; i < to; i++) {
+			// Records of different lengths
+			std::vector<uint32_t> payload(i % 7 + 1, i);
+			auto size = payload.size() * sizeof(uint32_t);
+			auto rec = bpftime_ringbuf_reserve(rb_fd, size);
+			REQUIRE(rec != nullptr);
+			memcpy(rec, payload.data(), size);
+			bpftime_ringbuf_submit(rb_fd, rec, i % 5 == 4, 0);
+			REQUIRE(bpftime_perf_event_output(perf_fd, payload.data(),
+							  size) == 0);
+		}
+	};
+	auto check = [&](const std::vector<read_record> &records,
+			 uint32_t count) {
+		std::vector<uint32_t> rb_seqs, perf_seqs;
+		for (auto &rec : records) {
+			if (rec.header.kind == TRACE_RECORD_RINGBUF) {
+				REQUIRE(rec.header.source == rb_fd);
+				REQUIRE(rec.header.size % 4 == 0);
+				auto seq = *(uint32_t *)rec.data.data();
+				REQUIRE(rec.header.size == (seq % 7 + 1) * 4);
+				rb_seqs.push_back(seq);
+			} else {
+				REQUIRE(rec.header.kind ==
+					TRACE_RECORD_PERF_EVENT);
+				REQUIRE(rec.header.source == perf_fd);
+				auto header =
+					(perf_event_header *)rec.data.data();
+				REQUIRE(header->type == PERF_RECORD_SAMPLE);
+				REQUIRE(header->size == rec.header.size);
+				// perf_event_header, then the u32 size
+				perf_seqs.push_back(
+					*(uint32_t *)(rec.data.data() + 12));
+			}
+		}
+		std::vector<uint32_t> expected_rb, expected_perf;
+		for (uint32_t i = 0; i < count; i++) {
+			if (i % 5 != 4)
+				expected_rb.push_back(i);
+			expected_perf.push_back(i);
+		}
+		REQUIRE(rb_seqs == expected_rb);
+		REQUIRE(perf_seqs == expected_perf);
+	};
+
+#if BPFTIME_HAVE_ZLIB
+	for (bool compress : { false, true }) {
+#else
+	{
+		trace_writer writer(trace_writer_opts{ .compress = true });
+		REQUIRE(writer.open(TRACE_FILE) < 0);
+		REQUIRE(errno == ENOTSUP);
+	}
+	for (bool compress : { false }) {
+#endif
+		// Small batches, so that records span several of them
+		trace_writer writer(trace_writer_opts{ .batch_bytes = 256,
+						       .compress = compress });
+		REQUIRE(writer.open(TRACE_FILE) == 0);
+		produce(0, 100);
+		REQUIRE(writer.drain(rb_fd) == 80);
+		REQUIRE(writer.drain(perf_fd) == 100);
+		REQUIRE(bpftime_ringbuf_query(rb_fd, BPF_RB_AVAIL_DATA) == 0);
+		// Finish the current batch, so that it could be read
+		REQUIRE(writer.flush() == 0);
+		check(read_all(TRACE_FILE), 100);
+
+		produce(100, 300);
+		REQUIRE(writer.drain(rb_fd) == 160);
+		REQUIRE(writer.drain(perf_fd) == 200);
+		REQUIRE(writer.drain(rb_fd) == 0);
+		REQUIRE(writer.close() == 0);
+		auto records = read_all(TRACE_FILE);
+		REQUIRE(records.size() == 540);
+		check(records, 300);
+	}
+	int map_fd = bpftime_maps_create(
+		-1, "array",
+		bpf_map_attr{ .type = (int)bpftime::bpf_map_type::BPF_MAP_TYPE_ARRAY,
+			      .key_size = 4,
+			      .value_size = 4,
+			      .max_ents = 1 });
+	trace_writer writer;
+	REQUIRE(writer.drain(rb_fd) < 0);
+	REQUIRE(writer.open(TRACE_FILE) == 0);
+	REQUIRE(writer.drain(map_fd) < 0);
+	// Wouldn't fit in trace_record_header::source
+	REQUIRE(writer.drain(UINT16_MAX + 1) < 0);
+	REQUIRE(errno == EINVAL);
+	REQUIRE(writer.close() == 0);
+	REQUIRE(read_all(TRACE_FILE).empty());
+	unlink(TRACE_FILE);
+	bpftime_remove_global_shm();
+}
@@ -1,11 +1,19 @@
 #include <cerrno>
+#include <cinttypes>
 #include <cstdlib>
 #include <iostream>
 #include <cstdio>
 #include <memory>
 #include <bpftime_shm.hpp>
+#include <bpftime_prog.hpp>
+#include <bpftime_helper_group.hpp>
+#include <bpftime_trace_writer.hpp>
+#include <csignal>
+#include <poll.h>
+#include <unistd.h>
 #include <ostream>
 #include <string>
+#include <vector>
 #include <filesystem>
 #include <spdlog/spdlog.h>
 #include <spdlog/cfg/env.h>
@@ -13,12 +21,166 @@
 using namespace std;
 using namespace bpftime;
 
+static int print_map_stats()
+{
+	uint64_t total_bytes, free_bytes;
+	bpftime_get_global_shm_usage(&total_bytes, &free_bytes);
+	printf("shared memory: %" PRIu64 " bytes, %" PRIu64 " used, %" PRIu64
+	       " free\n",
+	       total_bytes, total_bytes - free_bytes, free_bytes);
+	printf("%-6s %-24s %-6s %12s %14s %10s %14s %10s %12s\n", "fd", "name",
+	       "type", "max_entries", "lookups", "hit%", "updates",
+	       "failures", "bytes");
+	for (int fd = bpftime_map_get_next_fd(-1); fd >= 0;
+	     fd = bpftime_map_get_next_fd(fd)) {
+		bpf_map_attr attr;
+		const char *name;
+		bpf_map_type type;
+		bpf_map_stats stats;
+		if (bpftime_map_get_info(fd, &attr, &name, &type) < 0 ||
+		    bpftime_map_get_stats(fd, &stats) < 0)
+			continue;
+		double hit_rate =
+			stats.lookups == 0 ?
+				0 :
+				100.0 * (stats.lookups - stats.lookup_misses) /
+					stats.lookups;
+		printf("%-6d %-24s %-6d %12u %14" PRIu64 " %10.2f %14" PRIu64
+		       " %10" PRIu64 " %12" PRIu64 "\n",
+		       fd, name, (int)type, attr.max_ents, stats.lookups,
+		       hit_rate, stats.updates, stats.update_failures,
+		       stats.bytes_used);
+	}
+	return 0;
+}
+
+static volatile sig_atomic_t trace_exiting = 0;
+
+static void handle_trace_signal(int)
+{
+	trace_exiting = 1;
+}
+
+// Move records of the ringbuf maps and software perf events to a trace file,
+// until interrupted. Sleeps on eventfds of the sources while they are empty
+static int write_trace(const char *path, const std::vector<int> &fds,
+		       const trace_writer_opts &opts)
+{
+	trace_writer writer(opts);
+	if (writer.open(path) < 0)
+		return 1;
+	std::vector<pollfd> pollfds;
+	for (int fd : fds) {
+		int eventfd = bpftime_enable_eventfd_notification(fd);
+		if (eventfd < 0) {
+			cerr << "Unable to wait for records of fd " << fd
+			     << endl;
+			for (auto &pfd : pollfds)
+				close(pfd.fd);
+			writer.close();
+			return 1;
+		}
+		pollfds.push_back(pollfd{ .fd = eventfd, .events = POLLIN });
+	}
+	// Only delivered while sleeping, so that they can't be missed between
+	// checking trace_exiting and going to sleep
+	sigset_t exit_signals, old_mask;
+	sigemptyset(&exit_signals);
+	sigaddset(&exit_signals, SIGINT);
+	sigaddset(&exit_signals, SIGTERM);
+	sigprocmask(SIG_BLOCK, &exit_signals, &old_mask);
+	signal(SIGINT, handle_trace_signal);
+	signal(SIGTERM, handle_trace_signal);
+	uint64_t total = 0;
+	bool last_round = false;
+	int ret = 0;
+	while (!last_round) {
+		// Drain once more after being interrupted, so that nothing
+		// submitted before is left behind
+		last_round = trace_exiting;
+		long cnt = 0;
+		for (int fd : fds) {
+			long res = writer.drain(fd);
+			if (res < 0) {
+				ret = 1;
+				goto out;
+			}
+			cnt += res;
+		}
+		total += cnt;
+		if (cnt > 0 || last_round)
+			continue;
+		// Don't hold a batch of a quiet source forever
+		writer.flush();
+		bool pending = false;
+		for (int fd : fds) {
+			int res = bpftime_arm_eventfd_notification(fd);
+			if (res < 0) {
+				ret = 1;
+				goto out;
+			}
+			pending |= res > 0;
+		}
+		if (pending)
+			continue;
+		if (ppoll(pollfds.data(), pollfds.size(), nullptr, &old_mask) <
+			    0 &&
+		    errno != EINTR) {
+			cerr << "Unable to wait for records: " << errno << endl;
+			ret = 1;
+			goto out;
+		}
+		for (auto &pfd : pollfds) {
+			uint64_t value;
+			// Reset the counter, it's nonblocking
+			if ((pfd.revents & POLLIN) &&
+			    read(pfd.fd, &value, sizeof(value)) < 0 &&
+			    errno != EAGAIN)
+				spdlog::warn("Unable to read eventfd: {}", errno);
+		}
+	}
+out:
+	sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+	for (auto &pfd : pollfds)
+		close(pfd.fd);
+	if (writer.close() < 0 || ret != 0)
+		return 1;
+	printf("%" PRIu64 " records, %" PRIu64 " bytes written to %s\n", total,
+	       writer.bytes_written(), path);
+	return 0;
+}
+
+// Compile the programs in the global shared memory into the JIT cache, with
+// the helpers enabled in the agent config, so that agents load them instead
+// of compiling
+static int fill_jit_cache(const char *dir)
+{
+	const auto &config = bpftime_get_agent_config();
+	int cnt = 0;
+	for (int fd = bpftime_prog_get_next_fd(-1); fd >= 0;
+	     fd = bpftime_prog_get_next_fd(fd)) {
+		const ebpf_inst *insns;
+		size_t insn_cnt;
+		const char *name;
+		if (bpftime_prog_get_info(fd, &insns, &insn_cnt, &name) < 0)
+			continue;
+		bpftime_prog prog(insns, insn_cnt, name);
+		bpftime_helper_group::add_enabled_helper_groups_to_prog(&prog,
+									config);
+		if (prog.bpftime_prog_load_cached(dir) < 0)
+			return 1;
+		cnt++;
+	}
+	printf("%d programs in %s\n", cnt, dir);
+	return 0;
+}
+
 // Main program
 int main(int argc, char *argv[])
 {
 	if (argc == 1) {
 		cerr << "Usage: " << argv[0]
-		     << " [load|import|export|remove] ..." << endl
+		     << " [load|import|export|remove|stats|trace|aot] ..." << endl
 		     << "Command-line tool to inspect and manage userspace eBPF objects"
 		     << endl;
 		return 1;
@@ -64,6 +226,56 @@ int main(int argc, char *argv[])
 			shm_open_type::SHM_CREATE_OR_OPEN);
 		auto filename = std::string(argv[2]);
 		return bpftime_import_global_shm_from_json(filename.c_str());
+	} else if (cmd == "stats") {
+		if (argc != 2) {
+			cerr << "Usage: " << argv[0] << " stats" << endl
+			     << "Show the memory usage and operation counters of maps in the global shared memory"
+			     << endl;
+			return 1;
+		}
+		bpftime_initialize_global_shm(shm_open_type::SHM_OPEN_ONLY);
+		return print_map_stats();
+	} else if (cmd == "trace") {
+		trace_writer_opts opts;
+		int opt;
+		optind = 2;
+		while ((opt = getopt(argc, argv, "zb:")) != -1) {
+			if (opt == 'z') {
+#if BPFTIME_HAVE_ZLIB
+				opts.compress = true;
+#else
+				cerr << "Unable to compress trace batches, bpftime is built without zlib"
+				     << endl;
+				return 1;
+#endif
+			} else if (opt == 'b')
+				opts.batch_bytes = strtoul(optarg, nullptr, 0);
+			else
+				break;
+		}
+		if (opt != -1 || argc - optind < 2 || opts.batch_bytes == 0) {
+			cerr << "Usage: " << argv[0]
+			     << " trace [-z] [-b <batch bytes>] <filename> <fd>..."
+			     << endl
+			     << "Write records of ringbuf maps and software perf events to a trace file until interrupted. -z deflates each batch"
+			     << endl;
+			return 1;
+		}
+		bpftime_initialize_global_shm(shm_open_type::SHM_OPEN_ONLY);
+		std::vector<int> fds;
+		for (int i = optind + 1; i < argc; i++)
+			fds.push_back(atoi(argv[i]));
+		return write_trace(argv[optind], fds, opts);
+	} else if (cmd == "aot") {
+		if (argc != 3) {
+			cerr << "Usage: " << argv[0] << " aot <directory>"
+			     << endl
+			     << "Compile programs in the global shared memory into a JIT cache directory, which agents load from BPFTIME_JIT_CACHE_DIR"
+			     << endl;
+			return 1;
+		}
+		bpftime_initialize_global_shm(shm_open_type::SHM_OPEN_ONLY);
+		return fill_jit_cache(argv[2]);
 	} else if (cmd == "remove") {
 		if (argc != 2) {
 			cerr << "Usage: " << argv[0] << " remove" << endl
@@ -0,0 +1,574 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#define _GNU_SOURCE
+#include "ebpf_aot_object.h"
+#include <elf.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * A minimal static linker for the objects produced by ebpf_compile_aot, so
+ * that agents could run them without linking LLVM.
+ *
+ * The image is laid out as: read-only allocated sections, then a stub for
+ * each symbol, then writable allocated sections starting at a new page. A
+ * stub is `jmp *0(%rip)` followed by the absolute address of the symbol, so
+ * it serves both calls to helpers that are out of the range of a rel32 call,
+ * and as the GOT entry of the symbol.
+ */
+#define STUB_SIZE 16
+#define STUB_ADDR_OFFSET 6
+#define NOT_LOADED ((size_t)-1)
+
+struct ebpf_aot_symbol {
+	char *name;
+	void *addr;
+	size_t size;
+};
+
+struct ebpf_aot_object {
+	void *base;
+	size_t size;
+	struct ebpf_aot_symbol *syms;
+	size_t nr_syms;
+};
+
+struct load_ctx {
+	const uint8_t *buf;
+	size_t buf_len;
+	const Elf64_Ehdr *ehdr;
+	const Elf64_Shdr *shdrs;
+	const Elf64_Sym *syms;
+	size_t nr_syms;
+	const char *strtab;
+	size_t strtab_size;
+	size_t symtab_idx;
+	// Offset of each section in the image, NOT_LOADED if not allocated
+	size_t *sec_offsets;
+	size_t stubs_offset;
+	uint8_t *base;
+	ebpf_aot_resolve_fn resolve;
+	void *resolve_ctx;
+	char **errmsg;
+};
+
+static void set_error(char **errmsg, const char *fmt, ...)
+{
+	va_list ap;
+	if (errmsg == NULL)
+		return;
+	va_start(ap, fmt);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+	if (vasprintf(errmsg, fmt, ap) < 0)
+		*errmsg = NULL;
+#pragma GCC diagnostic pop
+	va_end(ap);
+}
+
+static size_t align_up(size_t x, size_t align)
+{
+	return (x + align - 1) & ~(align - 1);
+}
+
+static const char *symbol_name(const struct load_ctx *ctx,
+			       const Elf64_Sym *sym)
+{
+	if (sym->st_name >= ctx->strtab_size)
+		return NULL;
+	return ctx->strtab + sym->st_name;
+}
+
+static int parse_headers(struct load_ctx *ctx)
+{
+	const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)ctx->buf;
+	if (ctx->buf_len < sizeof(*ehdr) ||
+	    memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ehdr->e_ident[EI_DATA] != ELFDATA2LSB) {
+		set_error(ctx->errmsg, "not a 64-bit little endian ELF file");
+		return -1;
+	}
+	if (ehdr->e_type != ET_REL) {
+		set_error(ctx->errmsg, "not a relocatable object");
+		return -1;
+	}
+#if defined(__x86_64__)
+	if (ehdr->e_machine != EM_X86_64) {
+		set_error(ctx->errmsg, "object is built for machine %d",
+			  (int)ehdr->e_machine);
+		return -1;
+	}
+#else
+	set_error(ctx->errmsg,
+		  "loading AOT objects is not supported on this architecture");
+	return -1;
+#endif
+	if (ehdr->e_shentsize != sizeof(Elf64_Shdr) || ehdr->e_shoff == 0 ||
+	    ehdr->e_shoff > ctx->buf_len ||
+	    (ctx->buf_len - ehdr->e_shoff) / sizeof(Elf64_Shdr) <
+		    ehdr->e_shnum) {
+		set_error(ctx->errmsg, "invalid section header table");
+		return -1;
+	}
+	ctx->ehdr = ehdr;
+	ctx->shdrs = (const Elf64_Shdr *)(ctx->buf + ehdr->e_shoff);
+	ctx->symtab_idx = 0;
+	for (size_t i = 0; i < ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &ctx->shdrs[i];
+		if (shdr->sh_type != SHT_NOBITS &&
+		    (shdr->sh_offset > ctx->buf_len ||
+		     ctx->buf_len - shdr->sh_offset < shdr->sh_size)) {
+			set_error(ctx->errmsg, "section %zu is out of bounds",
+				  i);
+			return -1;
+		}
+		if (shdr->sh_type == SHT_REL) {
+			set_error(ctx->errmsg,
+				  "REL relocations are not supported");
+			return -1;
+		}
+		if (shdr->sh_type == SHT_SYMTAB) {
+			if (ctx->symtab_idx != 0) {
+				set_error(ctx->errmsg,
+					  "multiple symbol tables");
+				return -1;
+			}
+			ctx->symtab_idx = i;
+		}
+	}
+	if (ctx->symtab_idx == 0) {
+		set_error(ctx->errmsg, "no symbol table");
+		return -1;
+	}
+	const Elf64_Shdr *symtab = &ctx->shdrs[ctx->symtab_idx];
+	if (symtab->sh_entsize != sizeof(Elf64_Sym) ||
+	    symtab->sh_link >= ehdr->e_shnum) {
+		set_error(ctx->errmsg, "invalid symbol table");
+		return -1;
+	}
+	const Elf64_Shdr *strtab = &ctx->shdrs[symtab->sh_link];
+	if (strtab->sh_type != SHT_STRTAB || strtab->sh_size == 0 ||
+	    ctx->buf[strtab->sh_offset + strtab->sh_size - 1] != '\0') {
+		set_error(ctx->errmsg, "invalid string table");
+		return -1;
+	}
+	ctx->syms = (const Elf64_Sym *)(ctx->buf + symtab->sh_offset);
+	ctx->nr_syms = symtab->sh_size / sizeof(Elf64_Sym);
+	ctx->strtab = (const char *)ctx->buf + strtab->sh_offset;
+	ctx->strtab_size = strtab->sh_size;
+	return 0;
+}
+
+// Assign an offset in the image to each allocated section. Returns the size
+// of the image, and the size of the executable part in `exec_size`
+static size_t layout_sections(struct load_ctx *ctx, size_t *exec_size)
+{
+	size_t page_size = (size_t)getpagesize();
+	size_t offset = 0;
+	for (int writable = 0; writable <= 1; writable++) {
+		if (writable) {
+			ctx->stubs_offset = align_up(offset, STUB_SIZE);
+			offset = align_up(ctx->stubs_offset +
+						  ctx->nr_syms * STUB_SIZE,
+					  page_size);
+			*exec_size = offset;
+		}
+		for (size_t i = 0; i < ctx->ehdr->e_shnum; i++) {
+			const Elf64_Shdr *shdr = &ctx->shdrs[i];
+			if (!(shdr->sh_flags & SHF_ALLOC) ||
+			    !!(shdr->sh_flags & SHF_WRITE) != writable)
+				continue;
+			size_t align = shdr->sh_addralign ?: 1;
+			if (align > page_size || (align & (align - 1))) {
+				set_error(ctx->errmsg,
+					  "invalid alignment of section %zu",
+					  i);
+				return 0;
+			}
+			ctx->sec_offsets[i] = align_up(offset, align);
+			offset = ctx->sec_offsets[i] + shdr->sh_size;
+		}
+	}
+	return align_up(offset, page_size);
+}
+
+static void *write_stub(struct load_ctx *ctx, size_t sym_idx, uint64_t addr)
+{
+	uint8_t *stub = ctx->base + ctx->stubs_offset + sym_idx * STUB_SIZE;
+	// jmp *0(%rip)
+	static const uint8_t jmp[STUB_ADDR_OFFSET] = { 0xff, 0x25, 0, 0, 0, 0 };
+	memcpy(stub, jmp, sizeof(jmp));
+	memcpy(stub + STUB_ADDR_OFFSET, &addr, sizeof(addr));
+	return stub;
+}
+
+static int symbol_address(struct load_ctx *ctx, size_t sym_idx,
+			  uint64_t *addr)
+{
+	const Elf64_Sym *sym = &ctx->syms[sym_idx];
+	const char *name = symbol_name(ctx, sym);
+	if (name == NULL) {
+		set_error(ctx->errmsg, "invalid name of symbol %zu", sym_idx);
+		return -1;
+	}
+	if (sym->st_shndx == SHN_UNDEF) {
+		void *ret = *name ? ctx->resolve(ctx->resolve_ctx, name) : NULL;
+		if (ret == NULL) {
+			set_error(ctx->errmsg, "unresolved symbol `%s`",
+				  name);
+			return -1;
+		}
+		*addr = (uint64_t)(uintptr_t)ret;
+	} else if (sym->st_shndx == SHN_ABS) {
+		*addr = sym->st_value;
+	} else if (sym->st_shndx >= ctx->ehdr->e_shnum ||
+		   ctx->sec_offsets[sym->st_shndx] == NOT_LOADED) {
+		set_error(ctx->errmsg,
+			  "symbol `%s` is not in an allocated section", name);
+		return -1;
+	} else {
+		*addr = (uint64_t)(uintptr_t)ctx->base +
+			ctx->sec_offsets[sym->st_shndx] + sym->st_value;
+	}
+	return 0;
+}
+
+static int apply_relocation(struct load_ctx *ctx, size_t target_idx,
+			    const Elf64_Rela *rela)
+{
+	const Elf64_Shdr *target = &ctx->shdrs[target_idx];
+	size_t sym_idx = ELF64_R_SYM(rela->r_info);
+	uint32_t type = ELF64_R_TYPE(rela->r_info);
+	uint64_t addr = 0;
+	if (type == R_X86_64_NONE)
+		return 0;
+	if (sym_idx == 0 || sym_idx >= ctx->nr_syms) {
+		set_error(ctx->errmsg, "invalid symbol index %zu", sym_idx);
+		return -1;
+	}
+	size_t width = (type == R_X86_64_64 || type == R_X86_64_PC64) ? 8 : 4;
+	if (rela->r_offset > target->sh_size ||
+	    target->sh_size - rela->r_offset < width) {
+		set_error(ctx->errmsg, "relocation out of section %zu",
+			  target_idx);
+		return -1;
+	}
+	if (symbol_address(ctx, sym_idx, &addr) < 0)
+		return -1;
+	uint8_t *loc = ctx->base + ctx->sec_offsets[target_idx] +
+		       rela->r_offset;
+	uint64_t pc = (uint64_t)(uintptr_t)loc;
+	int64_t value;
+	switch (type) {
+	case R_X86_64_64:
+		value = (int64_t)(addr + rela->r_addend);
+		memcpy(loc, &value, 8);
+		return 0;
+	case R_X86_64_PC64:
+		value = (int64_t)(addr + rela->r_addend - pc);
+		memcpy(loc, &value, 8);
+		return 0;
+	case R_X86_64_PC32:
+	case R_X86_64_PLT32:
+		value = (int64_t)(addr + rela->r_addend - pc);
+		// Helpers in the agent are usually too far from the image
+		// for a rel32 call, so call them through the stub
+		if ((value < INT32_MIN || value > INT32_MAX) &&
+		    type == R_X86_64_PLT32)
+			value = (int64_t)((uint64_t)(uintptr_t)write_stub(
+						  ctx, sym_idx, addr) +
+					  rela->r_addend - pc);
+		break;
+	case R_X86_64_GOTPCREL:
+	case R_X86_64_GOTPCRELX:
+	case R_X86_64_REX_GOTPCRELX:
+		value = (int64_t)((uint64_t)(uintptr_t)write_stub(ctx, sym_idx,
+								 addr) +
+				  STUB_ADDR_OFFSET + rela->r_addend - pc);
+		break;
+	case R_X86_64_32:
+		value = (int64_t)(addr + rela->r_addend);
+		if ((uint64_t)value > UINT32_MAX) {
+			set_error(ctx->errmsg,
+				  "absolute relocation out of range");
+			return -1;
+		}
+		memcpy(loc, &value, 4);
+		return 0;
+	case R_X86_64_32S:
+		value = (int64_t)(addr + rela->r_addend);
+		break;
+	default:
+		set_error(ctx->errmsg, "unsupported relocation type %u",
+			  (unsigned)type);
+		return -1;
+	}
+	if (value < INT32_MIN || value > INT32_MAX) {
+		set_error(ctx->errmsg, "relocation of type %u out of range",
+			  (unsigned)type);
+		return -1;
+	}
+	int32_t value32 = (int32_t)value;
+	memcpy(loc, &value32, 4);
+	return 0;
+}
+
+static int apply_relocations(struct load_ctx *ctx)
+{
+	for (size_t i = 0; i < ctx->ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &ctx->shdrs[i];
+		if (shdr->sh_type != SHT_RELA)
+			continue;
+		// Relocations of debug info and other sections we don't load
+		if (shdr->sh_info >= ctx->ehdr->e_shnum ||
+		    ctx->sec_offsets[shdr->sh_info] == NOT_LOADED)
+			continue;
+		if (shdr->sh_link != ctx->symtab_idx ||
+		    shdr->sh_entsize != sizeof(Elf64_Rela)) {
+			set_error(ctx->errmsg,
+				  "invalid relocation section %zu", i);
+			return -1;
+		}
+		const Elf64_Rela *relas =
+			(const Elf64_Rela *)(ctx->buf + shdr->sh_offset);
+		size_t cnt = shdr->sh_size / sizeof(Elf64_Rela);
+		for (size_t j = 0; j < cnt; j++) {
+			if (apply_relocation(ctx, shdr->sh_info, &relas[j]) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int collect_symbols(struct load_ctx *ctx, struct ebpf_aot_object *obj)
+{
+	obj->syms = calloc(ctx->nr_syms, sizeof(*obj->syms));
+	if (obj->syms == NULL) {
+		set_error(ctx->errmsg, "out of memory");
+		return -1;
+	}
+	for (size_t i = 1; i < ctx->nr_syms; i++) {
+		const Elf64_Sym *sym = &ctx->syms[i];
+		int bind = ELF64_ST_BIND(sym->st_info);
+		const char *name = symbol_name(ctx, sym);
+		uint64_t addr;
+		if ((bind != STB_GLOBAL && bind != STB_WEAK) ||
+		    sym->st_shndx == SHN_UNDEF || name == NULL || !*name)
+			continue;
+		if (symbol_address(ctx, i, &addr) < 0)
+			return -1;
+		struct ebpf_aot_symbol *out = &obj->syms[obj->nr_syms];
+		out->name = strdup(name);
+		if (out->name == NULL) {
+			set_error(ctx->errmsg, "out of memory");
+			return -1;
+		}
+		out->addr = (void *)(uintptr_t)addr;
+		out->size = sym->st_size;
+		obj->nr_syms++;
+	}
+	return 0;
+}
+
+struct ebpf_aot_object *ebpf_aot_object_load(const void *buf, size_t buf_len,
+					     ebpf_aot_resolve_fn resolve,
+					     void *resolve_ctx, char **errmsg)
+{
+	struct load_ctx ctx = { .buf = buf,
+				.buf_len = buf_len,
+				.resolve = resolve,
+				.resolve_ctx = resolve_ctx,
+				.errmsg = errmsg };
+	struct ebpf_aot_object *obj = NULL;
+	size_t exec_size = 0;
+	if (errmsg)
+		*errmsg = NULL;
+	if (parse_headers(&ctx) < 0)
+		return NULL;
+	ctx.sec_offsets = malloc(ctx.ehdr->e_shnum * sizeof(size_t));
+	obj = calloc(1, sizeof(*obj));
+	if (ctx.sec_offsets == NULL || obj == NULL) {
+		set_error(errmsg, "out of memory");
+		goto err;
+	}
+	for (size_t i = 0; i < ctx.ehdr->e_shnum; i++)
+		ctx.sec_offsets[i] = NOT_LOADED;
+	obj->size = layout_sections(&ctx, &exec_size);
+	if (obj->size == 0)
+		goto err;
+	obj->base = mmap(NULL, obj->size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (obj->base == MAP_FAILED) {
+		obj->base = NULL;
+		set_error(errmsg, "mmap failed: %s", strerror(errno));
+		goto err;
+	}
+	ctx.base = obj->base;
+	for (size_t i = 0; i < ctx.ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &ctx.shdrs[i];
+		// Anonymous mappings are zeroed, so nothing to do for NOBITS
+		if (ctx.sec_offsets[i] != NOT_LOADED &&
+		    shdr->sh_type != SHT_NOBITS)
+			memcpy(ctx.base + ctx.sec_offsets[i],
+			       ctx.buf + shdr->sh_offset, shdr->sh_size);
+	}
+	if (apply_relocations(&ctx) < 0 || collect_symbols(&ctx, obj) < 0)
+		goto err;
+	if (mprotect(obj->base, exec_size, PROT_READ | PROT_EXEC) < 0) {
+		set_error(errmsg, "mprotect failed: %s", strerror(errno));
+		goto err;
+	}
+	free(ctx.sec_offsets);
+	return obj;
+err:
+	free(ctx.sec_offsets);
+	ebpf_aot_object_free(obj);
+	return NULL;
+}
+
+void *ebpf_aot_object_symbol(const struct ebpf_aot_object *obj,
+			     const char *name, size_t *size)
+{
+	for (size_t i = 0; i < obj->nr_syms; i++) {
+		if (strcmp(obj->syms[i].name, name) == 0) {
+			if (size)
+				*size = obj->syms[i].size;
+			return obj->syms[i].addr;
+		}
+	}
+	return NULL;
+}
+
+int ebpf_aot_object_check_insns(const struct ebpf_aot_object *obj,
+				const void *insns, size_t insn_cnt,
+				char **errmsg)
+{
+	size_t size = 0;
+	const uint64_t *cnt =
+		ebpf_aot_object_symbol(obj, EBPF_AOT_INSN_CNT_SYMBOL, NULL);
+	const void *expected =
+		ebpf_aot_object_symbol(obj, EBPF_AOT_INSNS_SYMBOL, &size);
+	if (cnt == NULL || expected == NULL || size != *cnt * 8) {
+		set_error(errmsg, "object has no instructions recorded");
+		return -1;
+	}
+	if (*cnt != insn_cnt || memcmp(expected, insns, size) != 0) {
+		set_error(errmsg,
+			  "object was compiled from different instructions");
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+uint64_t ebpf_aot_hash_program(const void *insns, size_t insn_cnt,
+			       void *const *ext_funcs, size_t nr_ext_funcs,
+			       uint32_t lddw_helpers)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint32_t version = EBPF_AOT_CODEGEN_VERSION;
+	uint64_t cnt = insn_cnt;
+	hash = fnv1a(hash, &version, sizeof(version));
+	hash = fnv1a(hash, &cnt, sizeof(cnt));
+	hash = fnv1a(hash, insns, insn_cnt * 8);
+	for (uint32_t i = 0; i < nr_ext_funcs; i++) {
+		if (ext_funcs[i])
+			hash = fnv1a(hash, &i, sizeof(i));
+	}
+	return fnv1a(hash, &lddw_helpers, sizeof(lddw_helpers));
+}
+
+static void *resolve_vm_symbol(void *ctx, const char *name)
+{
+	const struct ebpf_aot_vm_symbols *syms = ctx;
+	const size_t prefix_len = strlen(EBPF_AOT_EXT_FUNC_PREFIX);
+	if (strncmp(name, EBPF_AOT_EXT_FUNC_PREFIX, prefix_len) == 0) {
+		char *end;
+		unsigned long idx = strtoul(name + prefix_len, &end, 10);
+		if (*end != '\0' || idx >= syms->nr_ext_funcs)
+			return NULL;
+		return syms->ext_funcs[idx];
+	}
+	if (strcmp(name, EBPF_AOT_LDDW_MAP_BY_FD) == 0)
+		return syms->map_by_fd;
+	if (strcmp(name, EBPF_AOT_LDDW_MAP_BY_IDX) == 0)
+		return syms->map_by_idx;
+	if (strcmp(name, EBPF_AOT_LDDW_MAP_VAL) == 0)
+		return syms->map_val;
+	if (strcmp(name, EBPF_AOT_LDDW_VAR_ADDR) == 0)
+		return syms->var_addr;
+	if (strcmp(name, EBPF_AOT_LDDW_CODE_ADDR) == 0)
+		return syms->code_addr;
+	return NULL;
+}
+
+struct ebpf_aot_object *
+ebpf_aot_object_load_program(const void *buf, size_t buf_len,
+			     const void *insns, size_t insn_cnt,
+			     const struct ebpf_aot_vm_symbols *syms,
+			     void **entry, char **errmsg)
+{
+	struct ebpf_aot_object *obj = ebpf_aot_object_load(
+		buf, buf_len, resolve_vm_symbol, (void *)syms, errmsg);
+	if (obj == NULL)
+		return NULL;
+	*entry = ebpf_aot_object_symbol(obj, EBPF_AOT_ENTRY_SYMBOL, NULL);
+	if (*entry == NULL) {
+		set_error(errmsg, "object has no symbol %s",
+			  EBPF_AOT_ENTRY_SYMBOL);
+	} else if (ebpf_aot_object_check_insns(obj, insns, insn_cnt,
+					       errmsg) < 0) {
+		*entry = NULL;
+	}
+	if (*entry == NULL) {
+		ebpf_aot_object_free(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+uint64_t ebpf_aot_program_key(const void *insns, size_t insn_cnt,
+			      const struct ebpf_aot_vm_symbols *syms)
+{
+	uint32_t lddw_helpers =
+		(syms->map_by_fd ? EBPF_AOT_HAS_MAP_BY_FD : 0) |
+		(syms->map_by_idx ? EBPF_AOT_HAS_MAP_BY_IDX : 0) |
+		(syms->map_val ? EBPF_AOT_HAS_MAP_VAL : 0) |
+		(syms->var_addr ? EBPF_AOT_HAS_VAR_ADDR : 0) |
+		(syms->code_addr ? EBPF_AOT_HAS_CODE_ADDR : 0);
+	return ebpf_aot_hash_program(insns, insn_cnt, syms->ext_funcs,
+				     syms->nr_ext_funcs, lddw_helpers);
+}
+
+void ebpf_aot_object_free(struct ebpf_aot_object *obj)
+{
+	if (obj == NULL)
+		return;
+	if (obj->base)
+		munmap(obj->base, obj->size);
+	if (obj->syms) {
+		for (size_t i = 0; i < obj->nr_syms; i++)
+			free(obj->syms[i].name);
+		free(obj->syms);
+	}
+	free(obj);
+}
@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2022, eunomia-bpf org
+ * All rights reserved.
+ */
+#ifndef _EBPF_AOT_OBJECT_H
+#define _EBPF_AOT_OBJECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Symbols of objects produced by ebpf_compile_aot.
+ *
+ * Helpers are referenced as EBPF_AOT_EXT_FUNC_PREFIX followed by the 4-digit
+ * helper index, and lddw helpers by their names below. Both are left
+ * undefined in the object and resolved by the VM that loads it.
+ */
+#define EBPF_AOT_ENTRY_SYMBOL "bpf_main"
+// The instructions the object was compiled from, and their count
+#define EBPF_AOT_INSNS_SYMBOL "bpf_insns"
+#define EBPF_AOT_INSN_CNT_SYMBOL "bpf_insn_cnt"
+#define EBPF_AOT_EXT_FUNC_PREFIX "ext_"
+#define EBPF_AOT_LDDW_MAP_BY_FD "__lddw_helper_map_by_fd"
+#define EBPF_AOT_LDDW_MAP_BY_IDX "__lddw_helper_map_by_idx"
+#define EBPF_AOT_LDDW_MAP_VAL "__lddw_helper_map_val"
+#define EBPF_AOT_LDDW_VAR_ADDR "__lddw_helper_var_addr"
+#define EBPF_AOT_LDDW_CODE_ADDR "__lddw_helper_code_addr"
+
+/*
+ * Version of the code generated for AOT objects. Bump it whenever the
+ * generated code or the symbols above change, so that cached objects of the
+ * old version are not used.
+ */
+#define EBPF_AOT_CODEGEN_VERSION 2
+
+// Bits of lddw helpers in the key of an object
+enum ebpf_aot_lddw_helper {
+	EBPF_AOT_HAS_MAP_BY_FD = 1 << 0,
+	EBPF_AOT_HAS_MAP_BY_IDX = 1 << 1,
+	EBPF_AOT_HAS_MAP_VAL = 1 << 2,
+	EBPF_AOT_HAS_VAR_ADDR = 1 << 3,
+	EBPF_AOT_HAS_CODE_ADDR = 1 << 4,
+};
+
+struct ebpf_aot_object;
+
+// Return the address of an undefined symbol, or NULL if it is unknown
+typedef void *(*ebpf_aot_resolve_fn)(void *ctx, const char *name);
+
+// What the code of an object may reference in the VM loading it. Each JIT
+// backend fills it from its own struct ebpf_vm
+struct ebpf_aot_vm_symbols {
+	void *const *ext_funcs;
+	size_t nr_ext_funcs;
+	void *map_by_fd;
+	void *map_by_idx;
+	void *map_val;
+	void *var_addr;
+	void *code_addr;
+};
+
+/**
+ * @brief Load a relocatable ELF object into executable memory.
+ *
+ * Sections are copied into a private mapping, relocations are applied with
+ * undefined symbols resolved through `resolve`, and the code is made
+ * read-only and executable. Only x86_64 objects are supported for now.
+ *
+ * @param[in] buf The object file.
+ * @param[in] buf_len The length of the object file.
+ * @param[in] resolve Resolver of the undefined symbols.
+ * @param[in] ctx Passed to `resolve`.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @return The loaded object, or NULL on failure.
+ */
+struct ebpf_aot_object *ebpf_aot_object_load(const void *buf, size_t buf_len,
+					     ebpf_aot_resolve_fn resolve,
+					     void *ctx, char **errmsg);
+
+/**
+ * @brief Find a global symbol defined by a loaded object.
+ *
+ * @param[in] obj The loaded object.
+ * @param[in] name The name of the symbol.
+ * @param[out] size The size of the symbol, could be NULL.
+ * @return The address of the symbol, or NULL if it is not defined.
+ */
+void *ebpf_aot_object_symbol(const struct ebpf_aot_object *obj,
+			     const char *name, size_t *size);
+
+/**
+ * @brief Check that a loaded object was compiled from the given instructions.
+ *
+ * @param[in] obj The loaded object.
+ * @param[in] insns The eBPF instructions.
+ * @param[in] insn_cnt The number of instructions.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 The instructions match.
+ * @retval -1 They don't, or the object doesn't record them.
+ */
+int ebpf_aot_object_check_insns(const struct ebpf_aot_object *obj,
+				const void *insns, size_t insn_cnt,
+				char **errmsg);
+
+/**
+ * @brief Hash everything the code of an object depends on.
+ *
+ * That is the instructions, the indexes of the registered helpers, the lddw
+ * helpers in use, and EBPF_AOT_CODEGEN_VERSION. Addresses of helpers are
+ * not included, since they are resolved when the object is loaded.
+ *
+ * @param[in] insns The eBPF instructions.
+ * @param[in] insn_cnt The number of instructions.
+ * @param[in] ext_funcs The registered helpers, NULL if not registered.
+ * @param[in] nr_ext_funcs The length of `ext_funcs`.
+ * @param[in] lddw_helpers Bits of ebpf_aot_lddw_helper.
+ * @return The 64-bit FNV-1a hash.
+ */
+uint64_t ebpf_aot_hash_program(const void *insns, size_t insn_cnt,
+			       void *const *ext_funcs, size_t nr_ext_funcs,
+			       uint32_t lddw_helpers);
+
+/**
+ * @brief Load the object of a program for a VM.
+ *
+ * Undefined symbols are resolved from `syms`, and the object is rejected if
+ * it was compiled from other instructions, or references helpers the VM
+ * doesn't register.
+ *
+ * @param[in] buf The object file.
+ * @param[in] buf_len The length of the object file.
+ * @param[in] insns The eBPF instructions loaded in the VM.
+ * @param[in] insn_cnt The number of instructions.
+ * @param[in] syms The helpers of the VM.
+ * @param[out] entry The entry of the program.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @return The loaded object, or NULL on failure.
+ */
+struct ebpf_aot_object *
+ebpf_aot_object_load_program(const void *buf, size_t buf_len,
+			     const void *insns, size_t insn_cnt,
+			     const struct ebpf_aot_vm_symbols *syms,
+			     void **entry, char **errmsg);
+
+/**
+ * @brief Key of the objects of a program for a VM, as ebpf_aot_hash_program.
+ *
+ * @param[in] insns The eBPF instructions loaded in the VM.
+ * @param[in] insn_cnt The number of instructions.
+ * @param[in] syms The helpers of the VM.
+ * @return The key.
+ */
+uint64_t ebpf_aot_program_key(const void *insns, size_t insn_cnt,
+			      const struct ebpf_aot_vm_symbols *syms);
+
+/**
+ * @brief Unmap a loaded object.
+ *
+ * @param[in] obj The object to free, could be NULL.
+ */
+void ebpf_aot_object_free(struct ebpf_aot_object *obj);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -82,6 +82,20 @@ void ebpf_destroy(struct ebpf_vm* vm);
  */
 bool ebpf_toggle_bounds_check(struct ebpf_vm* vm, bool enable);
 
+/**
+ * @brief Enable / disable the threaded interpreter. It is disabled by default.
+ *
+ * When enabled, ebpf_load decodes the program once into an array of handler
+ * addresses and operands, which the interpreter runs with computed gotos
+ * instead of a switch. Only takes effect on the next call to ebpf_load, and
+ * requires a compiler supporting computed gotos.
+ *
+ * @param[in] vm The VM to enable / disable the threaded interpreter on.
+ * @param[in] enable Enable the threaded interpreter if true, disable if false.
+ * @retval true The threaded interpreter was previously enabled.
+ */
+bool ebpf_toggle_threaded_interpreter(struct ebpf_vm* vm, bool enable);
+
 /**
  * @brief Set the function to be invoked if the program hits a fatal error.
  *
@@ -148,6 +162,23 @@ void ebpf_unload_code(struct ebpf_vm* vm);
  */
 int ebpf_exec(const struct ebpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_return_value);
 
+/**
+ * @brief Execute a BPF program in the VM using the interpreter, even if it
+ * has been compiled.
+ *
+ * The LLVM JIT implements ebpf_exec by compiling the program the first time
+ * it runs, while this never compiles, so that a program could run while it
+ * is being compiled in another VM.
+ *
+ * @param[in] vm The VM to execute the program in.
+ * @param[in] mem The memory to pass to the program.
+ * @param[in] mem_len The length of the memory.
+ * @param[in] bpf_return_value The value of the r0 register when the program exits.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int ebpf_interpret(const struct ebpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_return_value);
+
 /**
  * @brief Compile a BPF program in the VM to native code, for jit execution.
  *
@@ -160,6 +191,53 @@ int ebpf_exec(const struct ebpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf
  */
 ebpf_jit_fn ebpf_compile(struct ebpf_vm* vm, char** errmsg);
 
+/**
+ * @brief Compile a BPF program in the VM ahead of time, into a relocatable
+ * native object of the host architecture.
+ *
+ * Calls to the registered functions and the lddw helpers are left as
+ * relocations, so that the object could be loaded into other processes with
+ * ebpf_load_aot_object. Only supported by the LLVM JIT.
+ *
+ * @param[in] vm The VM to compile the program in.
+ * @param[out] buf The object file. This should be freed by the caller.
+ * @param[out] buf_len The length of the object file.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int ebpf_compile_aot(struct ebpf_vm* vm, void** buf, size_t* buf_len, char** errmsg);
+
+/**
+ * @brief Load an object produced by ebpf_compile_aot, for jit execution.
+ *
+ * The program must be loaded into the VM with ebpf_load, and all external
+ * functions referenced by the object must be registered before calling this
+ * function. The object is rejected if it was compiled from other
+ * instructions. It is unmapped by ebpf_unload_code.
+ *
+ * @param[in] vm The VM to load the object into.
+ * @param[in] buf The object file.
+ * @param[in] buf_len The length of the object file.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @return ebpf_jit_fn A pointer to the loaded program, or NULL on failure.
+ */
+ebpf_jit_fn ebpf_load_aot_object(struct ebpf_vm* vm, const void* buf, size_t buf_len, char** errmsg);
+
+/**
+ * @brief Key of the object ebpf_compile_aot would produce for the loaded
+ * program, to cache objects across processes.
+ *
+ * It covers the instructions, the indexes of the registered functions, the
+ * lddw helpers set and the version of the code generator, but not the
+ * addresses of the functions, which are resolved by ebpf_load_aot_object.
+ * Both JIT backends compute the same key.
+ *
+ * @param[in] vm The VM the program is loaded into.
+ * @return The key, or 0 if no program is loaded.
+ */
+uint64_t ebpf_aot_cache_key(const struct ebpf_vm* vm);
+
 /**
  * @brief Instruct the ebpf runtime to apply unwind-on-success semantics to a helper function.
  * If the function returns 0, the ebpf runtime will end execution of
@@ -193,7 +271,7 @@ int ebpf_set_pointer_secret(struct ebpf_vm* vm, uint64_t secret);
  * @param[in] map_by_idx A helper to to convert a 32-bit index into an address of a map
  * @param[in] map_val Helper to get the address of the first value in a given map
  * @param[in] var_addr Helper to get the address of a platform variable with a given id
- * @param[in] code_addr Helper to get the address of the instruction at a specified relative offset in number of (64-bit) instructions
+ * @param[in] code_addr Helper to get the address of the instruction at a specified relative offset in number of (64-bit) instructions. If null, lddw loads the address of a struct ebpf_callback instead
  */
 void ebpf_set_lddw_helpers(struct ebpf_vm *vm, uint64_t (*map_by_fd)(uint32_t),
 			   uint64_t (*map_by_idx)(uint32_t),
@@ -201,6 +279,35 @@ void ebpf_set_lddw_helpers(struct ebpf_vm *vm, uint64_t (*map_by_fd)(uint32_t),
 			   uint64_t (*var_addr)(uint32_t),
 			   uint64_t (*code_addr)(uint32_t));
 
+/**
+ * @brief A BPF subprogram, loaded by a lddw with src_reg 4 (BPF_PSEUDO_FUNC)
+ * when no code_addr helper is set.
+ *
+ * Helpers taking callbacks, such as bpf_user_ringbuf_drain, get its address
+ * as an argument, and run the subprogram with ebpf_call_callback. It runs the
+ * way the program does, interpreted or compiled, with a stack of its own.
+ */
+struct ebpf_callback {
+	uint64_t (*fn)(const struct ebpf_callback* cb, uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4, uint64_t r5);
+	/* The VM interpreting the subprogram, or NULL if it is compiled */
+	const void* ctx;
+	/* Index of the first instruction of the subprogram */
+	uint64_t pc;
+};
+
+/**
+ * @brief Run a subprogram loaded by a lddw with src_reg 4.
+ *
+ * @param[in] callback The value loaded by the lddw.
+ * @return The r0 register when the subprogram exits, or UINT64_MAX if the
+ * interpreter failed to run it.
+ */
+static inline uint64_t ebpf_call_callback(uint64_t callback, uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4, uint64_t r5)
+{
+	const struct ebpf_callback* cb = (const struct ebpf_callback*)(uintptr_t)callback;
+	return cb->fn(cb, r1, r2, r3, r4, r5);
+}
+
 #ifdef __cplusplus
 }
 #endif
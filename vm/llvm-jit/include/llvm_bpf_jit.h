@@ -24,20 +24,31 @@ typedef uint64_t (*ext_func)(uint64_t arg0, uint64_t arg1, uint64_t arg2,
 			     uint64_t arg3, uint64_t arg4);
 
 struct bpf_jit_context;
+struct ebpf_aot_object;
+struct ebpf_threaded_insn;
 
+// Also included by the interpreter, which is C
 struct ebpf_vm {
 	/* ubpf_defs*/
 	/* Instructions for interpreter */
-	struct ebpf_inst *insnsi = NULL;
+	struct ebpf_inst *insnsi;
 	uint16_t num_insts;
 	bool bounds_check_enabled;
+	bool threaded_interpreter;
+	// Decoded by ebpf_load if threaded_interpreter is set
+	struct ebpf_threaded_insn *threaded_insns;
+	// Subprograms loaded by lddw without code_addr, indexed by their first
+	// instruction
+	struct ebpf_callback *callbacks;
 	ext_func ext_funcs[MAX_EXT_FUNCS];
-	const char **ext_func_names = NULL;
+	const char **ext_func_names;
 	int unwind_stack_extension_index;
-	int (*error_printf)(FILE *stream, const char *format, ...) = NULL;
+	int (*error_printf)(FILE *stream, const char *format, ...);
 	uint64_t pointer_secret;
 	ebpf_jit_fn jitted_function;
-	bpf_jit_context *jit_context;
+	struct bpf_jit_context *jit_context;
+	// Set if jitted_function is loaded from an AOT object
+	struct ebpf_aot_object *aot_object;
 	uint64_t (*map_by_fd)(uint32_t);
 	uint64_t (*map_by_idx)(uint32_t);
 	uint64_t (*map_val)(uint64_t);
@@ -45,6 +56,12 @@ struct ebpf_vm {
 	uint64_t (*code_addr)(uint32_t);
 };
 
+struct ebpf_inst ebpf_fetch_instruction(const struct ebpf_vm *vm, uint16_t pc);
+char *ebpf_error(const char *fmt, ...);
+// Defined with the interpreter
+int ebpf_decode_threaded(struct ebpf_vm *vm);
+int ebpf_prepare_callbacks(struct ebpf_vm *vm, char **errmsg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,9 +19,16 @@
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
 
 #include <utility>
 #include <iostream>
+#include <cstring>
 #include <string>
 #include <cinttypes>
 #include <spdlog/spdlog.h>
@@ -94,10 +101,82 @@ ebpf_jit_fn bpf_jit_context::compile()
 	tryDefineLddwHelper(LDDW_HELPER_VAR_ADDR, (void *)vm->var_addr);
 	ExitOnErr(mainDylib.define(absoluteSymbols(lddwSyms)));
 	auto bpfModule = ExitOnErr(
-		generateModule(*jit, extFuncNames, definedLddwHelpers));
+		generateModule(extFuncNames, definedLddwHelpers));
 	bpfModule.withModuleDo([](auto &M) { optimizeModule(M); });
 	ExitOnErr(jit->addIRModule(std::move(bpfModule)));
 	auto func = ExitOnErr(jit->lookup("bpf_main"));
 	this->jit = std::move(jit);
 	return func.toPtr<ebpf_jit_fn>();
 }
+
+// Record the instructions in the object, so that the loader could tell an
+// object compiled from another version of the program
+static void emitInsnsRecord(llvm::Module &M, const ebpf_vm *vm)
+{
+	std::vector<uint64_t> words(vm->num_insts);
+	memcpy(words.data(), vm->insnsi, words.size() * sizeof(uint64_t));
+	auto insns = ConstantDataArray::get(M.getContext(), words);
+	new GlobalVariable(M, insns->getType(), true,
+			   GlobalValue::ExternalLinkage, insns,
+			   EBPF_AOT_INSNS_SYMBOL);
+	auto cnt = ConstantInt::get(Type::getInt64Ty(M.getContext()),
+				    vm->num_insts);
+	new GlobalVariable(M, cnt->getType(), true,
+			   GlobalValue::ExternalLinkage, cnt,
+			   EBPF_AOT_INSN_CNT_SYMBOL);
+}
+
+Expected<std::vector<uint8_t> > bpf_jit_context::do_aot_compile()
+{
+	spdlog::info("AOT compiling to a relocatable object");
+	std::vector<std::string> extFuncNames;
+	for (uint32_t i = 0; i < std::size(vm->ext_funcs); i++) {
+		if (vm->ext_funcs[i] != nullptr)
+			extFuncNames.push_back(ext_func_sym(i));
+	}
+	std::vector<std::string> lddwHelpers;
+	const auto tryAddLddwHelper = [&](const char *name, void *func) {
+		if (func)
+			lddwHelpers.push_back(name);
+	};
+	tryAddLddwHelper(LDDW_HELPER_MAP_BY_FD, (void *)vm->map_by_fd);
+	tryAddLddwHelper(LDDW_HELPER_MAP_BY_IDX, (void *)vm->map_by_idx);
+	tryAddLddwHelper(LDDW_HELPER_MAP_VAL, (void *)vm->map_val);
+	tryAddLddwHelper(LDDW_HELPER_CODE_ADDR, (void *)vm->code_addr);
+	tryAddLddwHelper(LDDW_HELPER_VAR_ADDR, (void *)vm->var_addr);
+	auto bpfModule = generateModule(extFuncNames, lddwHelpers);
+	if (!bpfModule)
+		return bpfModule.takeError();
+	return bpfModule->withModuleDo(
+		[&](Module &M) -> Expected<std::vector<uint8_t> > {
+			auto triple = sys::getProcessTriple();
+			std::string error;
+			auto target = TargetRegistry::lookupTarget(triple, error);
+			if (!target)
+				return make_error<StringError>(
+					error, inconvertibleErrorCode());
+			// Objects are deployed to other machines, so don't
+			// tune for the host CPU. PIC keeps references to
+			// the sections relative, so that the loader could map
+			// the object anywhere
+			std::unique_ptr<TargetMachine> tm(
+				target->createTargetMachine(
+					triple, "", "", TargetOptions(),
+					Reloc::PIC_, CodeModel::Small,
+					CodeGenOpt::Aggressive));
+			M.setTargetTriple(triple);
+			M.setDataLayout(tm->createDataLayout());
+			emitInsnsRecord(M, vm);
+			optimizeModule(M);
+			SmallVector<char, 0> buf;
+			raw_svector_ostream os(buf);
+			legacy::PassManager PM;
+			if (tm->addPassesToEmitFile(PM, os, nullptr,
+						    CGFT_ObjectFile))
+				return make_error<StringError>(
+					"Target can't emit object files",
+					inconvertibleErrorCode());
+			PM.run(M);
+			return std::vector<uint8_t>(buf.begin(), buf.end());
+		});
+}
@@ -14,6 +14,8 @@
 #include <llvm-15/llvm/Support/Error.h>
 #include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/Instruction.h>
 #include <llvm/IR/Value.h>
 #include <llvm/Support/raw_ostream.h>
@@ -22,6 +24,7 @@
 #include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Support/Debug.h>
+#include <algorithm>
 #include <map>
 #include <vector>
 #include <endian.h>
@@ -80,8 +83,7 @@ const int CALL_STACK_SIZE = 64;
 	EBPF_OP_EXIT, EBPF_OP_CALL
 */
 Expected<ThreadSafeModule>
-bpf_jit_context::generateModule(const LLJIT &jit,
-				const std::vector<std::string> &extFuncNames,
+bpf_jit_context::generateModule(const std::vector<std::string> &extFuncNames,
 				const std::vector<std::string> &lddwHelpers)
 {
 	auto context = std::make_unique<LLVMContext>();
@@ -112,13 +114,13 @@ bpf_jit_context::generateModule(const LLJIT &jit,
 		if (helperName == LDDW_HELPER_MAP_VAL) {
 			func = Function::Create(lddwHelperWithUint64,
 						Function::ExternalLinkage,
-						jit.mangle(helperName),
+						helperName,
 						jitModule.get());
 
 		} else {
 			func = Function::Create(lddwHelperWithUint32,
 						Function::ExternalLinkage,
-						jit.mangle(helperName),
+						helperName,
 						jitModule.get());
 		}
 		spdlog::debug("Initializing lddw function with name {}",
@@ -138,7 +140,7 @@ bpf_jit_context::generateModule(const LLJIT &jit,
 		auto currFunc =
 			Function::Create(helperFuncTy,
 					 Function::ExternalLinkage,
-					 jit.mangle(name), jitModule.get());
+					 name, jitModule.get());
 		extFunc[name] = currFunc;
 	}
 	std::vector<bool> blockBegin(vm->num_insts, false);
@@ -156,26 +158,55 @@ bpf_jit_context::generateModule(const LLJIT &jit,
 			blockBegin[i + curr.off + 1] = true;
 		}
 	}
+	// Subprograms loaded by lddw without code_addr are called back by
+	// helpers, so the body could also be entered at their first
+	// instruction
+	std::vector<uint16_t> callbackTargets;
+	if (!lddwHelper.contains(LDDW_HELPER_CODE_ADDR)) {
+		for (uint16_t i = 0; i + 1 < vm->num_insts; i++) {
+			if (insts[i].code != EBPF_OP_LDDW)
+				continue;
+			int64_t target = (int64_t)i + insts[i].imm + 1;
+			if (insts[i].src_reg == 4) {
+				if (target < 0 || target >= vm->num_insts) {
+					return llvm::make_error<
+						llvm::StringError>(
+						"lddw at pc " +
+							std::to_string(i) +
+							" loads an instruction out of the program",
+						llvm::inconvertibleErrorCode());
+				}
+				callbackTargets.push_back(target);
+				blockBegin[target] = true;
+			}
+			i++;
+		}
+		std::sort(callbackTargets.begin(), callbackTargets.end());
+		callbackTargets.erase(std::unique(callbackTargets.begin(),
+						  callbackTargets.end()),
+				      callbackTargets.end());
+	}
 
-	// The main function
-	Function *bpf_func = Function::Create(
-		FunctionType::get(Type::getInt64Ty(*context),
-				  { Type::getInt8PtrTy(*context),
-				    Type::getInt64Ty(*context) },
-				  false),
-		Function::ExternalLinkage, "bpf_main", jitModule.get());
-
-	// Get args of uint64_t bpf_main(uint64_t, uint64_t)
-	Argument *mem = bpf_func->getArg(0);
-	Argument *mem_len = bpf_func->getArg(1);
+	// The body of the program, entered at the instruction `entry` with r1
+	// to r5 set, which is 0 for the program and the first instruction of
+	// a subprogram for callbacks
+	FunctionType *bodyTy = FunctionType::get(
+		Type::getInt64Ty(*context),
+		{ Type::getInt64Ty(*context), Type::getInt64Ty(*context),
+		  Type::getInt64Ty(*context), Type::getInt64Ty(*context),
+		  Type::getInt64Ty(*context), Type::getInt64Ty(*context) },
+		false);
+	Function *bpf_func = Function::Create(bodyTy,
+					      Function::InternalLinkage,
+					      "bpf_body", jitModule.get());
 
 	std::vector<Value *> regs;
 	std::vector<BasicBlock *> allBlocks;
 	// Stack used to save return address and saved registers
 	Value *callStack, *callItemCnt;
+	BasicBlock *setupBlock =
+		BasicBlock::Create(*context, "setupBlock", bpf_func);
 	{
-		BasicBlock *setupBlock =
-			BasicBlock::Create(*context, "setupBlock", bpf_func);
 		allBlocks.push_back(setupBlock);
 		IRBuilder<> builder(setupBlock);
 		// Create registers
@@ -196,10 +227,9 @@ bpf_jit_context::generateModule(const LLJIT &jit,
 					  "stackEnd");
 		// Write stack pointer into r10
 		builder.CreateStore(stackEnd, regs[10]);
-		// Write memory address into r1
-		builder.CreateStore(mem, regs[1]);
-		// Write memory len into r1
-		builder.CreateStore(mem_len, regs[2]);
+		// Write arguments into r1 to r5
+		for (int i = 1; i <= 5; i++)
+			builder.CreateStore(bpf_func->getArg(i), regs[i]);
 
 		callStack = builder.CreateAlloca(
 			builder.getPtrTy(),
@@ -240,6 +270,80 @@ bpf_jit_context::generateModule(const LLJIT &jit,
 		}
 	}
 
+	// Enter the body at the requested instruction
+	{
+		IRBuilder<> builder(setupBlock);
+		auto entrySwitch =
+			builder.CreateSwitch(bpf_func->getArg(0), instBlocks[0],
+					     callbackTargets.size());
+		for (auto target : callbackTargets)
+			entrySwitch->addCase(builder.getInt64(target),
+					     instBlocks[target]);
+	}
+	// The program itself, uint64_t bpf_main(void *mem, uint64_t mem_len)
+	{
+		Function *mainFunc = Function::Create(
+			FunctionType::get(Type::getInt64Ty(*context),
+					  { Type::getInt8PtrTy(*context),
+					    Type::getInt64Ty(*context) },
+					  false),
+			Function::ExternalLinkage, "bpf_main",
+			jitModule.get());
+		IRBuilder<> builder(
+			BasicBlock::Create(*context, "entry", mainFunc));
+		builder.CreateRet(builder.CreateCall(
+			bodyTy, bpf_func,
+			{ builder.getInt64(0),
+			  builder.CreatePtrToInt(mainFunc->getArg(0),
+						 builder.getInt64Ty()),
+			  mainFunc->getArg(1), builder.getInt64(0),
+			  builder.getInt64(0), builder.getInt64(0) }));
+	}
+	// A struct ebpf_callback for each subprogram, whose function enters
+	// the body at the subprogram. They are left as relocations in AOT
+	// objects, like everything else in them
+	std::map<uint16_t, GlobalVariable *> callbacks;
+	{
+		auto callbackTy = StructType::get(
+			*context, { PointerType::getUnqual(*context),
+				    PointerType::getUnqual(*context),
+				    Type::getInt64Ty(*context) });
+		FunctionType *callbackFnTy = FunctionType::get(
+			Type::getInt64Ty(*context),
+			{ PointerType::getUnqual(*context),
+			  Type::getInt64Ty(*context), Type::getInt64Ty(*context),
+			  Type::getInt64Ty(*context), Type::getInt64Ty(*context),
+			  Type::getInt64Ty(*context) },
+			false);
+		for (auto target : callbackTargets) {
+			Function *callbackFn = Function::Create(
+				callbackFnTy, Function::InternalLinkage,
+				"bpf_callback_" + std::to_string(target),
+				jitModule.get());
+			IRBuilder<> builder(BasicBlock::Create(
+				*context, "entry", callbackFn));
+			std::vector<Value *> args = { builder.getInt64(
+				target) };
+			for (int i = 1; i <= 5; i++)
+				args.push_back(callbackFn->getArg(i));
+			builder.CreateRet(
+				builder.CreateCall(bodyTy, bpf_func, args));
+			callbacks[target] = new GlobalVariable(
+				*jitModule, callbackTy, true,
+				GlobalValue::InternalLinkage,
+				ConstantStruct::get(
+					callbackTy,
+					{ callbackFn,
+					  ConstantPointerNull::get(
+						  PointerType::getUnqual(
+							  *context)),
+					  ConstantInt::get(
+						  Type::getInt64Ty(*context),
+						  target) }),
+				"bpf_callback_desc_" + std::to_string(target));
+		}
+	}
+
 	// Basic block used to exit the eBPF program
 	// will read r0 and return it
 	BasicBlock *exitBlk =
@@ -716,9 +820,20 @@ bpf_jit_context::generateModule(const LLJIT &jit,
 						llvm::inconvertibleErrorCode());
 				}
 			} else if (inst.src_reg == 4) {
-				if (auto itr = lddwHelper.find(
-					    LDDW_HELPER_CODE_ADDR);
-				    itr != lddwHelper.end()) {
+				// pc is at the second slot of lddw by now
+				if (auto cb = callbacks.find(pc + inst.imm);
+				    cb != callbacks.end()) {
+					builder.CreateStore(
+						builder.CreatePtrToInt(
+							cb->second,
+							builder.getInt64Ty()),
+						regs[inst.dst_reg]);
+					spdlog::debug(
+						"Emit lddw of the callback at {} at pc {}",
+						cb->first, pc - 1);
+				} else if (auto itr = lddwHelper.find(
+						   LDDW_HELPER_CODE_ADDR);
+					   itr != lddwHelper.end()) {
 					builder.CreateStore(
 						builder.CreateCall(
 							lddwHelperWithUint32,
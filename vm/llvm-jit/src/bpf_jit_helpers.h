@@ -214,7 +214,7 @@ emitJmpLoadSrcAndDstAndZero(const ebpf_inst &inst, llvm::Value **regs,
 static inline std::string ext_func_sym(uint32_t idx)
 {
 	char buf[16];
-	sprintf(buf, "ext_%04" PRIu32, idx);
+	sprintf(buf, EBPF_AOT_EXT_FUNC_PREFIX "%04" PRIu32, idx);
 	return buf;
 }
 
@@ -2,6 +2,7 @@
 #include "llvm_bpf_jit.h"
 #include "llvm_jit_context.h"
 #include "bpf_jit_helpers.h"
+#include "ebpf_aot_object.h"
 #include <cassert>
 #include <cstddef>
 #include <cstdlib>
@@ -94,6 +95,7 @@ struct ebpf_vm *ebpf_create(void)
 	vm->jit_context = new bpf_jit_context(vm);
 
 	vm->bounds_check_enabled = true;
+	vm->error_printf = fprintf;
 	vm->unwind_stack_extension_index = -1;
 	return vm;
 }
@@ -175,6 +177,17 @@ int ebpf_load(struct ebpf_vm *vm, const void *code, uint32_t code_len,
 		ebpf_store_instruction(vm, i, source_inst[i]);
 	}
 
+	if (ebpf_prepare_callbacks(vm, errmsg) < 0) {
+		ebpf_unload_code(vm);
+		return -1;
+	}
+
+	if (vm->threaded_interpreter && ebpf_decode_threaded(vm) < 0) {
+		*errmsg = ebpf_error("out of memory");
+		ebpf_unload_code(vm);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -183,11 +196,19 @@ void ebpf_unload_code(struct ebpf_vm *vm)
 	if (vm->jitted_function) {
 		vm->jitted_function = NULL;
 	}
+	if (vm->aot_object) {
+		ebpf_aot_object_free(vm->aot_object);
+		vm->aot_object = NULL;
+	}
 	if (vm->insnsi) {
 		free(vm->insnsi);
 		vm->insnsi = NULL;
 		vm->num_insts = 0;
 	}
+	free(vm->threaded_insns);
+	vm->threaded_insns = NULL;
+	free(vm->callbacks);
+	vm->callbacks = NULL;
 }
 
 #define IS_ALIGNED(x, a) (((uintptr_t)(x) & ((a)-1)) == 0)
@@ -267,6 +288,76 @@ ebpf_jit_fn ebpf_compile(struct ebpf_vm *vm, char **errmsg)
 	return func;
 }
 
+int ebpf_compile_aot(struct ebpf_vm *vm, void **buf, size_t *buf_len,
+		     char **errmsg)
+{
+	if (!vm->insnsi) {
+		if (errmsg)
+			*errmsg = ebpf_error("code has not been loaded");
+		return -1;
+	}
+	auto obj = vm->jit_context->do_aot_compile();
+	if (!obj) {
+		auto msg = llvm::toString(obj.takeError());
+		spdlog::error("Failed to AOT compile: {}", msg);
+		if (errmsg)
+			*errmsg = ebpf_error("%s", msg.c_str());
+		return -1;
+	}
+	*buf = malloc(obj->size());
+	if (*buf == NULL) {
+		if (errmsg)
+			*errmsg = ebpf_error("out of memory");
+		return -1;
+	}
+	memcpy(*buf, obj->data(), obj->size());
+	*buf_len = obj->size();
+	return 0;
+}
+
+static ebpf_aot_vm_symbols aot_vm_symbols(const ebpf_vm *vm)
+{
+	return ebpf_aot_vm_symbols{
+		.ext_funcs = (void *const *)vm->ext_funcs,
+		.nr_ext_funcs = MAX_EXT_FUNCS,
+		.map_by_fd = (void *)vm->map_by_fd,
+		.map_by_idx = (void *)vm->map_by_idx,
+		.map_val = (void *)vm->map_val,
+		.var_addr = (void *)vm->var_addr,
+		.code_addr = (void *)vm->code_addr,
+	};
+}
+
+ebpf_jit_fn ebpf_load_aot_object(struct ebpf_vm *vm, const void *buf,
+				 size_t buf_len, char **errmsg)
+{
+	if (!vm->insnsi || vm->jitted_function) {
+		*errmsg = ebpf_error(
+			"code must be loaded and not compiled before loading an AOT object");
+		return NULL;
+	}
+	auto syms = aot_vm_symbols(vm);
+	void *entry;
+	auto obj = ebpf_aot_object_load_program(buf, buf_len, vm->insnsi,
+						vm->num_insts, &syms, &entry,
+						errmsg);
+	if (!obj)
+		return NULL;
+	spdlog::debug("LLJIT: loaded AOT object, bpf_main at {:x}",
+		      (uintptr_t)entry);
+	vm->aot_object = obj;
+	vm->jitted_function = (ebpf_jit_fn)entry;
+	return vm->jitted_function;
+}
+
+uint64_t ebpf_aot_cache_key(const struct ebpf_vm *vm)
+{
+	if (!vm->insnsi)
+		return 0;
+	auto syms = aot_vm_symbols(vm);
+	return ebpf_aot_program_key(vm->insnsi, vm->num_insts, &syms);
+}
+
 int ebpf_exec(const struct ebpf_vm *vm, void *mem, size_t mem_len,
 	      uint64_t *bpf_return_value)
 {
@@ -4,8 +4,10 @@
 #define DEBUG_TYPE "debug"
 
 #include "llvm_bpf_jit.h"
+#include "ebpf_aot_object.h"
 #include <llvm/Support/TargetSelect.h>
 #include <memory>
+#include <mutex>
 #include <llvm/ExecutionEngine/Orc/Core.h>
 #include <llvm/Support/InitLLVM.h>
 #include <llvm/IR/Module.h>
@@ -13,6 +15,7 @@
 #include <llvm/ExecutionEngine/Orc/LLJIT.h>
 #include <optional>
 #include <string>
+#include <vector>
 #include <cstdio>
 
 typedef uint8_t u8;
@@ -24,11 +27,11 @@ typedef int32_t s32;
 typedef uint64_t u64;
 typedef int64_t s64;
 
-const static char *LDDW_HELPER_MAP_BY_FD = "__lddw_helper_map_by_fd";
-const static char *LDDW_HELPER_MAP_BY_IDX = "__lddw_helper_map_by_idx";
-const static char *LDDW_HELPER_MAP_VAL = "__lddw_helper_map_val";
-const static char *LDDW_HELPER_VAR_ADDR = "__lddw_helper_var_addr";
-const static char *LDDW_HELPER_CODE_ADDR = "__lddw_helper_code_addr";
+const static char *LDDW_HELPER_MAP_BY_FD = EBPF_AOT_LDDW_MAP_BY_FD;
+const static char *LDDW_HELPER_MAP_BY_IDX = EBPF_AOT_LDDW_MAP_BY_IDX;
+const static char *LDDW_HELPER_MAP_VAL = EBPF_AOT_LDDW_MAP_VAL;
+const static char *LDDW_HELPER_VAR_ADDR = EBPF_AOT_LDDW_VAR_ADDR;
+const static char *LDDW_HELPER_CODE_ADDR = EBPF_AOT_LDDW_CODE_ADDR;
 
 #define IS_ALIGNED(x, a) (((uintptr_t)(x) & ((a)-1)) == 0)
 
@@ -37,19 +40,26 @@ struct bpf_jit_context {
 	std::optional<std::unique_ptr<llvm::orc::LLJIT> > jit;
 
 	llvm::Expected<llvm::orc::ThreadSafeModule>
-	generateModule(const llvm::orc::LLJIT &jit,
-		       const std::vector<std::string> &extFuncNames, const std::vector<std::string>& lddwHelpers);
+	generateModule(const std::vector<std::string> &extFuncNames,
+		       const std::vector<std::string> &lddwHelpers);
 
     public:
 	bpf_jit_context(const ebpf_vm *m_vm) : vm(m_vm)
 	{
 		using namespace llvm;
-		// It's legal to call them multiple times
-		InitializeNativeTarget();
-		InitializeNativeTargetAsmPrinter();
+		// Programs may be compiled by several threads at once, and
+		// registering targets isn't thread safe
+		static std::once_flag init_flag;
+		std::call_once(init_flag, []() {
+			InitializeNativeTarget();
+			InitializeNativeTargetAsmPrinter();
+		});
 	}
 	~bpf_jit_context() = default;
 	ebpf_jit_fn compile();
+	// Compile into a relocatable object of the host, with helpers and
+	// lddw helpers left as undefined symbols
+	llvm::Expected<std::vector<uint8_t> > do_aot_compile();
 };
 
 #endif
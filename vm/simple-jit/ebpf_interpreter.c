@@ -0,0 +1,2082 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The interpreter, built by both JIT backends. The LLVM JIT uses it to run
+ * programs before they are compiled, so it only relies on the fields both
+ * backends' struct ebpf_vm have.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include "ebpf_inst.h"
+#ifdef EBPF_LLVM_JIT
+#include "llvm_bpf_jit.h"
+#else
+#include "debug.h"
+#include "ebpf_vm.h"
+#endif
+
+typedef uint32_t u32;
+
+static bool bounds_check(const struct ebpf_vm *vm, void *addr, int size,
+			 const char *type, uint16_t cur_pc, void *mem,
+			 size_t mem_len, void *stack);
+#if defined(__GNUC__)
+static int run_threaded(const struct ebpf_vm *vm, uint16_t pc,
+			const uint64_t *args, void *mem, size_t mem_len,
+			uint64_t *bpf_return_value,
+			const void *const **handlers);
+#endif
+
+
+#define IS_ALIGNED(x, a) (((uintptr_t)(x) & ((a)-1)) == 0)
+
+inline static uint64_t ebpf_mem_load(uint64_t address, size_t size)
+{
+	if (!IS_ALIGNED(address, size)) {
+		// Fill the result with 0 to avoid leaking uninitialized memory.
+		uint64_t value = 0;
+		memcpy(&value, (void *)address, size);
+		return value;
+	}
+
+	switch (size) {
+	case 1:
+		return *(uint8_t *)address;
+	case 2:
+		return *(uint16_t *)address;
+	case 4:
+		return *(uint32_t *)address;
+	case 8:
+		return *(uint64_t *)address;
+	default:
+		abort();
+	}
+}
+
+inline static void ebpf_mem_store(uint64_t address, uint64_t value, size_t size)
+{
+	if (!IS_ALIGNED(address, size)) {
+		memcpy((void *)address, &value, size);
+		return;
+	}
+
+	switch (size) {
+	case 1:
+		*(uint8_t *)(uintptr_t)address = value;
+		break;
+	case 2:
+		*(uint16_t *)(uintptr_t)address = value;
+		break;
+	case 4:
+		*(uint32_t *)(uintptr_t)address = value;
+		break;
+	case 8:
+		*(uint64_t *)(uintptr_t)address = value;
+		break;
+	default:
+		abort();
+	}
+}
+
+/*
+ * Run from the instruction at pc, with r1 to r5 set to args. Programs start
+ * at 0 with the context, subprograms called back by helpers at their first
+ * instruction, where mem is NULL since they have no context of their own.
+ */
+static int interpret(const struct ebpf_vm *vm, uint16_t pc,
+		     const uint64_t *args, void *mem, size_t mem_len,
+		     uint64_t *bpf_return_value)
+{
+	const struct ebpf_inst *insts = vm->insnsi;
+	uint64_t *reg;
+	uint64_t _reg[16];
+	uint64_t stack[(EBPF_STACK_SIZE + 7) / 8];
+
+	if (!insts) {
+		/* Code must be loaded before we can execute */
+		return -1;
+	}
+#if defined(__GNUC__)
+	if (vm->threaded_insns)
+		return run_threaded(vm, pc, args, mem, mem_len,
+				    bpf_return_value, NULL);
+#endif
+
+#if DEBUG
+	if (vm->regs)
+		reg = vm->regs;
+	else
+		reg = _reg;
+#else
+	reg = _reg;
+#endif
+
+	memcpy(&reg[1], args, 5 * sizeof(reg[0]));
+	reg[10] = (uintptr_t)stack + sizeof(stack);
+
+	while (1) {
+		const uint16_t cur_pc = pc;
+		struct ebpf_inst inst = ebpf_fetch_instruction(vm, pc++);
+
+		LOG_DEBUG("%08" PRIu64 "x, [%d] %d %d %d %d\n",
+			  *(uint64_t *)(uintptr_t)&inst, cur_pc, inst.dst_reg,
+			  inst.src_reg, inst.off, inst.imm);
+
+		switch (inst.code) {
+		case EBPF_OP_ADD_IMM:
+			reg[inst.dst_reg] += inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_ADD_REG:
+			reg[inst.dst_reg] += reg[inst.src_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_SUB_IMM:
+			reg[inst.dst_reg] -= inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_SUB_REG:
+			reg[inst.dst_reg] -= reg[inst.src_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_MUL_IMM:
+			reg[inst.dst_reg] *= inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_MUL_REG:
+			reg[inst.dst_reg] *= reg[inst.src_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_DIV_IMM:
+			reg[inst.dst_reg] =
+				(uint32_t)(inst.imm) ?
+					(uint32_t)(reg[inst.dst_reg]) /
+						(uint32_t)(inst.imm) :
+					0;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_DIV_REG:
+			reg[inst.dst_reg] =
+				(uint32_t)(reg[inst.src_reg]) ?
+					(uint32_t)(reg[inst.dst_reg]) /
+						(uint32_t)(reg[inst.src_reg]) :
+					0;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_OR_IMM:
+			reg[inst.dst_reg] |= inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_OR_REG:
+			reg[inst.dst_reg] |= reg[inst.src_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_AND_IMM:
+			reg[inst.dst_reg] &= inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_AND_REG:
+			reg[inst.dst_reg] &= reg[inst.src_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_LSH_IMM:
+			reg[inst.dst_reg] <<= inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_LSH_REG:
+			reg[inst.dst_reg] <<= reg[inst.src_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_RSH_IMM:
+			reg[inst.dst_reg] =
+				(uint32_t)(reg[inst.dst_reg]) >> inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_RSH_REG:
+			reg[inst.dst_reg] = (uint32_t)(reg[inst.dst_reg]) >>
+					    reg[inst.src_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_NEG:
+			reg[inst.dst_reg] = -(int64_t)reg[inst.dst_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_MOD_IMM:
+			reg[inst.dst_reg] =
+				(uint32_t)(inst.imm) ?
+					(uint32_t)(reg[inst.dst_reg]) %
+						(uint32_t)(inst.imm) :
+					(uint32_t)(reg[inst.dst_reg]);
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_MOD_REG:
+			reg[inst.dst_reg] =
+				(uint32_t)(reg[inst.src_reg]) ?
+					(uint32_t)(reg[inst.dst_reg]) %
+						(uint32_t)(reg[inst.src_reg]) :
+					(uint32_t)(reg[inst.dst_reg]);
+			break;
+		case EBPF_OP_XOR_IMM:
+			reg[inst.dst_reg] ^= inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_XOR_REG:
+			reg[inst.dst_reg] ^= reg[inst.src_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_MOV_IMM:
+			reg[inst.dst_reg] = inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_MOV_REG:
+			reg[inst.dst_reg] = reg[inst.src_reg];
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_ARSH_IMM:
+			reg[inst.dst_reg] =
+				(int32_t)reg[inst.dst_reg] >> inst.imm;
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+		case EBPF_OP_ARSH_REG:
+			reg[inst.dst_reg] = (int32_t)reg[inst.dst_reg] >>
+					    (uint32_t)(reg[inst.src_reg]);
+			reg[inst.dst_reg] &= UINT32_MAX;
+			break;
+
+		case EBPF_OP_LE:
+			if (inst.imm == 16) {
+				reg[inst.dst_reg] = htole16(reg[inst.dst_reg]);
+			} else if (inst.imm == 32) {
+				reg[inst.dst_reg] = htole32(reg[inst.dst_reg]);
+			} else if (inst.imm == 64) {
+				reg[inst.dst_reg] = htole64(reg[inst.dst_reg]);
+			}
+			break;
+		case EBPF_OP_BE:
+			if (inst.imm == 16) {
+				reg[inst.dst_reg] = htobe16(reg[inst.dst_reg]);
+			} else if (inst.imm == 32) {
+				reg[inst.dst_reg] = htobe32(reg[inst.dst_reg]);
+			} else if (inst.imm == 64) {
+				reg[inst.dst_reg] = htobe64(reg[inst.dst_reg]);
+			}
+			break;
+
+		case EBPF_OP_ADD64_IMM:
+			reg[inst.dst_reg] += inst.imm;
+			break;
+		case EBPF_OP_ADD64_REG:
+			reg[inst.dst_reg] += reg[inst.src_reg];
+			break;
+		case EBPF_OP_SUB64_IMM:
+			reg[inst.dst_reg] -= inst.imm;
+			break;
+		case EBPF_OP_SUB64_REG:
+			reg[inst.dst_reg] -= reg[inst.src_reg];
+			break;
+		case EBPF_OP_MUL64_IMM:
+			reg[inst.dst_reg] *= inst.imm;
+			break;
+		case EBPF_OP_MUL64_REG:
+			reg[inst.dst_reg] *= reg[inst.src_reg];
+			break;
+		case EBPF_OP_DIV64_IMM:
+			reg[inst.dst_reg] =
+				inst.imm ? reg[inst.dst_reg] / inst.imm : 0;
+			break;
+		case EBPF_OP_DIV64_REG:
+			reg[inst.dst_reg] =
+				reg[inst.src_reg] ?
+					reg[inst.dst_reg] / reg[inst.src_reg] :
+					0;
+			break;
+		case EBPF_OP_OR64_IMM:
+			reg[inst.dst_reg] |= inst.imm;
+			break;
+		case EBPF_OP_OR64_REG:
+			reg[inst.dst_reg] |= reg[inst.src_reg];
+			break;
+		case EBPF_OP_AND64_IMM:
+			reg[inst.dst_reg] &= inst.imm;
+			break;
+		case EBPF_OP_AND64_REG:
+			reg[inst.dst_reg] &= reg[inst.src_reg];
+			break;
+		case EBPF_OP_LSH64_IMM:
+			reg[inst.dst_reg] <<= inst.imm;
+			break;
+		case EBPF_OP_LSH64_REG:
+			reg[inst.dst_reg] <<= reg[inst.src_reg];
+			break;
+		case EBPF_OP_RSH64_IMM:
+			reg[inst.dst_reg] >>= inst.imm;
+			break;
+		case EBPF_OP_RSH64_REG:
+			reg[inst.dst_reg] >>= reg[inst.src_reg];
+			break;
+		case EBPF_OP_NEG64:
+			reg[inst.dst_reg] = -reg[inst.dst_reg];
+			break;
+		case EBPF_OP_MOD64_IMM:
+			reg[inst.dst_reg] =
+				inst.imm ? reg[inst.dst_reg] % inst.imm :
+					   reg[inst.dst_reg];
+			break;
+		case EBPF_OP_MOD64_REG:
+			reg[inst.dst_reg] =
+				reg[inst.src_reg] ?
+					reg[inst.dst_reg] % reg[inst.src_reg] :
+					reg[inst.dst_reg];
+			break;
+		case EBPF_OP_XOR64_IMM:
+			reg[inst.dst_reg] ^= inst.imm;
+			break;
+		case EBPF_OP_XOR64_REG:
+			reg[inst.dst_reg] ^= reg[inst.src_reg];
+			break;
+		case EBPF_OP_MOV64_IMM:
+			reg[inst.dst_reg] = inst.imm;
+			break;
+		case EBPF_OP_MOV64_REG:
+			reg[inst.dst_reg] = reg[inst.src_reg];
+			break;
+		case EBPF_OP_ARSH64_IMM:
+			reg[inst.dst_reg] =
+				(int64_t)(uint64_t)reg[inst.dst_reg] >>
+				inst.imm;
+			break;
+		case EBPF_OP_ARSH64_REG:
+			reg[inst.dst_reg] =
+				(int64_t)(uint64_t)reg[inst.dst_reg] >>
+				reg[inst.src_reg];
+			break;
+
+			/*
+			 * HACK runtime bounds check
+			 *
+			 * Needed since we don't have a verifier yet.
+			 */
+#define BOUNDS_CHECK_LOAD(size)                                                \
+	do {                                                                   \
+		if (!bounds_check(                                             \
+			    vm,                                                \
+			    (char *)(uintptr_t)reg[inst.src_reg] + inst.off,   \
+			    size, "load", cur_pc, mem, mem_len, stack)) {      \
+			return -1;                                             \
+		}                                                              \
+	} while (0)
+#define BOUNDS_CHECK_STORE(size)                                               \
+	do {                                                                   \
+		if (!bounds_check(                                             \
+			    vm,                                                \
+			    (char *)(uintptr_t)reg[inst.dst_reg] + inst.off,   \
+			    size, "store", cur_pc, mem, mem_len, stack)) {     \
+			return -1;                                             \
+		}                                                              \
+	} while (0)
+
+		case EBPF_OP_LDXW:
+			BOUNDS_CHECK_LOAD(4);
+			reg[inst.dst_reg] =
+				ebpf_mem_load(reg[inst.src_reg] + inst.off, 4);
+			break;
+		case EBPF_OP_LDXH:
+			BOUNDS_CHECK_LOAD(2);
+			reg[inst.dst_reg] =
+				ebpf_mem_load(reg[inst.src_reg] + inst.off, 2);
+			break;
+		case EBPF_OP_LDXB:
+			BOUNDS_CHECK_LOAD(1);
+			reg[inst.dst_reg] =
+				ebpf_mem_load(reg[inst.src_reg] + inst.off, 1);
+			break;
+		case EBPF_OP_LDXDW:
+			BOUNDS_CHECK_LOAD(8);
+			reg[inst.dst_reg] =
+				ebpf_mem_load(reg[inst.src_reg] + inst.off, 8);
+			break;
+
+		case EBPF_OP_STW:
+			BOUNDS_CHECK_STORE(4);
+			ebpf_mem_store(reg[inst.dst_reg] + inst.off, inst.imm,
+				       4);
+			break;
+		case EBPF_OP_STH:
+			BOUNDS_CHECK_STORE(2);
+			ebpf_mem_store(reg[inst.dst_reg] + inst.off, inst.imm,
+				       2);
+			break;
+		case EBPF_OP_STB:
+			BOUNDS_CHECK_STORE(1);
+			ebpf_mem_store(reg[inst.dst_reg] + inst.off, inst.imm,
+				       1);
+			break;
+		case EBPF_OP_STDW:
+			BOUNDS_CHECK_STORE(8);
+			ebpf_mem_store(reg[inst.dst_reg] + inst.off, inst.imm,
+				       8);
+			break;
+
+		case EBPF_OP_STXW:
+			BOUNDS_CHECK_STORE(4);
+			ebpf_mem_store(reg[inst.dst_reg] + inst.off,
+				       reg[inst.src_reg], 4);
+			break;
+		case EBPF_OP_STXH:
+			BOUNDS_CHECK_STORE(2);
+			ebpf_mem_store(reg[inst.dst_reg] + inst.off,
+				       reg[inst.src_reg], 2);
+			break;
+		case EBPF_OP_STXB:
+			BOUNDS_CHECK_STORE(1);
+			ebpf_mem_store(reg[inst.dst_reg] + inst.off,
+				       reg[inst.src_reg], 1);
+			break;
+		case EBPF_OP_STXDW:
+			BOUNDS_CHECK_STORE(8);
+			ebpf_mem_store(reg[inst.dst_reg] + inst.off,
+				       reg[inst.src_reg], 8);
+			break;
+
+		case EBPF_OP_LDDW: {
+			struct ebpf_inst next_inst =
+				ebpf_fetch_instruction(vm, pc++);
+			if (inst.src_reg == 0) {
+				reg[inst.dst_reg] =
+					(u32)(inst.imm) |
+					((uint64_t)next_inst.imm << 32);
+			} else if (inst.src_reg == 1) {
+				reg[inst.dst_reg] = vm->map_by_fd(inst.imm);
+			} else if (inst.src_reg == 2) {
+				reg[inst.dst_reg] =
+					vm->map_val(vm->map_by_fd(inst.imm)) +
+					(uint64_t)next_inst.imm;
+			} else if (inst.src_reg == 3) {
+				reg[inst.dst_reg] = vm->var_addr(inst.imm);
+			} else if (inst.src_reg == 4) {
+				reg[inst.dst_reg] =
+					vm->code_addr ?
+						vm->code_addr(inst.imm) :
+						(uintptr_t)&vm->callbacks
+							[cur_pc + inst.imm + 1];
+			} else if (inst.src_reg == 5) {
+				reg[inst.dst_reg] = vm->map_by_idx(inst.imm);
+			} else if (inst.src_reg == 6) {
+				reg[inst.dst_reg] =
+					vm->map_val(vm->map_by_idx(inst.imm)) +
+					(uint64_t)next_inst.imm;
+			}
+			break;
+		}
+		case EBPF_OP_JA:
+			pc += inst.off;
+			break;
+		case EBPF_OP_JEQ_IMM:
+			if (reg[inst.dst_reg] == (uint64_t)inst.imm) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JEQ_REG:
+			if (reg[inst.dst_reg] == reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JEQ32_IMM:
+			if ((uint32_t)(reg[inst.dst_reg]) ==
+			    (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JEQ32_REG:
+			if ((uint32_t)(reg[inst.dst_reg]) ==
+			    reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JGT_IMM:
+			if (reg[inst.dst_reg] > (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JGT_REG:
+			if (reg[inst.dst_reg] > reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JGT32_IMM:
+			if ((uint32_t)(reg[inst.dst_reg]) >
+			    (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JGT32_REG:
+			if ((uint32_t)(reg[inst.dst_reg]) >
+			    (uint32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JGE_IMM:
+			if (reg[inst.dst_reg] >= (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JGE_REG:
+			if (reg[inst.dst_reg] >= reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JGE32_IMM:
+			if ((uint32_t)(reg[inst.dst_reg]) >=
+			    (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JGE32_REG:
+			if ((uint32_t)(reg[inst.dst_reg]) >=
+			    (uint32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JLT_IMM:
+			if (reg[inst.dst_reg] < (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JLT_REG:
+			if (reg[inst.dst_reg] < reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JLT32_IMM:
+			if ((uint32_t)(reg[inst.dst_reg]) <
+			    (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JLT32_REG:
+			if ((uint32_t)(reg[inst.dst_reg]) <
+			    (uint32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JLE_IMM:
+			if (reg[inst.dst_reg] <= (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JLE_REG:
+			if (reg[inst.dst_reg] <= reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JLE32_IMM:
+			if ((uint32_t)(reg[inst.dst_reg]) <=
+			    (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JLE32_REG:
+			if ((uint32_t)(reg[inst.dst_reg]) <=
+			    (uint32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSET_IMM:
+			if (reg[inst.dst_reg] & inst.imm) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSET_REG:
+			if (reg[inst.dst_reg] & reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSET32_IMM:
+			if ((uint32_t)(reg[inst.dst_reg]) &
+			    (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSET32_REG:
+			if ((uint32_t)(reg[inst.dst_reg]) &
+			    (uint32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JNE_IMM:
+			if (reg[inst.dst_reg] != (uint64_t)inst.imm) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JNE_REG:
+			if (reg[inst.dst_reg] != reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JNE32_IMM:
+			if ((uint32_t)(reg[inst.dst_reg]) !=
+			    (uint32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JNE32_REG:
+			if ((uint32_t)(reg[inst.dst_reg]) !=
+			    (uint32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSGT_IMM:
+			if ((int64_t)reg[inst.dst_reg] > inst.imm) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSGT_REG:
+			if ((int64_t)reg[inst.dst_reg] >
+			    (int64_t)reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSGT32_IMM:
+			if ((int32_t)(reg[inst.dst_reg]) >
+			    (int32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSGT32_REG:
+			if ((int32_t)(reg[inst.dst_reg]) >
+			    (int32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSGE_IMM:
+			if ((int64_t)reg[inst.dst_reg] >= inst.imm) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSGE_REG:
+			if ((int64_t)reg[inst.dst_reg] >=
+			    (int64_t)reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSGE32_IMM:
+			if ((int32_t)(reg[inst.dst_reg]) >=
+			    (int32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSGE32_REG:
+			if ((int32_t)(reg[inst.dst_reg]) >=
+			    (int32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSLT_IMM:
+			if ((int64_t)reg[inst.dst_reg] < inst.imm) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSLT_REG:
+			if ((int64_t)reg[inst.dst_reg] <
+			    (int64_t)reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSLT32_IMM:
+			if ((int32_t)(reg[inst.dst_reg]) <
+			    (int32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSLT32_REG:
+			if ((int32_t)(reg[inst.dst_reg]) <
+			    (int32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSLE_IMM:
+			if ((int64_t)reg[inst.dst_reg] <= inst.imm) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSLE_REG:
+			if ((int64_t)reg[inst.dst_reg] <=
+			    (int64_t)reg[inst.src_reg]) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSLE32_IMM:
+			if ((int32_t)(reg[inst.dst_reg]) <=
+			    (int32_t)(inst.imm)) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_JSLE32_REG:
+			if ((int32_t)(reg[inst.dst_reg]) <=
+			    (int32_t)(reg[inst.src_reg])) {
+				pc += inst.off;
+			}
+			break;
+		case EBPF_OP_EXIT:
+			*bpf_return_value = reg[0];
+			return 0;
+		case EBPF_OP_CALL:
+			LOG_DEBUG("call: %p", vm->ext_funcs[inst.imm]);
+			if (inst.src_reg != 0) {
+				LOG_DEBUG(
+					"ubpf only supports call helpers at pc %d",
+					(int)pc);
+				return -1;
+			}
+			reg[0] = vm->ext_funcs[inst.imm](reg[1], reg[2], reg[3],
+							 reg[4], reg[5]);
+			// Unwind the stack if unwind extension returns success.
+			if (inst.imm == vm->unwind_stack_extension_index &&
+			    reg[0] == 0) {
+				*bpf_return_value = reg[0];
+				return 0;
+			}
+			break;
+
+			// 32b atomic ops
+		case EBPF_ATOMIC | EBPF_SIZE_W | EBPF_STX: {
+			switch (inst.imm) {
+			case EBPF_ATOMIC_ADD: {
+				// Add
+				__atomic_fetch_add(
+					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					reg[inst.src_reg], __ATOMIC_RELAXED);
+				break;
+			}
+			case EBPF_ATOMIC_OR: {
+				// Or
+				__atomic_fetch_or(
+					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					reg[inst.src_reg], __ATOMIC_RELAXED);
+				break;
+			}
+			case EBPF_ATOMIC_AND: {
+				// And
+				__atomic_fetch_and(
+					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					reg[inst.src_reg], __ATOMIC_RELAXED);
+				break;
+			}
+			case EBPF_ATOMIC_XOR: {
+				// Xor
+				__atomic_fetch_xor(
+					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					reg[inst.src_reg], __ATOMIC_RELAXED);
+				break;
+			}
+			case EBPF_XCHG: {
+				// XCHG
+				__atomic_exchange(
+					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					(uint32_t *)&reg[inst.src_reg],
+					(uint32_t *)&reg[inst.src_reg],
+					__ATOMIC_RELAXED);
+				break;
+			}
+			// case EBPF_CMPXCHG: {
+			// 	__atomic_compare_exchange(
+			// 		(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
+			// 					inst.off),
+			// 		(uint32_t *)&reg[0],
+			// 		(uint32_t *)&reg[inst.src_reg], false,
+			// 		__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			// }
+			}
+			break;
+		}
+			// 64b atomic ops
+		case EBPF_ATOMIC | EBPF_SIZE_DW | EBPF_STX: {
+			switch (inst.imm) {
+			case EBPF_ATOMIC_ADD: {
+				// Add
+				__atomic_fetch_add(
+					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					reg[inst.src_reg], __ATOMIC_RELAXED);
+				break;
+			}
+			case EBPF_ATOMIC_OR: {
+				// Or
+				__atomic_fetch_or(
+					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					reg[inst.src_reg], __ATOMIC_RELAXED);
+				break;
+			}
+			case EBPF_ATOMIC_AND: {
+				// And
+				__atomic_fetch_and(
+					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					reg[inst.src_reg], __ATOMIC_RELAXED);
+				break;
+			}
+			case EBPF_ATOMIC_XOR: {
+				// Xor
+				__atomic_fetch_xor(
+					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					reg[inst.src_reg], __ATOMIC_RELAXED);
+				break;
+			}
+			case EBPF_XCHG: {
+				// XCHG
+				__atomic_exchange(
+					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
+								inst.off),
+					(uint64_t *)&reg[inst.src_reg],
+					(uint64_t *)&reg[inst.src_reg],
+					__ATOMIC_RELAXED);
+				break;
+			}
+			// case EBPF_CMPXCHG: {
+			// 	__atomic_compare_exchange(
+			// 		(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
+			// 					inst.off),
+			// 		(uint64_t *)&reg[0],
+			// 		(uint64_t *)&reg[inst.src_reg], false,
+			// 		__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			// }
+			}
+			break;
+			break;
+		}
+		}
+	}
+}
+
+int ebpf_interpret(const struct ebpf_vm *vm, void *mem, size_t mem_len,
+		    uint64_t *bpf_return_value)
+{
+	const uint64_t args[5] = { (uintptr_t)mem, (uint64_t)mem_len };
+
+	return interpret(vm, 0, args, mem, mem_len, bpf_return_value);
+}
+
+static uint64_t interpret_callback(const struct ebpf_callback *cb,
+				   uint64_t r1, uint64_t r2, uint64_t r3,
+				   uint64_t r4, uint64_t r5)
+{
+	const uint64_t args[5] = { r1, r2, r3, r4, r5 };
+	uint64_t ret;
+
+	if (interpret(cb->ctx, cb->pc, args, NULL, 0, &ret) < 0)
+		return UINT64_MAX;
+	return ret;
+}
+
+int ebpf_prepare_callbacks(struct ebpf_vm *vm, char **errmsg)
+{
+	struct ebpf_callback *callbacks = NULL;
+
+	if (vm->code_addr)
+		return 0;
+	for (uint32_t i = 0; i < vm->num_insts; i++) {
+		struct ebpf_inst inst = ebpf_fetch_instruction(vm, i);
+		int64_t target = (int64_t)i + inst.imm + 1;
+
+		if (inst.code != EBPF_OP_LDDW)
+			continue;
+		/* The second slot is never decoded as an instruction */
+		i++;
+		if (inst.src_reg != 4)
+			continue;
+		if (target < 0 || target >= vm->num_insts) {
+			*errmsg = ebpf_error(
+				"lddw at PC %u loads instruction %" PRId64
+				" out of the program",
+				i - 1, target);
+			free(callbacks);
+			return -1;
+		}
+		if (!callbacks)
+			callbacks = calloc(vm->num_insts, sizeof(*callbacks));
+		if (!callbacks) {
+			*errmsg = ebpf_error("out of memory");
+			return -1;
+		}
+		/*
+		 * Compiled programs load callbacks of their own, these run the
+		 * subprogram with the interpreter.
+		 */
+		callbacks[target].fn = interpret_callback;
+		callbacks[target].ctx = vm;
+		callbacks[target].pc = target;
+	}
+	vm->callbacks = callbacks;
+	return 0;
+}
+
+#if defined(__GNUC__)
+/*
+ * Direct threaded interpreter. ebpf_load translates the program once into an
+ * array of ebpf_threaded_insn, which hold the address of the code handling
+ * each instruction, with its operands already extracted. The code of each
+ * instruction jumps straight to the one of the next, so that there is no
+ * switch to go through, and the indirect jumps are spread over the handlers,
+ * which branch predictors handle better. Sequences of instructions compilers
+ * often emit are also fused into superinstructions, see fuse().
+ */
+
+/* Instructions run like in ebpf_interpret, named after EBPF_OP_* */
+#define THREADED_OPS(X)                                                        \
+	X(ADD_IMM) X(ADD_REG) X(SUB_IMM) X(SUB_REG)                            \
+	X(MUL_IMM) X(MUL_REG) X(DIV_IMM) X(DIV_REG)                            \
+	X(OR_IMM) X(OR_REG) X(AND_IMM) X(AND_REG)                              \
+	X(LSH_IMM) X(LSH_REG) X(RSH_IMM) X(RSH_REG)                            \
+	X(NEG) X(MOD_IMM) X(MOD_REG) X(XOR_IMM)                                \
+	X(XOR_REG) X(MOV_IMM) X(MOV_REG) X(ARSH_IMM)                           \
+	X(ARSH_REG) X(ADD64_IMM) X(ADD64_REG) X(SUB64_IMM)                     \
+	X(SUB64_REG) X(MUL64_IMM) X(MUL64_REG) X(DIV64_IMM)                    \
+	X(DIV64_REG) X(OR64_IMM) X(OR64_REG) X(AND64_IMM)                      \
+	X(AND64_REG) X(LSH64_IMM) X(LSH64_REG) X(RSH64_IMM)                    \
+	X(RSH64_REG) X(NEG64) X(MOD64_IMM) X(MOD64_REG)                        \
+	X(XOR64_IMM) X(XOR64_REG) X(MOV64_IMM) X(MOV64_REG)                    \
+	X(ARSH64_IMM) X(ARSH64_REG) X(LDXW) X(LDXH)                            \
+	X(LDXB) X(LDXDW) X(STW) X(STH)                                         \
+	X(STB) X(STDW) X(STXW) X(STXH)                                         \
+	X(STXB) X(STXDW) X(JA) X(JEQ_IMM)                                      \
+	X(JEQ_REG) X(JEQ32_IMM) X(JEQ32_REG) X(JGT_IMM)                        \
+	X(JGT_REG) X(JGT32_IMM) X(JGT32_REG) X(JGE_IMM)                        \
+	X(JGE_REG) X(JGE32_IMM) X(JGE32_REG) X(JLT_IMM)                        \
+	X(JLT_REG) X(JLT32_IMM) X(JLT32_REG) X(JLE_IMM)                        \
+	X(JLE_REG) X(JLE32_IMM) X(JLE32_REG) X(JSET_IMM)                       \
+	X(JSET_REG) X(JSET32_IMM) X(JSET32_REG) X(JNE_IMM)                     \
+	X(JNE_REG) X(JNE32_IMM) X(JNE32_REG) X(JSGT_IMM)                       \
+	X(JSGT_REG) X(JSGT32_IMM) X(JSGT32_REG) X(JSGE_IMM)                    \
+	X(JSGE_REG) X(JSGE32_IMM) X(JSGE32_REG) X(JSLT_IMM)                    \
+	X(JSLT_REG) X(JSLT32_IMM) X(JSLT32_REG) X(JSLE_IMM)                    \
+	X(JSLE_REG) X(JSLE32_IMM) X(JSLE32_REG)
+
+/* Instructions split by their operands when decoding */
+#define THREADED_SPECIAL_OPS(X)                                                \
+	X(LDDW_IMM) X(LDDW_MAP_FD) X(LDDW_MAP_VAL) X(LDDW_VAR_ADDR)            \
+	X(LDDW_CODE_ADDR) X(LDDW_MAP_IDX) X(LDDW_MAP_IDX_VAL) X(LDDW_SKIP)     \
+	X(LDDW_CALLBACK) X(LE16) X(LE32) X(LE64)                               \
+	X(BE16) X(BE32) X(BE64) X(ATOMIC32_ADD)                                \
+	X(ATOMIC32_OR) X(ATOMIC32_AND) X(ATOMIC32_XOR) X(ATOMIC32_XCHG)        \
+	X(ATOMIC64_ADD) X(ATOMIC64_OR) X(ATOMIC64_AND) X(ATOMIC64_XOR)         \
+	X(ATOMIC64_XCHG) X(CALL) X(CALL_INVALID) X(EXIT)                       \
+	X(NOP) X(END)
+
+/* Superinstructions, named after the instructions they run */
+#define THREADED_FUSED_OPS(X)                                                  \
+	X(LDDW_CALL_JEQ0) X(CALL_JEQ0) X(LDXDW_ADD64_STXDW)                    \
+	X(LDXW_ADD64_STXW) X(LDXW_ADD_STXW) X(MOV64_LSH64_ARSH64)              \
+	X(LSH64_ARSH64)
+
+enum threaded_op {
+#define THREADED_ENUM(op) T_##op,
+	THREADED_OPS(THREADED_ENUM) THREADED_SPECIAL_OPS(THREADED_ENUM)
+		THREADED_FUSED_OPS(THREADED_ENUM)
+#undef THREADED_ENUM
+};
+
+struct ebpf_threaded_insn {
+	const void *handler;
+	uint8_t dst;
+	uint8_t src;
+	int16_t off;
+	int32_t imm;
+};
+
+/*
+ * Labels are local to the function, so calling it with handlers set returns
+ * their addresses for the decoder instead of running the program.
+ */
+static int run_threaded(const struct ebpf_vm *vm, uint16_t pc,
+			const uint64_t *args, void *mem, size_t mem_len,
+			uint64_t *bpf_return_value,
+			const void *const **handlers)
+{
+	static const void *const labels[] = {
+#define THREADED_LABEL(op) [T_##op] = &&op_##op,
+		THREADED_OPS(THREADED_LABEL)
+			THREADED_SPECIAL_OPS(THREADED_LABEL)
+				THREADED_FUSED_OPS(THREADED_LABEL)
+#undef THREADED_LABEL
+	};
+	const struct ebpf_threaded_insn *code, *ip;
+	bool check;
+	uint64_t *reg;
+	uint64_t _reg[16];
+	uint64_t stack[(EBPF_STACK_SIZE + 7) / 8];
+
+	if (handlers) {
+		*handlers = labels;
+		return 0;
+	}
+	code = vm->threaded_insns;
+	ip = code + pc;
+	check = vm->bounds_check_enabled;
+
+#if DEBUG
+	if (vm->regs)
+		reg = vm->regs;
+	else
+		reg = _reg;
+#else
+	reg = _reg;
+#endif
+
+	memcpy(&reg[1], args, 5 * sizeof(reg[0]));
+	reg[10] = (uintptr_t)stack + sizeof(stack);
+
+#define NEXT goto *(++ip)->handler
+#define THREADED_CHECK_LOAD(size)                                              \
+	do {                                                                   \
+		if (check &&                                                   \
+		    !bounds_check(vm,                                          \
+				  (char *)(uintptr_t)reg[ip->src] + ip->off,   \
+				  size, "load", ip - code, mem, mem_len,       \
+				  stack)) {                                    \
+			return -1;                                             \
+		}                                                              \
+	} while (0)
+#define THREADED_CHECK_STORE(size)                                             \
+	do {                                                                   \
+		if (check &&                                                   \
+		    !bounds_check(vm,                                          \
+				  (char *)(uintptr_t)reg[ip->dst] + ip->off,   \
+				  size, "store", ip - code, mem, mem_len,      \
+				  stack)) {                                    \
+			return -1;                                             \
+		}                                                              \
+	} while (0)
+
+	goto *ip->handler;
+
+op_ADD_IMM:
+	reg[ip->dst] += ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_ADD_REG:
+	reg[ip->dst] += reg[ip->src];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_SUB_IMM:
+	reg[ip->dst] -= ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_SUB_REG:
+	reg[ip->dst] -= reg[ip->src];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_MUL_IMM:
+	reg[ip->dst] *= ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_MUL_REG:
+	reg[ip->dst] *= reg[ip->src];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_DIV_IMM:
+	reg[ip->dst] =
+		(uint32_t)(ip->imm) ?
+			(uint32_t)(reg[ip->dst]) /
+				(uint32_t)(ip->imm) :
+			0;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_DIV_REG:
+	reg[ip->dst] =
+		(uint32_t)(reg[ip->src]) ?
+			(uint32_t)(reg[ip->dst]) /
+				(uint32_t)(reg[ip->src]) :
+			0;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_OR_IMM:
+	reg[ip->dst] |= ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_OR_REG:
+	reg[ip->dst] |= reg[ip->src];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_AND_IMM:
+	reg[ip->dst] &= ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_AND_REG:
+	reg[ip->dst] &= reg[ip->src];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_LSH_IMM:
+	reg[ip->dst] <<= ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_LSH_REG:
+	reg[ip->dst] <<= reg[ip->src];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_RSH_IMM:
+	reg[ip->dst] = (uint32_t)(reg[ip->dst]) >> ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_RSH_REG:
+	reg[ip->dst] = (uint32_t)(reg[ip->dst]) >> reg[ip->src];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_NEG:
+	reg[ip->dst] = -(int64_t)reg[ip->dst];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_MOD_IMM:
+	reg[ip->dst] =
+		(uint32_t)(ip->imm) ?
+			(uint32_t)(reg[ip->dst]) %
+				(uint32_t)(ip->imm) :
+			(uint32_t)(reg[ip->dst]);
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_MOD_REG:
+	reg[ip->dst] =
+		(uint32_t)(reg[ip->src]) ?
+			(uint32_t)(reg[ip->dst]) %
+				(uint32_t)(reg[ip->src]) :
+			(uint32_t)(reg[ip->dst]);
+	NEXT;
+
+op_XOR_IMM:
+	reg[ip->dst] ^= ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_XOR_REG:
+	reg[ip->dst] ^= reg[ip->src];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_MOV_IMM:
+	reg[ip->dst] = ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_MOV_REG:
+	reg[ip->dst] = reg[ip->src];
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_ARSH_IMM:
+	reg[ip->dst] = (int32_t)reg[ip->dst] >> ip->imm;
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_ARSH_REG:
+	reg[ip->dst] = (int32_t)reg[ip->dst] >> (uint32_t)(reg[ip->src]);
+	reg[ip->dst] &= UINT32_MAX;
+	NEXT;
+
+op_ADD64_IMM:
+	reg[ip->dst] += ip->imm;
+	NEXT;
+
+op_ADD64_REG:
+	reg[ip->dst] += reg[ip->src];
+	NEXT;
+
+op_SUB64_IMM:
+	reg[ip->dst] -= ip->imm;
+	NEXT;
+
+op_SUB64_REG:
+	reg[ip->dst] -= reg[ip->src];
+	NEXT;
+
+op_MUL64_IMM:
+	reg[ip->dst] *= ip->imm;
+	NEXT;
+
+op_MUL64_REG:
+	reg[ip->dst] *= reg[ip->src];
+	NEXT;
+
+op_DIV64_IMM:
+	reg[ip->dst] = ip->imm ? reg[ip->dst] / ip->imm : 0;
+	NEXT;
+
+op_DIV64_REG:
+	reg[ip->dst] = reg[ip->src] ? reg[ip->dst] / reg[ip->src] :
+			0;
+	NEXT;
+
+op_OR64_IMM:
+	reg[ip->dst] |= ip->imm;
+	NEXT;
+
+op_OR64_REG:
+	reg[ip->dst] |= reg[ip->src];
+	NEXT;
+
+op_AND64_IMM:
+	reg[ip->dst] &= ip->imm;
+	NEXT;
+
+op_AND64_REG:
+	reg[ip->dst] &= reg[ip->src];
+	NEXT;
+
+op_LSH64_IMM:
+	reg[ip->dst] <<= ip->imm;
+	NEXT;
+
+op_LSH64_REG:
+	reg[ip->dst] <<= reg[ip->src];
+	NEXT;
+
+op_RSH64_IMM:
+	reg[ip->dst] >>= ip->imm;
+	NEXT;
+
+op_RSH64_REG:
+	reg[ip->dst] >>= reg[ip->src];
+	NEXT;
+
+op_NEG64:
+	reg[ip->dst] = -reg[ip->dst];
+	NEXT;
+
+op_MOD64_IMM:
+	reg[ip->dst] = ip->imm ? reg[ip->dst] % ip->imm :
+			   reg[ip->dst];
+	NEXT;
+
+op_MOD64_REG:
+	reg[ip->dst] = reg[ip->src] ? reg[ip->dst] % reg[ip->src] :
+			reg[ip->dst];
+	NEXT;
+
+op_XOR64_IMM:
+	reg[ip->dst] ^= ip->imm;
+	NEXT;
+
+op_XOR64_REG:
+	reg[ip->dst] ^= reg[ip->src];
+	NEXT;
+
+op_MOV64_IMM:
+	reg[ip->dst] = ip->imm;
+	NEXT;
+
+op_MOV64_REG:
+	reg[ip->dst] = reg[ip->src];
+	NEXT;
+
+op_ARSH64_IMM:
+	reg[ip->dst] = (int64_t)(uint64_t)reg[ip->dst] >> ip->imm;
+	NEXT;
+
+op_ARSH64_REG:
+	reg[ip->dst] = (int64_t)(uint64_t)reg[ip->dst] >> reg[ip->src];
+	NEXT;
+
+op_LDXW:
+	THREADED_CHECK_LOAD(4);
+	reg[ip->dst] = ebpf_mem_load(reg[ip->src] + ip->off, 4);
+	NEXT;
+
+op_LDXH:
+	THREADED_CHECK_LOAD(2);
+	reg[ip->dst] = ebpf_mem_load(reg[ip->src] + ip->off, 2);
+	NEXT;
+
+op_LDXB:
+	THREADED_CHECK_LOAD(1);
+	reg[ip->dst] = ebpf_mem_load(reg[ip->src] + ip->off, 1);
+	NEXT;
+
+op_LDXDW:
+	THREADED_CHECK_LOAD(8);
+	reg[ip->dst] = ebpf_mem_load(reg[ip->src] + ip->off, 8);
+	NEXT;
+
+op_STW:
+	THREADED_CHECK_STORE(4);
+	ebpf_mem_store(reg[ip->dst] + ip->off, ip->imm, 4);
+	NEXT;
+
+op_STH:
+	THREADED_CHECK_STORE(2);
+	ebpf_mem_store(reg[ip->dst] + ip->off, ip->imm, 2);
+	NEXT;
+
+op_STB:
+	THREADED_CHECK_STORE(1);
+	ebpf_mem_store(reg[ip->dst] + ip->off, ip->imm, 1);
+	NEXT;
+
+op_STDW:
+	THREADED_CHECK_STORE(8);
+	ebpf_mem_store(reg[ip->dst] + ip->off, ip->imm, 8);
+	NEXT;
+
+op_STXW:
+	THREADED_CHECK_STORE(4);
+	ebpf_mem_store(reg[ip->dst] + ip->off, reg[ip->src], 4);
+	NEXT;
+
+op_STXH:
+	THREADED_CHECK_STORE(2);
+	ebpf_mem_store(reg[ip->dst] + ip->off, reg[ip->src], 2);
+	NEXT;
+
+op_STXB:
+	THREADED_CHECK_STORE(1);
+	ebpf_mem_store(reg[ip->dst] + ip->off, reg[ip->src], 1);
+	NEXT;
+
+op_STXDW:
+	THREADED_CHECK_STORE(8);
+	ebpf_mem_store(reg[ip->dst] + ip->off, reg[ip->src], 8);
+	NEXT;
+
+op_JA:
+	ip += ip->off;
+	NEXT;
+
+op_JEQ_IMM:
+	if (reg[ip->dst] == (uint64_t)ip->imm) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JEQ_REG:
+	if (reg[ip->dst] == reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JEQ32_IMM:
+	if ((uint32_t)(reg[ip->dst]) == (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JEQ32_REG:
+	if ((uint32_t)(reg[ip->dst]) == reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JGT_IMM:
+	if (reg[ip->dst] > (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JGT_REG:
+	if (reg[ip->dst] > reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JGT32_IMM:
+	if ((uint32_t)(reg[ip->dst]) > (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JGT32_REG:
+	if ((uint32_t)(reg[ip->dst]) > (uint32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JGE_IMM:
+	if (reg[ip->dst] >= (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JGE_REG:
+	if (reg[ip->dst] >= reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JGE32_IMM:
+	if ((uint32_t)(reg[ip->dst]) >= (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JGE32_REG:
+	if ((uint32_t)(reg[ip->dst]) >= (uint32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JLT_IMM:
+	if (reg[ip->dst] < (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JLT_REG:
+	if (reg[ip->dst] < reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JLT32_IMM:
+	if ((uint32_t)(reg[ip->dst]) < (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JLT32_REG:
+	if ((uint32_t)(reg[ip->dst]) < (uint32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JLE_IMM:
+	if (reg[ip->dst] <= (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JLE_REG:
+	if (reg[ip->dst] <= reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JLE32_IMM:
+	if ((uint32_t)(reg[ip->dst]) <= (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JLE32_REG:
+	if ((uint32_t)(reg[ip->dst]) <= (uint32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSET_IMM:
+	if (reg[ip->dst] & ip->imm) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSET_REG:
+	if (reg[ip->dst] & reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSET32_IMM:
+	if ((uint32_t)(reg[ip->dst]) & (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSET32_REG:
+	if ((uint32_t)(reg[ip->dst]) & (uint32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JNE_IMM:
+	if (reg[ip->dst] != (uint64_t)ip->imm) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JNE_REG:
+	if (reg[ip->dst] != reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JNE32_IMM:
+	if ((uint32_t)(reg[ip->dst]) != (uint32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JNE32_REG:
+	if ((uint32_t)(reg[ip->dst]) != (uint32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSGT_IMM:
+	if ((int64_t)reg[ip->dst] > ip->imm) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSGT_REG:
+	if ((int64_t)reg[ip->dst] > (int64_t)reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSGT32_IMM:
+	if ((int32_t)(reg[ip->dst]) > (int32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSGT32_REG:
+	if ((int32_t)(reg[ip->dst]) > (int32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSGE_IMM:
+	if ((int64_t)reg[ip->dst] >= ip->imm) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSGE_REG:
+	if ((int64_t)reg[ip->dst] >= (int64_t)reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSGE32_IMM:
+	if ((int32_t)(reg[ip->dst]) >= (int32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSGE32_REG:
+	if ((int32_t)(reg[ip->dst]) >= (int32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSLT_IMM:
+	if ((int64_t)reg[ip->dst] < ip->imm) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSLT_REG:
+	if ((int64_t)reg[ip->dst] < (int64_t)reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSLT32_IMM:
+	if ((int32_t)(reg[ip->dst]) < (int32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSLT32_REG:
+	if ((int32_t)(reg[ip->dst]) < (int32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSLE_IMM:
+	if ((int64_t)reg[ip->dst] <= ip->imm) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSLE_REG:
+	if ((int64_t)reg[ip->dst] <= (int64_t)reg[ip->src]) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSLE32_IMM:
+	if ((int32_t)(reg[ip->dst]) <= (int32_t)(ip->imm)) {
+		ip += ip->off;
+	}
+	NEXT;
+
+op_JSLE32_REG:
+	if ((int32_t)(reg[ip->dst]) <= (int32_t)(reg[ip->src])) {
+		ip += ip->off;
+	}
+	NEXT;
+
+	/* The second slot of lddw holds the upper half of the immediate */
+op_LDDW_IMM:
+	reg[ip->dst] = (u32)(ip->imm) | ((uint64_t)ip[1].imm << 32);
+	ip++;
+	NEXT;
+
+op_LDDW_MAP_FD:
+	reg[ip->dst] = vm->map_by_fd(ip->imm);
+	ip++;
+	NEXT;
+
+op_LDDW_MAP_VAL:
+	reg[ip->dst] =
+		vm->map_val(vm->map_by_fd(ip->imm)) + (uint64_t)ip[1].imm;
+	ip++;
+	NEXT;
+
+op_LDDW_VAR_ADDR:
+	reg[ip->dst] = vm->var_addr(ip->imm);
+	ip++;
+	NEXT;
+
+op_LDDW_CODE_ADDR:
+	reg[ip->dst] = vm->code_addr(ip->imm);
+	ip++;
+	NEXT;
+
+op_LDDW_MAP_IDX:
+	reg[ip->dst] = vm->map_by_idx(ip->imm);
+	ip++;
+	NEXT;
+
+op_LDDW_MAP_IDX_VAL:
+	reg[ip->dst] =
+		vm->map_val(vm->map_by_idx(ip->imm)) + (uint64_t)ip[1].imm;
+	ip++;
+	NEXT;
+
+op_LDDW_SKIP:
+	ip++;
+	NEXT;
+
+op_LDDW_CALLBACK:
+	reg[ip->dst] = (uintptr_t)&vm->callbacks[ip - code + ip->imm + 1];
+	ip++;
+	NEXT;
+
+op_LE16:
+	reg[ip->dst] = htole16(reg[ip->dst]);
+	NEXT;
+
+op_LE32:
+	reg[ip->dst] = htole32(reg[ip->dst]);
+	NEXT;
+
+op_LE64:
+	reg[ip->dst] = htole64(reg[ip->dst]);
+	NEXT;
+
+op_BE16:
+	reg[ip->dst] = htobe16(reg[ip->dst]);
+	NEXT;
+
+op_BE32:
+	reg[ip->dst] = htobe32(reg[ip->dst]);
+	NEXT;
+
+op_BE64:
+	reg[ip->dst] = htobe64(reg[ip->dst]);
+	NEXT;
+
+op_ATOMIC32_ADD:
+	__atomic_fetch_add((uint32_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			   reg[ip->src], __ATOMIC_RELAXED);
+	NEXT;
+
+op_ATOMIC32_OR:
+	__atomic_fetch_or((uint32_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			  reg[ip->src], __ATOMIC_RELAXED);
+	NEXT;
+
+op_ATOMIC32_AND:
+	__atomic_fetch_and((uint32_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			   reg[ip->src], __ATOMIC_RELAXED);
+	NEXT;
+
+op_ATOMIC32_XOR:
+	__atomic_fetch_xor((uint32_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			   reg[ip->src], __ATOMIC_RELAXED);
+	NEXT;
+
+op_ATOMIC32_XCHG:
+	__atomic_exchange((uint32_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			  (uint32_t *)&reg[ip->src], (uint32_t *)&reg[ip->src],
+			  __ATOMIC_RELAXED);
+	NEXT;
+
+op_ATOMIC64_ADD:
+	__atomic_fetch_add((uint64_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			   reg[ip->src], __ATOMIC_RELAXED);
+	NEXT;
+
+op_ATOMIC64_OR:
+	__atomic_fetch_or((uint64_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			  reg[ip->src], __ATOMIC_RELAXED);
+	NEXT;
+
+op_ATOMIC64_AND:
+	__atomic_fetch_and((uint64_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			   reg[ip->src], __ATOMIC_RELAXED);
+	NEXT;
+
+op_ATOMIC64_XOR:
+	__atomic_fetch_xor((uint64_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			   reg[ip->src], __ATOMIC_RELAXED);
+	NEXT;
+
+op_ATOMIC64_XCHG:
+	__atomic_exchange((uint64_t *)(uintptr_t)(reg[ip->dst] + ip->off),
+			  (uint64_t *)&reg[ip->src], (uint64_t *)&reg[ip->src],
+			  __ATOMIC_RELAXED);
+	NEXT;
+
+op_CALL:
+	reg[0] = vm->ext_funcs[ip->imm](reg[1], reg[2], reg[3], reg[4], reg[5]);
+	// Unwind the stack if unwind extension returns success.
+	if (ip->imm == vm->unwind_stack_extension_index && reg[0] == 0) {
+		*bpf_return_value = reg[0];
+		return 0;
+	}
+	NEXT;
+
+op_CALL_INVALID:
+	LOG_DEBUG("ubpf only supports call helpers at pc %d",
+		  (int)(ip - code + 1));
+	return -1;
+
+op_EXIT:
+	*bpf_return_value = reg[0];
+	return 0;
+
+	/* Looking up a map */
+op_LDDW_CALL_JEQ0:
+	reg[ip->dst] = vm->map_by_fd(ip->imm);
+	ip += 2;
+	/* fallthrough */
+op_CALL_JEQ0:
+	reg[0] = vm->ext_funcs[ip->imm](reg[1], reg[2], reg[3], reg[4], reg[5]);
+	if (ip->imm == vm->unwind_stack_extension_index && reg[0] == 0) {
+		*bpf_return_value = reg[0];
+		return 0;
+	}
+	ip++;
+	if (reg[0] == 0)
+		ip += ip->off;
+	NEXT;
+
+	/* Incrementing a counter, checked like the separate load and store */
+op_LDXDW_ADD64_STXDW:
+	THREADED_CHECK_LOAD(8);
+	reg[ip->dst] = ebpf_mem_load(reg[ip->src] + ip->off, 8) + ip[1].imm;
+	ip += 2;
+	THREADED_CHECK_STORE(8);
+	ebpf_mem_store(reg[ip->dst] + ip->off, reg[ip->src], 8);
+	NEXT;
+
+op_LDXW_ADD64_STXW:
+	THREADED_CHECK_LOAD(4);
+	reg[ip->dst] = ebpf_mem_load(reg[ip->src] + ip->off, 4) + ip[1].imm;
+	ip += 2;
+	THREADED_CHECK_STORE(4);
+	ebpf_mem_store(reg[ip->dst] + ip->off, reg[ip->src], 4);
+	NEXT;
+
+op_LDXW_ADD_STXW:
+	THREADED_CHECK_LOAD(4);
+	reg[ip->dst] = (ebpf_mem_load(reg[ip->src] + ip->off, 4) + ip[1].imm) &
+		       UINT32_MAX;
+	ip += 2;
+	THREADED_CHECK_STORE(4);
+	ebpf_mem_store(reg[ip->dst] + ip->off, reg[ip->src], 4);
+	NEXT;
+
+	/* Sign extending */
+op_MOV64_LSH64_ARSH64:
+	reg[ip->dst] = reg[ip->src];
+	ip++;
+	/* fallthrough */
+op_LSH64_ARSH64:
+	reg[ip->dst] = (int64_t)(reg[ip->dst] << ip->imm) >> ip->imm;
+	ip++;
+	NEXT;
+
+	/* Unknown instructions are ignored, like ebpf_interpret does */
+op_NOP:
+	NEXT;
+
+op_END:
+	vm->error_printf(stderr,
+			 "ebpf error: ran past the end of the program\n");
+	return -1;
+
+#undef THREADED_CHECK_STORE
+#undef THREADED_CHECK_LOAD
+#undef NEXT
+}
+
+static enum threaded_op decode_op(struct ebpf_inst inst)
+{
+	switch (inst.code) {
+#define THREADED_CASE(op)                                                      \
+	case EBPF_OP_##op:                                                     \
+		return T_##op;
+		THREADED_OPS(THREADED_CASE)
+#undef THREADED_CASE
+	case EBPF_OP_LDDW:
+		switch (inst.src_reg) {
+		case 0:
+			return T_LDDW_IMM;
+		case 1:
+			return T_LDDW_MAP_FD;
+		case 2:
+			return T_LDDW_MAP_VAL;
+		case 3:
+			return T_LDDW_VAR_ADDR;
+		case 4:
+			return T_LDDW_CODE_ADDR;
+		case 5:
+			return T_LDDW_MAP_IDX;
+		case 6:
+			return T_LDDW_MAP_IDX_VAL;
+		default:
+			return T_LDDW_SKIP;
+		}
+	case EBPF_OP_LE:
+		return inst.imm == 16 ? T_LE16 :
+		       inst.imm == 32 ? T_LE32 :
+		       inst.imm == 64 ? T_LE64 :
+					T_NOP;
+	case EBPF_OP_BE:
+		return inst.imm == 16 ? T_BE16 :
+		       inst.imm == 32 ? T_BE32 :
+		       inst.imm == 64 ? T_BE64 :
+					T_NOP;
+	case EBPF_ATOMIC | EBPF_SIZE_W | EBPF_STX:
+		switch (inst.imm) {
+		case EBPF_ATOMIC_ADD:
+			return T_ATOMIC32_ADD;
+		case EBPF_ATOMIC_OR:
+			return T_ATOMIC32_OR;
+		case EBPF_ATOMIC_AND:
+			return T_ATOMIC32_AND;
+		case EBPF_ATOMIC_XOR:
+			return T_ATOMIC32_XOR;
+		case EBPF_XCHG:
+			return T_ATOMIC32_XCHG;
+		default:
+			return T_NOP;
+		}
+	case EBPF_ATOMIC | EBPF_SIZE_DW | EBPF_STX:
+		switch (inst.imm) {
+		case EBPF_ATOMIC_ADD:
+			return T_ATOMIC64_ADD;
+		case EBPF_ATOMIC_OR:
+			return T_ATOMIC64_OR;
+		case EBPF_ATOMIC_AND:
+			return T_ATOMIC64_AND;
+		case EBPF_ATOMIC_XOR:
+			return T_ATOMIC64_XOR;
+		case EBPF_XCHG:
+			return T_ATOMIC64_XCHG;
+		default:
+			return T_NOP;
+		}
+	case EBPF_OP_CALL:
+		return inst.src_reg ? T_CALL_INVALID : T_CALL;
+	case EBPF_OP_EXIT:
+		return T_EXIT;
+	default:
+		return T_NOP;
+	}
+}
+
+static bool is_call_jeq0(const struct ebpf_inst *in)
+{
+	return in[0].code == EBPF_OP_CALL && in[0].src_reg == 0 &&
+	       in[1].code == EBPF_OP_JEQ_IMM && in[1].dst_reg == 0 &&
+	       in[1].imm == 0;
+}
+
+static bool is_ldx_add_stx(const struct ebpf_inst *in, uint8_t ldx,
+			   uint8_t add, uint8_t stx)
+{
+	return in[0].code == ldx && in[0].dst_reg != in[0].src_reg &&
+	       in[1].code == add && in[1].dst_reg == in[0].dst_reg &&
+	       in[2].code == stx && in[2].dst_reg == in[0].src_reg &&
+	       in[2].src_reg == in[0].dst_reg && in[2].off == in[0].off;
+}
+
+static bool is_lsh_arsh(const struct ebpf_inst *in, uint8_t reg)
+{
+	return in[0].code == EBPF_OP_LSH64_IMM && in[0].dst_reg == reg &&
+	       in[1].code == EBPF_OP_ARSH64_IMM && in[1].dst_reg == reg &&
+	       in[1].imm == in[0].imm && (uint32_t)in[0].imm < 64;
+}
+
+/*
+ * Match a superinstruction at pc, returning the number of slots it runs, or
+ * 0 if there is none. Only the first slot is replaced, so that jumps into the
+ * middle of the sequence run the rest of it one instruction at a time.
+ */
+static uint32_t fuse(const struct ebpf_vm *vm, uint32_t pc,
+		     enum threaded_op *op)
+{
+	struct ebpf_inst in[4] = { 0 };
+
+	for (uint32_t i = 0; i < 4 && pc + i < vm->num_insts; i++)
+		in[i] = ebpf_fetch_instruction(vm, pc + i);
+
+	if (in[0].code == EBPF_OP_LDDW && in[0].src_reg == 1 &&
+	    is_call_jeq0(in + 2)) {
+		*op = T_LDDW_CALL_JEQ0;
+		return 4;
+	}
+	if (is_call_jeq0(in)) {
+		*op = T_CALL_JEQ0;
+		return 2;
+	}
+	if (is_ldx_add_stx(in, EBPF_OP_LDXDW, EBPF_OP_ADD64_IMM,
+			   EBPF_OP_STXDW)) {
+		*op = T_LDXDW_ADD64_STXDW;
+		return 3;
+	}
+	if (is_ldx_add_stx(in, EBPF_OP_LDXW, EBPF_OP_ADD64_IMM, EBPF_OP_STXW)) {
+		*op = T_LDXW_ADD64_STXW;
+		return 3;
+	}
+	if (is_ldx_add_stx(in, EBPF_OP_LDXW, EBPF_OP_ADD_IMM, EBPF_OP_STXW)) {
+		*op = T_LDXW_ADD_STXW;
+		return 3;
+	}
+	if (in[0].code == EBPF_OP_MOV64_REG &&
+	    is_lsh_arsh(in + 1, in[0].dst_reg)) {
+		*op = T_MOV64_LSH64_ARSH64;
+		return 3;
+	}
+	if (is_lsh_arsh(in, in[0].dst_reg)) {
+		*op = T_LSH64_ARSH64;
+		return 2;
+	}
+	return 0;
+}
+
+int ebpf_decode_threaded(struct ebpf_vm *vm)
+{
+	const void *const *handlers;
+	struct ebpf_threaded_insn *code;
+	uint32_t len;
+
+	run_threaded(vm, 0, NULL, NULL, 0, NULL, &handlers);
+	/*
+	 * Programs running past their end, even through the second slot of a
+	 * trailing lddw, stop on one of the two extra slots.
+	 */
+	code = calloc(vm->num_insts + 2, sizeof(*code));
+	if (!code)
+		return -1;
+	for (uint32_t i = 0; i < vm->num_insts; i++) {
+		struct ebpf_inst inst = ebpf_fetch_instruction(vm, i);
+		enum threaded_op op = decode_op(inst);
+
+		/* Without code_addr, lddw loads the callback of a subprogram */
+		if (op == T_LDDW_CODE_ADDR && !vm->code_addr)
+			op = T_LDDW_CALLBACK;
+		code[i].handler = handlers[op];
+		code[i].dst = inst.dst_reg;
+		code[i].src = inst.src_reg;
+		code[i].off = inst.off;
+		code[i].imm = inst.imm;
+	}
+	for (uint32_t i = 0; i < vm->num_insts; i += len) {
+		enum threaded_op op;
+
+		len = fuse(vm, i, &op);
+		if (len)
+			code[i].handler = handlers[op];
+		else if (ebpf_fetch_instruction(vm, i).code == EBPF_OP_LDDW)
+			len = 2;
+		else
+			len = 1;
+	}
+	code[vm->num_insts].handler = handlers[T_END];
+	code[vm->num_insts + 1].handler = handlers[T_END];
+	vm->threaded_insns = code;
+	return 0;
+}
+#else
+int ebpf_decode_threaded(struct ebpf_vm *vm)
+{
+	/* Computed gotos are a GNU extension, run the switch instead */
+	(void)vm;
+	return 0;
+}
+#endif
+
+bool ebpf_toggle_threaded_interpreter(struct ebpf_vm *vm, bool enable)
+{
+	bool old = vm->threaded_interpreter;
+	vm->threaded_interpreter = enable;
+	return old;
+}
+
+static bool bounds_check(const struct ebpf_vm *vm, void *addr, int size,
+			 const char *type, uint16_t cur_pc, void *mem,
+			 size_t mem_len, void *stack)
+{
+	if (!vm->bounds_check_enabled)
+		return true;
+	if (mem &&
+	    (addr >= mem && ((char *)addr + size) <= ((char *)mem + mem_len))) {
+		/* Context access */
+		return true;
+	} else if (addr >= stack &&
+		   ((char *)addr + size) <= ((char *)stack + EBPF_STACK_SIZE)) {
+		/* Stack access */
+		return true;
+	} else {
+		vm->error_printf(
+			stderr,
+			"ebpf error: out of bounds memory %s at PC %u, addr %p, size %d\nmem %p/%zd stack %p/%d\n",
+			type, cur_pc, addr, size, mem, mem_len, stack,
+			EBPF_STACK_SIZE);
+		return false;
+	}
+}
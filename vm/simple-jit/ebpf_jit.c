@@ -27,6 +27,7 @@
 #include <assert.h>
 #include "ebpf_inst.h"
 #include "ebpf_jit_x86_64.h"
+#include "ebpf_aot_object.h"
 
 #define UNUSED(x) ((void)x)
 
@@ -96,3 +97,59 @@ out:
     }
     return vm->jitted_function;
 }
+
+int
+ebpf_compile_aot(struct ebpf_vm* vm, void** buf, size_t* buf_len, char** errmsg)
+{
+    UNUSED(vm);
+    UNUSED(buf);
+    UNUSED(buf_len);
+    *errmsg = ebpf_error("AOT compilation requires the LLVM JIT");
+    return -1;
+}
+
+static struct ebpf_aot_vm_symbols
+aot_vm_symbols(const struct ebpf_vm* vm)
+{
+    struct ebpf_aot_vm_symbols syms = {
+        .ext_funcs = (void* const*)vm->ext_funcs,
+        .nr_ext_funcs = MAX_EXT_FUNCS,
+        .map_by_fd = (void*)vm->map_by_fd,
+        .map_by_idx = (void*)vm->map_by_idx,
+        .map_val = (void*)vm->map_val,
+        .var_addr = (void*)vm->var_addr,
+        .code_addr = (void*)vm->code_addr,
+    };
+    return syms;
+}
+
+ebpf_jit_fn
+ebpf_load_aot_object(struct ebpf_vm* vm, const void* buf, size_t buf_len, char** errmsg)
+{
+    struct ebpf_aot_vm_symbols syms;
+    void* entry;
+
+    if (!vm->insnsi || vm->jitted_function) {
+        *errmsg = ebpf_error("code must be loaded and not compiled before loading an AOT object");
+        return NULL;
+    }
+    syms = aot_vm_symbols(vm);
+    vm->aot_object = ebpf_aot_object_load_program(buf, buf_len, vm->insnsi, vm->num_insts, &syms, &entry, errmsg);
+    if (vm->aot_object == NULL) {
+        return NULL;
+    }
+    vm->jitted_function = (ebpf_jit_fn)entry;
+    return vm->jitted_function;
+}
+
+uint64_t
+ebpf_aot_cache_key(const struct ebpf_vm* vm)
+{
+    struct ebpf_aot_vm_symbols syms;
+
+    if (!vm->insnsi) {
+        return 0;
+    }
+    syms = aot_vm_symbols(vm);
+    return ebpf_aot_program_key(vm->insnsi, vm->num_insts, &syms);
+}
@@ -1054,6 +1054,10 @@ translate(struct ebpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_LDDW: {
             struct ebpf_inst inst2 = ebpf_fetch_instruction(vm, ++i);
             uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
+            /* Subprograms are called back through the interpreter */
+            if (inst.src_reg == 4 && vm->callbacks) {
+                imm = (uintptr_t)&vm->callbacks[i + inst.imm];
+            }
             emit_movewide_immediate(state, true, dst, imm);
             break;
         }
@@ -25,6 +25,7 @@
 #include <endian.h>
 #include "ebpf_inst.h"
 #include "ebpf_vm.h"
+#include "ebpf_aot_object.h"
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdint.h>
@@ -33,9 +34,6 @@ typedef uint32_t u32;
 
 static bool validate(const struct ebpf_vm *vm, const struct ebpf_inst *insts,
 		     uint32_t num_insts, char **errmsg);
-static bool bounds_check(const struct ebpf_vm *vm, void *addr, int size,
-			 const char *type, uint16_t cur_pc, void *mem,
-			 size_t mem_len, void *stack);
 
 bool ebpf_toggle_bounds_check(struct ebpf_vm *vm, bool enable)
 {
@@ -174,11 +172,27 @@ int ebpf_load(struct ebpf_vm *vm, const void *code, uint32_t code_len,
 		ebpf_store_instruction(vm, i, source_inst[i]);
 	}
 
+	if (ebpf_prepare_callbacks(vm, errmsg) < 0) {
+		ebpf_unload_code(vm);
+		return -1;
+	}
+
+	if (vm->threaded_interpreter && ebpf_decode_threaded(vm) < 0) {
+		*errmsg = ebpf_error("out of memory");
+		ebpf_unload_code(vm);
+		return -1;
+	}
+
 	return 0;
 }
 
 void ebpf_unload_code(struct ebpf_vm *vm)
 {
+	if (vm->aot_object) {
+		ebpf_aot_object_free(vm->aot_object);
+		vm->aot_object = NULL;
+		vm->jitted_function = NULL;
+	}
 	if (vm->jitted_function) {
 		munmap(vm->jitted_function, vm->jitted_size);
 		vm->jitted_function = NULL;
@@ -189,820 +203,16 @@ void ebpf_unload_code(struct ebpf_vm *vm)
 		vm->insnsi = NULL;
 		vm->num_insts = 0;
 	}
-}
-
-#define IS_ALIGNED(x, a) (((uintptr_t)(x) & ((a)-1)) == 0)
-
-inline static uint64_t ebpf_mem_load(uint64_t address, size_t size)
-{
-	if (!IS_ALIGNED(address, size)) {
-		// Fill the result with 0 to avoid leaking uninitialized memory.
-		uint64_t value = 0;
-		memcpy(&value, (void *)address, size);
-		return value;
-	}
-
-	switch (size) {
-	case 1:
-		return *(uint8_t *)address;
-	case 2:
-		return *(uint16_t *)address;
-	case 4:
-		return *(uint32_t *)address;
-	case 8:
-		return *(uint64_t *)address;
-	default:
-		abort();
-	}
-}
-
-inline static void ebpf_mem_store(uint64_t address, uint64_t value, size_t size)
-{
-	if (!IS_ALIGNED(address, size)) {
-		memcpy((void *)address, &value, size);
-		return;
-	}
-
-	switch (size) {
-	case 1:
-		*(uint8_t *)(uintptr_t)address = value;
-		break;
-	case 2:
-		*(uint16_t *)(uintptr_t)address = value;
-		break;
-	case 4:
-		*(uint32_t *)(uintptr_t)address = value;
-		break;
-	case 8:
-		*(uint64_t *)(uintptr_t)address = value;
-		break;
-	default:
-		abort();
-	}
+	free(vm->threaded_insns);
+	vm->threaded_insns = NULL;
+	free(vm->callbacks);
+	vm->callbacks = NULL;
 }
 
 int ebpf_exec(const struct ebpf_vm *vm, void *mem, size_t mem_len,
 	      uint64_t *bpf_return_value)
 {
-	uint16_t pc = 0;
-	const struct ebpf_inst *insts = vm->insnsi;
-	uint64_t *reg;
-	uint64_t _reg[16];
-	uint64_t stack[(EBPF_STACK_SIZE + 7) / 8];
-
-	if (!insts) {
-		/* Code must be loaded before we can execute */
-		return -1;
-	}
-
-#if DEBUG
-	if (vm->regs)
-		reg = vm->regs;
-	else
-		reg = _reg;
-#else
-	reg = _reg;
-#endif
-
-	reg[1] = (uintptr_t)mem;
-	reg[2] = (uint64_t)mem_len;
-	reg[10] = (uintptr_t)stack + sizeof(stack);
-
-	while (1) {
-		const uint16_t cur_pc = pc;
-		struct ebpf_inst inst = ebpf_fetch_instruction(vm, pc++);
-
-		LOG_DEBUG("%08" PRIu64 "x, [%d] %d %d %d %d\n",
-			  *(uint64_t *)(uintptr_t)&inst, cur_pc, inst.dst_reg,
-			  inst.src_reg, inst.off, inst.imm);
-
-		switch (inst.code) {
-		case EBPF_OP_ADD_IMM:
-			reg[inst.dst_reg] += inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_ADD_REG:
-			reg[inst.dst_reg] += reg[inst.src_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_SUB_IMM:
-			reg[inst.dst_reg] -= inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_SUB_REG:
-			reg[inst.dst_reg] -= reg[inst.src_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_MUL_IMM:
-			reg[inst.dst_reg] *= inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_MUL_REG:
-			reg[inst.dst_reg] *= reg[inst.src_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_DIV_IMM:
-			reg[inst.dst_reg] =
-				(uint32_t)(inst.imm) ?
-					(uint32_t)(reg[inst.dst_reg]) /
-						(uint32_t)(inst.imm) :
-					0;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_DIV_REG:
-			reg[inst.dst_reg] =
-				reg[inst.src_reg] ?
-					(uint32_t)(reg[inst.dst_reg]) /
-						(uint32_t)(reg[inst.src_reg]) :
-					0;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_OR_IMM:
-			reg[inst.dst_reg] |= inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_OR_REG:
-			reg[inst.dst_reg] |= reg[inst.src_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_AND_IMM:
-			reg[inst.dst_reg] &= inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_AND_REG:
-			reg[inst.dst_reg] &= reg[inst.src_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_LSH_IMM:
-			reg[inst.dst_reg] <<= inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_LSH_REG:
-			reg[inst.dst_reg] <<= reg[inst.src_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_RSH_IMM:
-			reg[inst.dst_reg] =
-				(uint32_t)(reg[inst.dst_reg]) >> inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_RSH_REG:
-			reg[inst.dst_reg] = (uint32_t)(reg[inst.dst_reg]) >>
-					    reg[inst.src_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_NEG:
-			reg[inst.dst_reg] = -(int64_t)reg[inst.dst_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_MOD_IMM:
-			reg[inst.dst_reg] =
-				(uint32_t)(inst.imm) ?
-					(uint32_t)(reg[inst.dst_reg]) %
-						(uint32_t)(inst.imm) :
-					(uint32_t)(reg[inst.dst_reg]);
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_MOD_REG:
-			reg[inst.dst_reg] =
-				(uint32_t)(reg[inst.src_reg]) ?
-					(uint32_t)(reg[inst.dst_reg]) %
-						(uint32_t)(reg[inst.src_reg]) :
-					(uint32_t)(reg[inst.dst_reg]);
-			break;
-		case EBPF_OP_XOR_IMM:
-			reg[inst.dst_reg] ^= inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_XOR_REG:
-			reg[inst.dst_reg] ^= reg[inst.src_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_MOV_IMM:
-			reg[inst.dst_reg] = inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_MOV_REG:
-			reg[inst.dst_reg] = reg[inst.src_reg];
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_ARSH_IMM:
-			reg[inst.dst_reg] =
-				(int32_t)reg[inst.dst_reg] >> inst.imm;
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-		case EBPF_OP_ARSH_REG:
-			reg[inst.dst_reg] = (int32_t)reg[inst.dst_reg] >>
-					    (uint32_t)(reg[inst.src_reg]);
-			reg[inst.dst_reg] &= UINT32_MAX;
-			break;
-
-		case EBPF_OP_LE:
-			if (inst.imm == 16) {
-				reg[inst.dst_reg] = htole16(reg[inst.dst_reg]);
-			} else if (inst.imm == 32) {
-				reg[inst.dst_reg] = htole32(reg[inst.dst_reg]);
-			} else if (inst.imm == 64) {
-				reg[inst.dst_reg] = htole64(reg[inst.dst_reg]);
-			}
-			break;
-		case EBPF_OP_BE:
-			if (inst.imm == 16) {
-				reg[inst.dst_reg] = htobe16(reg[inst.dst_reg]);
-			} else if (inst.imm == 32) {
-				reg[inst.dst_reg] = htobe32(reg[inst.dst_reg]);
-			} else if (inst.imm == 64) {
-				reg[inst.dst_reg] = htobe64(reg[inst.dst_reg]);
-			}
-			break;
-
-		case EBPF_OP_ADD64_IMM:
-			reg[inst.dst_reg] += inst.imm;
-			break;
-		case EBPF_OP_ADD64_REG:
-			reg[inst.dst_reg] += reg[inst.src_reg];
-			break;
-		case EBPF_OP_SUB64_IMM:
-			reg[inst.dst_reg] -= inst.imm;
-			break;
-		case EBPF_OP_SUB64_REG:
-			reg[inst.dst_reg] -= reg[inst.src_reg];
-			break;
-		case EBPF_OP_MUL64_IMM:
-			reg[inst.dst_reg] *= inst.imm;
-			break;
-		case EBPF_OP_MUL64_REG:
-			reg[inst.dst_reg] *= reg[inst.src_reg];
-			break;
-		case EBPF_OP_DIV64_IMM:
-			reg[inst.dst_reg] =
-				inst.imm ? reg[inst.dst_reg] / inst.imm : 0;
-			break;
-		case EBPF_OP_DIV64_REG:
-			reg[inst.dst_reg] =
-				reg[inst.src_reg] ?
-					reg[inst.dst_reg] / reg[inst.src_reg] :
-					0;
-			break;
-		case EBPF_OP_OR64_IMM:
-			reg[inst.dst_reg] |= inst.imm;
-			break;
-		case EBPF_OP_OR64_REG:
-			reg[inst.dst_reg] |= reg[inst.src_reg];
-			break;
-		case EBPF_OP_AND64_IMM:
-			reg[inst.dst_reg] &= inst.imm;
-			break;
-		case EBPF_OP_AND64_REG:
-			reg[inst.dst_reg] &= reg[inst.src_reg];
-			break;
-		case EBPF_OP_LSH64_IMM:
-			reg[inst.dst_reg] <<= inst.imm;
-			break;
-		case EBPF_OP_LSH64_REG:
-			reg[inst.dst_reg] <<= reg[inst.src_reg];
-			break;
-		case EBPF_OP_RSH64_IMM:
-			reg[inst.dst_reg] >>= inst.imm;
-			break;
-		case EBPF_OP_RSH64_REG:
-			reg[inst.dst_reg] >>= reg[inst.src_reg];
-			break;
-		case EBPF_OP_NEG64:
-			reg[inst.dst_reg] = -reg[inst.dst_reg];
-			break;
-		case EBPF_OP_MOD64_IMM:
-			reg[inst.dst_reg] =
-				inst.imm ? reg[inst.dst_reg] % inst.imm :
-					   reg[inst.dst_reg];
-			break;
-		case EBPF_OP_MOD64_REG:
-			reg[inst.dst_reg] =
-				reg[inst.src_reg] ?
-					reg[inst.dst_reg] % reg[inst.src_reg] :
-					reg[inst.dst_reg];
-			break;
-		case EBPF_OP_XOR64_IMM:
-			reg[inst.dst_reg] ^= inst.imm;
-			break;
-		case EBPF_OP_XOR64_REG:
-			reg[inst.dst_reg] ^= reg[inst.src_reg];
-			break;
-		case EBPF_OP_MOV64_IMM:
-			reg[inst.dst_reg] = inst.imm;
-			break;
-		case EBPF_OP_MOV64_REG:
-			reg[inst.dst_reg] = reg[inst.src_reg];
-			break;
-		case EBPF_OP_ARSH64_IMM:
-			reg[inst.dst_reg] =
-				(int64_t)(uint64_t)reg[inst.dst_reg] >>
-				inst.imm;
-			break;
-		case EBPF_OP_ARSH64_REG:
-			reg[inst.dst_reg] =
-				(int64_t)(uint64_t)reg[inst.dst_reg] >>
-				reg[inst.src_reg];
-			break;
-
-			/*
-			 * HACK runtime bounds check
-			 *
-			 * Needed since we don't have a verifier yet.
-			 */
-#define BOUNDS_CHECK_LOAD(size)                                                \
-	do {                                                                   \
-		if (!bounds_check(                                             \
-			    vm,                                                \
-			    (char *)(uintptr_t)reg[inst.src_reg] + inst.off,   \
-			    size, "load", cur_pc, mem, mem_len, stack)) {      \
-			return -1;                                             \
-		}                                                              \
-	} while (0)
-#define BOUNDS_CHECK_STORE(size)                                               \
-	do {                                                                   \
-		if (!bounds_check(                                             \
-			    vm,                                                \
-			    (char *)(uintptr_t)reg[inst.dst_reg] + inst.off,   \
-			    size, "store", cur_pc, mem, mem_len, stack)) {     \
-			return -1;                                             \
-		}                                                              \
-	} while (0)
-
-		case EBPF_OP_LDXW:
-			BOUNDS_CHECK_LOAD(4);
-			reg[inst.dst_reg] =
-				ebpf_mem_load(reg[inst.src_reg] + inst.off, 4);
-			break;
-		case EBPF_OP_LDXH:
-			BOUNDS_CHECK_LOAD(2);
-			reg[inst.dst_reg] =
-				ebpf_mem_load(reg[inst.src_reg] + inst.off, 2);
-			break;
-		case EBPF_OP_LDXB:
-			BOUNDS_CHECK_LOAD(1);
-			reg[inst.dst_reg] =
-				ebpf_mem_load(reg[inst.src_reg] + inst.off, 1);
-			break;
-		case EBPF_OP_LDXDW:
-			BOUNDS_CHECK_LOAD(8);
-			reg[inst.dst_reg] =
-				ebpf_mem_load(reg[inst.src_reg] + inst.off, 8);
-			break;
-
-		case EBPF_OP_STW:
-			BOUNDS_CHECK_STORE(4);
-			ebpf_mem_store(reg[inst.dst_reg] + inst.off, inst.imm,
-				       4);
-			break;
-		case EBPF_OP_STH:
-			BOUNDS_CHECK_STORE(2);
-			ebpf_mem_store(reg[inst.dst_reg] + inst.off, inst.imm,
-				       2);
-			break;
-		case EBPF_OP_STB:
-			BOUNDS_CHECK_STORE(1);
-			ebpf_mem_store(reg[inst.dst_reg] + inst.off, inst.imm,
-				       1);
-			break;
-		case EBPF_OP_STDW:
-			BOUNDS_CHECK_STORE(8);
-			ebpf_mem_store(reg[inst.dst_reg] + inst.off, inst.imm,
-				       8);
-			break;
-
-		case EBPF_OP_STXW:
-			BOUNDS_CHECK_STORE(4);
-			ebpf_mem_store(reg[inst.dst_reg] + inst.off,
-				       reg[inst.src_reg], 4);
-			break;
-		case EBPF_OP_STXH:
-			BOUNDS_CHECK_STORE(2);
-			ebpf_mem_store(reg[inst.dst_reg] + inst.off,
-				       reg[inst.src_reg], 2);
-			break;
-		case EBPF_OP_STXB:
-			BOUNDS_CHECK_STORE(1);
-			ebpf_mem_store(reg[inst.dst_reg] + inst.off,
-				       reg[inst.src_reg], 1);
-			break;
-		case EBPF_OP_STXDW:
-			BOUNDS_CHECK_STORE(8);
-			ebpf_mem_store(reg[inst.dst_reg] + inst.off,
-				       reg[inst.src_reg], 8);
-			break;
-
-		case EBPF_OP_LDDW: {
-			struct ebpf_inst next_inst =
-				ebpf_fetch_instruction(vm, pc++);
-			if (inst.src_reg == 0) {
-				reg[inst.dst_reg] =
-					(u32)(inst.imm) |
-					((uint64_t)next_inst.imm << 32);
-			} else if (inst.src_reg == 1) {
-				reg[inst.dst_reg] = vm->map_by_fd(inst.imm);
-			} else if (inst.src_reg == 2) {
-				reg[inst.dst_reg] =
-					vm->map_val(vm->map_by_fd(inst.imm)) +
-					(uint64_t)next_inst.imm;
-			} else if (inst.src_reg == 3) {
-				reg[inst.dst_reg] = vm->var_addr(inst.imm);
-			} else if (inst.src_reg == 4) {
-				reg[inst.dst_reg] = vm->code_addr(inst.imm);
-			} else if (inst.src_reg == 5) {
-				reg[inst.dst_reg] = vm->map_by_idx(inst.imm);
-			} else if (inst.src_reg == 6) {
-				reg[inst.dst_reg] =
-					vm->map_val(vm->map_by_idx(inst.imm)) +
-					(uint64_t)next_inst.imm;
-			}
-			break;
-		}
-		case EBPF_OP_JA:
-			pc += inst.off;
-			break;
-		case EBPF_OP_JEQ_IMM:
-			if (reg[inst.dst_reg] == (uint64_t)inst.imm) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JEQ_REG:
-			if (reg[inst.dst_reg] == reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JEQ32_IMM:
-			if ((uint32_t)(reg[inst.dst_reg]) ==
-			    (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JEQ32_REG:
-			if ((uint32_t)(reg[inst.dst_reg]) ==
-			    reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JGT_IMM:
-			if (reg[inst.dst_reg] > (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JGT_REG:
-			if (reg[inst.dst_reg] > reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JGT32_IMM:
-			if ((uint32_t)(reg[inst.dst_reg]) >
-			    (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JGT32_REG:
-			if ((uint32_t)(reg[inst.dst_reg]) >
-			    (uint32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JGE_IMM:
-			if (reg[inst.dst_reg] >= (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JGE_REG:
-			if (reg[inst.dst_reg] >= reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JGE32_IMM:
-			if ((uint32_t)(reg[inst.dst_reg]) >=
-			    (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JGE32_REG:
-			if ((uint32_t)(reg[inst.dst_reg]) >=
-			    (uint32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JLT_IMM:
-			if (reg[inst.dst_reg] < (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JLT_REG:
-			if (reg[inst.dst_reg] < reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JLT32_IMM:
-			if ((uint32_t)(reg[inst.dst_reg]) <
-			    (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JLT32_REG:
-			if ((uint32_t)(reg[inst.dst_reg]) <
-			    (uint32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JLE_IMM:
-			if (reg[inst.dst_reg] <= (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JLE_REG:
-			if (reg[inst.dst_reg] <= reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JLE32_IMM:
-			if ((uint32_t)(reg[inst.dst_reg]) <=
-			    (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JLE32_REG:
-			if ((uint32_t)(reg[inst.dst_reg]) <=
-			    (uint32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSET_IMM:
-			if (reg[inst.dst_reg] & inst.imm) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSET_REG:
-			if (reg[inst.dst_reg] & reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSET32_IMM:
-			if ((uint32_t)(reg[inst.dst_reg]) &
-			    (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSET32_REG:
-			if ((uint32_t)(reg[inst.dst_reg]) &
-			    (uint32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JNE_IMM:
-			if (reg[inst.dst_reg] != (uint64_t)inst.imm) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JNE_REG:
-			if (reg[inst.dst_reg] != reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JNE32_IMM:
-			if ((uint32_t)(reg[inst.dst_reg]) !=
-			    (uint32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JNE32_REG:
-			if ((uint32_t)(reg[inst.dst_reg]) !=
-			    (uint32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSGT_IMM:
-			if ((int64_t)reg[inst.dst_reg] > inst.imm) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSGT_REG:
-			if ((int64_t)reg[inst.dst_reg] >
-			    (int64_t)reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSGT32_IMM:
-			if ((int32_t)(reg[inst.dst_reg]) >
-			    (int32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSGT32_REG:
-			if ((int32_t)(reg[inst.dst_reg]) >
-			    (int32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSGE_IMM:
-			if ((int64_t)reg[inst.dst_reg] >= inst.imm) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSGE_REG:
-			if ((int64_t)reg[inst.dst_reg] >=
-			    (int64_t)reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSGE32_IMM:
-			if ((int32_t)(reg[inst.dst_reg]) >=
-			    (int32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSGE32_REG:
-			if ((int32_t)(reg[inst.dst_reg]) >=
-			    (int32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSLT_IMM:
-			if ((int64_t)reg[inst.dst_reg] < inst.imm) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSLT_REG:
-			if ((int64_t)reg[inst.dst_reg] <
-			    (int64_t)reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSLT32_IMM:
-			if ((int32_t)(reg[inst.dst_reg]) <
-			    (int32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSLT32_REG:
-			if ((int32_t)(reg[inst.dst_reg]) <
-			    (int32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSLE_IMM:
-			if ((int64_t)reg[inst.dst_reg] <= inst.imm) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSLE_REG:
-			if ((int64_t)reg[inst.dst_reg] <=
-			    (int64_t)reg[inst.src_reg]) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSLE32_IMM:
-			if ((int32_t)(reg[inst.dst_reg]) <=
-			    (int32_t)(inst.imm)) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_JSLE32_REG:
-			if ((int32_t)(reg[inst.dst_reg]) <=
-			    (int32_t)(reg[inst.src_reg])) {
-				pc += inst.off;
-			}
-			break;
-		case EBPF_OP_EXIT:
-			*bpf_return_value = reg[0];
-			return 0;
-		case EBPF_OP_CALL:
-			LOG_DEBUG("call: %p", vm->ext_funcs[inst.imm]);
-			if (inst.src_reg != 0) {
-				LOG_DEBUG(
-					"ubpf only supports call helpers at pc %d",
-					(int)pc);
-				return -1;
-			}
-			reg[0] = vm->ext_funcs[inst.imm](reg[1], reg[2], reg[3],
-							 reg[4], reg[5]);
-			// Unwind the stack if unwind extension returns success.
-			if (inst.imm == vm->unwind_stack_extension_index &&
-			    reg[0] == 0) {
-				*bpf_return_value = reg[0];
-				return 0;
-			}
-			break;
-
-			// 32b atomic ops
-		case EBPF_ATOMIC | EBPF_SIZE_W | EBPF_STX: {
-			switch (inst.imm) {
-			case EBPF_ATOMIC_ADD: {
-				// Add
-				__atomic_fetch_add(
-					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					reg[inst.src_reg], __ATOMIC_RELAXED);
-				break;
-			}
-			case EBPF_ATOMIC_OR: {
-				// Or
-				__atomic_fetch_or(
-					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					reg[inst.src_reg], __ATOMIC_RELAXED);
-				break;
-			}
-			case EBPF_ATOMIC_AND: {
-				// And
-				__atomic_fetch_and(
-					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					reg[inst.src_reg], __ATOMIC_RELAXED);
-				break;
-			}
-			case EBPF_ATOMIC_XOR: {
-				// Xor
-				__atomic_fetch_xor(
-					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					reg[inst.src_reg], __ATOMIC_RELAXED);
-				break;
-			}
-			case EBPF_XCHG: {
-				// XCHG
-				__atomic_exchange(
-					(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					(uint32_t *)&reg[inst.src_reg],
-					(uint32_t *)&reg[inst.src_reg],
-					__ATOMIC_RELAXED);
-				break;
-			}
-			// case EBPF_CMPXCHG: {
-			// 	__atomic_compare_exchange(
-			// 		(uint32_t *)(uintptr_t)(reg[inst.dst_reg] +
-			// 					inst.off),
-			// 		(uint32_t *)&reg[0],
-			// 		(uint32_t *)&reg[inst.src_reg], false,
-			// 		__ATOMIC_RELAXED, __ATOMIC_RELAXED);
-			// }
-			}
-			break;
-		}
-			// 64b atomic ops
-		case EBPF_ATOMIC | EBPF_SIZE_DW | EBPF_STX: {
-			switch (inst.imm) {
-			case EBPF_ATOMIC_ADD: {
-				// Add
-				__atomic_fetch_add(
-					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					reg[inst.src_reg], __ATOMIC_RELAXED);
-				break;
-			}
-			case EBPF_ATOMIC_OR: {
-				// Or
-				__atomic_fetch_or(
-					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					reg[inst.src_reg], __ATOMIC_RELAXED);
-				break;
-			}
-			case EBPF_ATOMIC_AND: {
-				// And
-				__atomic_fetch_and(
-					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					reg[inst.src_reg], __ATOMIC_RELAXED);
-				break;
-			}
-			case EBPF_ATOMIC_XOR: {
-				// Xor
-				__atomic_fetch_xor(
-					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					reg[inst.src_reg], __ATOMIC_RELAXED);
-				break;
-			}
-			case EBPF_XCHG: {
-				// XCHG
-				__atomic_exchange(
-					(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
-								inst.off),
-					(uint64_t *)&reg[inst.src_reg],
-					(uint64_t *)&reg[inst.src_reg],
-					__ATOMIC_RELAXED);
-				break;
-			}
-			// case EBPF_CMPXCHG: {
-			// 	__atomic_compare_exchange(
-			// 		(uint64_t *)(uintptr_t)(reg[inst.dst_reg] +
-			// 					inst.off),
-			// 		(uint64_t *)&reg[0],
-			// 		(uint64_t *)&reg[inst.src_reg], false,
-			// 		__ATOMIC_RELAXED, __ATOMIC_RELAXED);
-			// }
-			}
-			break;
-			break;
-		}
-		}
-	}
+	return ebpf_interpret(vm, mem, mem_len, bpf_return_value);
 }
 
 static bool validate(const struct ebpf_vm *vm, const struct ebpf_inst *insts,
@@ -1118,12 +328,6 @@ static bool validate(const struct ebpf_vm *vm, const struct ebpf_inst *insts,
 					"Missing var_addr for instruction at %d",
 					i);
 				return false;
-			} else if (inst.src_reg == 4 &&
-				   (vm->code_addr == NULL)) {
-				*errmsg = ebpf_error(
-					"Missing code_addr for instruction at %d",
-					i);
-				return false;
 			} else if (inst.src_reg == 5 &&
 				   vm->map_by_idx == NULL) {
 				*errmsg = ebpf_error(
@@ -1280,30 +484,6 @@ static bool validate(const struct ebpf_vm *vm, const struct ebpf_inst *insts,
 	return true;
 }
 
-static bool bounds_check(const struct ebpf_vm *vm, void *addr, int size,
-			 const char *type, uint16_t cur_pc, void *mem,
-			 size_t mem_len, void *stack)
-{
-	if (!vm->bounds_check_enabled)
-		return true;
-	if (mem &&
-	    (addr >= mem && ((char *)addr + size) <= ((char *)mem + mem_len))) {
-		/* Context access */
-		return true;
-	} else if (addr >= stack &&
-		   ((char *)addr + size) <= ((char *)stack + EBPF_STACK_SIZE)) {
-		/* Stack access */
-		return true;
-	} else {
-		vm->error_printf(
-			stderr,
-			"ebpf error: out of bounds memory %s at PC %u, addr %p, size %d\nmem %p/%zd stack %p/%d\n",
-			type, cur_pc, addr, size, mem, mem_len, stack,
-			EBPF_STACK_SIZE);
-		return false;
-	}
-}
-
 char *ebpf_error(const char *fmt, ...)
 {
 	char *msg;
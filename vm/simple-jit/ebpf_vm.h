@@ -32,9 +32,16 @@ struct ebpf_vm
     uint16_t num_insts;
     ebpf_jit_fn jitted_function;
     size_t jitted_size;
+    /* Set if jitted_function is loaded from an AOT object */
+    struct ebpf_aot_object* aot_object;
     ext_func* ext_funcs;
     const char** ext_func_names;
     bool bounds_check_enabled;
+    bool threaded_interpreter;
+    /* Decoded by ebpf_load if threaded_interpreter is set */
+    struct ebpf_threaded_insn* threaded_insns;
+    /* Subprograms loaded by lddw without code_addr, indexed by their first instruction */
+    struct ebpf_callback* callbacks;
     int (*error_printf)(FILE* stream, const char* format, ...);
     int (*translate)(struct ebpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg);
     int unwind_stack_extension_index;
@@ -74,6 +81,28 @@ ebpf_lookup_registered_function(struct ebpf_vm* vm, const char* name);
 struct ebpf_inst
 ebpf_fetch_instruction(const struct ebpf_vm* vm, uint16_t pc);
 
+/**
+ * @brief Decode the loaded program for the threaded interpreter.
+ *
+ * @param[in] vm The VM to decode the program of.
+ * @retval 0 Success.
+ * @retval -1 Out of memory.
+ */
+int
+ebpf_decode_threaded(struct ebpf_vm* vm);
+
+/**
+ * @brief Prepare the struct ebpf_callback of each subprogram the loaded
+ * program loads with a lddw, if there is no code_addr helper.
+ *
+ * @param[in] vm The VM to prepare the callbacks of.
+ * @param[out] errmsg The error message, if any. This should be freed by the caller.
+ * @retval 0 Success.
+ * @retval -1 Out of memory, or a lddw loads an instruction out of the program.
+ */
+int
+ebpf_prepare_callbacks(struct ebpf_vm* vm, char** errmsg);
+
 /**
  * @brief Store the given instruction at the given index.
  *
@@ -37,11 +37,12 @@ register_functions(struct ebpf_vm* vm);
 static void
 usage(const char* name)
 {
-    fprintf(stderr, "usage: %s [-h] [-j|--jit] [-m|--mem PATH] BINARY\n", name);
+    fprintf(stderr, "usage: %s [-h] [-j|--jit] [-t|--threaded] [-m|--mem PATH] BINARY\n", name);
     fprintf(stderr, "\nExecutes the eBPF code in BINARY and prints the result to stdout.\n");
     fprintf(
         stderr, "If --mem is given then the specified file will be read and a pointer\nto its data passed in r1.\n");
     fprintf(stderr, "If --jit is given then the JIT compiler will be used.\n");
+    fprintf(stderr, "If --threaded is given then the threaded interpreter will be used.\n");
     fprintf(stderr, "\nOther options:\n");
     fprintf(stderr, "  -r, --register-offset NUM: Change the mapping from eBPF to x86 registers\n");
     fprintf(stderr, "  -U, --unload: unload the code and reload it (for testing only)\n");
@@ -59,6 +60,7 @@ main(int argc, char** argv)
         },
         {.name = "mem", .val = 'm', .has_arg = 1},
         {.name = "jit", .val = 'j'},
+        {.name = "threaded", .val = 't'},
         {.name = "register-offset", .val = 'r', .has_arg = 1},
         {.name = "unload", .val = 'U'}, /* for unit test only */
         {.name = "reload", .val = 'R'}, /* for unit test only */
@@ -66,13 +68,14 @@ main(int argc, char** argv)
 
     const char* mem_filename = NULL;
     bool jit = false;
+    bool threaded = false;
     bool unload = false;
     bool reload = false;
 
     uint64_t secret = (uint64_t)rand() << 32 | (uint64_t)rand();
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "hm:jr:UR", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hm:jtr:UR", longopts, NULL)) != -1) {
         switch (opt) {
         case 'm':
             mem_filename = optarg;
@@ -80,6 +83,9 @@ main(int argc, char** argv)
         case 'j':
             jit = true;
             break;
+        case 't':
+            threaded = true;
+            break;
         case 'r':
 #if defined(__x86_64__) || defined(_M_X64)
             ebpf_set_register_offset(atoi(optarg));
@@ -137,6 +143,7 @@ main(int argc, char** argv)
         return 1;
     }
 
+    ebpf_toggle_threaded_interpreter(vm, threaded);
     register_functions(vm);
 
     /*
@@ -331,6 +338,13 @@ strcmp_ext(uint64_t a, uint64_t b) {
     return strcmp((const char *)p1, (const char *)p2);
 }
 
+/* Stands for the maps of lddw by fd: fd 0 is missing, others are found */
+static uint64_t
+map_by_fd(uint32_t fd)
+{
+    return fd ? 0x1000 + fd : 0;
+}
+
 static void
 register_functions(struct ebpf_vm* vm)
 {
@@ -341,4 +355,5 @@ register_functions(struct ebpf_vm* vm)
     ebpf_register(vm, 4, "strcmp_ext", strcmp_ext);
     ebpf_register(vm, 5, "unwind", unwind);
     ebpf_set_unwind_function_index(vm, 5);
+    ebpf_set_lddw_helpers(vm, map_by_fd, NULL, NULL, NULL, NULL);
 }
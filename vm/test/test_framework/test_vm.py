@@ -12,7 +12,7 @@ _test_data_dir = os.path.join(os.path.dirname(os.path.realpath(__file__)), "../t
 
 VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "../..", "build/test/test_Tests")
 
-def check_datafile(filename):
+def check_datafile(filename, threaded=False):
     """
     Given assembly source code and an expected result, run the eBPF program and
     verify that the result matches.
@@ -42,6 +42,8 @@ def check_datafile(filename):
         cmd.extend(['-R'])
     if 'unload' in data:
         cmd.extend(['-U'])
+    if threaded:
+        cmd.extend(['-t'])
 
     cmd.append('-')
 
@@ -78,6 +80,7 @@ def check_datafile(filename):
             raise AssertionError("Expected VM to exit with an error code")
 
 @pytest.mark.parametrize("filename", testdata.list_files(_test_data_dir))
-def test_datafiles(filename):
+@pytest.mark.parametrize("threaded", [False, True])
+def test_datafiles(filename, threaded):
     # This is now a regular test function that will be called once for each filename
-    check_datafile(filename)
+    check_datafile(filename, threaded)